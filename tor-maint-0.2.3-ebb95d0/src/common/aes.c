@@ -130,6 +130,21 @@ aes_crypt_inplace(aes_cnt_cipher_t *cipher, char *data, size_t len)
   EVP_EncryptUpdate(&cipher->evp, (unsigned char*)data,
                     &outl, (unsigned char*)data, (int)len);
 }
+void
+aes_crypt_inplace_multi(aes_cnt_cipher_t **ciphers, int n_ciphers,
+                        char *data, size_t len)
+{
+  int i, outl;
+
+  tor_assert(len < INT_MAX);
+
+  /* EVP's counter mode already keeps several AES-NI blocks in flight and
+   * xors them a vector at a time, so there's nothing to gain by generating
+   * the keystreams separately. */
+  for (i = 0; i < n_ciphers; ++i)
+    EVP_EncryptUpdate(&ciphers[i]->evp, (unsigned char*)data,
+                      &outl, (unsigned char*)data, (int)len);
+}
 int
 evaluate_evp_for_aes(int force_val)
 {
@@ -303,6 +318,117 @@ _aes_fill_buf(aes_cnt_cipher_t *cipher)
   }
 }
 
+#if defined(USING_COUNTER_VARS)
+#define UPDATE_CTR_BUF(c, n) STMT_BEGIN                 \
+  (c)->ctr_buf.buf32[3-(n)] = htonl((c)->counter ## n); \
+  STMT_END
+#else
+#define UPDATE_CTR_BUF(c, n)
+#endif
+
+/** Helper: move <b>cipher</b>'s counter on to the next block. */
+static INLINE void
+_aes_advance_counter(aes_cnt_cipher_t *cipher)
+{
+  if (PREDICT_UNLIKELY(! ++COUNTER(cipher, 0))) {
+    if (PREDICT_UNLIKELY(! ++COUNTER(cipher, 1))) {
+      if (PREDICT_UNLIKELY(! ++COUNTER(cipher, 2))) {
+        ++COUNTER(cipher, 3);
+        UPDATE_CTR_BUF(cipher, 3);
+      }
+      UPDATE_CTR_BUF(cipher, 2);
+    }
+    UPDATE_CTR_BUF(cipher, 1);
+  }
+  UPDATE_CTR_BUF(cipher, 0);
+}
+
+/** How many keystream blocks _aes_crypt_inplace_wide() makes per batch:
+ * enough for a whole cell payload. */
+#define AES_WIDE_BLOCKS 32
+
+/**
+ * Helper function: advance <b>cipher</b>'s counter <b>n</b> times, writing
+ * the encrypted value of each new counter to <b>out</b>, and leave the last
+ * one in cipher-\>buf as _aes_fill_buf() would.  Handing all the blocks to
+ * EVP at once lets an engine keep several of them in flight.
+ */
+static void
+_aes_fill_blocks(aes_cnt_cipher_t *cipher, uint8_t *out, int n)
+{
+  int i;
+
+  for (i = 0; i < n; ++i) {
+    _aes_advance_counter(cipher);
+    memcpy(out + 16*i, cipher->ctr_buf.buf, 16);
+  }
+
+  if (cipher->using_evp) {
+    int outl = 16*n;
+    EVP_EncryptUpdate(&cipher->key.evp, out, &outl, out, 16*n);
+  } else {
+    for (i = 0; i < n; ++i)
+      AES_encrypt(out + 16*i, out + 16*i, &cipher->key.aes);
+  }
+
+  memcpy(cipher->buf, out + 16*(n-1), 16);
+}
+
+/** Helper: xor the <b>n</b> bytes at <b>ks</b> into <b>data</b>, a word at
+ * a time where we can. */
+static INLINE void
+_aes_xor(char *data, const uint8_t *ks, size_t n)
+{
+  uint64_t a, b;
+
+  for ( ; n >= 8; n -= 8, data += 8, ks += 8) {
+    memcpy(&a, data, 8);
+    memcpy(&b, ks, 8);
+    a ^= b;
+    memcpy(data, &a, 8);
+  }
+  while (n--)
+    *(data++) ^= *(ks++);
+}
+
+/** Helper: same as aes_crypt_inplace() with our own counter mode, but make
+ * the keystream for up to AES_WIDE_BLOCKS whole blocks at a time and xor it
+ * in words rather than bytes. */
+static void
+_aes_crypt_inplace_wide(aes_cnt_cipher_t *cipher, char *data, size_t len)
+{
+  uint8_t ks[16*(AES_WIDE_BLOCKS+1)];
+  unsigned int c = cipher->pos;
+  size_t n;
+
+  while (len) {
+    if (c || len < 16) {
+      /* finish off the block we're in the middle of */
+      n = MIN(len, 16 - c);
+      _aes_xor(data, cipher->buf + c, n);
+      data += n;
+      len -= n;
+      c += n;
+      if (c == 16) {
+        c = 0;
+        _aes_advance_counter(cipher);
+        _aes_fill_buf(cipher);
+      }
+      continue;
+    }
+
+    /* cipher->buf is the first block; the last one we make becomes the
+     * next cipher->buf, just as if we'd gone a block at a time. */
+    n = MIN(len / 16, AES_WIDE_BLOCKS);
+    memcpy(ks, cipher->buf, 16);
+    _aes_fill_blocks(cipher, ks + 16, (int)n);
+    _aes_xor(data, ks, 16*n);
+    data += 16*n;
+    len -= 16*n;
+  }
+  cipher->pos = c;
+}
+
 static void aes_set_key(aes_cnt_cipher_t *cipher, const char *key,
                         int key_bits);
 static void aes_set_iv(aes_cnt_cipher_t *cipher, const char *iv);
@@ -377,14 +503,6 @@ aes_cipher_free(aes_cnt_cipher_t *cipher)
   tor_free(cipher);
 }
 
-#if defined(USING_COUNTER_VARS)
-#define UPDATE_CTR_BUF(c, n) STMT_BEGIN                 \
-  (c)->ctr_buf.buf32[3-(n)] = htonl((c)->counter ## n); \
-  STMT_END
-#else
-#define UPDATE_CTR_BUF(c, n)
-#endif
-
 #ifdef CAN_USE_OPENSSL_CTR
 /* Helper function to use EVP with openssl's counter-mode wrapper. */
 static void evp_block128_fn(const uint8_t in[16],
@@ -442,17 +560,7 @@ aes_crypt(aes_cnt_cipher_t *cipher, const char *input, size_t len,
         *(output++) = *(input++) ^ cipher->buf[c];
       } while (++c != 16);
       cipher->pos = c = 0;
-      if (PREDICT_UNLIKELY(! ++COUNTER(cipher, 0))) {
-        if (PREDICT_UNLIKELY(! ++COUNTER(cipher, 1))) {
-          if (PREDICT_UNLIKELY(! ++COUNTER(cipher, 2))) {
-            ++COUNTER(cipher, 3);
-            UPDATE_CTR_BUF(cipher, 3);
-          }
-          UPDATE_CTR_BUF(cipher, 2);
-        }
-        UPDATE_CTR_BUF(cipher, 1);
-      }
-      UPDATE_CTR_BUF(cipher, 0);
+      _aes_advance_counter(cipher);
       _aes_fill_buf(cipher);
     }
   }
@@ -473,29 +581,29 @@ aes_crypt_inplace(aes_cnt_cipher_t *cipher, char *data, size_t len)
   else
 #endif
   {
-    int c = cipher->pos;
-    if (PREDICT_UNLIKELY(!len)) return;
+    _aes_crypt_inplace_wide(cipher, data, len);
+  }
+}
 
-    while (1) {
-      do {
-        if (len-- == 0) { cipher->pos = c; return; }
-        *(data++) ^= cipher->buf[c];
-      } while (++c != 16);
-      cipher->pos = c = 0;
-      if (PREDICT_UNLIKELY(! ++COUNTER(cipher, 0))) {
-        if (PREDICT_UNLIKELY(! ++COUNTER(cipher, 1))) {
-          if (PREDICT_UNLIKELY(! ++COUNTER(cipher, 2))) {
-            ++COUNTER(cipher, 3);
-            UPDATE_CTR_BUF(cipher, 3);
-          }
-          UPDATE_CTR_BUF(cipher, 2);
-        }
-        UPDATE_CTR_BUF(cipher, 1);
-      }
-      UPDATE_CTR_BUF(cipher, 0);
-      _aes_fill_buf(cipher);
-    }
+/** Apply every cipher in <b>ciphers</b> to the <b>len</b> bytes at
+ * <b>data</b>, in place; the result is the same as calling
+ * aes_crypt_inplace() with each in turn.  Used to add or strip all the
+ * onion layers of a relay cell in one go. */
+void
+aes_crypt_inplace_multi(aes_cnt_cipher_t **ciphers, int n_ciphers,
+                        char *data, size_t len)
+{
+  int i;
+
+#ifdef CAN_USE_OPENSSL_CTR
+  if (should_use_openssl_CTR) {
+    for (i = 0; i < n_ciphers; ++i)
+      aes_crypt(ciphers[i], data, len, data);
+    return;
   }
+#endif
+  for (i = 0; i < n_ciphers; ++i)
+    _aes_crypt_inplace_wide(ciphers[i], data, len);
 }
 
 /** Reset the 128-bit counter of <b>cipher</b> to the 16-bit big-endian value
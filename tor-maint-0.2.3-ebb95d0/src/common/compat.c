@@ -100,6 +100,15 @@
 #ifdef HAVE_SYS_FILE_H
 #include <sys/file.h>
 #endif
+#ifdef HAVE_SYS_IOCTL_H
+#include <sys/ioctl.h>
+#endif
+#ifdef HAVE_NETINET_TCP_H
+#include <netinet/tcp.h>
+#endif
+#ifdef HAVE_LINUX_SOCKIOS_H
+#include <linux/sockios.h>
+#endif
 #if defined(HAVE_SYS_PRCTL_H) && defined(__linux__)
 /* Only use the linux prctl;  the IRIX prctl is totally different */
 #include <sys/prctl.h>
@@ -1097,6 +1106,68 @@ set_socket_nonblocking(tor_socket_t socket)
 #endif
 }
 
+/** Ask the kernel about the send side of the TCP socket <b>sock</b>: how
+ * many bytes it holds that it hasn't put on the wire yet, and how many more
+ * its congestion window would let it send right now.  Store the answers in
+ * <b>out</b> and return 0, or return -1 if this platform can't tell us.
+ *
+ * (Only Linux can, for now: we need TCP_INFO for the congestion window and
+ * SIOCOUTQ for the queue.  SIOCOUTQNSD, where we have it, counts only the
+ * unsent bytes; otherwise we subtract the unacknowledged segments from the
+ * whole queue ourselves.) */
+int
+tor_socket_get_sendq(tor_socket_t sock, tor_sendq_t *out)
+{
+#if defined(TCP_INFO) && defined(SIOCOUTQ)
+  struct tcp_info info;
+  socklen_t len = sizeof(info);
+  int queued = 0;
+  size_t in_flight, window;
+
+  memset(&info, 0, sizeof(info));
+  if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, (void*)&info, &len) < 0)
+    return -1;
+  in_flight = ((size_t)info.tcpi_unacked) * info.tcpi_snd_mss;
+  window = ((size_t)info.tcpi_snd_cwnd) * info.tcpi_snd_mss;
+
+#ifdef SIOCOUTQNSD
+  if (ioctl(sock, SIOCOUTQNSD, &queued) < 0)
+    return -1;
+  out->unsent = queued > 0 ? (size_t)queued : 0;
+#else
+  if (ioctl(sock, SIOCOUTQ, &queued) < 0)
+    return -1;
+  out->unsent = (queued > 0 && (size_t)queued > in_flight) ?
+    (size_t)queued - in_flight : 0;
+#endif
+  out->window_space = window > in_flight ? window - in_flight : 0;
+  return 0;
+#else
+  (void)sock;
+  (void)out;
+  return -1;
+#endif
+}
+
+/** Have the kernel report the TCP socket <b>sock</b> writable only while
+ * fewer than <b>lowat</b> of the bytes written to it are still unsent.
+ * Return 0 on success, or -1 if this platform can't do that. */
+int
+tor_socket_set_notsent_lowat(tor_socket_t sock, size_t lowat)
+{
+#ifdef TCP_NOTSENT_LOWAT
+  int val = (int)lowat;
+  if (setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (void*)&val,
+                 sizeof(val)) < 0)
+    return -1;
+  return 0;
+#else
+  (void)sock;
+  (void)lowat;
+  return -1;
+#endif
+}
+
 /**
  * Allocate a pair of connected sockets.  (Like socketpair(family,
  * type,protocol,fd), but works on systems that don't have
@@ -2375,6 +2446,82 @@ tor_gettimeofday(struct timeval *timeval)
   return;
 }
 
+/** The last value returned by tor_monotime_nsec(). */
+static uint64_t monotime_last_nsec = 0;
+/** Cached result of tor_monotime_nsec() for tor_monotime_cached_nsec(), or
+ * 0 if the cache is empty. */
+static uint64_t monotime_cached_nsec = 0;
+
+/** Return the number of nanoseconds since some arbitrary point in the past,
+ * according to a clock that is not affected by changes to the time of day
+ * and never goes backwards.  Where we can, use the kernel's coarse clock:
+ * it is precise to a few milliseconds, which is all our callers need, and
+ * it can be read without entering the kernel. */
+uint64_t
+tor_monotime_nsec(void)
+{
+  uint64_t now;
+#if defined(HAVE_CLOCK_GETTIME) && \
+  (defined(CLOCK_MONOTONIC_COARSE) || defined(CLOCK_MONOTONIC))
+  struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+  if (clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) < 0)
+#endif
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+      log_err(LD_GENERAL, "clock_gettime failed.");
+      exit(1);
+    }
+  now = ((uint64_t)ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#elif defined(_WIN32)
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER count;
+  if (!freq.QuadPart) {
+    if (!QueryPerformanceFrequency(&freq) || !freq.QuadPart) {
+      log_err(LD_GENERAL, "No performance counter available.");
+      exit(1);
+    }
+  }
+  QueryPerformanceCounter(&count);
+  /* Split the division so that count * 10^9 can't overflow. */
+  now = ((uint64_t)(count.QuadPart / freq.QuadPart)) * 1000000000 +
+    ((uint64_t)(count.QuadPart % freq.QuadPart)) * 1000000000 /
+    freq.QuadPart;
+#else
+  /* No monotonic clock: make do with the time of day.  The check below
+   * keeps it from going backwards, but it can still jump forwards. */
+  struct timeval tv;
+  tor_gettimeofday(&tv);
+  now = ((uint64_t)tv.tv_sec) * 1000000000 + ((uint64_t)tv.tv_usec) * 1000;
+#endif
+
+  /* Some platforms' monotonic clocks can step backwards a little when we
+   * move between CPUs.  Never show that to our callers. */
+  if (now < monotime_last_nsec)
+    now = monotime_last_nsec;
+  monotime_last_nsec = now;
+  return now;
+}
+
+/** Return a recent value of tor_monotime_nsec().  The value is cached until
+ * the next call to tor_monotime_cache_clear(), which the event loop makes
+ * every time it dispatches an event, so callers on hot paths can check the
+ * time as often as they like without making a system call each time. */
+uint64_t
+tor_monotime_cached_nsec(void)
+{
+  if (!monotime_cached_nsec)
+    monotime_cached_nsec = tor_monotime_nsec();
+  return monotime_cached_nsec;
+}
+
+/** Forget the cached value of tor_monotime_cached_nsec(), so that the next
+ * call to it reads the clock again. */
+void
+tor_monotime_cache_clear(void)
+{
+  monotime_cached_nsec = 0;
+}
+
 #if defined(TOR_IS_MULTITHREADED) && !defined(_WIN32)
 /** Defined iff we need to add locks when defining fake versions of reentrant
  * versions of time-related functions. */
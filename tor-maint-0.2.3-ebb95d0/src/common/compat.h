@@ -326,6 +326,12 @@ struct timeval {
 
 void tor_gettimeofday(struct timeval *timeval);
 
+uint64_t tor_monotime_nsec(void);
+uint64_t tor_monotime_cached_nsec(void);
+void tor_monotime_cache_clear(void);
+/** Return tor_monotime_cached_nsec() in milliseconds. */
+#define tor_monotime_cached_msec() (tor_monotime_cached_nsec() / 1000000)
+
 struct tm *tor_localtime_r(const time_t *timep, struct tm *result);
 struct tm *tor_gmtime_r(const time_t *timep, struct tm *result);
 
@@ -490,6 +496,17 @@ const char *tor_inet_ntop(int af, const void *src, char *dst, size_t len);
 int tor_inet_pton(int af, const char *src, void *dst);
 int tor_lookup_hostname(const char *name, uint32_t *addr) ATTR_NONNULL((1,2));
 void set_socket_nonblocking(tor_socket_t socket);
+
+/** What the kernel will tell us about the send side of a TCP socket. */
+typedef struct tor_sendq_t {
+  /** Bytes written to the socket that the kernel has not sent yet. */
+  size_t unsent;
+  /** Bytes the congestion window would let the kernel send right now, on
+   * top of what it already has in flight. */
+  size_t window_space;
+} tor_sendq_t;
+int tor_socket_get_sendq(tor_socket_t sock, tor_sendq_t *out);
+int tor_socket_set_notsent_lowat(tor_socket_t sock, size_t lowat);
 int tor_socketpair(int family, int type, int protocol, tor_socket_t fd[2]);
 int network_init(void);
 
@@ -657,6 +674,33 @@ void tor_cond_signal_all(tor_cond_t *cond);
 #endif
 #endif
 
+/* Atomic operations.  These are only for the handful of structures that
+ * are handed between threads without a lock; everything else should use a
+ * tor_mutex_t. */
+#if defined(_MSC_VER)
+/** Atomically replace *<b>p</b> with <b>n</b> if it is equal to <b>o</b>.
+ * Return true iff the swap happened. */
+#define tor_atomic_cas_u32(p, o, n)                                     \
+  (InterlockedCompareExchange((volatile LONG *)(p), (LONG)(n), (LONG)(o)) \
+   == (LONG)(o))
+/** Atomically add <b>v</b> to *<b>p</b>. */
+#define tor_atomic_add_u32(p, v)                                        \
+  ((void) InterlockedExchangeAdd((volatile LONG *)(p), (LONG)(v)))
+/** Full memory barrier. */
+#define tor_memory_barrier() MemoryBarrier()
+#elif defined(__GNUC__)
+#define tor_atomic_cas_u32(p, o, n) __sync_bool_compare_and_swap((p), (o), (n))
+#define tor_atomic_add_u32(p, v) ((void) __sync_fetch_and_add((p), (v)))
+#define tor_memory_barrier() __sync_synchronize()
+#elif !defined(TOR_IS_MULTITHREADED)
+#define tor_atomic_cas_u32(p, o, n) \
+  ((*(p) == (o)) ? (*(p) = (n), 1) : 0)
+#define tor_atomic_add_u32(p, v) ((void) (*(p) += (v)))
+#define tor_memory_barrier() STMT_NIL
+#else
+#error "No atomic operations available for this compiler."
+#endif
+
 /** Macros for MIN/MAX.  Never use these when the arguments could have
  * side-effects.
  * {With GCC extensions we could probably define a safer MIN/MAX.  But
@@ -36,7 +36,9 @@ smartlist_new(void)
   sl->num_used = 0;
   sl->capacity = SMARTLIST_DEFAULT_CAPACITY;
   sl->list = tor_malloc(sizeof(void *) * sl->capacity);
+#ifdef LIBRARY_CORE_LOCKS
   sl->lock = tor_mutex_new();
+#endif
   return sl;
 }
 
@@ -48,6 +50,9 @@ smartlist_free(smartlist_t *sl)
 {
   if (!sl)
     return;
+#ifdef LIBRARY_CORE_LOCKS
+  tor_mutex_free(sl->lock);
+#endif
   tor_free(sl->list);
   tor_free(sl);
 }
@@ -64,7 +69,7 @@ smartlist_clear(smartlist_t *sl)
 static INLINE void
 smartlist_ensure_capacity(smartlist_t *sl, int size)
 {
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
 	tor_mutex_acquire(sl->lock);
 #endif
 
@@ -86,7 +91,7 @@ smartlist_ensure_capacity(smartlist_t *sl, int size)
     sl->list = tor_realloc(sl->list, sizeof(void*)*((size_t)sl->capacity));
   }
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
 tor_mutex_release(sl->lock);
 #endif
 }
@@ -95,14 +100,14 @@ tor_mutex_release(sl->lock);
 void
 smartlist_add(smartlist_t *sl, void *element)
 {
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(sl->lock);
 #endif
 
   smartlist_ensure_capacity(sl, sl->num_used+1);
   sl->list[sl->num_used++] = element;
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
 tor_mutex_release(sl->lock);
 #endif
 }
@@ -113,7 +118,7 @@ smartlist_add_all(smartlist_t *s1, const smartlist_t *s2)
 {
   int new_size;
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(s1->lock);
   tor_mutex_acquire(s2->lock);
 #endif
@@ -124,7 +129,7 @@ smartlist_add_all(smartlist_t *s1, const smartlist_t *s2)
   memcpy(s1->list + s1->num_used, s2->list, s2->num_used*sizeof(void*));
   s1->num_used = new_size;
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
 tor_mutex_release(s1->lock);
 tor_mutex_release(s2->lock);
 #endif
@@ -142,7 +147,7 @@ smartlist_remove(smartlist_t *sl, const void *element)
   if (element == NULL)
     return;
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(sl->lock);
 #endif
 
@@ -152,7 +157,7 @@ smartlist_remove(smartlist_t *sl, const void *element)
       i--; /* so we process the new i'th element */
     }
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
 tor_mutex_release(sl->lock);
 #endif
 }
@@ -165,7 +170,7 @@ smartlist_pop_last(smartlist_t *sl)
 void *x;
   tor_assert(sl);
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(sl->lock);
 #endif
 
@@ -174,7 +179,7 @@ void *x;
   else
     x = NULL;
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(sl->lock);
 #endif
 
@@ -183,14 +188,14 @@ void *x;
 
 void smartlist_lock(smartlist_t *sl)
 {
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(sl->lock);
 #endif
 }
 
 void smartlist_unlock(smartlist_t *sl)
 {
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
 tor_mutex_release(sl->lock);
 #endif
 }
@@ -203,7 +208,7 @@ smartlist_reverse(smartlist_t *sl)
   void *tmp;
   tor_assert(sl);
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(sl->lock);
 #endif
 
@@ -213,7 +218,7 @@ smartlist_reverse(smartlist_t *sl)
     sl->list[j] = tmp;
   }
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
 tor_mutex_release(sl->lock);
 #endif
 }
@@ -227,7 +232,7 @@ smartlist_string_remove(smartlist_t *sl, const char *element)
   tor_assert(sl);
   tor_assert(element);
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(sl->lock);
 #endif
 
@@ -239,7 +244,7 @@ smartlist_string_remove(smartlist_t *sl, const char *element)
     }
   }
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
 tor_mutex_release(sl->lock);
 #endif
 
@@ -252,7 +257,7 @@ smartlist_isin(const smartlist_t *sl, const void *element)
 {
   int i;
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(sl->lock);
 #endif
 
@@ -261,7 +266,7 @@ smartlist_isin(const smartlist_t *sl, const void *element)
       return 1;
   return 0;
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
 tor_mutex_release(sl->lock);
 #endif
 
@@ -276,20 +281,20 @@ smartlist_string_isin(const smartlist_t *sl, const char *element)
   int i;
   if (!sl) return 0;
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(sl->lock);
 #endif
 
   for (i=0; i < sl->num_used; i++)
     if (strcmp((const char*)sl->list[i],element)==0){
-	  #ifdef LIBRARY
+	  #ifdef LIBRARY_CORE_LOCKS
       tor_mutex_release(sl->lock);
       #endif
       return 1;
 	}
   return 0;
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
 tor_mutex_release(sl->lock);
 #endif
 
@@ -303,19 +308,19 @@ smartlist_string_pos(const smartlist_t *sl, const char *element)
   int i;
   if (!sl) return -1;
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(sl->lock);
 #endif
 
   for (i=0; i < sl->num_used; i++)
     if (strcmp((const char*)sl->list[i],element)==0){
-	  #ifdef LIBRARY
+	  #ifdef LIBRARY_CORE_LOCKS
       tor_mutex_release(sl->lock);
       #endif
       return i;
 	}
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(sl->lock);
   #endif
   return -1;
@@ -330,19 +335,19 @@ smartlist_string_isin_case(const smartlist_t *sl, const char *element)
   int i;
   if (!sl) return 0;
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(sl->lock);
 #endif
 
   for (i=0; i < sl->num_used; i++)
     if (strcasecmp((const char*)sl->list[i],element)==0){
-	  #ifdef LIBRARY
+	  #ifdef LIBRARY_CORE_LOCKS
       tor_mutex_release(sl->lock);
       #endif
       return 1;
 	}
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(sl->lock);
   #endif
   return 0;
@@ -371,11 +376,11 @@ smartlist_strings_eq(const smartlist_t *sl1, const smartlist_t *sl2)
   if (smartlist_len(sl1) != smartlist_len(sl2))
     return 0;
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
 tor_mutex_acquire(sl1->lock);
 #endif
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   SMARTLIST_FOREACH(sl1, const char *, cp1, {
       const char *cp2 = smartlist_get(sl2, cp1_sl_idx);
       if (strcmp(cp1, cp2))
@@ -399,7 +404,7 @@ SMARTLIST_FOREACH(sl1, const char *, cp1, {
 
 #endif
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
 tor_mutex_release(sl1->lock);
 #endif
   return 1;
@@ -414,20 +419,20 @@ smartlist_digest_isin(const smartlist_t *sl, const char *element)
   int i;
   if (!sl) return 0;
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(sl->lock);
 #endif
 
   for (i=0; i < sl->num_used; i++)
     if (tor_memeq((const char*)sl->list[i],element,DIGEST_LEN))
 	{
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
 tor_mutex_release(sl->lock);
 #endif
       return 1;
 	}
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
 tor_mutex_release(sl->lock);
 #endif
 
@@ -441,7 +446,7 @@ smartlist_overlap(const smartlist_t *sl1, const smartlist_t *sl2)
 {
   int i;
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
 tor_mutex_acquire(sl1->lock);
 tor_mutex_acquire(sl2->lock);
 #endif
@@ -449,7 +454,7 @@ tor_mutex_acquire(sl2->lock);
   for (i=0; i < sl2->num_used; i++)
     if (smartlist_isin(sl1, sl2->list[i])){
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
 tor_mutex_release(sl1->lock);
 tor_mutex_release(sl2->lock);
 #endif
@@ -457,7 +462,7 @@ tor_mutex_release(sl2->lock);
       return 1;
 	}
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
 tor_mutex_release(sl1->lock);
 tor_mutex_release(sl2->lock);
 #endif
@@ -473,7 +478,7 @@ smartlist_intersect(smartlist_t *sl1, const smartlist_t *sl2)
 {
   int i;
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(sl1->lock);
   tor_mutex_acquire(sl2->lock);
 #endif
@@ -484,7 +489,7 @@ smartlist_intersect(smartlist_t *sl1, const smartlist_t *sl2)
       i--; /* so we process the new i'th element */
     }
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
 tor_mutex_release(sl1->lock);
 tor_mutex_release(sl2->lock);
 #endif
@@ -498,7 +503,7 @@ smartlist_subtract(smartlist_t *sl1, const smartlist_t *sl2)
 {
   int i;
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(sl1->lock);
   tor_mutex_acquire(sl2->lock);
 #endif
@@ -506,7 +511,7 @@ smartlist_subtract(smartlist_t *sl1, const smartlist_t *sl2)
   for (i=0; i < sl2->num_used; i++)
     smartlist_remove(sl1, sl2->list[i]);
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
 tor_mutex_release(sl1->lock);
 tor_mutex_release(sl2->lock);
 #endif
@@ -522,14 +527,14 @@ smartlist_del(smartlist_t *sl, int idx)
   tor_assert(sl);
   tor_assert(idx>=0);
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(sl->lock);
 #endif
 
   tor_assert(idx < sl->num_used);
   sl->list[idx] = sl->list[--sl->num_used];
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(sl->lock);
 #endif
 
@@ -545,7 +550,7 @@ smartlist_del_keeporder(smartlist_t *sl, int idx)
   tor_assert(sl);
   tor_assert(idx>=0);
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(sl->lock);
 #endif
 
@@ -554,7 +559,7 @@ smartlist_del_keeporder(smartlist_t *sl, int idx)
   if (idx < sl->num_used)
     memmove(sl->list+idx, sl->list+idx+1, sizeof(void*)*(sl->num_used-idx));
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(sl->lock);
 #endif
 
@@ -570,7 +575,7 @@ smartlist_insert(smartlist_t *sl, int idx, void *val)
   tor_assert(sl);
   tor_assert(idx>=0);
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(sl->lock);
 #endif
 
@@ -587,7 +592,7 @@ smartlist_insert(smartlist_t *sl, int idx, void *val)
     sl->list[idx] = val;
   }
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(sl->lock);
 #endif
 
@@ -618,7 +623,7 @@ smartlist_split_string(smartlist_t *sl, const char *str, const char *sep,
   tor_assert(sl);
   tor_assert(str);
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(sl->lock);
 #endif
 
@@ -667,7 +672,7 @@ smartlist_split_string(smartlist_t *sl, const char *str, const char *sep,
     cp = next;
   }
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(sl->lock);
 #endif
 
@@ -707,7 +712,7 @@ smartlist_join_strings2(smartlist_t *sl, const char *join,
   if (terminate)
     n = join_len;
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(sl->lock);
 #endif
 
@@ -734,7 +739,7 @@ smartlist_join_strings2(smartlist_t *sl, const char *join,
   if (len_out)
     *len_out = dst-r;
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(sl->lock);
 #endif
 
@@ -749,7 +754,7 @@ void
 smartlist_sort(smartlist_t *sl, int (*compare)(const void **a, const void **b))
 {
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(sl->lock);
 #endif
 
@@ -759,7 +764,7 @@ smartlist_sort(smartlist_t *sl, int (*compare)(const void **a, const void **b))
   qsort(sl->list, sl->num_used, sizeof(void*),
         (int (*)(const void *,const void*))compare);
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(sl->lock);
 #endif
 }
@@ -778,7 +783,7 @@ smartlist_get_most_frequent(const smartlist_t *sl,
   const void *cur = NULL;
   int i, count=0;
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(sl->lock);
 #endif
 
@@ -802,7 +807,7 @@ smartlist_get_most_frequent(const smartlist_t *sl,
     most_frequent_count = count;
   }
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(sl->lock);
 #endif
 
@@ -820,7 +825,7 @@ smartlist_uniq(smartlist_t *sl,
 {
   int i;
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(sl->lock);
 #endif
 
@@ -833,7 +838,7 @@ smartlist_uniq(smartlist_t *sl,
     }
   }
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(sl->lock);
 #endif
 
@@ -869,7 +874,7 @@ smartlist_bsearch_idx(const smartlist_t *sl, const void *key,
   int len;
   int hi, lo, cmp, mid;
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(sl->lock);
 #endif
 
@@ -878,7 +883,7 @@ smartlist_bsearch_idx(const smartlist_t *sl, const void *key,
   if (len == 0) {
     *found_out = 0;
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(sl->lock);
 #endif
 
@@ -888,7 +893,7 @@ smartlist_bsearch_idx(const smartlist_t *sl, const void *key,
     if (cmp == 0) {
       *found_out = 1;
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(sl->lock);
 #endif
 
@@ -896,7 +901,7 @@ smartlist_bsearch_idx(const smartlist_t *sl, const void *key,
     } else if (cmp < 0) {
       *found_out = 0;
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(sl->lock);
 #endif
 
@@ -904,7 +909,7 @@ smartlist_bsearch_idx(const smartlist_t *sl, const void *key,
     } else {
       *found_out = 0;
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(sl->lock);
 #endif
 
@@ -925,7 +930,7 @@ smartlist_bsearch_idx(const smartlist_t *sl, const void *key,
     } else { /* key == sl[mid] */
       *found_out = 1;
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(sl->lock);
 #endif
 
@@ -945,7 +950,7 @@ smartlist_bsearch_idx(const smartlist_t *sl, const void *key,
   }
   *found_out = 0;
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(sl->lock);
 #endif
 
@@ -1128,7 +1133,7 @@ smartlist_pqueue_pop(smartlist_t *sl,
 {
   void *top;
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(sl->lock);
 #endif
 
@@ -1142,7 +1147,7 @@ smartlist_pqueue_pop(smartlist_t *sl,
     smartlist_heapify(sl, compare, idx_field_offset, 0);
   }
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(sl->lock);
 #endif
 
@@ -1249,7 +1254,7 @@ smartlist_uniq_digests256(smartlist_t *sl)
  * entry is declared using the C declaration <b>keydecl</b>.  All functions
  * and types associated with the map get prefixed with <b>prefix</b> */
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
 
 #define DEFINE_MAP_STRUCTS(maptype, keydecl, prefix)      \
   typedef struct prefix ## entry_t {                      \
@@ -1342,6 +1347,10 @@ digestmap_new(void)
   digestmap_t *result;
   result = tor_malloc(sizeof(digestmap_t));
   HT_INIT(digestmap_impl, &result->head);
+#ifdef LIBRARY_CORE_LOCKS
+  /* ht.h leaves head.lock alone; digestmap_set() takes it. */
+  result->head.lock = tor_mutex_new();
+#endif
   return result;
 }
 
@@ -1391,7 +1400,7 @@ digestmap_set(digestmap_t *map, const char *key, void *val)
   tor_assert(key);
   tor_assert(val);
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(map->head.lock);
   #endif
 
@@ -1415,7 +1424,7 @@ digestmap_set(digestmap_t *map, const char *key, void *val)
    * the hash table that we do in the unoptimized code above.  (Each of
    * HT_INSERT and HT_FIND calls HT_SET_HASH and HT_FIND_P.)
    */
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   HT_FIND_OR_INSERT_(digestmap_impl, node, digestmap_entry_hash, &(map->head),
          digestmap_entry_t, &search, ptr,
          {
@@ -1762,6 +1771,9 @@ digestmap_free(digestmap_t *map, void (*free_val)(void*))
   }
   tor_assert(HT_EMPTY(&map->head));
   HT_CLEAR(digestmap_impl, &map->head);
+#ifdef LIBRARY_CORE_LOCKS
+  tor_mutex_free(map->head.lock);
+#endif
   tor_free(map);
 }
 
@@ -1874,3 +1886,140 @@ digestset_free(digestset_t *set)
   tor_free(set);
 }
 
+
+/** One slot of an mpsc_ring_t.  <b>seq</b> tells producers and the consumer
+ * whose turn it is to touch <b>item</b>: it equals the slot's position when
+ * the slot is free, and the position plus one once an item is stored. */
+typedef struct mpsc_ring_slot_t {
+  volatile uint32_t seq;
+  void *item;
+} mpsc_ring_slot_t;
+
+/** Implementation for mpsc_ring_t; see container.h. */
+struct mpsc_ring_t {
+  /** Position that the next producer will claim. Shared by producers. */
+  volatile uint32_t tail;
+  /** Position that the consumer will read next. Only the consumer writes
+   * this. */
+  volatile uint32_t head;
+  /** True iff a producer has been told to wake the consumer, and the
+   * consumer hasn't yet called mpsc_ring_begin_drain(). */
+  volatile uint32_t wakeup_pending;
+  /** One less than the number of slots; the number of slots is a power of
+   * two. */
+  uint32_t mask;
+  mpsc_ring_slot_t *slots;
+};
+
+/** Allocate and return a new empty mpsc_ring_t able to hold at least
+ * <b>capacity</b> items. */
+mpsc_ring_t *
+mpsc_ring_new(unsigned int capacity)
+{
+  mpsc_ring_t *ring;
+  uint32_t n = 2, i;
+  tor_assert(capacity > 0 && capacity <= (1u<<30));
+  while (n < capacity)
+    n <<= 1;
+
+  ring = tor_malloc_zero(sizeof(mpsc_ring_t));
+  ring->mask = n - 1;
+  ring->slots = tor_malloc_zero(sizeof(mpsc_ring_slot_t) * n);
+  for (i = 0; i < n; ++i)
+    ring->slots[i].seq = i;
+  return ring;
+}
+
+/** Release all storage held by <b>ring</b>.  Does not free the items that
+ * are still queued. */
+void
+mpsc_ring_free(mpsc_ring_t *ring)
+{
+  if (!ring)
+    return;
+  tor_free(ring->slots);
+  tor_free(ring);
+}
+
+/** Add <b>item</b> to the end of <b>ring</b>.  Safe to call from any
+ * thread.  Return -1 if the ring is full.  Otherwise return 1 if the caller
+ * is the first to push since the consumer last called
+ * mpsc_ring_begin_drain(), and must therefore wake the consumer up; return
+ * 0 if a wakeup is already on its way. */
+int
+mpsc_ring_push(mpsc_ring_t *ring, void *item)
+{
+  mpsc_ring_slot_t *slot;
+  uint32_t pos, seq;
+
+  tor_assert(item);
+
+  for (;;) {
+    pos = ring->tail;
+    slot = &ring->slots[pos & ring->mask];
+    seq = slot->seq;
+    tor_memory_barrier();
+    if (seq == pos) {
+      /* The slot is free; try to claim it. */
+      if (tor_atomic_cas_u32(&ring->tail, pos, pos+1))
+        break;
+    } else if ((int32_t)(seq - pos) < 0) {
+      /* The consumer hasn't freed this slot yet: we're full. */
+      return -1;
+    }
+    /* Otherwise another producer claimed pos first; try again. */
+  }
+
+  slot->item = item;
+  tor_memory_barrier();
+  slot->seq = pos+1;
+
+  return tor_atomic_cas_u32(&ring->wakeup_pending, 0, 1) ? 1 : 0;
+}
+
+/** Remove and return the first item in <b>ring</b>, or NULL if there are no
+ * items ready.  Must only be called from the consuming thread. */
+void *
+mpsc_ring_pop(mpsc_ring_t *ring)
+{
+  uint32_t pos = ring->head;
+  mpsc_ring_slot_t *slot = &ring->slots[pos & ring->mask];
+  void *item;
+
+  if (slot->seq != pos+1)
+    return NULL;
+  tor_memory_barrier();
+  item = slot->item;
+  slot->item = NULL;
+  tor_memory_barrier();
+  slot->seq = pos + ring->mask + 1;
+  ring->head = pos+1;
+  return item;
+}
+
+/** Called by the consumer before it pops everything off <b>ring</b> in
+ * response to a wakeup: any push after this point will ask for a new
+ * wakeup. */
+void
+mpsc_ring_begin_drain(mpsc_ring_t *ring)
+{
+  ring->wakeup_pending = 0;
+  tor_memory_barrier();
+}
+
+/** Return the number of items in <b>ring</b>.  If producers are active, the
+ * answer is only approximate. */
+unsigned int
+mpsc_ring_len(const mpsc_ring_t *ring)
+{
+  uint32_t n = ring->tail - ring->head;
+  return n > ring->mask+1 ? ring->mask+1 : n;
+}
+
+/** Return the number of items that <b>ring</b> can hold. */
+unsigned int
+mpsc_ring_capacity(const mpsc_ring_t *ring)
+{
+  return ring->mask+1;
+}
+
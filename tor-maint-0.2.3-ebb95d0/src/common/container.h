@@ -25,7 +25,10 @@ typedef struct smartlist_t {
   int capacity;
   /** @} */
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
+  /** Only in library builds that still let several threads share core
+   * state. Normally everything but the command queue is owned by the main
+   * loop thread, and these locks are compiled out. */
   tor_mutex_t *lock;
 #endif
 
@@ -88,18 +91,11 @@ static INLINE void smartlist_set(smartlist_t *sl, int idx, void *val) {
  * smartlist <b>sl</b>. */
 static INLINE void smartlist_swap(smartlist_t *sl, int idx1, int idx2)
 {
-
-
-
   if (idx1 != idx2) {
     void *elt = smartlist_get(sl, idx1);
     smartlist_set(sl, idx1, smartlist_get(sl, idx2));
     smartlist_set(sl, idx2, elt);
   }
-
-  #ifdef LIBRARY
-    tor_mutex_release(sl->lock);
-  #endif
 }
 
 void smartlist_del(smartlist_t *sl, int idx);
@@ -611,6 +607,35 @@ bitarray_is_set(bitarray_t *b, int bit)
 {
   return b[bit >> BITARRAY_SHIFT] & (1u << (bit & BITARRAY_MASK));
 }
+/** Return the index of the first zero bit in <b>b</b> at or after
+ * <b>start</b>, among the first <b>n_bits</b> bits; or -1 if they are all
+ * set.  Skips a whole word of set bits at a time. */
+static INLINE int
+bitarray_find_first_zero(const bitarray_t *b, unsigned int n_bits,
+                         unsigned int start)
+{
+  unsigned int idx = start >> BITARRAY_SHIFT;
+  unsigned int n_words = (n_bits+BITARRAY_MASK) >> BITARRAY_SHIFT;
+  unsigned int zeros, bit;
+
+  if (start >= n_bits)
+    return -1;
+  /* Treat the bits before <b>start</b> in its word as set. */
+  zeros = ~b[idx] & ~((1u << (start & BITARRAY_MASK)) - 1);
+  while (!zeros) {
+    if (++idx >= n_words)
+      return -1;
+    zeros = ~b[idx];
+  }
+#if defined(__GNUC__) && __GNUC__ >= 4
+  bit = (unsigned int)__builtin_ctz(zeros);
+#else
+  for (bit = 0; !(zeros & (1u << bit)); ++bit)
+    ;
+#endif
+  bit += idx << BITARRAY_SHIFT;
+  return bit < n_bits ? (int)bit : -1;
+}
 
 /** A set of digests, implemented as a Bloom filter. */
 typedef struct {
@@ -655,6 +680,20 @@ digestset_isin(const digestset_t *set, const char *digest)
 digestset_t *digestset_new(int max_elements);
 void digestset_free(digestset_t* set);
 
+/** A bounded queue of pointers that any number of threads may push onto
+ * without locking, and that exactly one thread pops from.  Pushing fails
+ * instead of blocking when the queue is full, so that callers can report
+ * backpressure. */
+typedef struct mpsc_ring_t mpsc_ring_t;
+
+mpsc_ring_t *mpsc_ring_new(unsigned int capacity);
+void mpsc_ring_free(mpsc_ring_t *ring);
+int mpsc_ring_push(mpsc_ring_t *ring, void *item);
+void *mpsc_ring_pop(mpsc_ring_t *ring);
+void mpsc_ring_begin_drain(mpsc_ring_t *ring);
+unsigned int mpsc_ring_len(const mpsc_ring_t *ring);
+unsigned int mpsc_ring_capacity(const mpsc_ring_t *ring);
+
 /* These functions, given an <b>array</b> of <b>n_elements</b>, return the
  * <b>nth</b> lowest element. <b>nth</b>=0 gives the lowest element;
  * <b>n_elements</b>-1 gives the highest; and (<b>n_elements</b>-1) / 2 gives
@@ -1337,6 +1337,33 @@ crypto_cipher_crypt_inplace(crypto_cipher_t *env, char *buf, size_t len)
   return 0;
 }
 
+/** How many ciphers crypto_cipher_crypt_inplace_multi() hands to the AES
+ * code at once. */
+#define MAX_FUSED_CIPHERS 8
+
+/** Encrypt <b>len</b> bytes on <b>buf</b> with each of the <b>n</b> ciphers
+ * in <b>envs</b>, as if by calling crypto_cipher_crypt_inplace() with each in
+ * turn; on success, return 0.  On failure, return -1.
+ */
+int
+crypto_cipher_crypt_inplace_multi(crypto_cipher_t **envs, int n,
+                                  char *buf, size_t len)
+{
+  aes_cnt_cipher_t *ciphers[MAX_FUSED_CIPHERS];
+  int i, k;
+
+  tor_assert(len < SIZE_T_CEILING);
+  while (n > 0) {
+    k = MIN(n, MAX_FUSED_CIPHERS);
+    for (i = 0; i < k; ++i)
+      ciphers[i] = envs[i]->cipher;
+    aes_crypt_inplace_multi(ciphers, k, buf, len);
+    envs += k;
+    n -= k;
+  }
+  return 0;
+}
+
 /** Encrypt <b>fromlen</b> bytes (at least 1) from <b>from</b> with the key in
  * <b>key</b> to the buffer in <b>to</b> of length
  * <b>tolen</b>. <b>tolen</b> must be at least <b>fromlen</b> plus
@@ -1478,6 +1505,13 @@ struct crypto_digest_t {
   digest_algorithm_t algorithm : 8; /**< Which algorithm is in use? */
 };
 
+/** Compile-time check that a crypto_digest_checkpoint_t has room for the
+ * state of any digest we use: if not, this array's size is negative and
+ * the build fails. */
+typedef char crypto_digest_checkpoint_fits_state_t[
+  (sizeof(((crypto_digest_t*)0)->d) <=
+   sizeof(((crypto_digest_checkpoint_t*)0)->mem)) ? 1 : -1];
+
 /** Allocate and return a new digest object to compute SHA1 digests.
  */
 crypto_digest_t *
@@ -1600,6 +1634,46 @@ crypto_digest_assign(crypto_digest_t *into,
   memcpy(into,from,sizeof(crypto_digest_t));
 }
 
+/** Helper: return how many bytes of hash state <b>digest</b> really uses. */
+static INLINE size_t
+crypto_digest_state_len(const crypto_digest_t *digest)
+{
+  switch (digest->algorithm) {
+    case DIGEST_SHA1:
+      return sizeof(digest->d.sha1);
+    case DIGEST_SHA256:
+      return sizeof(digest->d.sha2);
+    default:
+      tor_fragile_assert();
+      return sizeof(digest->d);
+  }
+}
+
+/** Save the state of <b>digest</b> into <b>checkpoint</b>, so that
+ * crypto_digest_restore() can later undo whatever was added in between.
+ * Unlike crypto_digest_dup(), this never allocates.
+ */
+void
+crypto_digest_checkpoint(crypto_digest_checkpoint_t *checkpoint,
+                         const crypto_digest_t *digest)
+{
+  tor_assert(digest);
+  tor_assert(checkpoint);
+  memcpy(checkpoint->mem, &digest->d, crypto_digest_state_len(digest));
+}
+
+/** Put <b>digest</b> back into the state saved in <b>checkpoint</b>, which
+ * must have come from the same digest object.
+ */
+void
+crypto_digest_restore(crypto_digest_t *digest,
+                      const crypto_digest_checkpoint_t *checkpoint)
+{
+  tor_assert(digest);
+  tor_assert(checkpoint);
+  memcpy(&digest->d, checkpoint->mem, crypto_digest_state_len(digest));
+}
+
 /** Compute the HMAC-SHA-1 of the <b>msg_len</b> bytes in <b>msg</b>, using
  * the <b>key</b> of length <b>key_len</b>.  Store the DIGEST_LEN-byte result
  * in <b>hmac_out</b>.
@@ -108,6 +108,12 @@ typedef struct {
 typedef struct crypto_pk_t crypto_pk_t;
 typedef struct crypto_cipher_t crypto_cipher_t;
 typedef struct crypto_digest_t crypto_digest_t;
+
+/** Saved state of a crypto_digest_t; see crypto_digest_checkpoint().  Meant
+ * to live on the stack, so saving a digest costs no allocation. */
+typedef struct crypto_digest_checkpoint_t {
+  uint64_t mem[16]; /**< Room for the largest hash state we use. */
+} crypto_digest_checkpoint_t;
 typedef struct crypto_dh_t crypto_dh_t;
 
 /* global state */
@@ -191,6 +197,8 @@ int crypto_cipher_encrypt(crypto_cipher_t *env, char *to,
 int crypto_cipher_decrypt(crypto_cipher_t *env, char *to,
                           const char *from, size_t fromlen);
 int crypto_cipher_crypt_inplace(crypto_cipher_t *env, char *d, size_t len);
+int crypto_cipher_crypt_inplace_multi(crypto_cipher_t **envs, int n,
+                                      char *d, size_t len);
 
 int crypto_cipher_encrypt_with_iv(const char *key,
                                   char *to, size_t tolen,
@@ -216,6 +224,10 @@ void crypto_digest_get_digest(crypto_digest_t *digest,
 crypto_digest_t *crypto_digest_dup(const crypto_digest_t *digest);
 void crypto_digest_assign(crypto_digest_t *into,
                           const crypto_digest_t *from);
+void crypto_digest_checkpoint(crypto_digest_checkpoint_t *checkpoint,
+                              const crypto_digest_t *digest);
+void crypto_digest_restore(crypto_digest_t *digest,
+                           const crypto_digest_checkpoint_t *checkpoint);
 void crypto_hmac_sha1(char *hmac_out,
                       const char *key, size_t key_len,
                       const char *msg, size_t msg_len);
@@ -636,5 +636,33 @@ mp_pool_log_status(mp_pool_t *pool, int severity)
          U64_PRINTF_ARG(pool->total_chunks_freed));
 #endif
 }
+
+/** Store the number of bytes that <b>pool</b> holds in its chunks in
+ * *<b>bytes_out</b>, and the number of chunks it has ever allocated and
+ * freed in *<b>n_chunks_allocated_out</b> and *<b>n_chunks_freed_out</b>. */
+void
+mp_pool_get_stats(const mp_pool_t *pool, uint64_t *bytes_out,
+                  uint64_t *n_chunks_allocated_out,
+                  uint64_t *n_chunks_freed_out)
+{
+  const mp_chunk_t *chunk;
+  uint64_t bytes = 0;
+
+  ASSERT(pool);
+
+  for (chunk = pool->empty_chunks; chunk; chunk = chunk->next)
+    bytes += chunk->mem_size;
+  for (chunk = pool->used_chunks; chunk; chunk = chunk->next)
+    bytes += chunk->mem_size;
+  for (chunk = pool->full_chunks; chunk; chunk = chunk->next)
+    bytes += chunk->mem_size;
+  *bytes_out = bytes;
+#ifdef MEMPOOL_STATS
+  *n_chunks_allocated_out = pool->total_chunks_allocated;
+  *n_chunks_freed_out = pool->total_chunks_freed;
+#else
+  *n_chunks_allocated_out = *n_chunks_freed_out = 0;
+#endif
+}
 #endif
 
@@ -21,6 +21,9 @@ void mp_pool_clean(mp_pool_t *pool, int n_to_keep, int keep_recently_used);
 void mp_pool_destroy(mp_pool_t *pool);
 void mp_pool_assert_ok(mp_pool_t *pool);
 void mp_pool_log_status(mp_pool_t *pool, int severity);
+void mp_pool_get_stats(const mp_pool_t *pool, uint64_t *bytes_out,
+                       uint64_t *n_chunks_allocated_out,
+                       uint64_t *n_chunks_freed_out);
 
 #define MEMPOOL_STATS
 
@@ -0,0 +1,307 @@
+/* Copyright (c) 2012, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file timewheel.c
+ * \brief Hierarchical timing wheel: a set of deadlines that can be armed and
+ * disarmed in constant time, and that costs nothing per idle entry when the
+ * clock advances.
+ *
+ * Deadlines are measured in abstract "ticks"; the caller decides what a tick
+ * is (Tor's main loop uses seconds).  The wheel has TIMEWHEEL_LEVELS levels
+ * of TIMEWHEEL_SLOTS slots each.  Level 0 has one slot per tick; every slot
+ * on level N covers TIMEWHEEL_SLOTS times as many ticks as a slot on level
+ * N-1.  When level 0 wraps around, the next slot of level 1 is "cascaded":
+ * its entries are re-filed at finer granularity.  Entries further away than
+ * the whole wheel can represent are parked on the top level and re-filed
+ * each time their slot comes around.
+ **/
+
+#include "orconfig.h"
+#include "timewheel.h"
+#include "util.h"
+#include "torlog.h"
+
+/** log2 of TIMEWHEEL_SLOTS. */
+#define TIMEWHEEL_SLOT_BITS 6
+/** How many slots are there on each level of the wheel? */
+#define TIMEWHEEL_SLOTS (1<<TIMEWHEEL_SLOT_BITS)
+/** Mask to extract a slot index from a tick count. */
+#define TIMEWHEEL_SLOT_MASK (TIMEWHEEL_SLOTS-1)
+/** How many levels does the wheel have? */
+#define TIMEWHEEL_LEVELS 4
+/** How many ticks ahead can the wheel represent exactly? */
+#define TIMEWHEEL_SPAN \
+  (U64_LITERAL(1) << (TIMEWHEEL_SLOT_BITS*TIMEWHEEL_LEVELS))
+
+/** Implementation for timewheel_t. */
+struct timewheel_t {
+  /** The most recent tick we have advanced to.  Every entry due at or
+   * before this tick has already been run. */
+  uint64_t now;
+  /** Number of entries currently armed on this wheel. */
+  int n_scheduled;
+  /** Circular list heads for every slot on every level. */
+  timewheel_link_t slots[TIMEWHEEL_LEVELS][TIMEWHEEL_SLOTS];
+};
+
+/** Return the entry that contains the list node <b>lnk</b>. */
+#define ENTRY_OF(lnk)                                                   \
+  ((timewheel_entry_t*)                                                 \
+   (((char*)(lnk)) - STRUCT_OFFSET(timewheel_entry_t, link)))
+
+/** Make <b>head</b> into an empty list. */
+static INLINE void
+link_init_head(timewheel_link_t *head)
+{
+  head->next = head->prev = head;
+}
+
+/** Append <b>lnk</b> to the end of the list at <b>head</b>. */
+static INLINE void
+link_append(timewheel_link_t *head, timewheel_link_t *lnk)
+{
+  lnk->prev = head->prev;
+  lnk->next = head;
+  head->prev->next = lnk;
+  head->prev = lnk;
+}
+
+/** Remove <b>lnk</b> from whatever list it is on. */
+static INLINE void
+link_remove(timewheel_link_t *lnk)
+{
+  lnk->prev->next = lnk->next;
+  lnk->next->prev = lnk->prev;
+  lnk->next = lnk->prev = NULL;
+}
+
+/** Move every element of the list at <b>from</b> onto the (empty) list at
+ * <b>to</b>, leaving <b>from</b> empty. */
+static INLINE void
+link_take_all(timewheel_link_t *to, timewheel_link_t *from)
+{
+  if (from->next == from) {
+    link_init_head(to);
+    return;
+  }
+  to->next = from->next;
+  to->prev = from->prev;
+  to->next->prev = to;
+  to->prev->next = to;
+  link_init_head(from);
+}
+
+/** Allocate and return a new empty timewheel whose clock reads <b>now</b>.
+ */
+timewheel_t *
+timewheel_new(uint64_t now)
+{
+  timewheel_t *wheel = tor_malloc_zero(sizeof(timewheel_t));
+  int level, slot;
+  wheel->now = now;
+  for (level = 0; level < TIMEWHEEL_LEVELS; ++level)
+    for (slot = 0; slot < TIMEWHEEL_SLOTS; ++slot)
+      link_init_head(&wheel->slots[level][slot]);
+  return wheel;
+}
+
+/** Release all storage held by <b>wheel</b>.  Any entries still armed on it
+ * are disarmed, but not freed: they belong to their owners. */
+void
+timewheel_free(timewheel_t *wheel)
+{
+  int level, slot;
+  if (!wheel)
+    return;
+  for (level = 0; level < TIMEWHEEL_LEVELS; ++level) {
+    for (slot = 0; slot < TIMEWHEEL_SLOTS; ++slot) {
+      timewheel_link_t *head = &wheel->slots[level][slot];
+      while (head->next != head) {
+        timewheel_entry_t *ent = ENTRY_OF(head->next);
+        link_remove(&ent->link);
+        ent->wheel = NULL;
+      }
+    }
+  }
+  tor_free(wheel);
+}
+
+/** Initialize <b>ent</b> as an idle entry that will call <b>cb</b> with
+ * <b>arg</b> when it comes due. */
+void
+timewheel_entry_init(timewheel_entry_t *ent, timewheel_cb_t cb, void *arg)
+{
+  ent->link.next = ent->link.prev = NULL;
+  ent->wheel = NULL;
+  ent->when = 0;
+  ent->cb = cb;
+  ent->arg = arg;
+}
+
+/** File <b>ent</b>, which is not on any list, in the slot of <b>wheel</b>
+ * that matches its deadline. */
+static void
+timewheel_file(timewheel_t *wheel, timewheel_entry_t *ent)
+{
+  uint64_t delta;
+  int level = 0;
+  unsigned slot;
+
+  if (ent->when <= wheel->now) {
+    /* Only possible while cascading: the entry is due on the tick we are
+     * about to run. */
+    slot = (unsigned)(wheel->now & TIMEWHEEL_SLOT_MASK);
+    link_append(&wheel->slots[0][slot], &ent->link);
+    return;
+  }
+
+  delta = ent->when - wheel->now;
+  while (level < TIMEWHEEL_LEVELS-1 &&
+         delta >= (U64_LITERAL(1) << (TIMEWHEEL_SLOT_BITS*(level+1))))
+    ++level;
+  if (delta >= TIMEWHEEL_SPAN) {
+    /* Too far away to represent: park it in the current top-level slot,
+     * which will not be cascaded again for a full turn of the wheel, and
+     * re-file it then. */
+    slot = (unsigned)((wheel->now >> (TIMEWHEEL_SLOT_BITS*level))
+                      & TIMEWHEEL_SLOT_MASK);
+  } else {
+    slot = (unsigned)((ent->when >> (TIMEWHEEL_SLOT_BITS*level))
+                      & TIMEWHEEL_SLOT_MASK);
+  }
+  link_append(&wheel->slots[level][slot], &ent->link);
+}
+
+/** Arm <b>ent</b> to run when <b>wheel</b> advances to tick <b>when</b>.
+ * If <b>ent</b> was already armed, it is moved.  Deadlines that are not in
+ * the future run on the next tick.  Entries due on the same tick run in the
+ * order they were scheduled. */
+void
+timewheel_schedule(timewheel_t *wheel, timewheel_entry_t *ent, uint64_t when)
+{
+  tor_assert(ent->cb);
+  timewheel_cancel(ent);
+  if (when <= wheel->now)
+    when = wheel->now + 1;
+  ent->when = when;
+  ent->wheel = wheel;
+  ++wheel->n_scheduled;
+  timewheel_file(wheel, ent);
+}
+
+/** Disarm <b>ent</b> if it is armed. */
+void
+timewheel_cancel(timewheel_entry_t *ent)
+{
+  if (!ent->wheel)
+    return;
+  link_remove(&ent->link);
+  --ent->wheel->n_scheduled;
+  ent->wheel = NULL;
+}
+
+/** Re-file every entry in slot <b>slot</b> of level <b>level</b> of
+ * <b>wheel</b> according to the wheel's current time. */
+static void
+timewheel_cascade(timewheel_t *wheel, int level, unsigned slot)
+{
+  timewheel_link_t pending;
+  link_take_all(&pending, &wheel->slots[level][slot]);
+  while (pending.next != &pending) {
+    timewheel_entry_t *ent = ENTRY_OF(pending.next);
+    link_remove(&ent->link);
+    timewheel_file(wheel, ent);
+  }
+}
+
+/** Pull every entry off <b>wheel</b> and re-file it relative to the tick
+ * before <b>now</b>, so that a single step brings the wheel up to date.
+ * Used when the clock jumps further than the wheel can span. */
+static void
+timewheel_rebase(timewheel_t *wheel, uint64_t now)
+{
+  timewheel_link_t pending;
+  int level, slot;
+
+  link_init_head(&pending);
+  for (level = 0; level < TIMEWHEEL_LEVELS; ++level) {
+    for (slot = 0; slot < TIMEWHEEL_SLOTS; ++slot) {
+      timewheel_link_t *head = &wheel->slots[level][slot];
+      while (head->next != head) {
+        timewheel_link_t *lnk = head->next;
+        link_remove(lnk);
+        link_append(&pending, lnk);
+      }
+    }
+  }
+  wheel->now = now - 1;
+  while (pending.next != &pending) {
+    timewheel_entry_t *ent = ENTRY_OF(pending.next);
+    link_remove(&ent->link);
+    if (ent->when < now)
+      ent->when = now;
+    timewheel_file(wheel, ent);
+  }
+}
+
+/** Advance the clock of <b>wheel</b> to <b>now</b>, running the callback of
+ * every entry whose deadline is at or before <b>now</b>.  Callbacks receive
+ * <b>now</b>, not the tick they were due at, so that an entry which
+ * reschedules itself relative to the time it is passed does not run more
+ * than once after the clock jumps forward.  Moving the clock backwards does
+ * nothing. */
+void
+timewheel_advance(timewheel_t *wheel, uint64_t now)
+{
+  if (now <= wheel->now)
+    return;
+  if (now - wheel->now >= TIMEWHEEL_SPAN)
+    timewheel_rebase(wheel, now);
+
+  while (wheel->now < now) {
+    uint64_t tick;
+    timewheel_link_t *head;
+    int level;
+
+    if (!wheel->n_scheduled) {
+      wheel->now = now;
+      break;
+    }
+    tick = ++wheel->now;
+
+    /* Cascade from the coarsest level that rolled over on this tick down to
+     * level 1, so that entries can fall more than one level at once. */
+    for (level = TIMEWHEEL_LEVELS-1; level > 0; --level) {
+      uint64_t low_mask =
+        (U64_LITERAL(1) << (TIMEWHEEL_SLOT_BITS*level)) - 1;
+      if ((tick & low_mask) == 0)
+        timewheel_cascade(wheel, level,
+              (unsigned)((tick >> (TIMEWHEEL_SLOT_BITS*level))
+                         & TIMEWHEEL_SLOT_MASK));
+    }
+
+    head = &wheel->slots[0][tick & TIMEWHEEL_SLOT_MASK];
+    while (head->next != head) {
+      timewheel_entry_t *ent = ENTRY_OF(head->next);
+      tor_assert(ent->when <= tick);
+      timewheel_cancel(ent);
+      ent->cb(wheel, ent->arg, now);
+    }
+  }
+}
+
+/** Return the tick that <b>wheel</b> was most recently advanced to. */
+uint64_t
+timewheel_get_now(const timewheel_t *wheel)
+{
+  return wheel->now;
+}
+
+/** Return the number of entries armed on <b>wheel</b>. */
+int
+timewheel_n_scheduled(const timewheel_t *wheel)
+{
+  return wheel->n_scheduled;
+}
+
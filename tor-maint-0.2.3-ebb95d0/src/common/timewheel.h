@@ -0,0 +1,56 @@
+/* Copyright (c) 2012, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file timewheel.h
+ * \brief Headers for timewheel.c
+ **/
+
+#ifndef _TOR_TIMEWHEEL_H
+#define _TOR_TIMEWHEEL_H
+
+#include "compat.h"
+
+typedef struct timewheel_t timewheel_t;
+
+/** Callback invoked when a timewheel entry comes due.  The entry has
+ * already been removed from <b>wheel</b>; the callback may reschedule it. */
+typedef void (*timewheel_cb_t)(timewheel_t *wheel, void *arg, uint64_t now);
+
+/** Doubly-linked list node used to keep entries in their wheel slots. */
+typedef struct timewheel_link_t {
+  struct timewheel_link_t *next;
+  struct timewheel_link_t *prev;
+} timewheel_link_t;
+
+/** A single deadline on a timewheel_t.  Entries are meant to be embedded in
+ * the object that owns the deadline, so that arming and disarming them never
+ * allocates. */
+typedef struct timewheel_entry_t {
+  timewheel_link_t link; /**< Position in a wheel slot. */
+  timewheel_t *wheel; /**< The wheel this entry is armed on, or NULL. */
+  uint64_t when; /**< Tick at which this entry is due. */
+  timewheel_cb_t cb; /**< Function to call when the entry is due. */
+  void *arg; /**< Second argument for <b>cb</b>. */
+} timewheel_entry_t;
+
+timewheel_t *timewheel_new(uint64_t now);
+void timewheel_free(timewheel_t *wheel);
+void timewheel_entry_init(timewheel_entry_t *ent, timewheel_cb_t cb,
+                          void *arg);
+void timewheel_schedule(timewheel_t *wheel, timewheel_entry_t *ent,
+                        uint64_t when);
+void timewheel_cancel(timewheel_entry_t *ent);
+void timewheel_advance(timewheel_t *wheel, uint64_t now);
+uint64_t timewheel_get_now(const timewheel_t *wheel);
+int timewheel_n_scheduled(const timewheel_t *wheel);
+
+/** Return true iff <b>ent</b> is currently armed on some wheel. */
+static INLINE int
+timewheel_entry_is_scheduled(const timewheel_entry_t *ent)
+{
+  return ent->wheel != NULL;
+}
+
+#endif
+
@@ -0,0 +1,106 @@
+/* Copyright (c) 2012, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file token_bucket.c
+ * \brief Lazily-refilled token buckets, used for bandwidth limiting.
+ *
+ * A bucket is only ever refilled when somebody is about to look at it, by
+ * however many tokens it earned since it was last refilled.  That keeps the
+ * cost of rate limiting proportional to the number of buckets in use rather
+ * than the number that exist, and lets callers check buckets as often as
+ * they like without losing precision: fractions of a token are carried over
+ * between refills.
+ **/
+
+#include "orconfig.h"
+#include "token_bucket.h"
+#include "util.h"
+
+/** Longest gap between refills that we account for exactly.  Anything
+ * longer is enough to fill any bucket we configure, and capping it keeps
+ * rate * elapsed from overflowing. */
+#define MAX_REFILL_MSEC INT32_MAX
+
+/** Set up <b>tb</b> to add <b>rate</b> tokens per second up to at most
+ * <b>burst</b>, and start it off full at time <b>now_msec</b>. */
+void
+token_bucket_init(token_bucket_t *tb, uint32_t rate, int32_t burst,
+                  uint64_t now_msec)
+{
+  tb->rate = rate;
+  tb->burst = burst;
+  token_bucket_reset(tb, now_msec);
+}
+
+/** Change the rate and burst of <b>tb</b>.  If the bucket now holds more
+ * than its new burst, take out the extra tokens; if it holds fewer, leave it
+ * to grow towards the new cap. */
+void
+token_bucket_adjust(token_bucket_t *tb, uint32_t rate, int32_t burst)
+{
+  tb->rate = rate;
+  tb->burst = burst;
+  if (tb->bucket > burst)
+    tb->bucket = burst;
+}
+
+/** Fill <b>tb</b> to its burst, as of <b>now_msec</b>. */
+void
+token_bucket_reset(token_bucket_t *tb, uint64_t now_msec)
+{
+  tb->bucket = tb->burst;
+  tb->partial = 0;
+  tb->last_refilled_msec = now_msec;
+}
+
+/** Add to <b>tb</b> every token it has earned between its last refill and
+ * <b>now_msec</b>.  Return 1 if this took the bucket from empty (or
+ * overdrawn) to nonempty, and 0 otherwise.  If the clock seems to have
+ * gone backwards, just restart the accounting from <b>now_msec</b>. */
+int
+token_bucket_refill(token_bucket_t *tb, uint64_t now_msec)
+{
+  uint64_t elapsed, earned;
+  int32_t old_bucket = tb->bucket;
+
+  if (now_msec <= tb->last_refilled_msec) {
+    tb->last_refilled_msec = now_msec;
+    return 0;
+  }
+  elapsed = now_msec - tb->last_refilled_msec;
+  tb->last_refilled_msec = now_msec;
+
+  if (tb->bucket >= tb->burst) {
+    tb->partial = 0;
+    return 0;
+  }
+  if (elapsed > MAX_REFILL_MSEC)
+    elapsed = MAX_REFILL_MSEC;
+
+  earned = ((uint64_t)tb->rate) * elapsed + tb->partial;
+  tb->partial = (uint32_t)(earned % 1000);
+  earned /= 1000;
+  if (earned >= (uint64_t)((int64_t)tb->burst - tb->bucket)) {
+    tb->bucket = tb->burst;
+    tb->partial = 0;
+  } else {
+    tb->bucket += (int32_t)earned;
+  }
+
+  return old_bucket <= 0 && tb->bucket > 0;
+}
+
+/** Take <b>n</b> tokens out of <b>tb</b>.  Return 1 if this emptied the
+ * bucket (or overdrew it), and 0 otherwise. */
+int
+token_bucket_dec(token_bucket_t *tb, int32_t n)
+{
+  int32_t old_bucket = tb->bucket;
+  if (tb->bucket < INT32_MIN + n)
+    tb->bucket = INT32_MIN;
+  else
+    tb->bucket -= n;
+  return old_bucket > 0 && tb->bucket <= 0;
+}
+
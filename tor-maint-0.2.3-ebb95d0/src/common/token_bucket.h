@@ -0,0 +1,38 @@
+/* Copyright (c) 2012, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file token_bucket.h
+ * \brief Headers for token_bucket.c
+ **/
+
+#ifndef _TOR_TOKEN_BUCKET_H
+#define _TOR_TOKEN_BUCKET_H
+
+#include "torint.h"
+
+/** A token bucket that is refilled lazily: instead of somebody adding
+ * tokens to every bucket on every tick, each bucket remembers when it was
+ * last topped up, and catches up whenever it is looked at. */
+typedef struct token_bucket_t {
+  int32_t bucket; /**< Tokens available now.  Can go negative if a caller
+                   * spends more than it had. */
+  uint32_t rate; /**< Tokens added per second. */
+  int32_t burst; /**< The bucket never refills beyond this many tokens. */
+  uint32_t partial; /**< Thousandths of a token earned but not yet added. */
+  uint64_t last_refilled_msec; /**< Millisecond timestamp of the last
+                                * refill. */
+} token_bucket_t;
+
+void token_bucket_init(token_bucket_t *tb, uint32_t rate, int32_t burst,
+                       uint64_t now_msec);
+void token_bucket_adjust(token_bucket_t *tb, uint32_t rate, int32_t burst);
+void token_bucket_reset(token_bucket_t *tb, uint64_t now_msec);
+int token_bucket_refill(token_bucket_t *tb, uint64_t now_msec);
+int token_bucket_dec(token_bucket_t *tb, int32_t n);
+
+/** Return the number of tokens in <b>tb</b> as of its last refill. */
+#define token_bucket_get(tb) ((tb)->bucket)
+
+#endif
+
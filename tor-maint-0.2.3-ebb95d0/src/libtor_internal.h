@@ -7,8 +7,6 @@
 /* XXX: remove me once the library becomes reentrant */
 typedef void (*onionroute_command_processor_t)(void* data);
 
-extern smartlist_t *cqueue;
-
 typedef struct onionroute_command_t
 {
 
@@ -17,4 +15,73 @@ typedef struct onionroute_command_t
 
 } onionroute_command_t;
 
+/** How many commands can be waiting for the main loop before API calls
+ * start failing with ONIONROUTE_ERR_QUEUE_FULL. */
+#define ONIONROUTE_COMMAND_QUEUE_SIZE 4096
+
+/** Default for how long, in msec, a library stream may hold back a partial
+ * relay cell waiting for the application to write more. */
+#define ONIONROUTE_DEFAULT_FLUSH_DELAY_MSEC 10
+
+/** Most bytes a library stream's receive ring holds. It must fit a whole
+ * stream window (STREAMWINDOW_START * RELAY_PAYLOAD_SIZE), since the exit
+ * may send that much before hearing from us. */
+#define ONIONROUTE_RECV_RING_MAX (256*1024)
+
+/** How long, in msec, bytes the v3 data callback left unconsumed wait
+ * before they are offered again if no new data arrives first. */
+#define ONIONROUTE_REDELIVER_DELAY_MSEC 50
+
+/* receive rings, see main.c; all of these are called from the main loop */
+struct onionroute_recv_stream_t;
+struct onionroute_recv_stream_t *onionroute_recv_stream_attach(void *id);
+void onionroute_recv_stream_detach(struct onionroute_recv_stream_t *rs);
+int onionroute_recv_stream_deliver(struct onionroute_recv_stream_t *rs,
+                                   const char *data, size_t len);
+int onionroute_recv_stream_has_room(struct onionroute_recv_stream_t *rs,
+                                    size_t len);
+
+/** What the library keeps per onionroute_ctx_t: callbacks and the flush
+ * delay, and nothing else. Streams opened without a context use
+ * onionroute_default_ctx. */
+struct onionroute_ctx_t
+{
+  /* Only the main loop touches the callbacks once the library is running;
+   * the setters in main.c hand them over through the command queue. */
+  onionroute_event_stream_open_t_v1 open_v1;
+  onionroute_event_stream_open_t_v2 open_v2;
+  onionroute_event_stream_close_t_v1 close_v1;
+  onionroute_event_stream_close_t_v2 close_v2;
+  onionroute_event_stream_data_received_t_v1 data_v1;
+  onionroute_event_stream_data_received_t_v2 data_v2;
+  onionroute_event_stream_data_received_t_v3 data_v3;
+  /** See onionroute_set_stream_flush_delay_v1().  Only the main loop
+   * touches this once the library is running; see
+   * onionroute_ctx_set_flush_delay(). */
+  unsigned int flush_delay_msec;
+  /** Streams using this context, plus one until the application frees it.
+   * Only the main loop touches this. */
+  int refcount;
+};
+
+extern onionroute_ctx_t onionroute_default_ctx;
+void onionroute_ctx_decref(onionroute_ctx_t *ctx);
+
+/* stream handles, see main.c; onionroute_handle_new() and
+   onionroute_handle_is_live() may be called from any thread */
+struct edge_connection_t;
+void *onionroute_handle_new(void);
+int onionroute_handle_is_live(void *id);
+void onionroute_handle_bind(void *id, struct edge_connection_t *conn);
+struct edge_connection_t *onionroute_handle_get_conn(void *id);
+void onionroute_handle_free(void *id);
+
+/* queue a command to be run by the main loop, callable from any thread */
+int onionroute_command_queue_is_ready(void);
+int onionroute_command_enqueue(onionroute_command_processor_t processor,
+                               void *data);
+
+/* change a context's flush delay, callable from any thread */
+int onionroute_ctx_set_flush_delay(onionroute_ctx_t *ctx, unsigned int msec);
+
 #endif
\ No newline at end of file
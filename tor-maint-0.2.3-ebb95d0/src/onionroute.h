@@ -67,6 +67,17 @@ typedef unsigned int uint32_t;
  * very wrong, and the Tor process can no longer proceed. */
 #define LOG_ERR     3
 
+/** Returned by the calls that hand work to the library main loop when its
+ * command queue is full; the call had no effect and may be retried. */
+#define ONIONROUTE_ERR_QUEUE_FULL (-2)
+
+/** Returned by onionroute_try_recv_stream_data_v1 when the stream has no
+ * data to read yet. */
+#define ONIONROUTE_ERR_WOULD_BLOCK (-3)
+
+/** Returned by stream calls given a handle whose stream has already ended. */
+#define ONIONROUTE_ERR_STALE_STREAM (-4)
+
 /** Enum describing various stages of bootstrapping, The values range from 0 to 100. */
 typedef enum {
   BOOTSTRAP_STATUS_UNDEF=-1,
@@ -131,43 +142,73 @@ onionroute_format_msg_v1(char *buf, size_t buf_len,
            log_domain_mask_t_v1 domain, int severity, const char *funcname,
            const char *format, va_list ap, size_t *msg_len_out);
 
+/* stream handles: the first argument of every stream callback, and the id every stream
+   call takes, is the stream's opaque handle. v1 and v2 callbacks used to be passed the
+   library's own connection pointer instead; code that only hands the id back to the
+   library works unchanged, but the id must not be dereferenced, and a new stream never
+   gets the id of an old one */
+
 /* stream close */
 typedef void (*onionroute_event_stream_close_t_v1)(void*);
 typedef void (*onionroute_event_stream_close_t_v2)(void*, void*);
 
 ONIONROUTE_API
-void
+int
 onionroute_set_stream_close_callback_v1(onionroute_event_stream_close_t_v1 callback);
 
 ONIONROUTE_API
-void
+int
 onionroute_set_stream_close_callback_v2(onionroute_event_stream_close_t_v2 callback);
 
 /* stream open */
 typedef void (*onionroute_event_stream_open_t_v1)(void *);
 ONIONROUTE_API
-void
+int
 onionroute_set_stream_open_callback_v1(onionroute_event_stream_open_t_v1 callback);
 
 typedef void (*onionroute_event_stream_open_t_v2)(void *, void *);
 ONIONROUTE_API
-void
+int
 onionroute_set_stream_open_callback_v2(onionroute_event_stream_open_t_v2 callback);
 
 
 
+/* a piece of caller or library memory */
+typedef struct onionroute_iovec_t
+{
+  const char *base;
+  size_t len;
+} onionroute_iovec_t;
+
 /* stream read */
 typedef void (*onionroute_event_stream_data_received_t_v1)(void *, size_t len, char* data);
 typedef void (*onionroute_event_stream_data_received_t_v2)(void *, void*, size_t len, char* data);
 
 ONIONROUTE_API
-void
+int
 onionroute_set_stream_data_received_callback_v1(onionroute_event_stream_data_received_t_v1 callback);
 
 ONIONROUTE_API
-void
+int
 onionroute_set_stream_data_received_callback_v2(onionroute_event_stream_data_received_t_v2 callback);
 
+/* batched receive: called once per stream per network read with one span per data cell
+   (total bytes in all of them). Return how many bytes from the front you consumed; the
+   rest is offered again, ahead of newer data, and the stream window only reopens as you
+   consume, so the exit slows down to your pace. Spans are only valid during the call */
+typedef size_t (*onionroute_event_stream_data_received_t_v3)(void *id, void *obj,
+              const onionroute_iovec_t *spans, int n_spans, size_t total);
+
+ONIONROUTE_API
+int
+onionroute_set_stream_data_received_callback_v3(onionroute_event_stream_data_received_t_v3 callback);
+
+/* receive flow control: while a stream is paused no SENDMEs go out for it, so the exit
+   stops once the stream window (at most ~250KB) is used up. Cells already in flight still
+   arrive; v3 callbacks hold them until resume */
+ONIONROUTE_API int onionroute_stream_pause_read_v1(void *id);
+ONIONROUTE_API int onionroute_stream_resume_read_v1(void *id);
+
 
 
 
@@ -178,29 +219,121 @@ int onionroute_stream_open_v1(char *addr, int port);
 ONIONROUTE_API
 int onionroute_stream_open_v2(char *addr, int port, void *obj);
 
+/* returns the new stream's handle right away, or NULL on failure. The handle is what
+   every callback and stream call uses; it may be written to before the open callback
+   fires and the data goes out as soon as the exit allows. Handles are never reused, a
+   call on a closed stream fails with ONIONROUTE_ERR_STALE_STREAM. Where pointers are
+   32 bits this means the library runs out of handles, and opens fail, after about four
+   billion streams */
+ONIONROUTE_API
+void *onionroute_stream_open_v3(const char *addr, int port, void *obj);
+
+/* contexts: a context is a callback namespace. Each one has its own stream callbacks
+   and flush delay and only hears about the streams opened on it, so independent parts
+   of a program each get their own events. Nothing else is per context: all of them
+   share the single Tor client started by onionroute_init_v1, with its event loop,
+   options, circuits, DNS cache and command queue, so e.g.
+   onionroute_switch_to_new_circuits_v1 affects every context's streams.
+   The calls without a context use a built-in default one.
+   Callback setters, with or without a context, may be called from any thread; once
+   onionroute_init_v1 has run the change reaches the main loop through the command
+   queue, so they return 0 or ONIONROUTE_ERR_QUEUE_FULL.
+   XXX contexts are a first step towards separate client instances in one process;
+   giving each context its own event base, connections and circuits is still to do */
+typedef struct onionroute_ctx_t onionroute_ctx_t;
+
+ONIONROUTE_API onionroute_ctx_t *onionroute_ctx_new_v1(void);
+
+/* closes every stream still open on ctx; their close callbacks still fire, after
+   which ctx goes away */
+ONIONROUTE_API int onionroute_ctx_free_v1(onionroute_ctx_t *ctx);
+
+ONIONROUTE_API int onionroute_ctx_set_stream_open_callback_v1(onionroute_ctx_t *ctx,
+              onionroute_event_stream_open_t_v1 callback);
+ONIONROUTE_API int onionroute_ctx_set_stream_open_callback_v2(onionroute_ctx_t *ctx,
+              onionroute_event_stream_open_t_v2 callback);
+ONIONROUTE_API int onionroute_ctx_set_stream_close_callback_v1(onionroute_ctx_t *ctx,
+              onionroute_event_stream_close_t_v1 callback);
+ONIONROUTE_API int onionroute_ctx_set_stream_close_callback_v2(onionroute_ctx_t *ctx,
+              onionroute_event_stream_close_t_v2 callback);
+ONIONROUTE_API int onionroute_ctx_set_stream_data_received_callback_v1(onionroute_ctx_t *ctx,
+              onionroute_event_stream_data_received_t_v1 callback);
+ONIONROUTE_API int onionroute_ctx_set_stream_data_received_callback_v2(onionroute_ctx_t *ctx,
+              onionroute_event_stream_data_received_t_v2 callback);
+ONIONROUTE_API int onionroute_ctx_set_stream_data_received_callback_v3(onionroute_ctx_t *ctx,
+              onionroute_event_stream_data_received_t_v3 callback);
+ONIONROUTE_API int onionroute_ctx_set_stream_flush_delay_v1(onionroute_ctx_t *ctx,
+              unsigned int msec);
+
+/* same as onionroute_stream_open_v3, on ctx */
+ONIONROUTE_API
+void *onionroute_ctx_stream_open_v1(onionroute_ctx_t *ctx, const char *addr, int port,
+              void *obj);
+
 ONIONROUTE_API
 int
 onionroute_closestream_v1(void *id);
 
 ONIONROUTE_API int onionroute_stream_write_v1(void *id, char* data, int size);
+/* returns the same as onionroute_stream_write_v1 for the formatted text */
 ONIONROUTE_API int onionroute_stream_printf_v1(void *id, const char *format, ...);
 ONIONROUTE_API int onionroute_stream_flush_v1(void *id);
 
+/* writes are coalesced into full relay cells; a partial cell is sent once it
+   has waited msec milliseconds or onionroute_stream_flush_v1 is called.
+   0 sends every write at once. Returns 0, or ONIONROUTE_ERR_QUEUE_FULL if the
+   change could not be handed to the running client */
+ONIONROUTE_API
+int
+onionroute_set_stream_flush_delay_v1(unsigned int msec);
+
+/* zero-copy write: the library keeps pointing at the caller's buffers until
+   every byte has been packaged into relay cells, then calls done_cb from the
+   main loop thread. status is 0 when the data was sent and -1 when the stream
+   closed first. The iovec array itself is copied and can be reused at once */
+typedef void (*onionroute_write_done_t_v2)(void *id, void *ctx, int status);
+
+ONIONROUTE_API
+int
+onionroute_stream_writev_v2(void *id, const onionroute_iovec_t *iov, int n,
+                            onionroute_write_done_t_v2 done_cb, void *ctx);
+
 
 
 /* control */
 ONIONROUTE_API int onionroute_clear_dns_cache_signal_v1();
 ONIONROUTE_API int onionroute_switch_to_new_circuits_v1();
 
+/* command queue statistics: commands waiting now, queue size, and how many
+   calls were refused with ONIONROUTE_ERR_QUEUE_FULL so far */
+ONIONROUTE_API
+void
+onionroute_get_command_queue_stats_v1(unsigned int *depth,
+                                      unsigned int *capacity,
+                                      unsigned int *n_rejected);
+
 
 
 
 
-/* this API function is to easily replace code using sockets like read(socket, ...) as the library is async */
+/* this API function is to easily replace code using sockets like read(socket, ...) as the library is async.
+   Blocks until the stream has data, returns the number of bytes read or -1 once the stream closed */
 ONIONROUTE_API
 int
 onionroute_recv_stream_data_v1(void *id, char* buffer, size_t buffersize);
 
+/* same as onionroute_recv_stream_data_v1 but returns ONIONROUTE_ERR_WOULD_BLOCK instead of waiting */
+ONIONROUTE_API
+int
+onionroute_try_recv_stream_data_v1(void *id, char* buffer, size_t buffersize);
+
+/* a descriptor that polls readable exactly when a recv on the stream would not block, for use in
+   the application's own select/poll/epoll loop. Never read from it; it is closed once recv has
+   reported the end of the stream */
+ONIONROUTE_API
+tor_socket_t
+onionroute_stream_recv_fd_v1(void *id);
+
 /* send data to the queque so it can be read */
 ONIONROUTE_API
 int
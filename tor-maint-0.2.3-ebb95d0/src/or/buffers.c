@@ -19,11 +19,29 @@
 #include "connection_or.h"
 #include "control.h"
 #include "reasons.h"
+#include "../common/mempool.h"
 #include "../common/util.h"
 #include "../common/torlog.h"
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
+#if defined(HAVE_READV) && defined(HAVE_WRITEV) && defined(HAVE_SYS_UIO_H)
+/** Defined if we can read into and write from a whole chain of chunks with
+ * one readv() or writev() call. */
+#define USE_SCATTER_GATHER_IO
+/** Most chunks we'll hand to a single readv() or writev().  POSIX only
+ * promises that IOV_MAX is at least 16. */
+#define MAX_IOVECS_PER_CALL 16
+#endif
+
+/** Number of recv()/readv() calls made by read_to_buf(). */
+static uint64_t n_buf_read_calls = 0;
+/** Number of send()/writev() calls made by flush_buf(). */
+static uint64_t n_buf_write_calls = 0;
 
 //#define PARANOIA
 
@@ -109,97 +127,113 @@ chunk_repack(chunk_t *chunk)
   chunk->data = &chunk->mem[0];
 }
 
+/** If a read onto the end of a chunk would be smaller than this number, then
+ * just start a new chunk. */
+#define MIN_READ_LEN 8
+/** Every chunk should take up at least this many bytes. */
+#define MIN_CHUNK_ALLOC 256
+/** No chunk should take up more than this many bytes. */
+#define MAX_CHUNK_ALLOC 65536
+
 #if defined(ENABLE_BUF_FREELISTS) || defined(RUNNING_DOXYGEN)
-/** A freelist of chunks. */
-typedef struct chunk_freelist_t {
-  size_t alloc_size; /**< What size chunks does this freelist hold? */
-  int max_length; /**< Never allow more than this number of chunks in the
-                   * freelist. */
-  int slack; /**< When trimming the freelist, leave this number of extra
-              * chunks beyond lowest_length.*/
-  int cur_length; /**< How many chunks on the freelist now? */
-  int lowest_length; /**< What's the smallest value of cur_length since the
-                      * last time we cleaned this freelist? */
-  uint64_t n_alloc;
-  uint64_t n_free;
-  uint64_t n_hit;
-  chunk_t *head; /**< First chunk on the freelist. */
-} chunk_freelist_t;
-
-/** Macro to help define freelists. */
-#define FL(a,m,s) { a, m, s, 0, 0, 0, 0, 0, NULL }
-
-/** Static array of freelists, sorted by alloc_len, terminated by an entry
- * with alloc_size of 0. */
-static chunk_freelist_t freelists[] = {
-  FL(4096, 256, 8), FL(8192, 128, 4), FL(16384, 64, 4), FL(32768, 32, 2),
-  FL(0, 0, 0)
-};
-#undef FL
-/** How many times have we looked for a chunk of a size that no freelist
+/** log2 of MIN_CHUNK_ALLOC. */
+#define MIN_CHUNK_ALLOC_BITS 8
+/** How many chunk size classes are there?  One for each power of two from
+ * MIN_CHUNK_ALLOC to MAX_CHUNK_ALLOC. */
+#define N_CHUNK_SIZE_CLASSES 9
+/** How many bytes should each slab of chunks try to take up? */
+#define CHUNK_SLAB_SIZE (128*1024)
+
+/** All the chunks with a given allocation size.  Chunks in a size class
+ * are carved out of larger slabs by a memory pool, and go back to the pool
+ * when they are freed, so that a busy relay can recycle its chunks without
+ * going to malloc for each one. */
+typedef struct chunk_size_class_t {
+  mp_pool_t *pool; /**< Slabs for this class; NULL until we first need one.*/
+  int n_in_use; /**< How many chunks of this size are on buffers now? */
+  uint64_t n_alloc; /**< How many chunks of this size have we handed out? */
+  uint64_t n_free; /**< How many chunks of this size have come back? */
+} chunk_size_class_t;
+
+/** Size classes for every power-of-two chunk allocation size from
+ * MIN_CHUNK_ALLOC to MAX_CHUNK_ALLOC, smallest first. */
+static chunk_size_class_t chunk_size_classes[N_CHUNK_SIZE_CLASSES];
+/** How many times have we allocated a chunk of a size that no size class
  * could help with? */
 static uint64_t n_freelist_miss = 0;
 
-static void assert_freelist_ok(chunk_freelist_t *fl);
+#ifdef LIBRARY_CORE_LOCKS
+/** Protects chunk_size_classes: with core locks, buffers can be used from
+ * threads other than the main one. */
+static tor_mutex_t *chunk_size_class_mutex = NULL;
+/** Take the lock that protects the chunk size classes. */
+static INLINE void
+chunk_size_classes_lock(void)
+{
+  if (PREDICT_UNLIKELY(!chunk_size_class_mutex))
+    chunk_size_class_mutex = tor_mutex_new();
+  tor_mutex_acquire(chunk_size_class_mutex);
+}
+/** Release the lock that protects the chunk size classes. */
+static INLINE void
+chunk_size_classes_unlock(void)
+{
+  tor_mutex_release(chunk_size_class_mutex);
+}
+#else
+#define chunk_size_classes_lock() STMT_NIL
+#define chunk_size_classes_unlock() STMT_NIL
+#endif
 
-/** Return the freelist to hold chunks of size <b>alloc</b>, or NULL if
- * no freelist exists for that size. */
-static INLINE chunk_freelist_t *
-get_freelist(size_t alloc)
+/** Return the size class for chunks of allocation size <b>alloc</b>, or NULL
+ * if no size class holds chunks of that size. */
+static INLINE chunk_size_class_t *
+get_chunk_size_class(size_t alloc)
 {
-  int i;
-  for (i=0; (freelists[i].alloc_size <= alloc &&
-             freelists[i].alloc_size); ++i ) {
-    if (freelists[i].alloc_size == alloc) {
-      return &freelists[i];
-    }
-  }
-  return NULL;
+  if (alloc < MIN_CHUNK_ALLOC || alloc > MAX_CHUNK_ALLOC ||
+      (alloc & (alloc-1)))
+    return NULL;
+  return &chunk_size_classes[tor_log2(alloc) - MIN_CHUNK_ALLOC_BITS];
 }
 
-/** Deallocate a chunk or put it on a freelist */
+/** Deallocate a chunk, or return it to its size class. */
 static void
 chunk_free_unchecked(chunk_t *chunk)
 {
-  size_t alloc;
-  chunk_freelist_t *freelist;
+  chunk_size_class_t *cls;
 
-  alloc = CHUNK_ALLOC_SIZE(chunk->memlen);
-  freelist = get_freelist(alloc);
-  if (freelist && freelist->cur_length < freelist->max_length) {
-    chunk->next = freelist->head;
-    freelist->head = chunk;
-    ++freelist->cur_length;
+  cls = get_chunk_size_class(CHUNK_ALLOC_SIZE(chunk->memlen));
+  if (cls) {
+    chunk_size_classes_lock();
+    mp_pool_release(chunk);
+    --cls->n_in_use;
+    ++cls->n_free;
+    chunk_size_classes_unlock();
   } else {
-    if (freelist)
-      ++freelist->n_free;
     tor_free(chunk);
   }
 }
 
-/** Allocate a new chunk with a given allocation size, or get one from the
- * freelist.  Note that a chunk with allocation size A can actually hold only
- * CHUNK_SIZE_WITH_ALLOC(A) bytes in its mem field. */
+/** Allocate a new chunk with a given allocation size, from its size class if
+ * it has one.  Note that a chunk with allocation size A can actually hold
+ * only CHUNK_SIZE_WITH_ALLOC(A) bytes in its mem field. */
 static INLINE chunk_t *
 chunk_new_with_alloc_size(size_t alloc)
 {
   chunk_t *ch;
-  chunk_freelist_t *freelist;
+  chunk_size_class_t *cls;
   tor_assert(alloc >= sizeof(chunk_t));
-  freelist = get_freelist(alloc);
-  if (freelist && freelist->head) {
-    ch = freelist->head;
-    freelist->head = ch->next;
-    if (--freelist->cur_length < freelist->lowest_length)
-      freelist->lowest_length = freelist->cur_length;
-    ++freelist->n_hit;
+  cls = get_chunk_size_class(alloc);
+  if (cls) {
+    chunk_size_classes_lock();
+    if (PREDICT_UNLIKELY(!cls->pool))
+      cls->pool = mp_pool_new(alloc, CHUNK_SLAB_SIZE);
+    ch = mp_pool_get(cls->pool);
+    ++cls->n_in_use;
+    ++cls->n_alloc;
+    chunk_size_classes_unlock();
   } else {
-    /* XXXX take advantage of tor_malloc_roundup, once we know how that
-     * affects freelists. */
-    if (freelist)
-      ++freelist->n_alloc;
-    else
-      ++n_freelist_miss;
+    ++n_freelist_miss;
     ch = tor_malloc(alloc);
   }
   ch->next = NULL;
@@ -208,7 +242,26 @@ chunk_new_with_alloc_size(size_t alloc)
   ch->data = &ch->mem[0];
   return ch;
 }
+
+/** Expand <b>chunk</b> until it can hold <b>sz</b> bytes, and return a
+ * new pointer to <b>chunk</b>.  Old pointers are no longer valid.  (Chunks
+ * that live in slabs can't be realloc'd, so we always move the data.) */
+static INLINE chunk_t *
+chunk_grow(chunk_t *chunk, size_t sz)
+{
+  chunk_t *newchunk;
+  tor_assert(sz > chunk->memlen);
+  newchunk = chunk_new_with_alloc_size(CHUNK_ALLOC_SIZE(sz));
+  memcpy(newchunk->mem, chunk->data, chunk->datalen);
+  newchunk->datalen = chunk->datalen;
+  newchunk->next = chunk->next;
+  chunk_free_unchecked(chunk);
+  return newchunk;
+}
 #else
+/** How many chunks have we allocated? */
+static uint64_t n_chunk_mallocs = 0;
+
 static void
 chunk_free_unchecked(chunk_t *chunk)
 {
@@ -218,6 +271,7 @@ static INLINE chunk_t *
 chunk_new_with_alloc_size(size_t alloc)
 {
   chunk_t *ch;
+  ++n_chunk_mallocs;
   ch = tor_malloc_roundup(&alloc);
   ch->next = NULL;
   ch->datalen = 0;
@@ -225,7 +279,6 @@ chunk_new_with_alloc_size(size_t alloc)
   ch->data = &ch->mem[0];
   return ch;
 }
-#endif
 
 /** Expand <b>chunk</b> until it can hold <b>sz</b> bytes, and return a
  * new pointer to <b>chunk</b>.  Old pointers are no longer valid. */
@@ -235,19 +288,13 @@ chunk_grow(chunk_t *chunk, size_t sz)
   off_t offset;
   tor_assert(sz > chunk->memlen);
   offset = chunk->data - chunk->mem;
+  ++n_chunk_mallocs;
   chunk = tor_realloc(chunk, CHUNK_ALLOC_SIZE(sz));
   chunk->memlen = sz;
   chunk->data = chunk->mem + offset;
   return chunk;
 }
-
-/** If a read onto the end of a chunk would be smaller than this number, then
- * just start a new chunk. */
-#define MIN_READ_LEN 8
-/** Every chunk should take up at least this many bytes. */
-#define MIN_CHUNK_ALLOC 256
-/** No chunk should take up more than this many bytes. */
-#define MAX_CHUNK_ALLOC 65536
+#endif
 
 /** Return the allocation size we'd like to use to hold <b>target</b>
  * bytes. */
@@ -261,103 +308,123 @@ preferred_chunk_size(size_t target)
   return sz;
 }
 
-/** Remove from the freelists most chunks that have not been used since the
- * last call to buf_shrink_freelists(). */
+/** Give back to the system most of the slabs of chunks that have not been
+ * used since the last call to buf_shrink_freelists().  If <b>free_all</b>
+ * is true, give back every slab we can. */
 void
 buf_shrink_freelists(int free_all)
 {
 #ifdef ENABLE_BUF_FREELISTS
   int i;
-  disable_control_logging();
-  for (i = 0; freelists[i].alloc_size; ++i) {
-    int slack = freelists[i].slack;
-    assert_freelist_ok(&freelists[i]);
-    if (free_all || freelists[i].lowest_length > slack) {
-      int n_to_free = free_all ? freelists[i].cur_length :
-        (freelists[i].lowest_length - slack);
-      int n_to_skip = freelists[i].cur_length - n_to_free;
-      int orig_length = freelists[i].cur_length;
-      int orig_n_to_free = n_to_free, n_freed=0;
-      int orig_n_to_skip = n_to_skip;
-      int new_length = n_to_skip;
-      chunk_t **chp = &freelists[i].head;
-      chunk_t *chunk;
-      while (n_to_skip) {
-        if (! (*chp)->next) {
-          log_warn(LD_BUG, "I wanted to skip %d chunks in the freelist for "
-                   "%d-byte chunks, but only found %d. (Length %d)",
-                   orig_n_to_skip, (int)freelists[i].alloc_size,
-                   orig_n_to_skip-n_to_skip, freelists[i].cur_length);
-          assert_freelist_ok(&freelists[i]);
-          goto done;
-        }
-        // tor_assert((*chp)->next);
-        chp = &(*chp)->next;
-        --n_to_skip;
-      }
-      chunk = *chp;
-      *chp = NULL;
-      while (chunk) {
-        chunk_t *next = chunk->next;
-        tor_free(chunk);
-        chunk = next;
-        --n_to_free;
-        ++n_freed;
-        ++freelists[i].n_free;
-      }
-      if (n_to_free) {
-        log_warn(LD_BUG, "Freelist length for %d-byte chunks may have been "
-                 "messed up somehow.", (int)freelists[i].alloc_size);
-        log_warn(LD_BUG, "There were %d chunks at the start.  I decided to "
-                 "keep %d. I wanted to free %d.  I freed %d.  I somehow think "
-                 "I have %d left to free.",
-                 freelists[i].cur_length, n_to_skip, orig_n_to_free,
-                 n_freed, n_to_free);
-      }
-      // tor_assert(!n_to_free);
-      freelists[i].cur_length = new_length;
-      log_info(LD_MM, "Cleaned freelist for %d-byte chunks: original "
-               "length %d, kept %d, dropped %d.",
-               (int)freelists[i].alloc_size, orig_length,
-               orig_n_to_skip, orig_n_to_free);
+  chunk_size_classes_lock();
+  for (i = 0; i < N_CHUNK_SIZE_CLASSES; ++i) {
+    chunk_size_class_t *cls = &chunk_size_classes[i];
+    if (!cls->pool)
+      continue;
+    if (free_all && !cls->n_in_use) {
+      mp_pool_destroy(cls->pool);
+      cls->pool = NULL;
+    } else {
+      mp_pool_clean(cls->pool, 0, !free_all);
     }
-    freelists[i].lowest_length = freelists[i].cur_length;
-    assert_freelist_ok(&freelists[i]);
   }
- done:
-  enable_control_logging();
+  chunk_size_classes_unlock();
 #else
   (void) free_all;
 #endif
 }
 
+#ifdef ENABLE_BUF_FREELISTS
+/** Return a newly allocated list of strings describing the state of each
+ * chunk size class. */
+static smartlist_t *
+buf_describe_freelists(void)
+{
+  smartlist_t *lines = smartlist_new();
+  int i;
+  chunk_size_classes_lock();
+  for (i = 0; i < N_CHUNK_SIZE_CLASSES; ++i) {
+    chunk_size_class_t *cls = &chunk_size_classes[i];
+    uint64_t slab_bytes = 0, n_slabs_alloc = 0, n_slabs_freed = 0;
+    if (cls->pool)
+      mp_pool_get_stats(cls->pool, &slab_bytes, &n_slabs_alloc,
+                        &n_slabs_freed);
+    smartlist_add_asprintf(lines,
+        "%d-byte chunks: %d in use; "U64_FORMAT" bytes in slabs ["
+        U64_FORMAT" allocations; "U64_FORMAT" frees; "
+        U64_FORMAT" slabs allocated; "U64_FORMAT" slabs freed]",
+        (int)(MIN_CHUNK_ALLOC << i), cls->n_in_use,
+        U64_PRINTF_ARG(slab_bytes),
+        U64_PRINTF_ARG(cls->n_alloc), U64_PRINTF_ARG(cls->n_free),
+        U64_PRINTF_ARG(n_slabs_alloc), U64_PRINTF_ARG(n_slabs_freed));
+  }
+  smartlist_add_asprintf(lines, U64_FORMAT" allocations in non-freelist "
+                         "sizes", U64_PRINTF_ARG(n_freelist_miss));
+  chunk_size_classes_unlock();
+  return lines;
+}
+#endif
+
 /** Describe the current status of the freelists at log level <b>severity</b>.
  */
 void
 buf_dump_freelist_sizes(int severity)
 {
 #ifdef ENABLE_BUF_FREELISTS
-  int i;
+  smartlist_t *lines = buf_describe_freelists();
   log(severity, LD_MM, "====== Buffer freelists:");
-  for (i = 0; freelists[i].alloc_size; ++i) {
-    uint64_t total = ((uint64_t)freelists[i].cur_length) *
-      freelists[i].alloc_size;
-    log(severity, LD_MM,
-        U64_FORMAT" bytes in %d %d-byte chunks ["U64_FORMAT
-        " misses; "U64_FORMAT" frees; "U64_FORMAT" hits]",
-        U64_PRINTF_ARG(total),
-        freelists[i].cur_length, (int)freelists[i].alloc_size,
-        U64_PRINTF_ARG(freelists[i].n_alloc),
-        U64_PRINTF_ARG(freelists[i].n_free),
-        U64_PRINTF_ARG(freelists[i].n_hit));
-  }
-  log(severity, LD_MM, U64_FORMAT" allocations in non-freelist sizes",
-      U64_PRINTF_ARG(n_freelist_miss));
+  SMARTLIST_FOREACH(lines, char *, line, {
+      log(severity, LD_MM, "%s", line);
+      tor_free(line);
+  });
+  smartlist_free(lines);
 #else
   (void)severity;
 #endif
 }
 
+/** Return a newly allocated string describing the status of the freelists,
+ * one line per chunk size, for the controller. */
+char *
+buf_get_freelist_stats(void)
+{
+#ifdef ENABLE_BUF_FREELISTS
+  smartlist_t *lines = buf_describe_freelists();
+  char *result = smartlist_join_strings(lines, "\n", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, line, tor_free(line));
+  smartlist_free(lines);
+  return result;
+#else
+  return tor_strdup("");
+#endif
+}
+
+/** Return the number of times we have had to go to the system allocator
+ * for chunk memory: once per slab for chunks that have a size class, and
+ * once per chunk for those that don't. */
+uint64_t
+buf_get_chunk_malloc_count(void)
+{
+#ifdef ENABLE_BUF_FREELISTS
+  uint64_t total;
+  int i;
+  chunk_size_classes_lock();
+  total = n_freelist_miss;
+  for (i = 0; i < N_CHUNK_SIZE_CLASSES; ++i) {
+    uint64_t bytes, n_alloc, n_freed;
+    if (!chunk_size_classes[i].pool)
+      continue;
+    mp_pool_get_stats(chunk_size_classes[i].pool, &bytes, &n_alloc,
+                      &n_freed);
+    total += n_alloc;
+  }
+  chunk_size_classes_unlock();
+  return total;
+#else
+  return n_chunk_mallocs;
+#endif
+}
+
 /** Magic value for buf_t.magic, to catch pointer errors. */
 #define BUFFER_MAGIC 0xB0FFF312u
 /** A resizeable buffer, optimized for reading and writing. */
@@ -369,7 +436,7 @@ struct buf_t {
                               * this for this buffer. */
   chunk_t *head; /**< First chunk in the list, or NULL for none. */
   chunk_t *tail; /**< Last chunk in the list, or NULL for none. */
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_t *lock;
 #endif
 };
@@ -380,16 +447,18 @@ struct buf_t {
  *
  * If <b>nulterminate</b> is true, ensure that there is a 0 byte in
  * buf->head->mem right after all the data. */
-static void
+void
 buf_pullup(buf_t *buf, size_t bytes, int nulterminate)
 {
   chunk_t *dest, *src;
   size_t capacity;
 
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(buf->lock);
+#endif
 
   if (!buf->head){
-	#ifdef LIBRARY
+	#ifdef LIBRARY_CORE_LOCKS
     tor_mutex_release(buf->lock);
     #endif
     return;
@@ -404,7 +473,7 @@ buf_pullup(buf_t *buf, size_t bytes, int nulterminate)
     if (buf->head->datalen >= bytes && CHUNK_REMAINING_CAPACITY(buf->head)) {
       *CHUNK_WRITE_PTR(buf->head) = '\0';
 
-	 #ifdef LIBRARY
+	 #ifdef LIBRARY_CORE_LOCKS
      tor_mutex_release(buf->lock);
      #endif
 
@@ -414,7 +483,7 @@ buf_pullup(buf_t *buf, size_t bytes, int nulterminate)
     capacity = bytes;
     if (buf->head->datalen >= bytes)
 	{
-	  #ifdef LIBRARY
+	  #ifdef LIBRARY_CORE_LOCKS
       tor_mutex_release(buf->lock);
       #endif
       return;
@@ -470,7 +539,7 @@ buf_pullup(buf_t *buf, size_t bytes, int nulterminate)
 
   check();
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(buf->lock);
   #endif
 }
@@ -489,7 +558,7 @@ static INLINE void
 buf_remove_from_front(buf_t *buf, size_t n)
 {
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(buf->lock);
   #endif
 
@@ -504,7 +573,7 @@ buf_remove_from_front(buf_t *buf, size_t n)
       buf->head->data += n;
       buf->datalen -= n;
 
-	  #ifdef LIBRARY
+	  #ifdef LIBRARY_CORE_LOCKS
       tor_mutex_release(buf->lock);
       #endif
 
@@ -521,7 +590,7 @@ buf_remove_from_front(buf_t *buf, size_t n)
   }
   check();
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(buf->lock);
   #endif
 }
@@ -534,7 +603,7 @@ buf_new_with_capacity(size_t size)
   buf_t *b = buf_new();
   b->default_chunk_size = preferred_chunk_size(size);
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   b->lock = tor_mutex_new();
   #endif
 
@@ -549,7 +618,7 @@ buf_new(void)
   buf->magic = BUFFER_MAGIC;
   buf->default_chunk_size = 4096;
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   buf->lock = tor_mutex_new();
   #endif
 
@@ -562,7 +631,7 @@ buf_clear(buf_t *buf)
 {
   chunk_t *chunk, *next;
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(buf->lock);
   #endif
 
@@ -573,7 +642,7 @@ buf_clear(buf_t *buf)
   }
   buf->head = buf->tail = NULL;
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(buf->lock);
   #endif
 }
@@ -592,7 +661,7 @@ buf_allocation(const buf_t *buf)
   size_t total = 0;
   const chunk_t *chunk;
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(buf->lock);
   #endif
 
@@ -601,7 +670,7 @@ buf_allocation(const buf_t *buf)
   }
 
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(buf->lock);
   #endif
 
@@ -614,13 +683,13 @@ size_t
 buf_slack(const buf_t *buf)
 {
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(buf->lock);
   #endif
 
   if (!buf->tail){
 
-	  #ifdef LIBRARY
+	  #ifdef LIBRARY_CORE_LOCKS
       tor_mutex_release(buf->lock);
       #endif
 
@@ -629,7 +698,7 @@ buf_slack(const buf_t *buf)
   else{
 	  size_t x = CHUNK_REMAINING_CAPACITY(buf->tail);
 
-	  #ifdef LIBRARY
+	  #ifdef LIBRARY_CORE_LOCKS
       tor_mutex_release(buf->lock);
       #endif
 
@@ -644,15 +713,16 @@ buf_free(buf_t *buf)
   if (!buf)
     return;
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(buf->lock);
   #endif
 
   buf_clear(buf);
   buf->magic = 0xdeadbeef;
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(buf->lock);
+  tor_mutex_free(buf->lock);
   #endif
 
   tor_free(buf);
@@ -678,7 +748,7 @@ buf_copy(const buf_t *buf)
   chunk_t *ch;
   buf_t *out = buf_new();
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(buf->lock);
   #endif
 
@@ -694,13 +764,28 @@ buf_copy(const buf_t *buf)
   }
   out->datalen = buf->datalen;
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(buf->lock);
   #endif
 
   return out;
 }
 
+/** Return a new chunk, not yet on any buffer, with enough capacity to hold
+ * <b>capacity</b> bytes for <b>buf</b>.  If <b>capped</b>, don't allocate a
+ * chunk bigger than MAX_CHUNK_ALLOC. */
+static INLINE chunk_t *
+buf_new_chunk_with_capacity(const buf_t *buf, size_t capacity, int capped)
+{
+  if (CHUNK_ALLOC_SIZE(capacity) < buf->default_chunk_size) {
+    return chunk_new_with_alloc_size(buf->default_chunk_size);
+  } else if (capped && CHUNK_ALLOC_SIZE(capacity) > MAX_CHUNK_ALLOC) {
+    return chunk_new_with_alloc_size(MAX_CHUNK_ALLOC);
+  } else {
+    return chunk_new_with_alloc_size(preferred_chunk_size(capacity));
+  }
+}
+
 /** Append a new chunk with enough capacity to hold <b>capacity</b> bytes to
  * the tail of <b>buf</b>.  If <b>capped</b>, don't allocate a chunk bigger
  * than MAX_CHUNK_ALLOC. */
@@ -709,17 +794,11 @@ buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped)
 {
   chunk_t *chunk;
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(buf->lock);
   #endif
 
-  if (CHUNK_ALLOC_SIZE(capacity) < buf->default_chunk_size) {
-    chunk = chunk_new_with_alloc_size(buf->default_chunk_size);
-  } else if (capped && CHUNK_ALLOC_SIZE(capacity) > MAX_CHUNK_ALLOC) {
-    chunk = chunk_new_with_alloc_size(MAX_CHUNK_ALLOC);
-  } else {
-    chunk = chunk_new_with_alloc_size(preferred_chunk_size(capacity));
-  }
+  chunk = buf_new_chunk_with_capacity(buf, capacity, capped);
   if (buf->tail) {
     tor_assert(buf->head);
     buf->tail->next = chunk;
@@ -730,7 +809,7 @@ buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped)
   }
   check();
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(buf->lock);
   #endif
 
@@ -747,13 +826,14 @@ read_to_chunk(buf_t *buf, chunk_t *chunk, tor_socket_t fd, size_t at_most,
 {
   ssize_t read_result;
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(buf->lock);
   #endif
 
   if (at_most > CHUNK_REMAINING_CAPACITY(chunk))
     at_most = CHUNK_REMAINING_CAPACITY(chunk);
   read_result = tor_socket_recv(fd, CHUNK_WRITE_PTR(chunk), at_most, 0);
+  ++n_buf_read_calls;
 
   if (read_result < 0) {
     int e = tor_socket_errno(fd);
@@ -764,7 +844,7 @@ read_to_chunk(buf_t *buf, chunk_t *chunk, tor_socket_t fd, size_t at_most,
 #endif
       *socket_error = e;
 
-	  #ifdef LIBRARY
+	  #ifdef LIBRARY_CORE_LOCKS
       tor_mutex_release(buf->lock);
       #endif
 
@@ -775,7 +855,7 @@ read_to_chunk(buf_t *buf, chunk_t *chunk, tor_socket_t fd, size_t at_most,
     log_debug(LD_NET,"Encountered eof on fd %d", (int)fd);
     *reached_eof = 1;
 
-	#ifdef LIBRARY
+	#ifdef LIBRARY_CORE_LOCKS
     tor_mutex_release(buf->lock);
     #endif
 
@@ -787,7 +867,7 @@ read_to_chunk(buf_t *buf, chunk_t *chunk, tor_socket_t fd, size_t at_most,
               (int)buf->datalen);
     tor_assert(read_result < INT_MAX);
 
-	#ifdef LIBRARY
+	#ifdef LIBRARY_CORE_LOCKS
     tor_mutex_release(buf->lock);
     #endif
 
@@ -805,14 +885,14 @@ read_to_chunk_tls(buf_t *buf, chunk_t *chunk, tor_tls_t *tls,
 
   tor_assert(CHUNK_REMAINING_CAPACITY(chunk) >= at_most);
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(buf->lock);
   #endif
 
   read_result = tor_tls_read(tls, CHUNK_WRITE_PTR(chunk), at_most);
   if (read_result < 0){
 
-	#ifdef LIBRARY
+	#ifdef LIBRARY_CORE_LOCKS
     tor_mutex_release(buf->lock);
     #endif
 
@@ -821,13 +901,164 @@ read_to_chunk_tls(buf_t *buf, chunk_t *chunk, tor_tls_t *tls,
   buf->datalen += read_result;
   chunk->datalen += read_result;
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(buf->lock);
   #endif
 
   return read_result;
 }
 
+#ifdef USE_SCATTER_GATHER_IO
+/** If false, read_to_buf() and flush_buf() make one call per chunk, as they
+ * used to.  Only changed by benchmarks. */
+static int use_scatter_gather_io = 1;
+
+/** Helper for read_to_buf(): with a single readv() call, read up to
+ * <b>at_most</b> bytes from <b>fd</b> into whatever space is left in the
+ * tail chunk of <b>buf</b> and into as many new chunks as it takes to hold
+ * the rest.  New chunks that receive no data are freed again.  Set
+ * *<b>readlen_out</b> to the number of bytes we asked for.  Return values
+ * are as for read_to_chunk(). */
+static int
+read_to_buf_iov(buf_t *buf, tor_socket_t fd, size_t at_most,
+                size_t *readlen_out, int *reached_eof, int *socket_error)
+{
+  struct iovec iov[MAX_IOVECS_PER_CALL];
+  chunk_t *chunks[MAX_IOVECS_PER_CALL];
+  int n_iov = 0, first_new = 0, i;
+  size_t planned = 0, remaining;
+  ssize_t read_result;
+
+  if (buf->tail && CHUNK_REMAINING_CAPACITY(buf->tail) >= MIN_READ_LEN) {
+    chunks[0] = buf->tail;
+    iov[0].iov_base = CHUNK_WRITE_PTR(buf->tail);
+    iov[0].iov_len = MIN(CHUNK_REMAINING_CAPACITY(buf->tail), at_most);
+    planned = iov[0].iov_len;
+    n_iov = first_new = 1;
+  }
+  while (planned < at_most && n_iov < MAX_IOVECS_PER_CALL) {
+    chunk_t *chunk = buf_new_chunk_with_capacity(buf, at_most - planned, 1);
+    chunks[n_iov] = chunk;
+    iov[n_iov].iov_base = chunk->mem;
+    iov[n_iov].iov_len = MIN(chunk->memlen, at_most - planned);
+    planned += iov[n_iov].iov_len;
+    ++n_iov;
+  }
+  *readlen_out = planned;
+
+  read_result = readv(fd, iov, n_iov);
+  ++n_buf_read_calls;
+
+  if (read_result <= 0) {
+    for (i = first_new; i < n_iov; ++i)
+      chunk_free_unchecked(chunks[i]);
+    if (read_result == 0) {
+      log_debug(LD_NET,"Encountered eof on fd %d", (int)fd);
+      *reached_eof = 1;
+      return 0;
+    } else {
+      int e = tor_socket_errno(fd);
+      if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+        *socket_error = e;
+        return -1;
+      }
+      return 0; /* would block. */
+    }
+  }
+
+  /* Account for the bytes in the order we handed out the space, and link
+   * the new chunks that got any of them onto the buffer. */
+  remaining = read_result;
+  for (i = 0; i < n_iov; ++i) {
+    size_t n = MIN(remaining, iov[i].iov_len);
+    if (i >= first_new) {
+      if (!n) {
+        chunk_free_unchecked(chunks[i]);
+        continue;
+      }
+      if (buf->tail) {
+        buf->tail->next = chunks[i];
+        buf->tail = chunks[i];
+      } else {
+        buf->head = buf->tail = chunks[i];
+      }
+    }
+    chunks[i]->datalen += n;
+    remaining -= n;
+  }
+  buf->datalen += read_result;
+  log_debug(LD_NET,"Read %ld bytes into %d chunks. %d on inbuf.",
+            (long)read_result, n_iov, (int)buf->datalen);
+  tor_assert(read_result < INT_MAX);
+  return (int)read_result;
+}
+
+/** Helper for flush_buf(): with a single writev() call, try to write up to
+ * <b>sz</b> bytes from the chunks at the front of <b>buf</b> onto socket
+ * <b>s</b>.  Set *<b>writelen_out</b> to the number of bytes we offered.
+ * Return values are as for flush_chunk(). */
+static int
+flush_buf_iov(tor_socket_t s, buf_t *buf, size_t sz, size_t *writelen_out,
+              size_t *buf_flushlen)
+{
+  struct iovec iov[MAX_IOVECS_PER_CALL];
+  chunk_t *chunk;
+  int n_iov = 0;
+  size_t offered = 0;
+  ssize_t write_result;
+
+  for (chunk = buf->head; chunk && offered < sz && n_iov < MAX_IOVECS_PER_CALL;
+       chunk = chunk->next) {
+    if (!chunk->datalen)
+      continue;
+    iov[n_iov].iov_base = chunk->data;
+    iov[n_iov].iov_len = MIN(chunk->datalen, sz - offered);
+    offered += iov[n_iov].iov_len;
+    ++n_iov;
+  }
+  *writelen_out = offered;
+
+  write_result = writev(s, iov, n_iov);
+  ++n_buf_write_calls;
+
+  if (write_result < 0) {
+    int e = tor_socket_errno(s);
+    if (!ERRNO_IS_EAGAIN(e)) /* it's a real error */
+      return -1;
+    log_debug(LD_NET,"write() would block, returning.");
+    return 0;
+  }
+  *buf_flushlen -= write_result;
+  buf_remove_from_front(buf, write_result);
+  tor_assert(write_result < INT_MAX);
+  return (int)write_result;
+}
+#endif
+
+/** Set *<b>reads_out</b> and *<b>writes_out</b> to the number of system
+ * calls that read_to_buf() and flush_buf() have made so far. */
+void
+buf_get_io_call_counts(uint64_t *reads_out, uint64_t *writes_out)
+{
+  *reads_out = n_buf_read_calls;
+  *writes_out = n_buf_write_calls;
+}
+
+/** Tell read_to_buf() and flush_buf() whether to move data with one
+ * readv()/writev() per call (if <b>enabled</b>) or one recv()/send() per
+ * chunk.  Return 0 on success, or -1 if this platform can only do the
+ * latter. */
+int
+buf_set_scatter_gather_io(int enabled)
+{
+#ifdef USE_SCATTER_GATHER_IO
+  use_scatter_gather_io = enabled;
+  return 0;
+#else
+  return enabled ? -1 : 0;
+#endif
+}
+
 /** Read from socket <b>s</b>, writing onto end of <b>buf</b>.  Read at most
  * <b>at_most</b> bytes, growing the buffer as necessary.  If recv() returns 0
  * (because of EOF), set *<b>reached_eof</b> to 1 and return 0. Return -1 on
@@ -848,29 +1079,37 @@ read_to_buf(tor_socket_t s, size_t at_most, buf_t *buf, int *reached_eof,
   tor_assert(reached_eof);
   tor_assert(SOCKET_OK(s));
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(buf->lock);
   #endif
 
   while (at_most > total_read) {
     size_t readlen = at_most - total_read;
     chunk_t *chunk;
-    if (!buf->tail || CHUNK_REMAINING_CAPACITY(buf->tail) < MIN_READ_LEN) {
-      chunk = buf_add_chunk_with_capacity(buf, at_most, 1);
-      if (readlen > chunk->memlen)
-        readlen = chunk->memlen;
-    } else {
-      size_t cap = CHUNK_REMAINING_CAPACITY(buf->tail);
-      chunk = buf->tail;
-      if (cap < readlen)
-        readlen = cap;
-    }
+#ifdef USE_SCATTER_GATHER_IO
+    if (use_scatter_gather_io) {
+      r = read_to_buf_iov(buf, s, readlen, &readlen, reached_eof,
+                          socket_error);
+    } else
+#endif
+    {
+      if (!buf->tail || CHUNK_REMAINING_CAPACITY(buf->tail) < MIN_READ_LEN) {
+        chunk = buf_add_chunk_with_capacity(buf, at_most, 1);
+        if (readlen > chunk->memlen)
+          readlen = chunk->memlen;
+      } else {
+        size_t cap = CHUNK_REMAINING_CAPACITY(buf->tail);
+        chunk = buf->tail;
+        if (cap < readlen)
+          readlen = cap;
+      }
 
-    r = read_to_chunk(buf, chunk, s, readlen, reached_eof, socket_error);
+      r = read_to_chunk(buf, chunk, s, readlen, reached_eof, socket_error);
+    }
     check();
     if (r < 0)
 	{
-	  #ifdef LIBRARY
+	  #ifdef LIBRARY_CORE_LOCKS
       tor_mutex_release(buf->lock);
       #endif
       return r; /* Error */
@@ -882,7 +1121,7 @@ read_to_buf(tor_socket_t s, size_t at_most, buf_t *buf, int *reached_eof,
     }
   }
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(buf->lock);
   #endif
 
@@ -919,7 +1158,7 @@ read_to_buf_tls(tor_tls_t *tls, size_t at_most, buf_t *buf)
 
   check();
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(buf->lock);
   #endif
 
@@ -940,7 +1179,7 @@ read_to_buf_tls(tor_tls_t *tls, size_t at_most, buf_t *buf)
     r = read_to_chunk_tls(buf, chunk, tls, readlen);
     check();
     if (r < 0){
-	  #ifdef LIBRARY
+	  #ifdef LIBRARY_CORE_LOCKS
       tor_mutex_release(buf->lock);
       #endif
       return r; /* Error */
@@ -951,7 +1190,7 @@ read_to_buf_tls(tor_tls_t *tls, size_t at_most, buf_t *buf)
       break;
   }
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(buf->lock);
   #endif
 
@@ -969,13 +1208,14 @@ flush_chunk(tor_socket_t s, buf_t *buf, chunk_t *chunk, size_t sz,
 {
   ssize_t write_result;
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(buf->lock);
   #endif
 
   if (sz > chunk->datalen)
     sz = chunk->datalen;
   write_result = tor_socket_send(s, chunk->data, sz, 0);
+  ++n_buf_write_calls;
 
   if (write_result < 0) {
     int e = tor_socket_errno(s);
@@ -985,7 +1225,7 @@ flush_chunk(tor_socket_t s, buf_t *buf, chunk_t *chunk, size_t sz,
         log_warn(LD_NET,"write() failed: WSAENOBUFS. Not enough ram?");
 #endif
 
-	  #ifdef LIBRARY
+	  #ifdef LIBRARY_CORE_LOCKS
       tor_mutex_release(buf->lock);
       #endif
 
@@ -998,7 +1238,7 @@ flush_chunk(tor_socket_t s, buf_t *buf, chunk_t *chunk, size_t sz,
     buf_remove_from_front(buf, write_result);
     tor_assert(write_result < INT_MAX);
 
-	#ifdef LIBRARY
+	#ifdef LIBRARY_CORE_LOCKS
     tor_mutex_release(buf->lock);
     #endif
 
@@ -1067,16 +1307,23 @@ flush_buf(tor_socket_t s, buf_t *buf, size_t sz, size_t *buf_flushlen)
     size_t flushlen0;
     tor_assert(buf->head);
 
-	#ifdef LIBRARY
+	#ifdef LIBRARY_CORE_LOCKS
     tor_mutex_acquire(buf->lock);
     #endif
 
-    if (buf->head->datalen >= sz)
-      flushlen0 = sz;
-    else
-      flushlen0 = buf->head->datalen;
+#ifdef USE_SCATTER_GATHER_IO
+    if (use_scatter_gather_io) {
+      r = flush_buf_iov(s, buf, sz, &flushlen0, buf_flushlen);
+    } else
+#endif
+    {
+      if (buf->head->datalen >= sz)
+        flushlen0 = sz;
+      else
+        flushlen0 = buf->head->datalen;
 
-    r = flush_chunk(s, buf, buf->head, flushlen0, buf_flushlen);
+      r = flush_chunk(s, buf, buf->head, flushlen0, buf_flushlen);
+    }
     check();
     if (r < 0)
       return r;
@@ -1101,7 +1348,7 @@ flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t flushlen,
   ssize_t sz;
   tor_assert(buf_flushlen);
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(buf->lock);
   #endif
 
@@ -1136,7 +1383,7 @@ flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t flushlen,
   } while (sz > 0);
   tor_assert(flushed < INT_MAX);
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(buf->lock);
   #endif
 
@@ -1151,13 +1398,13 @@ flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t flushlen,
 int
 write_to_buf(const char *string, size_t string_len, buf_t *buf)
 {
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(buf->lock);
   #endif
 
   if (!string_len){
 
-	#ifdef LIBRARY
+	#ifdef LIBRARY_CORE_LOCKS
     tor_mutex_release(buf->lock);
     #endif
 
@@ -1183,7 +1430,7 @@ write_to_buf(const char *string, size_t string_len, buf_t *buf)
   check();
   tor_assert(buf->datalen < INT_MAX);
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(buf->lock);
   #endif
 
@@ -1201,7 +1448,7 @@ peek_from_buf(char *string, size_t string_len, const buf_t *buf)
   tor_assert(string);
 
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(buf->lock);
   #endif
 
@@ -1221,7 +1468,7 @@ peek_from_buf(char *string, size_t string_len, const buf_t *buf)
     chunk = chunk->next;
   }
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(buf->lock);
   #endif
 }
@@ -1243,7 +1490,7 @@ fetch_from_buf(char *string, size_t string_len, buf_t *buf)
   buf_remove_from_front(buf, string_len);
   check();
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(buf->lock);
   #endif
 
@@ -1251,7 +1498,7 @@ fetch_from_buf(char *string, size_t string_len, buf_t *buf)
 
   x = (int)buf->datalen;
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(buf->lock);
   #endif
 
@@ -1301,7 +1548,7 @@ fetch_var_cell_from_buf(buf_t *buf, var_cell_t **out, int linkproto)
   uint16_t length;
   check();
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(buf->lock);
   #endif
 
@@ -1328,13 +1575,39 @@ fetch_var_cell_from_buf(buf_t *buf, var_cell_t **out, int linkproto)
 
   *out = result;
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(buf->lock);
   #endif
 
   return 1;
 }
 
+/** Pull as many whole fixed-length cells as are waiting on the front of
+ * <b>buf</b>, up to <b>max_cells</b>, onto <b>out</b> in network format,
+ * stopping short of any cell that is variable-length according to link
+ * protocol <b>linkproto</b>. Return the number of cells fetched. */
+int
+fetch_cells_from_buf(buf_t *buf, char *out, int max_cells, int linkproto)
+{
+  int i, n;
+  check();
+
+  n = (int)MIN(buf->datalen / CELL_NETWORK_SIZE, (size_t)max_cells);
+  if (!n)
+    return 0;
+  peek_from_buf(out, n*CELL_NETWORK_SIZE, buf);
+
+  for (i = 0; i < n; ++i) {
+    uint8_t command = get_uint8(out + i*CELL_NETWORK_SIZE + 2);
+    if (cell_command_is_var_length(command, linkproto))
+      break;
+  }
+
+  buf_remove_from_front(buf, i*CELL_NETWORK_SIZE);
+  check();
+  return i;
+}
+
 #ifdef USE_BUFFEREVENTS
 /** Try to read <b>n</b> bytes from <b>buf</b> at <b>pos</b> (which may be
  * NULL for the start of the buffer), copying the data only if necessary.  Set
@@ -1432,7 +1705,7 @@ move_buf_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen)
   size_t cp, len;
   len = *buf_flushlen;
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(buf_out->lock);
   tor_mutex_acquire(buf_in->lock);
   #endif
@@ -1454,7 +1727,7 @@ move_buf_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen)
   *buf_flushlen -= cp;
 
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(buf_out->lock);
   tor_mutex_release(buf_in->lock);
   #endif
@@ -1559,7 +1832,7 @@ buf_find_string_offset(const buf_t *buf, const char *s, size_t n)
 {
   buf_pos_t pos;
 
-   #ifdef LIBRARY
+   #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(buf->lock);
   #endif
 
@@ -1568,7 +1841,7 @@ buf_find_string_offset(const buf_t *buf, const char *s, size_t n)
     if (buf_matches_at_pos(&pos, s, n)) {
       tor_assert(pos.chunk_pos + pos.pos < INT_MAX);
 
-	  #ifdef LIBRARY
+	  #ifdef LIBRARY_CORE_LOCKS
       tor_mutex_release(buf->lock);
       #endif
 
@@ -1576,7 +1849,7 @@ buf_find_string_offset(const buf_t *buf, const char *s, size_t n)
     } else {
       if (buf_pos_inc(&pos)<0){
 
-		#ifdef LIBRARY
+		#ifdef LIBRARY_CORE_LOCKS
         tor_mutex_release(buf->lock);
         #endif
 
@@ -1585,7 +1858,7 @@ buf_find_string_offset(const buf_t *buf, const char *s, size_t n)
     }
   }
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(buf->lock);
   #endif
 
@@ -1624,12 +1897,12 @@ fetch_from_buf_http(buf_t *buf,
   check();
 
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(buf->lock);
   #endif
 
   if (!buf->head){
-	#ifdef LIBRARY
+	#ifdef LIBRARY_CORE_LOCKS
     tor_mutex_release(buf->lock);
     #endif
     return 0;
@@ -1640,7 +1913,7 @@ fetch_from_buf_http(buf_t *buf,
       (crlf_offset < 0 && buf->datalen > max_headerlen)) {
     log_debug(LD_HTTP,"headers too long.");
 
-	#ifdef LIBRARY
+	#ifdef LIBRARY_CORE_LOCKS
     tor_mutex_release(buf->lock);
     #endif
 
@@ -1648,7 +1921,7 @@ fetch_from_buf_http(buf_t *buf,
   } else if (crlf_offset < 0) {
     log_debug(LD_HTTP,"headers not all here yet.");
 
-	#ifdef LIBRARY
+	#ifdef LIBRARY_CORE_LOCKS
     tor_mutex_release(buf->lock);
     #endif
 
@@ -1668,7 +1941,7 @@ fetch_from_buf_http(buf_t *buf,
     log_warn(LD_HTTP,"headerlen %d larger than %d. Failing.",
              (int)headerlen, (int)max_headerlen-1);
 
-	#ifdef LIBRARY
+	#ifdef LIBRARY_CORE_LOCKS
     tor_mutex_release(buf->lock);
     #endif
 
@@ -1678,7 +1951,7 @@ fetch_from_buf_http(buf_t *buf,
     log_warn(LD_HTTP,"bodylen %d larger than %d. Failing.",
              (int)bodylen, (int)max_bodylen-1);
 
-	#ifdef LIBRARY
+	#ifdef LIBRARY_CORE_LOCKS
     tor_mutex_release(buf->lock);
     #endif
 
@@ -1694,7 +1967,7 @@ fetch_from_buf_http(buf_t *buf,
       log_warn(LD_PROTOCOL, "Content-Length is less than zero; it looks like "
                "someone is trying to crash us.");
 
-	  #ifdef LIBRARY
+	  #ifdef LIBRARY_CORE_LOCKS
       tor_mutex_release(buf->lock);
       #endif
 
@@ -1707,7 +1980,7 @@ fetch_from_buf_http(buf_t *buf,
       if (!force_complete) {
         log_debug(LD_HTTP,"body not all here yet.");
 
-		#ifdef LIBRARY
+		#ifdef LIBRARY_CORE_LOCKS
         tor_mutex_release(buf->lock);
         #endif
 
@@ -1735,7 +2008,7 @@ fetch_from_buf_http(buf_t *buf,
   check();
 
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(buf->lock);
   #endif
 
@@ -1930,7 +2203,7 @@ fetch_from_buf_socks(buf_t *buf, socks_request_t *req,
   ssize_t n_drain;
   size_t want_length = 128;
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(buf->lock);
   #endif
 
@@ -1954,7 +2227,7 @@ fetch_from_buf_socks(buf_t *buf, socks_request_t *req,
   } while (res == 0 && buf->head && want_length < buf->datalen &&
            buf->datalen >= 2);
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(buf->lock);
   #endif
 
@@ -2431,12 +2704,12 @@ fetch_from_buf_socks_client(buf_t *buf, int state, char **reason)
   ssize_t drain = 0;
   int r;
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(buf->lock);
   #endif
 
   if (buf->datalen < 2){
-	#ifdef LIBRARY
+	#ifdef LIBRARY_CORE_LOCKS
     tor_mutex_release(buf->lock);
     #endif
     return 0;
@@ -2452,7 +2725,7 @@ fetch_from_buf_socks_client(buf_t *buf, int state, char **reason)
   else if (drain < 0)
     buf_clear(buf);
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(buf->lock);
   #endif
 
@@ -2611,7 +2884,7 @@ int
 peek_buf_has_control0_command(buf_t *buf)
 {
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(buf->lock);
   #endif
 
@@ -2621,14 +2894,14 @@ peek_buf_has_control0_command(buf_t *buf)
     peek_from_buf(header, sizeof(header), buf);
     cmd = ntohs(get_uint16(header+2));
     if (cmd <= 0x14){
-	  #ifdef LIBRARY
+	  #ifdef LIBRARY_CORE_LOCKS
       tor_mutex_release(buf->lock);
       #endif
       return 1; /* This is definitely not a v1 control command. */
 	}
   }
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(buf->lock);
   #endif
 
@@ -2664,7 +2937,7 @@ buf_find_offset_of_char(buf_t *buf, char ch)
   chunk_t *chunk;
   off_t offset = 0;
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(buf->lock);
   #endif
 
@@ -2672,7 +2945,7 @@ buf_find_offset_of_char(buf_t *buf, char ch)
     char *cp = memchr(chunk->data, ch, chunk->datalen);
     if (cp){
 
-	  #ifdef LIBRARY
+	  #ifdef LIBRARY_CORE_LOCKS
       tor_mutex_release(buf->lock);
       #endif
 
@@ -2682,7 +2955,7 @@ buf_find_offset_of_char(buf_t *buf, char ch)
       offset += chunk->datalen;
   }
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(buf->lock);
   #endif
 
@@ -2702,12 +2975,12 @@ fetch_from_buf_line(buf_t *buf, char *data_out, size_t *data_len)
   size_t sz;
   off_t offset;
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(buf->lock);
   #endif
 
   if (!buf->head){
-    #ifdef LIBRARY
+    #ifdef LIBRARY_CORE_LOCKS
     tor_mutex_release(buf->lock);
     #endif
     return 0;
@@ -2717,7 +2990,7 @@ fetch_from_buf_line(buf_t *buf, char *data_out, size_t *data_len)
 
   if (offset < 0){
 
-	#ifdef LIBRARY
+	#ifdef LIBRARY_CORE_LOCKS
     tor_mutex_release(buf->lock);
     #endif
 
@@ -2727,7 +3000,7 @@ fetch_from_buf_line(buf_t *buf, char *data_out, size_t *data_len)
   if (sz+2 > *data_len) {
     *data_len = sz + 2;
 
-	#ifdef LIBRARY
+	#ifdef LIBRARY_CORE_LOCKS
     tor_mutex_release(buf->lock);
     #endif
 
@@ -2738,7 +3011,7 @@ fetch_from_buf_line(buf_t *buf, char *data_out, size_t *data_len)
   data_out[sz+1] = '\0';
   *data_len = sz+1;
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(buf->lock);
   #endif
 
@@ -2758,7 +3031,7 @@ write_to_buf_zlib(buf_t *buf, tor_zlib_state_t *state,
   size_t old_avail, avail;
   int over = 0;
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(buf->lock);
   #endif
 
@@ -2797,7 +3070,7 @@ write_to_buf_zlib(buf_t *buf, tor_zlib_state_t *state,
   } while (!over);
   check();
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(buf->lock);
   #endif
 
@@ -2901,7 +3174,7 @@ assert_buf_ok(buf_t *buf)
 {
   tor_assert(buf);
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(buf->lock);
   #endif
 
@@ -2926,29 +3199,9 @@ assert_buf_ok(buf_t *buf)
     tor_assert(buf->datalen == total);
   }
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(buf->lock);
   #endif
 
 }
 
-#ifdef ENABLE_BUF_FREELISTS
-/** Log an error and exit if <b>fl</b> is corrupted.
- */
-static void
-assert_freelist_ok(chunk_freelist_t *fl)
-{
-  chunk_t *ch;
-  int n;
-  tor_assert(fl->alloc_size > 0);
-  n = 0;
-  for (ch = fl->head; ch; ch = ch->next) {
-    tor_assert(CHUNK_ALLOC_SIZE(ch->memlen) == fl->alloc_size);
-    ++n;
-  }
-  tor_assert(n == fl->cur_length);
-  tor_assert(n >= fl->lowest_length);
-  tor_assert(n <= fl->max_length);
-}
-#endif
-
@@ -20,6 +20,7 @@ buf_t *buf_copy(const buf_t *buf);
 void buf_shrink(buf_t *buf);
 void buf_shrink_freelists(int free_all);
 void buf_dump_freelist_sizes(int severity);
+char *buf_get_freelist_stats(void);
 
 size_t buf_datalen(const buf_t *buf);
 size_t buf_allocation(const buf_t *buf);
@@ -38,6 +39,8 @@ int write_to_buf_zlib(buf_t *buf, tor_zlib_state_t *state,
 int move_buf_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen);
 int fetch_from_buf(char *string, size_t string_len, buf_t *buf);
 int fetch_var_cell_from_buf(buf_t *buf, var_cell_t **out, int linkproto);
+int fetch_cells_from_buf(buf_t *buf, char *out, int max_cells,
+                         int linkproto);
 int fetch_from_buf_http(buf_t *buf,
                         char **headers_out, size_t max_headerlen,
                         char **body_out, size_t *body_used, size_t max_bodylen,
@@ -90,6 +93,10 @@ void assert_buf_ok(buf_t *buf);
 
 #ifdef BUFFERS_PRIVATE
 int buf_find_string_offset(const buf_t *buf, const char *s, size_t n);
+void buf_pullup(buf_t *buf, size_t bytes, int nulterminate);
+uint64_t buf_get_chunk_malloc_count(void);
+void buf_get_io_call_counts(uint64_t *reads_out, uint64_t *writes_out);
+int buf_set_scatter_gather_io(int enabled);
 #endif
 
 #endif
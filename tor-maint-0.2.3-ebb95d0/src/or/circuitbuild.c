@@ -1682,9 +1682,9 @@ circuit_build_times_set_timeout(circuit_build_times_t *cbt)
 static circid_t
 get_unique_circ_id_by_conn(or_connection_t *conn)
 {
-  circid_t test_circ_id;
-  circid_t attempts=0;
+  bitarray_t *in_use;
   circid_t high_bit;
+  int idx;
 
   tor_assert(conn);
   if (conn->circ_id_type == CIRC_ID_TYPE_NEITHER) {
@@ -1693,24 +1693,28 @@ get_unique_circ_id_by_conn(or_connection_t *conn)
     return 0;
   }
   high_bit = (conn->circ_id_type == CIRC_ID_TYPE_HIGHER) ? 1<<15 : 0;
-  do {
-    /* Sequentially iterate over test_circ_id=1...1<<15-1 until we find a
-     * circID such that (high_bit|test_circ_id) is not already used. */
-    test_circ_id = conn->next_circ_id++;
-    if (test_circ_id == 0 || test_circ_id >= 1<<15) {
-      test_circ_id = 1;
-      conn->next_circ_id = 2;
-    }
-    if (++attempts > 1<<15) {
-      /* Make sure we don't loop forever if all circ_id's are used. This
-       * matters because it's an external DoS opportunity.
-       */
+  in_use = circuit_get_id_bitmap_on_orconn(conn);
+  for (;;) {
+    /* Take the first free ID at or after next_circ_id, wrapping around to
+     * the start if there's none.  If every ID is in use, fail right away:
+     * this matters because it's an external DoS opportunity. */
+    idx = bitarray_find_first_zero(in_use, CIRCUIT_ID_BITMAP_BITS,
+                                   conn->next_circ_id);
+    if (idx < 0)
+      idx = bitarray_find_first_zero(in_use, CIRCUIT_ID_BITMAP_BITS, 1);
+    if (idx < 0) {
       log_warn(LD_CIRC,"No unused circ IDs. Failing.");
       return 0;
     }
-    test_circ_id |= high_bit;
-  } while (circuit_id_in_use_on_orconn(test_circ_id, conn));
-  return test_circ_id;
+    conn->next_circ_id = (idx + 1) & ((1<<15)-1);
+    if (!circuit_id_in_use_on_orconn(((circid_t)idx)|high_bit, conn))
+      return ((circid_t)idx)|high_bit;
+    /* The map says it's taken after all.  Believe the map, and don't pick
+     * this one again until it's released. */
+    log_warn(LD_BUG, "Circuit ID %d was in use on a connection, but not "
+             "marked as used.", idx|high_bit);
+    bitarray_set(in_use, idx);
+  }
 }
 
 /** If <b>verbose</b> is false, allocate and return a comma-separated list of
@@ -2259,10 +2263,9 @@ circuit_send_next_onion_skin(origin_circuit_t *circ)
       /* done building the circuit. whew. */
       circuit_set_state(TO_CIRCUIT(circ), CIRCUIT_STATE_OPEN);
       if (circuit_timeout_want_to_count_circ(circ)) {
-        struct timeval end;
         long timediff;
-        tor_gettimeofday(&end);
-        timediff = tv_mdiff(&circ->_base.timestamp_created, &end);
+        timediff = circuit_get_age_msec(TO_CIRCUIT(circ),
+                                        tor_monotime_nsec());
 
         /*
          * If the circuit build time is much greater than we would have cut
@@ -19,6 +19,7 @@
 #include "connection_edge.h"
 #include "connection_or.h"
 #include "control.h"
+#include "main.h"
 #include "networkstatus.h"
 #include "nodelist.h"
 #include "onion.h"
@@ -86,6 +87,24 @@ HT_GENERATE(orconn_circid_map, orconn_circid_circuit_map_t, node,
  */
 orconn_circid_circuit_map_t *_last_circid_orconn_ent = NULL;
 
+/** If <b>conn</b> keeps a bitmap of the circuit IDs in use on it, and
+ * <b>id</b> is from the half of the ID space that we pick from, record
+ * whether <b>id</b> is now <b>in_use</b>. */
+static INLINE void
+circ_id_bitmap_update(or_connection_t *conn, circid_t id, int in_use)
+{
+  circid_t high_bit;
+  if (!conn->circ_id_bitmap)
+    return;
+  high_bit = (conn->circ_id_type == CIRC_ID_TYPE_HIGHER) ? 1<<15 : 0;
+  if ((id & (1<<15)) != high_bit || !(id & ~(1<<15)))
+    return; /* Not ours to pick, or never valid. */
+  if (in_use)
+    bitarray_set(conn->circ_id_bitmap, id & ~(1<<15));
+  else
+    bitarray_clear(conn->circ_id_bitmap, id & ~(1<<15));
+}
+
 /** Implementation helper for circuit_set_{p,n}_circid_orconn: A circuit ID
  * and/or or_connection for circ has just changed from <b>old_conn, old_id</b>
  * to <b>conn, id</b>.  Adjust the conn,circid map as appropriate, removing
@@ -102,7 +121,7 @@ circuit_set_circid_orconn_helper(circuit_t *circ, int direction,
   circid_t old_id, *circid_ptr;
   int was_active, make_active;
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(circ->lock);
   #endif	
 
@@ -142,7 +161,9 @@ circuit_set_circid_orconn_helper(circuit_t *circ, int direction,
     found = HT_REMOVE(orconn_circid_map, &orconn_circid_circuit_map, &search);
     if (found) {
       tor_free(found);
-      --old_conn->n_circuits;
+      circ_id_bitmap_update(old_conn, old_id, 0);
+      if (--old_conn->n_circuits == 0)
+        connection_update_housekeeping(TO_CONN(old_conn));
     }
     if (was_active && old_conn != conn)
       make_circuit_inactive_on_conn(circ,old_conn);
@@ -169,13 +190,14 @@ circuit_set_circid_orconn_helper(circuit_t *circ, int direction,
     found->circuit = circ;
     HT_INSERT(orconn_circid_map, &orconn_circid_circuit_map, found);
   }
+  circ_id_bitmap_update(conn, id, 1);
 
   if (make_active && old_conn != conn)
     make_circuit_active_on_conn(circ,conn);
 
   ++conn->n_circuits;
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(circ->lock);
   #endif
 }
@@ -191,11 +213,11 @@ circuit_set_p_circid_orconn(or_circuit_t *circ, circid_t id,
                                    id, conn);
 
   if (conn){
-	#ifdef LIBRARY
+	#ifdef LIBRARY_CORE_LOCKS
     tor_mutex_acquire(circ->lock);
     #endif
     tor_assert(bool_eq(circ->p_conn_cells.n, circ->next_active_on_p_conn));
-	#ifdef LIBRARY
+	#ifdef LIBRARY_CORE_LOCKS
     tor_mutex_release(circ->lock);
     #endif
   }
@@ -211,11 +233,11 @@ circuit_set_n_circid_orconn(circuit_t *circ, circid_t id,
   circuit_set_circid_orconn_helper(circ, CELL_DIRECTION_OUT, id, conn);
 
   if (conn){
-	#ifdef LIBRARY
+	#ifdef LIBRARY_CORE_LOCKS
     tor_mutex_acquire(circ->lock);
     #endif
     tor_assert(bool_eq(circ->n_conn_cells.n, circ->next_active_on_n_conn));
-	#ifdef LIBRARY
+	#ifdef LIBRARY_CORE_LOCKS
     tor_mutex_release(circ->lock);
     #endif
   }
@@ -228,7 +250,7 @@ circuit_set_state(circuit_t *circ, uint8_t state)
 {
   tor_assert(circ);
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(circ->lock);
   #endif
 
@@ -250,7 +272,7 @@ circuit_set_state(circuit_t *circ, uint8_t state)
     tor_assert(!circ->n_conn_onionskin);
   circ->state = state;
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(circ->lock);
   #endif
 
@@ -328,7 +350,7 @@ circuit_close_all_marked(void)
 {
   circuit_t *tmp,*m;
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_t *lock1;
   tor_mutex_t *lock2;
   if(!global_circuitlist) return;
@@ -336,14 +358,14 @@ circuit_close_all_marked(void)
 
   while (global_circuitlist && global_circuitlist->marked_for_close) {
 
-	#ifdef LIBRARY
+	#ifdef LIBRARY_CORE_LOCKS
     lock1 = global_circuitlist->lock;
     tor_mutex_acquire(lock1);
     #endif
 
     tmp = global_circuitlist->next;
 
-	#ifdef LIBRARY
+	#ifdef LIBRARY_CORE_LOCKS
     tor_mutex_release(lock1);
     #endif
 
@@ -354,7 +376,7 @@ circuit_close_all_marked(void)
 
   tmp = global_circuitlist;
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
 
   if(!tmp) return;
 
@@ -364,7 +386,7 @@ circuit_close_all_marked(void)
 
   while (tmp && tmp->next) {
 
-	#ifdef LIBRARY
+	#ifdef LIBRARY_CORE_LOCKS
 	lock2 = tmp->next->lock;
 	tor_mutex_acquire(lock2);
     #endif
@@ -373,7 +395,7 @@ circuit_close_all_marked(void)
 
       m = tmp->next->next;
 
-	  #ifdef LIBRARY
+	  #ifdef LIBRARY_CORE_LOCKS
       tor_mutex_release(lock2);
       #endif
 
@@ -387,14 +409,14 @@ circuit_close_all_marked(void)
 
       tmp = tmp->next;
 
-	  #ifdef LIBRARY
+	  #ifdef LIBRARY_CORE_LOCKS
       tor_mutex_release(lock1);
 	  lock1 = lock2;
       #endif
     }
   }
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(lock1);
   #endif
 
@@ -605,24 +627,22 @@ static void
 init_circuit_base(circuit_t *circ)
 {
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   //tor_mutex_acquire(circ->lock);
   #endif
 
   tor_gettimeofday(&circ->timestamp_created);
+  circ->timestamp_created_nsec = tor_monotime_nsec();
 
   circ->package_window = circuit_initial_package_window();
   circ->deliver_window = CIRCWINDOW_START;
 
   /* Initialize the cell_ewma_t structure */
-  circ->n_cell_ewma.last_adjusted_tick = cell_ewma_get_tick();
-  circ->n_cell_ewma.cell_count = 0.0;
-  circ->n_cell_ewma.heap_index = -1;
-  circ->n_cell_ewma.is_for_p_conn = 0;
+  cell_ewma_init(&circ->n_cell_ewma, 0);
 
   circuit_add(circ);
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   //tor_mutex_release(circ->lock);
   #endif
 }
@@ -647,7 +667,7 @@ origin_circuit_new(void)
   circ->remaining_relay_early_cells = MAX_RELAY_EARLY_CELLS_PER_CIRCUIT;
   circ->remaining_relay_early_cells -= crypto_rand_int(2);
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   circ->lock = tor_mutex_new();
   circ->_base.lock = tor_mutex_new();
 #endif
@@ -680,16 +700,9 @@ or_circuit_new(circid_t p_circ_id, or_connection_t *p_conn)
   init_circuit_base(TO_CIRCUIT(circ));
 
   /* Initialize the cell_ewma_t structure */
+  cell_ewma_init(&circ->p_cell_ewma, 1);
 
-  /* Initialize the cell counts to 0 */
-  circ->p_cell_ewma.cell_count = 0.0;
-  circ->p_cell_ewma.last_adjusted_tick = cell_ewma_get_tick();
-  circ->p_cell_ewma.is_for_p_conn = 1;
-
-  /* It's not in any heap yet. */
-  circ->p_cell_ewma.heap_index = -1;
-
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   circ->lock = tor_mutex_new();
   #endif
 
@@ -706,7 +719,7 @@ circuit_free(circuit_t *circ)
   if (!circ)
     return;
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(circ->lock);
   #endif
 
@@ -784,7 +797,7 @@ circuit_free(circuit_t *circ)
    * "active" checks will be violated. */
   cell_queue_clear(&circ->n_conn_cells);
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(circ->lock);
   tor_free(circ->lock);
   #endif
@@ -877,7 +890,7 @@ circuit_dump_details(int severity, circuit_t *circ, int conn_array_index,
                      const char *type, int this_circid, int other_circid)
 {
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(circ->lock);
   #endif
 
@@ -891,7 +904,7 @@ circuit_dump_details(int severity, circuit_t *circ, int conn_array_index,
     circuit_log_path(severity, LD_CIRC, TO_ORIGIN_CIRCUIT(circ));
   }
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(circ->lock);
   #endif
 }
@@ -960,6 +973,18 @@ circuit_dump_by_conn(connection_t *conn, int severity)
   }
 }
 
+/** Return how many milliseconds old <b>circ</b> is at <b>now_nsec</b>, as
+ * returned by tor_monotime_nsec(). */
+long
+circuit_get_age_msec(const circuit_t *circ, uint64_t now_nsec)
+{
+  uint64_t age;
+  if (now_nsec <= circ->timestamp_created_nsec)
+    return 0;
+  age = (now_nsec - circ->timestamp_created_nsec) / 1000000;
+  return age > LONG_MAX ? LONG_MAX : (long)age;
+}
+
 /** Return the circuit whose global ID is <b>id</b>, or NULL if no
  * such circuit exists. */
 origin_circuit_t *
@@ -1054,6 +1079,29 @@ circuit_id_in_use_on_orconn(circid_t circ_id, or_connection_t *conn)
   return circuit_get_by_circid_orconn_impl(circ_id, conn) != NULL;
 }
 
+/** Return a bitmap of the circuit IDs in use on <b>conn</b>, from the half
+ * of the ID space that we pick from: bit <i>i</i> is set iff the circuit
+ * ID made of <i>i</i> and our half's high bit is taken.  Bit 0 is always
+ * set, since no circuit may use ID 0.  The bitmap holds
+ * CIRCUIT_ID_BITMAP_BITS bits; we build it the first time we are asked,
+ * and keep it up to date as circuits come and go on <b>conn</b>. */
+bitarray_t *
+circuit_get_id_bitmap_on_orconn(or_connection_t *conn)
+{
+  orconn_circid_circuit_map_t **ent;
+
+  if (conn->circ_id_bitmap)
+    return conn->circ_id_bitmap;
+
+  conn->circ_id_bitmap = bitarray_init_zero(CIRCUIT_ID_BITMAP_BITS);
+  bitarray_set(conn->circ_id_bitmap, 0);
+  HT_FOREACH(ent, orconn_circid_map, &orconn_circid_circuit_map) {
+    if ((*ent)->or_conn == conn && (*ent)->circuit)
+      circ_id_bitmap_update(conn, (*ent)->circ_id, 1);
+  }
+  return conn->circ_id_bitmap;
+}
+
 /** Return the circuit that a given edge connection is using. */
 circuit_t *
 circuit_get_by_edge_conn(edge_connection_t *conn)
@@ -1079,7 +1127,7 @@ circuit_unlink_all_from_or_conn(or_connection_t *conn, int reason)
 
   connection_or_unlink_all_active_circs(conn);
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   if(global_circuitlist) tor_mutex_acquire(global_circuitlist->lock);
   #endif
 
@@ -1100,7 +1148,7 @@ circuit_unlink_all_from_or_conn(or_connection_t *conn, int reason)
       circuit_mark_for_close(circ, reason);
   }
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   if(global_circuitlist) tor_mutex_release(global_circuitlist->lock);
   #endif
 }
@@ -1119,7 +1167,7 @@ circuit_get_ready_rend_circ_by_rend_data(const rend_data_t *rend_data)
 {
   circuit_t *circ;
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(global_circuitlist->lock);
   #endif
 
@@ -1141,7 +1189,7 @@ circuit_get_ready_rend_circ_by_rend_data(const rend_data_t *rend_data)
 
   }
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(global_circuitlist->lock);
   #endif
 
@@ -1169,13 +1217,13 @@ circuit_get_next_by_pk_and_purpose(origin_circuit_t *start,
 
   for ( ; circ; circ = circ->next) {
 
-    #ifdef LIBRARY
+    #ifdef LIBRARY_CORE_LOCKS
     tor_mutex_acquire(circ->lock);
     #endif
 
     if (circ->marked_for_close)
 	{
-	  #ifdef LIBRARY
+	  #ifdef LIBRARY_CORE_LOCKS
       tor_mutex_release(global_circuitlist->lock);
       #endif
       continue;
@@ -1183,7 +1231,7 @@ circuit_get_next_by_pk_and_purpose(origin_circuit_t *start,
 
     if (circ->purpose != purpose)
 	{
-	  #ifdef LIBRARY
+	  #ifdef LIBRARY_CORE_LOCKS
       tor_mutex_release(global_circuitlist->lock);
       #endif
       continue;
@@ -1191,7 +1239,7 @@ circuit_get_next_by_pk_and_purpose(origin_circuit_t *start,
 
     if (!digest)
 	{
-	  #ifdef LIBRARY
+	  #ifdef LIBRARY_CORE_LOCKS
       tor_mutex_release(global_circuitlist->lock);
       #endif
       return TO_ORIGIN_CIRCUIT(circ);
@@ -1200,7 +1248,7 @@ circuit_get_next_by_pk_and_purpose(origin_circuit_t *start,
              tor_memeq(TO_ORIGIN_CIRCUIT(circ)->rend_data->rend_pk_digest,
                      digest, DIGEST_LEN))
 	{
-	  #ifdef LIBRARY
+	  #ifdef LIBRARY_CORE_LOCKS
       tor_mutex_release(global_circuitlist->lock);
       #endif
 
@@ -1209,7 +1257,7 @@ circuit_get_next_by_pk_and_purpose(origin_circuit_t *start,
 
   }
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(global_circuitlist->lock);
   #endif
 
@@ -1225,7 +1273,7 @@ circuit_get_by_rend_token_and_purpose(uint8_t purpose, const char *token,
 {
   circuit_t *circ;
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(global_circuitlist->lock);
   #endif
 
@@ -1236,7 +1284,7 @@ circuit_get_by_rend_token_and_purpose(uint8_t purpose, const char *token,
       return TO_OR_CIRCUIT(circ);
   }
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(global_circuitlist->lock);
   #endif
 
@@ -1353,7 +1401,7 @@ int
 circuit_get_cpath_len(origin_circuit_t *circ)
 {
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
 //  tor_mutex_acquire(circ->lock);
   #endif
 
@@ -1374,7 +1422,7 @@ crypt_path_t *
 circuit_get_cpath_hop(origin_circuit_t *circ, int hopnum)
 {
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
 //  tor_mutex_acquire(circ->lock);
   #endif
 
@@ -1458,7 +1506,7 @@ _circuit_mark_for_close(circuit_t *circ, int reason, int line,
   tor_assert(line);
   tor_assert(file);
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(circ->lock);
   #endif
 
@@ -1676,7 +1724,7 @@ assert_circuit_ok(const circuit_t *c)
   const or_circuit_t *or_circ = NULL;
   const origin_circuit_t *origin_circ = NULL;
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(c->lock);
   #endif
 
@@ -1755,7 +1803,7 @@ assert_circuit_ok(const circuit_t *c)
     tor_assert(!or_circ || !or_circ->rend_splice);
   }
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(c->lock);
   #endif
 
@@ -23,6 +23,7 @@ void circuit_set_p_circid_orconn(or_circuit_t *circ, circid_t id,
 void circuit_set_n_circid_orconn(circuit_t *circ, circid_t id,
                                  or_connection_t *conn);
 void circuit_set_state(circuit_t *circ, uint8_t state);
+long circuit_get_age_msec(const circuit_t *circ, uint64_t now_nsec);
 void circuit_close_all_marked(void);
 int32_t circuit_initial_package_window(void);
 origin_circuit_t *origin_circuit_new(void);
@@ -30,6 +31,9 @@ or_circuit_t *or_circuit_new(circid_t p_circ_id, or_connection_t *p_conn);
 circuit_t *circuit_get_by_circid_orconn(circid_t circ_id,
                                         or_connection_t *conn);
 int circuit_id_in_use_on_orconn(circid_t circ_id, or_connection_t *conn);
+/** How many circuit IDs are there in each half of the ID space? */
+#define CIRCUIT_ID_BITMAP_BITS (1<<15)
+bitarray_t *circuit_get_id_bitmap_on_orconn(or_connection_t *conn);
 circuit_t *circuit_get_by_edge_conn(edge_connection_t *conn);
 void circuit_unlink_all_from_or_conn(or_connection_t *conn, int reason);
 origin_circuit_t *circuit_get_by_global_id(uint32_t id);
@@ -16,6 +16,7 @@
 #include "config.h"
 #include "connection.h"
 #include "connection_edge.h"
+#include "connection_or.h"
 #include "control.h"
 #include "nodelist.h"
 #include "networkstatus.h"
@@ -254,6 +255,7 @@ circuit_get_best(const entry_connection_t *conn,
   circuit_t *circ;
   origin_circuit_t *best=NULL;
   struct timeval now;
+  uint64_t now_nsec;
   int intro_going_on_but_too_old = 0;
 
   tor_assert(conn);
@@ -263,6 +265,7 @@ circuit_get_best(const entry_connection_t *conn,
              purpose == CIRCUIT_PURPOSE_C_REND_JOINED);
 
   tor_gettimeofday(&now);
+  now_nsec = tor_monotime_nsec();
 
   for (circ=global_circuitlist;circ;circ = circ->next) {
     origin_circuit_t *origin_circ;
@@ -275,7 +278,7 @@ circuit_get_best(const entry_connection_t *conn,
 
     if (purpose == CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT &&
         !must_be_open && circ->state != CIRCUIT_STATE_OPEN &&
-        tv_mdiff(&now, &circ->timestamp_created) > circ_times.timeout_ms) {
+        circuit_get_age_msec(circ, now_nsec) > circ_times.timeout_ms) {
       intro_going_on_but_too_old = 1;
       continue;
     }
@@ -355,35 +358,39 @@ circuit_expire_building(void)
   /* circ_times.timeout_ms and circ_times.close_ms are from
    * circuit_build_times_get_initial_timeout() if we haven't computed
    * custom timeouts yet */
-  struct timeval general_cutoff, begindir_cutoff, fourhop_cutoff,
+  /* All of these are ages in msec; circuits younger than that are spared. */
+  long general_cutoff, begindir_cutoff, fourhop_cutoff,
     cannibalize_cutoff, close_cutoff, extremely_old_cutoff,
     hs_extremely_old_cutoff;
   const or_options_t *options = get_options();
   struct timeval now;
+  uint64_t now_nsec;
   cpath_build_state_t *build_state;
 
   tor_gettimeofday(&now);
+  now_nsec = tor_monotime_nsec();
 #define SET_CUTOFF(target, msec) do {                       \
-    long ms = tor_lround(msec);                             \
+    long ms = (msec);                                       \
     struct timeval diff;                                    \
     diff.tv_sec = ms / 1000;                                \
     diff.tv_usec = (int)((ms % 1000) * 1000);               \
     timersub(&now, &diff, &target);                         \
   } while (0)
 
-  SET_CUTOFF(general_cutoff, circ_times.timeout_ms);
-  SET_CUTOFF(begindir_cutoff, circ_times.timeout_ms);
-  SET_CUTOFF(fourhop_cutoff, circ_times.timeout_ms * (4/3.0));
-  SET_CUTOFF(cannibalize_cutoff, circ_times.timeout_ms / 2.0);
-  SET_CUTOFF(close_cutoff, circ_times.close_ms);
-  SET_CUTOFF(extremely_old_cutoff, circ_times.close_ms*2 + 1000);
+  general_cutoff = tor_lround(circ_times.timeout_ms);
+  begindir_cutoff = tor_lround(circ_times.timeout_ms);
+  fourhop_cutoff = tor_lround(circ_times.timeout_ms * (4/3.0));
+  cannibalize_cutoff = tor_lround(circ_times.timeout_ms / 2.0);
+  close_cutoff = tor_lround(circ_times.close_ms);
+  extremely_old_cutoff = tor_lround(circ_times.close_ms*2 + 1000);
 
-  SET_CUTOFF(hs_extremely_old_cutoff,
-             MAX(circ_times.close_ms*2 + 1000,
-                 options->SocksTimeout * 1000));
+  hs_extremely_old_cutoff =
+    tor_lround(MAX(circ_times.close_ms*2 + 1000,
+                   options->SocksTimeout * 1000));
 
   while (next_circ) {
     struct timeval cutoff;
+    long cutoff_ms, age_ms;
     victim = next_circ;
     next_circ = next_circ->next;
     if (!CIRCUIT_IS_ORIGIN(victim) || /* didn't originate here */
@@ -392,22 +399,25 @@ circuit_expire_building(void)
 
     build_state = TO_ORIGIN_CIRCUIT(victim)->build_state;
     if (build_state && build_state->onehop_tunnel)
-      cutoff = begindir_cutoff;
+      cutoff_ms = begindir_cutoff;
     else if (build_state && build_state->desired_path_len == 4
              && !TO_ORIGIN_CIRCUIT(victim)->has_opened)
-      cutoff = fourhop_cutoff;
+      cutoff_ms = fourhop_cutoff;
     else if (TO_ORIGIN_CIRCUIT(victim)->has_opened)
-      cutoff = cannibalize_cutoff;
+      cutoff_ms = cannibalize_cutoff;
     else if (victim->purpose == CIRCUIT_PURPOSE_C_MEASURE_TIMEOUT)
-      cutoff = close_cutoff;
+      cutoff_ms = close_cutoff;
     else
-      cutoff = general_cutoff;
+      cutoff_ms = general_cutoff;
 
     if (TO_ORIGIN_CIRCUIT(victim)->hs_circ_has_timed_out)
-      cutoff = hs_extremely_old_cutoff;
+      cutoff_ms = hs_extremely_old_cutoff;
 
-    if (timercmp(&victim->timestamp_created, &cutoff, >))
+    age_ms = circuit_get_age_msec(victim, now_nsec);
+    if (age_ms < cutoff_ms)
       continue; /* it's still young, leave it alone */
+    /* Some purposes measure their age from timestamp_dirty instead. */
+    SET_CUTOFF(cutoff, cutoff_ms);
 
 #if 0
     /* some debug logs, to help track bugs */
@@ -496,11 +506,11 @@ circuit_expire_building(void)
          * it off at, we probably had a suspend event along this codepath,
          * and we should discard the value.
          */
-        if (timercmp(&victim->timestamp_created, &extremely_old_cutoff, <)) {
+        if (age_ms > extremely_old_cutoff) {
           log_notice(LD_CIRC,
                      "Extremely large value for circuit build timeout: %lds. "
                      "Assuming clock jump. Purpose %d (%s)",
-                     (long)(now.tv_sec - victim->timestamp_created.tv_sec),
+                     age_ms / 1000,
                      victim->purpose,
                      circuit_purpose_to_string(victim->purpose));
         } else if (circuit_build_times_count_close(&circ_times,
@@ -877,18 +887,20 @@ static void
 circuit_expire_old_circuits_clientside(void)
 {
   circuit_t *circ;
-  struct timeval cutoff, now;
+  struct timeval now;
+  uint64_t now_nsec;
+  long cutoff_ms, age_ms;
 
   tor_gettimeofday(&now);
-  cutoff = now;
+  now_nsec = tor_monotime_nsec();
 
   if (get_options()->LearnCircuitBuildTimeout &&
       circuit_build_times_needs_circuits(&circ_times)) {
     /* Circuits should be shorter lived if we need more of them
      * for learning a good build timeout */
-    cutoff.tv_sec -= IDLE_TIMEOUT_WHILE_LEARNING;
+    cutoff_ms = IDLE_TIMEOUT_WHILE_LEARNING * 1000L;
   } else {
-    cutoff.tv_sec -= get_options()->CircuitIdleTimeout;
+    cutoff_ms = get_options()->CircuitIdleTimeout * 1000L;
   }
 
   for (circ = global_circuitlist; circ; circ = circ->next) {
@@ -907,7 +919,8 @@ circuit_expire_old_circuits_clientside(void)
                 circ->purpose);
       circuit_mark_for_close(circ, END_CIRC_REASON_FINISHED);
     } else if (!circ->timestamp_dirty && circ->state == CIRCUIT_STATE_OPEN) {
-      if (timercmp(&circ->timestamp_created, &cutoff, <)) {
+      age_ms = circuit_get_age_msec(circ, now_nsec);
+      if (age_ms > cutoff_ms) {
         if (circ->purpose == CIRCUIT_PURPOSE_C_GENERAL ||
                 circ->purpose == CIRCUIT_PURPOSE_C_MEASURE_TIMEOUT ||
                 circ->purpose == CIRCUIT_PURPOSE_S_ESTABLISH_INTRO ||
@@ -917,7 +930,7 @@ circuit_expire_old_circuits_clientside(void)
                 circ->purpose == CIRCUIT_PURPOSE_S_CONNECT_REND) {
           log_debug(LD_CIRC,
                     "Closing circuit that has been unused for %ld msec.",
-                    tv_mdiff(&circ->timestamp_created, &now));
+                    age_ms);
           circuit_mark_for_close(circ, END_CIRC_REASON_FINISHED);
         } else if (!TO_ORIGIN_CIRCUIT(circ)->is_ancient) {
           /* Server-side rend joined circuits can end up really old, because
@@ -931,7 +944,7 @@ circuit_expire_old_circuits_clientside(void)
                        "Ancient non-dirty circuit %d is still around after "
                        "%ld milliseconds. Purpose: %d (%s)",
                        TO_ORIGIN_CIRCUIT(circ)->global_identifier,
-                       tv_mdiff(&circ->timestamp_created, &now),
+                       age_ms,
                        circ->purpose,
                        circuit_purpose_to_string(circ->purpose));
             TO_ORIGIN_CIRCUIT(circ)->is_ancient = 1;
@@ -1197,7 +1210,7 @@ circuit_build_failed(origin_circuit_t *circ)
                "Our circuit failed to get a response from the first hop "
                "(%s:%d). I'm going to try to rotate to a better connection.",
                n_conn->_base.address, n_conn->_base.port);
-      n_conn->is_bad_for_new_circs = 1;
+      connection_or_mark_bad_for_new_circs(n_conn);
     } else {
       log_info(LD_OR,
                "Our circuit died before the first hop with no connection");
@@ -1310,7 +1323,7 @@ circuit_launch_by_extend_info(uint8_t purpose,
     circ = circuit_find_to_cannibalize(purpose, extend_info, flags);
     if (circ) {
       uint8_t old_purpose = circ->_base.purpose;
-      struct timeval old_timestamp_created;
+      struct timeval old_timestamp_created = circ->_base.timestamp_created;
 
       log_info(LD_CIRC,"Cannibalizing circ '%s' for purpose %d (%s)",
                build_state_get_exit_nickname(circ->build_state), purpose,
@@ -1321,6 +1334,7 @@ circuit_launch_by_extend_info(uint8_t purpose,
        * will see it and think it's been trying to build since it
        * began. */
       tor_gettimeofday(&circ->_base.timestamp_created);
+      circ->_base.timestamp_created_nsec = tor_monotime_nsec();
 
       control_event_circuit_cannibalized(circ, old_purpose,
                                          &old_timestamp_created);
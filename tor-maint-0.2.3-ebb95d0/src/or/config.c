@@ -1572,16 +1572,15 @@ options_act(const or_options_t *old_options)
   if (accounting_is_enabled(options))
     configure_accounting(time(NULL));
 
-#ifdef USE_BUFFEREVENTS
-  /* If we're using the bufferevents implementation and our rate limits
-   * changed, we need to tell the rate-limiting system about it. */
-  if (!old_options ||
-      old_options->BandwidthRate != options->BandwidthRate ||
-      old_options->BandwidthBurst != options->BandwidthBurst ||
-      old_options->RelayBandwidthRate != options->RelayBandwidthRate ||
-      old_options->RelayBandwidthBurst != options->RelayBandwidthBurst)
-    connection_bucket_init();
-#endif
+  /* If our rate limits changed, we need to tell the rate-limiting system
+   * about it.  (The first time through, the buckets don't exist yet;
+   * do_main_loop() sets them up from these options.) */
+  if (old_options &&
+      (old_options->BandwidthRate != options->BandwidthRate ||
+       old_options->BandwidthBurst != options->BandwidthBurst ||
+       old_options->RelayBandwidthRate != options->RelayBandwidthRate ||
+       old_options->RelayBandwidthBurst != options->RelayBandwidthBurst))
+    connection_bucket_adjust(options);
 
   /* Change the cell EWMA settings */
   cell_ewma_set_scale_factor(options, networkstatus_get_latest_consensus());
@@ -1695,6 +1694,11 @@ options_act(const or_options_t *old_options)
     if (options->PerConnBWRate != old_options->PerConnBWRate ||
         options->PerConnBWBurst != old_options->PerConnBWBurst)
       connection_or_update_token_buckets(get_connection_array(), options);
+
+    /* A shorter keepalive period brings every OR connection's housekeeping
+     * deadline closer. */
+    if (options->KeepalivePeriod < old_options->KeepalivePeriod)
+      connection_update_all_housekeeping();
   }
 
   /* Maybe load geoip file */
@@ -11,6 +11,7 @@
  * on connections.
  **/
 
+#define CONNECTION_PRIVATE
 #include "or.h"
 #include "buffers.h"
 #include "circuitbuild.h"
@@ -36,9 +37,15 @@
 #include "rephist.h"
 #include "router.h"
 #include "routerparse.h"
+#include "scheduler.h"
 
 #ifdef LIBRARY
 #include "../libtor_internal.h"
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
 #endif
 
 #ifdef USE_BUFFEREVENTS
@@ -59,10 +66,7 @@ static void connection_init(time_t now, connection_t *conn, int type,
 static int connection_init_accepted_conn(connection_t *conn,
                           const listener_connection_t *listener);
 static int connection_handle_listener_read(connection_t *conn, int new_type);
-#ifndef USE_BUFFEREVENTS
-static int connection_bucket_should_increase(int bucket,
-                                             or_connection_t *conn);
-#endif
+static void connection_forget_blocked_on_bw(connection_t *conn);
 static int connection_finished_flushing(connection_t *conn);
 static int connection_flushed_some(connection_t *conn);
 static int connection_finished_connecting(connection_t *conn);
@@ -255,7 +259,7 @@ or_connection_new(int socket_family)
   or_conn->next_circ_id = crypto_rand_int(1<<15);
 
   or_conn->active_circuit_pqueue = smartlist_new();
-  or_conn->active_circuit_pqueue_last_recalibrated = cell_ewma_get_tick();
+  or_conn->sched_heap_idx = -1;
 
   return or_conn;
 }
@@ -473,6 +477,9 @@ _connection_free(connection_t *conn)
              (int)connection_get_outbuf_len(conn));
   }
 
+  timewheel_cancel(&conn->housekeeping_timer);
+  connection_forget_blocked_on_bw(conn);
+
   if (!connection_is_listener(conn)) {
     buf_free(conn->inbuf);
     buf_free(conn->outbuf);
@@ -497,6 +504,8 @@ _connection_free(connection_t *conn)
     or_conn->tls = NULL;
     or_handshake_state_free(or_conn->handshake_state);
     or_conn->handshake_state = NULL;
+    scheduler_release_conn(or_conn);
+    bitarray_free(or_conn->circ_id_bitmap);
     smartlist_free(or_conn->active_circuit_pqueue);
     tor_free(or_conn->nickname);
   }
@@ -515,6 +524,26 @@ _connection_free(connection_t *conn)
   }
   if (CONN_IS_EDGE(conn)) {
     rend_data_free(TO_EDGE_CONN(conn)->rend_data);
+#ifdef LIBRARY
+    onionroute_pending_writes_abort(TO_EDGE_CONN(conn));
+    if (TO_EDGE_CONN(conn)->flush_timer) {
+      tor_event_free(TO_EDGE_CONN(conn)->flush_timer);
+      TO_EDGE_CONN(conn)->flush_timer = NULL;
+    }
+    relay_free_onionroute_batch(TO_EDGE_CONN(conn));
+    if (TO_EDGE_CONN(conn)->recv_stream) {
+      onionroute_recv_stream_detach(TO_EDGE_CONN(conn)->recv_stream);
+      TO_EDGE_CONN(conn)->recv_stream = NULL;
+    }
+    if (TO_EDGE_CONN(conn)->onionroute_id) {
+      onionroute_handle_free(TO_EDGE_CONN(conn)->onionroute_id);
+      TO_EDGE_CONN(conn)->onionroute_id = NULL;
+    }
+    if (TO_EDGE_CONN(conn)->onionroute_ctx) {
+      onionroute_ctx_decref(TO_EDGE_CONN(conn)->onionroute_ctx);
+      TO_EDGE_CONN(conn)->onionroute_ctx = NULL;
+    }
+#endif
   }
   if (conn->type == CONN_TYPE_CONTROL) {
     control_connection_t *control_conn = TO_CONTROL_CONN(conn);
@@ -1154,14 +1183,14 @@ check_sockaddr_family_match(sa_family_t got, connection_t *listener)
 #ifdef LIBRARY
 
 int
-onionroute_connection_ap_process(entry_connection_t *conn, char* address, int port, void* obj);
+onionroute_connection_ap_process(entry_connection_t *conn, char* address, int port, void* obj, void *id, onionroute_ctx_t *ctx);
 
-void *onionroute_stream_connect_i(char* addr, int port, void* obj)
+void *onionroute_stream_connect_i(char* addr, int port, void* obj, void *id, onionroute_ctx_t *ctx)
 {
 	entry_connection_t *entry_conn;
 	entry_conn = entry_connection_new(CONN_TYPE_AP, AF_INET);
  
-	onionroute_connection_ap_process(entry_conn, tor_strdup(addr), port, obj);
+	onionroute_connection_ap_process(entry_conn, tor_strdup(addr), port, obj, id, ctx);
 
 	return entry_conn;
 }
@@ -1172,6 +1201,8 @@ typedef struct onionroute_connect_command_t
   char* address;
   int port;
   void *obj;
+  void *id;
+  onionroute_ctx_t *ctx;
 
 } onionroute_connect_command_t;
 
@@ -1188,7 +1219,7 @@ connect_command_processor(void *data)
 	address = cmd->address;
     port = cmd->port;
 
-	onionroute_stream_connect_i(address, port, cmd->obj);
+	onionroute_stream_connect_i(address, port, cmd->obj, cmd->id, cmd->ctx);
 
 	tor_free(address);
 	tor_free(data);
@@ -1196,16 +1227,26 @@ connect_command_processor(void *data)
 
 
 
-ONIONROUTE_API
-int onionroute_stream_open_v2(char* addr, int port, void *obj)
+/* queue a connect to addr:port on ctx under a fresh handle, stored in *idp */
+static int
+onionroute_stream_open_i(onionroute_ctx_t *ctx, const char* addr, int port,
+                         void *obj, void **idp)
 {
 	char *naddr;
 	onionroute_connect_command_t *ccmd;
-	onionroute_command_t *cmd;
+	void *id;
+	int r;
+
+	id = onionroute_handle_new();
+	if(NULL == id) return -1;
 	
 	naddr = _tor_strdup(addr);
 
-	if(NULL == naddr) return -1;
+	if(NULL == naddr)
+	{
+		onionroute_handle_free(id);
+		return -1;
+	}
 
 	/* store data */
 	ccmd = tor_malloc(sizeof(onionroute_connect_command_t));
@@ -1215,26 +1256,54 @@ int onionroute_stream_open_v2(char* addr, int port, void *obj)
 		return -1;
 	}
 
-	cmd = tor_malloc(sizeof(onionroute_command_t));
-	if(NULL == cmd)
+	ccmd->address = naddr;
+	ccmd->port = port;
+	ccmd->obj = obj;
+	ccmd->id = id;
+	ccmd->ctx = ctx;
+
+	/* store command in queue */
+	r = onionroute_command_enqueue(connect_command_processor, ccmd);
+	if(r < 0)
 	{
 		/* I love catch / finally blocks to cleanup */
+		onionroute_handle_free(id);
 		tor_free(naddr);
 		tor_free(ccmd);
-		return -1;
+		id = NULL;
 	}
 
-	ccmd->address = naddr;
-	ccmd->port = port;
-	ccmd->obj = obj;
-	
-	cmd->data = ccmd;
-	cmd->processor = connect_command_processor;
+	*idp = id;
+	return r;
+}
 
-	/* store command in queue */
-	smartlist_add(cqueue, cmd);
+ONIONROUTE_API
+void *onionroute_stream_open_v3(const char* addr, int port, void *obj)
+{
+	void *id;
 
-	return 0;
+	onionroute_stream_open_i(&onionroute_default_ctx, addr, port, obj, &id);
+	return id;
+}
+
+ONIONROUTE_API
+void *onionroute_ctx_stream_open_v1(onionroute_ctx_t *ctx, const char* addr,
+                                    int port, void *obj)
+{
+	void *id;
+
+	if(NULL == ctx) return NULL;
+
+	onionroute_stream_open_i(ctx, addr, port, obj, &id);
+	return id;
+}
+
+ONIONROUTE_API
+int onionroute_stream_open_v2(char* addr, int port, void *obj)
+{
+	void *id;
+
+	return onionroute_stream_open_i(&onionroute_default_ctx, addr, port, obj, &id);
 }
 
 ONIONROUTE_API
@@ -2154,12 +2223,33 @@ connection_is_rate_limited(connection_t *conn)
 #ifdef USE_BUFFEREVENTS
 static struct bufferevent_rate_limit_group *global_rate_limit = NULL;
 #else
-extern int global_read_bucket, global_write_bucket;
-extern int global_relayed_read_bucket, global_relayed_write_bucket;
-
-/** Did either global write bucket run dry last second? If so,
- * we are likely to run dry again this second, so be stingy with the
- * tokens we just put in. */
+/** Global token buckets: every rate-limited connection draws on these. */
+static token_bucket_t global_read_bucket, global_write_bucket;
+/** Token buckets for relayed traffic (see
+ * connection_counts_as_relayed_traffic()).  Relayed traffic draws on these
+ * as well as on the global buckets. */
+static token_bucket_t global_relayed_read_bucket, global_relayed_write_bucket;
+
+/** How many bytes have we read on rate-limited connections, ever? */
+static uint64_t rate_limited_bytes_read = 0;
+/** How many bytes have we written on rate-limited connections, ever? */
+static uint64_t rate_limited_bytes_written = 0;
+
+/** Bytes the cell scheduler has put on rate-limited outbufs during its
+ * current run, against the global and relayed write buckets.  They are
+ * still owed to the buckets, so every connection's write room must leave
+ * them out, not just the connection's own outbuf.  See
+ * connection_bucket_commit_write(). */
+static size_t global_write_committed = 0, global_relayed_write_committed = 0;
+
+/** Every connection that has stopped reading or writing because it ran out
+ * of tokens.  Buckets refill lazily, so these are the only connections that
+ * connection_bucket_refill() needs to look at. */
+static smartlist_t *bw_blocked_conns = NULL;
+
+/** Did either global write bucket run dry since the last refill tick? If so,
+ * we are likely to run dry again soon, so be stingy with the tokens we just
+ * put in. */
 static int write_buckets_empty_last_second = 0;
 #endif
 
@@ -2168,6 +2258,23 @@ static int write_buckets_empty_last_second = 0;
 #define CLIENT_IDLE_TIME_FOR_PRIORITY 30
 
 #ifndef USE_BUFFEREVENTS
+/** Return the current time in milliseconds, for refilling token buckets.
+ * This comes from the cached monotonic clock, so it never goes backwards,
+ * even if the wall clock does. */
+uint64_t
+connection_bucket_now_msec(void)
+{
+  return tor_monotime_cached_msec();
+}
+
+/** Return true iff <b>conn</b> is an OR connection whose own token buckets
+ * are in use: only open OR connections play the rate limiting game. */
+static INLINE int
+connection_has_own_buckets(const connection_t *conn)
+{
+  return connection_speaks_cells(conn) && conn->state == OR_CONN_STATE_OPEN;
+}
+
 /** Return 1 if <b>conn</b> should use tokens from the "relayed"
  * bandwidth rates, else 0. Currently, only OR conns with bandwidth
  * class 1, and directory conns that are serving data out, count.
@@ -2225,12 +2332,13 @@ connection_bucket_read_limit(connection_t *conn, time_t now)
                CELL_NETWORK_SIZE : RELAY_PAYLOAD_SIZE;
   int priority = conn->type != CONN_TYPE_DIR;
   int conn_bucket = -1;
-  int global_bucket = global_read_bucket;
+  int global_bucket;
+  uint64_t now_msec = connection_bucket_now_msec();
 
-  if (connection_speaks_cells(conn)) {
+  if (connection_has_own_buckets(conn)) {
     or_connection_t *or_conn = TO_OR_CONN(conn);
-    if (conn->state == OR_CONN_STATE_OPEN)
-      conn_bucket = or_conn->read_bucket;
+    token_bucket_refill(&or_conn->read_bucket, now_msec);
+    conn_bucket = token_bucket_get(&or_conn->read_bucket);
   }
 
   if (!connection_is_rate_limited(conn)) {
@@ -2238,9 +2346,13 @@ connection_bucket_read_limit(connection_t *conn, time_t now)
     return conn_bucket>=0 ? conn_bucket : 1<<14;
   }
 
-  if (connection_counts_as_relayed_traffic(conn, now) &&
-      global_relayed_read_bucket <= global_read_bucket)
-    global_bucket = global_relayed_read_bucket;
+  token_bucket_refill(&global_read_bucket, now_msec);
+  global_bucket = token_bucket_get(&global_read_bucket);
+  if (connection_counts_as_relayed_traffic(conn, now)) {
+    token_bucket_refill(&global_relayed_read_bucket, now_msec);
+    if (token_bucket_get(&global_relayed_read_bucket) <= global_bucket)
+      global_bucket = token_bucket_get(&global_relayed_read_bucket);
+  }
 
   return connection_bucket_round_robin(base, priority,
                                        global_bucket, conn_bucket);
@@ -2254,30 +2366,91 @@ connection_bucket_write_limit(connection_t *conn, time_t now)
                CELL_NETWORK_SIZE : RELAY_PAYLOAD_SIZE;
   int priority = conn->type != CONN_TYPE_DIR;
   int conn_bucket = (int)conn->outbuf_flushlen;
-  int global_bucket = global_write_bucket;
+  int global_bucket;
+  uint64_t now_msec;
 
   if (!connection_is_rate_limited(conn)) {
     /* be willing to write to local conns even if our buckets are empty */
     return conn->outbuf_flushlen;
   }
 
-  if (connection_speaks_cells(conn)) {
+  now_msec = connection_bucket_now_msec();
+  if (connection_has_own_buckets(conn)) {
     /* use the per-conn write limit if it's lower, but if it's less
      * than zero just use zero */
     or_connection_t *or_conn = TO_OR_CONN(conn);
-    if (conn->state == OR_CONN_STATE_OPEN)
-      if (or_conn->write_bucket < conn_bucket)
-        conn_bucket = or_conn->write_bucket >= 0 ?
-                        or_conn->write_bucket : 0;
+    int write_bucket;
+    token_bucket_refill(&or_conn->write_bucket, now_msec);
+    write_bucket = token_bucket_get(&or_conn->write_bucket);
+    if (write_bucket < conn_bucket)
+      conn_bucket = write_bucket >= 0 ? write_bucket : 0;
   }
 
-  if (connection_counts_as_relayed_traffic(conn, now) &&
-      global_relayed_write_bucket <= global_write_bucket)
-    global_bucket = global_relayed_write_bucket;
+  token_bucket_refill(&global_write_bucket, now_msec);
+  global_bucket = token_bucket_get(&global_write_bucket);
+  if (connection_counts_as_relayed_traffic(conn, now)) {
+    token_bucket_refill(&global_relayed_write_bucket, now_msec);
+    if (token_bucket_get(&global_relayed_write_bucket) <= global_bucket)
+      global_bucket = token_bucket_get(&global_relayed_write_bucket);
+  }
 
   return connection_bucket_round_robin(base, priority,
                                        global_bucket, conn_bucket);
 }
+
+/** How many more bytes could <b>conn</b> write right now than it already
+ * has waiting on its outbuf, and than the cell scheduler has already
+ * promised the global buckets to in its current run?  The cell scheduler
+ * uses this to keep cells in circuit queues, where they can still be
+ * reordered, until the write buckets will let them go out.  The result may
+ * be negative. */
+ssize_t
+connection_bucket_write_room(connection_t *conn, time_t now)
+{
+  ssize_t room, flushlen = (ssize_t)conn->outbuf_flushlen;
+  uint64_t now_msec;
+
+  if (!connection_is_rate_limited(conn))
+    return SSIZE_T_MAX;
+
+  /* conn's own outbuf counts towards the committed totals too, so take
+   * whichever is larger rather than both. */
+  now_msec = connection_bucket_now_msec();
+  token_bucket_refill(&global_write_bucket, now_msec);
+  room = token_bucket_get(&global_write_bucket) -
+    MAX(flushlen, (ssize_t)global_write_committed);
+  if (connection_counts_as_relayed_traffic(conn, now)) {
+    token_bucket_refill(&global_relayed_write_bucket, now_msec);
+    room = MIN(room, token_bucket_get(&global_relayed_write_bucket) -
+               MAX(flushlen, (ssize_t)global_relayed_write_committed));
+  }
+  if (connection_has_own_buckets(conn)) {
+    or_connection_t *or_conn = TO_OR_CONN(conn);
+    token_bucket_refill(&or_conn->write_bucket, now_msec);
+    room = MIN(room, token_bucket_get(&or_conn->write_bucket) - flushlen);
+  }
+  return room;
+}
+
+/** The cell scheduler just put <b>n</b> bytes on <b>conn</b>'s outbuf:
+ * count them against the global buckets they will draw on, until
+ * connection_bucket_clear_committed(). */
+void
+connection_bucket_commit_write(connection_t *conn, time_t now, size_t n)
+{
+  if (!connection_is_rate_limited(conn))
+    return;
+  global_write_committed += n;
+  if (connection_counts_as_relayed_traffic(conn, now))
+    global_relayed_write_committed += n;
+}
+
+/** The cell scheduler has finished its run: forget what it committed. */
+void
+connection_bucket_clear_committed(void)
+{
+  global_write_committed = global_relayed_write_committed = 0;
+}
 #else
 static ssize_t
 connection_bucket_read_limit(connection_t *conn, time_t now)
@@ -2291,6 +2464,26 @@ connection_bucket_write_limit(connection_t *conn, time_t now)
   (void) now;
   return bufferevent_get_max_to_write(conn->bufev);
 }
+ssize_t
+connection_bucket_write_room(connection_t *conn, time_t now)
+{
+  (void) conn;
+  (void) now;
+  /* Libevent decides how fast the outbuf drains, and has no way to tell us
+   * in advance; the outbuf high-water mark will have to do. */
+  return SSIZE_T_MAX;
+}
+void
+connection_bucket_commit_write(connection_t *conn, time_t now, size_t n)
+{
+  (void) conn;
+  (void) now;
+  (void) n;
+}
+void
+connection_bucket_clear_committed(void)
+{
+}
 #endif
 
 /** Return 1 if the global write buckets are low enough that we
@@ -2319,8 +2512,12 @@ global_write_bucket_low(connection_t *conn, size_t attempt, int priority)
 #ifdef USE_BUFFEREVENTS
   ssize_t smaller_bucket = bufferevent_get_max_to_write(conn->bufev);
 #else
-  int smaller_bucket = global_write_bucket < global_relayed_write_bucket ?
-                       global_write_bucket : global_relayed_write_bucket;
+  int smaller_bucket;
+  uint64_t now_msec = connection_bucket_now_msec();
+  token_bucket_refill(&global_write_bucket, now_msec);
+  token_bucket_refill(&global_relayed_write_bucket, now_msec);
+  smaller_bucket = MIN(token_bucket_get(&global_write_bucket),
+                       token_bucket_get(&global_relayed_write_bucket));
 #endif
   if (authdir_mode(get_options()) && priority>1)
     return 0; /* there's always room to answer v2 if we're an auth dir */
@@ -2428,18 +2625,56 @@ connection_buckets_decrement(connection_t *conn, time_t now,
   if (!connection_is_rate_limited(conn))
     return; /* local IPs are free */
 
+  rate_limited_bytes_read += num_read;
+  rate_limited_bytes_written += num_written;
+
   if (connection_counts_as_relayed_traffic(conn, now)) {
-    global_relayed_read_bucket -= (int)num_read;
-    global_relayed_write_bucket -= (int)num_written;
+    token_bucket_dec(&global_relayed_read_bucket, (int32_t)num_read);
+    token_bucket_dec(&global_relayed_write_bucket, (int32_t)num_written);
   }
-  global_read_bucket -= (int)num_read;
-  global_write_bucket -= (int)num_written;
-  if (connection_speaks_cells(conn) && conn->state == OR_CONN_STATE_OPEN) {
-    TO_OR_CONN(conn)->read_bucket -= (int)num_read;
-    TO_OR_CONN(conn)->write_bucket -= (int)num_written;
+  token_bucket_dec(&global_read_bucket, (int32_t)num_read);
+  token_bucket_dec(&global_write_bucket, (int32_t)num_written);
+  if (connection_has_own_buckets(conn)) {
+    token_bucket_dec(&TO_OR_CONN(conn)->read_bucket, (int32_t)num_read);
+    token_bucket_dec(&TO_OR_CONN(conn)->write_bucket, (int32_t)num_written);
   }
 }
 
+/** Remember that <b>conn</b> has stopped reading (if <b>reading</b> is
+ * true) or writing because it ran out of bandwidth, so that
+ * connection_bucket_refill() wakes it up again once it has tokens. */
+void
+connection_set_blocked_on_bw(connection_t *conn, int reading)
+{
+  if (!conn->read_blocked_on_bw && !conn->write_blocked_on_bw) {
+    if (!bw_blocked_conns)
+      bw_blocked_conns = smartlist_new();
+    smartlist_add(bw_blocked_conns, conn);
+  }
+  if (reading)
+    conn->read_blocked_on_bw = 1;
+  else
+    conn->write_blocked_on_bw = 1;
+}
+
+/** <b>conn</b> is going away: stop waiting to wake it up. */
+static void
+connection_forget_blocked_on_bw(connection_t *conn)
+{
+  if (bw_blocked_conns &&
+      (conn->read_blocked_on_bw || conn->write_blocked_on_bw))
+    smartlist_remove(bw_blocked_conns, conn);
+}
+
+/** Report how many bytes we have read and written on rate-limited
+ * connections since we started. */
+void
+connection_get_rate_limit_totals(uint64_t *read_out, uint64_t *written_out)
+{
+  *read_out = rate_limited_bytes_read;
+  *written_out = rate_limited_bytes_written;
+}
+
 /** If we have exhausted our global buckets, or the buckets for conn,
  * stop reading. */
 static void
@@ -2447,20 +2682,19 @@ connection_consider_empty_read_buckets(connection_t *conn)
 {
   const char *reason;
 
-  if (global_read_bucket <= 0) {
+  if (token_bucket_get(&global_read_bucket) <= 0) {
     reason = "global read bucket exhausted. Pausing.";
   } else if (connection_counts_as_relayed_traffic(conn, approx_time()) &&
-             global_relayed_read_bucket <= 0) {
+             token_bucket_get(&global_relayed_read_bucket) <= 0) {
     reason = "global relayed read bucket exhausted. Pausing.";
-  } else if (connection_speaks_cells(conn) &&
-             conn->state == OR_CONN_STATE_OPEN &&
-             TO_OR_CONN(conn)->read_bucket <= 0) {
+  } else if (connection_has_own_buckets(conn) &&
+             token_bucket_get(&TO_OR_CONN(conn)->read_bucket) <= 0) {
     reason = "connection read bucket exhausted. Pausing.";
   } else
     return; /* all good, no need to stop it */
 
   LOG_FN_CONN(conn, (LOG_DEBUG, LD_NET, "%s", reason));
-  conn->read_blocked_on_bw = 1;
+  connection_set_blocked_on_bw(conn, 1);
   connection_stop_reading(conn);
 }
 
@@ -2471,141 +2705,161 @@ connection_consider_empty_write_buckets(connection_t *conn)
 {
   const char *reason;
 
-  if (global_write_bucket <= 0) {
+  if (token_bucket_get(&global_write_bucket) <= 0) {
     reason = "global write bucket exhausted. Pausing.";
   } else if (connection_counts_as_relayed_traffic(conn, approx_time()) &&
-             global_relayed_write_bucket <= 0) {
+             token_bucket_get(&global_relayed_write_bucket) <= 0) {
     reason = "global relayed write bucket exhausted. Pausing.";
-  } else if (connection_speaks_cells(conn) &&
-             conn->state == OR_CONN_STATE_OPEN &&
-             TO_OR_CONN(conn)->write_bucket <= 0) {
+  } else if (connection_has_own_buckets(conn) &&
+             token_bucket_get(&TO_OR_CONN(conn)->write_bucket) <= 0) {
     reason = "connection write bucket exhausted. Pausing.";
   } else
     return; /* all good, no need to stop it */
 
   LOG_FN_CONN(conn, (LOG_DEBUG, LD_NET, "%s", reason));
-  conn->write_blocked_on_bw = 1;
+  connection_set_blocked_on_bw(conn, 0);
   connection_stop_writing(conn);
 }
 
+/** Set *<b>rate_out</b> and *<b>burst_out</b> to the limits that
+ * <b>options</b> impose on relayed traffic. */
+static void
+connection_bucket_get_relay_limits(const or_options_t *options,
+                                   uint32_t *rate_out, int32_t *burst_out)
+{
+  if (options->RelayBandwidthRate) {
+    *rate_out = (uint32_t)options->RelayBandwidthRate;
+    *burst_out = (int32_t)options->RelayBandwidthBurst;
+  } else {
+    *rate_out = (uint32_t)options->BandwidthRate;
+    *burst_out = (int32_t)options->BandwidthBurst;
+  }
+}
+
 /** Initialize the global read bucket to options-\>BandwidthBurst. */
 void
 connection_bucket_init(void)
 {
   const or_options_t *options = get_options();
+  uint64_t now_msec = connection_bucket_now_msec();
+  uint32_t relayrate;
+  int32_t relayburst;
+
+  connection_bucket_get_relay_limits(options, &relayrate, &relayburst);
+
   /* start it at max traffic */
-  global_read_bucket = (int)options->BandwidthBurst;
-  global_write_bucket = (int)options->BandwidthBurst;
-  if (options->RelayBandwidthRate) {
-    global_relayed_read_bucket = (int)options->RelayBandwidthBurst;
-    global_relayed_write_bucket = (int)options->RelayBandwidthBurst;
-  } else {
-    global_relayed_read_bucket = (int)options->BandwidthBurst;
-    global_relayed_write_bucket = (int)options->BandwidthBurst;
-  }
+  token_bucket_init(&global_read_bucket, (uint32_t)options->BandwidthRate,
+                    (int32_t)options->BandwidthBurst, now_msec);
+  token_bucket_init(&global_write_bucket, (uint32_t)options->BandwidthRate,
+                    (int32_t)options->BandwidthBurst, now_msec);
+  token_bucket_init(&global_relayed_read_bucket, relayrate, relayburst,
+                    now_msec);
+  token_bucket_init(&global_relayed_write_bucket, relayrate, relayburst,
+                    now_msec);
+  if (!bw_blocked_conns)
+    bw_blocked_conns = smartlist_new();
 }
 
-/** Refill a single <b>bucket</b> called <b>name</b> with bandwidth rate per
- * second <b>rate</b> and bandwidth burst <b>burst</b>, assuming that
- * <b>milliseconds_elapsed</b> milliseconds have passed since the last
- * call. */
-static void
-connection_bucket_refill_helper(int *bucket, int rate, int burst,
-                                int milliseconds_elapsed,
-                                const char *name)
-{
-  int starting_bucket = *bucket;
-  if (starting_bucket < burst && milliseconds_elapsed > 0) {
-    int64_t incr = (((int64_t)rate) * milliseconds_elapsed) / 1000;
-    if ((burst - starting_bucket) < incr) {
-      *bucket = burst;  /* We would overflow the bucket; just set it to
-                         * the maximum. */
-    } else {
-      *bucket += (int)incr;
-      if (*bucket > burst || *bucket < starting_bucket) {
-        /* If we overflow the burst, or underflow our starting bucket,
-         * cap the bucket value to burst. */
-        /* XXXX this might be redundant now, but it doesn't show up
-         * in profiles.  Remove it after analysis. */
-        *bucket = burst;
-      }
-    }
-    log(LOG_DEBUG, LD_NET,"%s now %d.", name, *bucket);
-  }
+/** Our bandwidth limits have changed: give the global buckets the rates and
+ * bursts from <b>options</b>.  As with the per-connection buckets, a bucket
+ * that now holds more than its new burst loses the extra tokens, and one
+ * that holds less is left to grow towards its new cap. */
+void
+connection_bucket_adjust(const or_options_t *options)
+{
+  uint32_t relayrate;
+  int32_t relayburst;
+
+  connection_bucket_get_relay_limits(options, &relayrate, &relayburst);
+
+  token_bucket_adjust(&global_read_bucket, (uint32_t)options->BandwidthRate,
+                      (int32_t)options->BandwidthBurst);
+  token_bucket_adjust(&global_write_bucket, (uint32_t)options->BandwidthRate,
+                      (int32_t)options->BandwidthBurst);
+  token_bucket_adjust(&global_relayed_read_bucket, relayrate, relayburst);
+  token_bucket_adjust(&global_relayed_write_bucket, relayrate, relayburst);
 }
 
-/** Time has passed; increment buckets appropriately. */
-void
-connection_bucket_refill(int milliseconds_elapsed, time_t now)
+/** Return the global write bucket if <b>writing</b>, else the global read
+ * bucket; or the relayed-traffic one if <b>relayed</b>. */
+const token_bucket_t *
+connection_get_global_bucket(int relayed, int writing)
 {
-  const or_options_t *options = get_options();
-  smartlist_t *conns = get_connection_array();
-  int bandwidthrate, bandwidthburst, relayrate, relayburst;
+  if (relayed)
+    return writing ? &global_relayed_write_bucket :
+                     &global_relayed_read_bucket;
+  else
+    return writing ? &global_write_bucket : &global_read_bucket;
+}
 
-  bandwidthrate = (int)options->BandwidthRate;
-  bandwidthburst = (int)options->BandwidthBurst;
+/** Return true iff <b>conn</b>, which ran out of read tokens, may start
+ * reading again. */
+static int
+connection_read_buckets_refilled(connection_t *conn, time_t now,
+                                 uint64_t now_msec)
+{
+  if (token_bucket_get(&global_read_bucket) <= 0)
+    return 0; /* we're not allowed to read */
+  if (connection_counts_as_relayed_traffic(conn, now) &&
+      token_bucket_get(&global_relayed_read_bucket) <= 0)
+    return 0; /* not even if it's relayed traffic */
+  if (connection_has_own_buckets(conn)) {
+    token_bucket_refill(&TO_OR_CONN(conn)->read_bucket, now_msec);
+    if (token_bucket_get(&TO_OR_CONN(conn)->read_bucket) <= 0)
+      return 0; /* a cell conn whose own bucket is still empty */
+  }
+  return 1;
+}
 
-  if (options->RelayBandwidthRate) {
-    relayrate = (int)options->RelayBandwidthRate;
-    relayburst = (int)options->RelayBandwidthBurst;
-  } else {
-    relayrate = bandwidthrate;
-    relayburst = bandwidthburst;
+/** Return true iff <b>conn</b>, which ran out of write tokens, may start
+ * writing again. */
+static int
+connection_write_buckets_refilled(connection_t *conn, time_t now,
+                                  uint64_t now_msec)
+{
+  if (token_bucket_get(&global_write_bucket) <= 0)
+    return 0;
+  if (connection_counts_as_relayed_traffic(conn, now) &&
+      token_bucket_get(&global_relayed_write_bucket) <= 0)
+    return 0;
+  if (connection_has_own_buckets(conn)) {
+    token_bucket_refill(&TO_OR_CONN(conn)->write_bucket, now_msec);
+    if (token_bucket_get(&TO_OR_CONN(conn)->write_bucket) <= 0)
+      return 0;
   }
+  return 1;
+}
 
-  tor_assert(milliseconds_elapsed >= 0);
+/** Time has passed: bring the global buckets up to date, and wake up any
+ * connection that was waiting for tokens and now has some.  Connections
+ * that aren't blocked refill their own buckets when they next use them, so
+ * this only touches the blocked ones. */
+void
+connection_bucket_refill(time_t now)
+{
+  uint64_t now_msec = connection_bucket_now_msec();
 
   write_buckets_empty_last_second =
-    global_relayed_write_bucket <= 0 || global_write_bucket <= 0;
+    token_bucket_get(&global_relayed_write_bucket) <= 0 ||
+    token_bucket_get(&global_write_bucket) <= 0;
 
   /* refill the global buckets */
-  connection_bucket_refill_helper(&global_read_bucket,
-                                  bandwidthrate, bandwidthburst,
-                                  milliseconds_elapsed,
-                                  "global_read_bucket");
-  connection_bucket_refill_helper(&global_write_bucket,
-                                  bandwidthrate, bandwidthburst,
-                                  milliseconds_elapsed,
-                                  "global_write_bucket");
-  connection_bucket_refill_helper(&global_relayed_read_bucket,
-                                  relayrate, relayburst,
-                                  milliseconds_elapsed,
-                                  "global_relayed_read_bucket");
-  connection_bucket_refill_helper(&global_relayed_write_bucket,
-                                  relayrate, relayburst,
-                                  milliseconds_elapsed,
-                                  "global_relayed_write_bucket");
-
-  /* refill the per-connection buckets */
-  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
-    if (connection_speaks_cells(conn)) {
-      or_connection_t *or_conn = TO_OR_CONN(conn);
-      int orbandwidthrate = or_conn->bandwidthrate;
-      int orbandwidthburst = or_conn->bandwidthburst;
-      if (connection_bucket_should_increase(or_conn->read_bucket, or_conn)) {
-        connection_bucket_refill_helper(&or_conn->read_bucket,
-                                        orbandwidthrate,
-                                        orbandwidthburst,
-                                        milliseconds_elapsed,
-                                        "or_conn->read_bucket");
-      }
-      if (connection_bucket_should_increase(or_conn->write_bucket, or_conn)) {
-        connection_bucket_refill_helper(&or_conn->write_bucket,
-                                        orbandwidthrate,
-                                        orbandwidthburst,
-                                        milliseconds_elapsed,
-                                        "or_conn->write_bucket");
-      }
-    }
+  token_bucket_refill(&global_read_bucket, now_msec);
+  token_bucket_refill(&global_write_bucket, now_msec);
+  token_bucket_refill(&global_relayed_read_bucket, now_msec);
+  token_bucket_refill(&global_relayed_write_bucket, now_msec);
+
+  scheduler_bandwidth_refilled();
+
+  if (!bw_blocked_conns)
+    return;
+
+  SMARTLIST_FOREACH_BEGIN(bw_blocked_conns, connection_t *, conn) {
+    if (conn->conn_array_index < 0)
+      continue; /* unlinked already; it will be freed soon. */
 
     if (conn->read_blocked_on_bw == 1 /* marked to turn reading back on now */
-        && global_read_bucket > 0 /* and we're allowed to read */
-        && (!connection_counts_as_relayed_traffic(conn, now) ||
-            global_relayed_read_bucket > 0) /* even if we're relayed traffic */
-        && (!connection_speaks_cells(conn) ||
-            conn->state != OR_CONN_STATE_OPEN ||
-            TO_OR_CONN(conn)->read_bucket > 0)) {
-        /* and either a non-cell conn or a cell conn with non-empty bucket */
+        && connection_read_buckets_refilled(conn, now, now_msec)) {
       LOG_FN_CONN(conn, (LOG_DEBUG,LD_NET,
                          "waking up conn (fd %d) for read", (int)conn->s));
       conn->read_blocked_on_bw = 0;
@@ -2613,34 +2867,16 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
     }
 
     if (conn->write_blocked_on_bw == 1
-        && global_write_bucket > 0 /* and we're allowed to write */
-        && (!connection_counts_as_relayed_traffic(conn, now) ||
-            global_relayed_write_bucket > 0) /* even if it's relayed traffic */
-        && (!connection_speaks_cells(conn) ||
-            conn->state != OR_CONN_STATE_OPEN ||
-            TO_OR_CONN(conn)->write_bucket > 0)) {
+        && connection_write_buckets_refilled(conn, now, now_msec)) {
       LOG_FN_CONN(conn, (LOG_DEBUG,LD_NET,
                          "waking up conn (fd %d) for write", (int)conn->s));
       conn->write_blocked_on_bw = 0;
       connection_start_writing(conn);
     }
-  } SMARTLIST_FOREACH_END(conn);
-}
 
-/** Is the <b>bucket</b> for connection <b>conn</b> low enough that we
- * should add another pile of tokens to it?
- */
-static int
-connection_bucket_should_increase(int bucket, or_connection_t *conn)
-{
-  tor_assert(conn);
-
-  if (conn->_base.state != OR_CONN_STATE_OPEN)
-    return 0; /* only open connections play the rate limiting game */
-  if (bucket >= conn->bandwidthburst)
-    return 0;
-
-  return 1;
+    if (!conn->read_blocked_on_bw && !conn->write_blocked_on_bw)
+      SMARTLIST_DEL_CURRENT(bw_blocked_conns, conn);
+  } SMARTLIST_FOREACH_END(conn);
 }
 #else
 static void
@@ -2655,12 +2891,26 @@ connection_buckets_decrement(connection_t *conn, time_t now,
 }
 
 void
-connection_bucket_refill(int seconds_elapsed, time_t now)
+connection_bucket_refill(time_t now)
 {
-  (void) seconds_elapsed;
   (void) now;
   /* Libevent does this for us. */
 }
+
+void
+connection_set_blocked_on_bw(connection_t *conn, int reading)
+{
+  if (reading)
+    conn->read_blocked_on_bw = 1;
+  else
+    conn->write_blocked_on_bw = 1;
+}
+
+static void
+connection_forget_blocked_on_bw(connection_t *conn)
+{
+  (void) conn;
+}
 void
 connection_bucket_init(void)
 {
@@ -2694,6 +2944,14 @@ connection_bucket_init(void)
   ev_token_bucket_cfg_free(bucket_cfg);
 }
 
+void
+connection_bucket_adjust(const or_options_t *options)
+{
+  /* connection_bucket_init() replaces the group's configuration in place. */
+  (void) options;
+  connection_bucket_init();
+}
+
 void
 connection_get_rate_limit_totals(uint64_t *read_out, uint64_t *written_out)
 {
@@ -2730,6 +2988,117 @@ connection_consider_empty_read_buckets(connection_t *conn)
 #endif
 
 
+#ifdef LIBRARY
+/** A new flush delay for a context, handed from the application's thread
+ * to the main loop. */
+typedef struct onionroute_flush_delay_command_t {
+  onionroute_ctx_t *ctx;
+  unsigned int msec;
+} onionroute_flush_delay_command_t;
+
+/** Main loop side of onionroute_ctx_set_flush_delay(). */
+static void
+flush_delay_command_processor(void *data)
+{
+  onionroute_flush_delay_command_t *cmd = data;
+  cmd->ctx->flush_delay_msec = cmd->msec;
+  tor_free(cmd);
+}
+
+/** Make <b>ctx</b> hold partial cells for <b>msec</b> milliseconds.  The
+ * main loop reads the delay whenever a stream gets data, so once it is
+ * running we hand the new value over through the command queue rather than
+ * writing it from the caller's thread.  Before then, nothing else can be
+ * looking at it.  Return 0 on success or ONIONROUTE_ERR_QUEUE_FULL. */
+int
+onionroute_ctx_set_flush_delay(onionroute_ctx_t *ctx, unsigned int msec)
+{
+  onionroute_flush_delay_command_t *cmd;
+
+  if (!onionroute_command_queue_is_ready()) {
+    ctx->flush_delay_msec = msec;
+    return 0;
+  }
+  cmd = tor_malloc(sizeof(onionroute_flush_delay_command_t));
+  cmd->ctx = ctx;
+  cmd->msec = msec;
+  if (onionroute_command_enqueue(flush_delay_command_processor, cmd) < 0) {
+    tor_free(cmd);
+    return ONIONROUTE_ERR_QUEUE_FULL;
+  }
+  return 0;
+}
+
+ONIONROUTE_API
+int
+onionroute_set_stream_flush_delay_v1(unsigned int msec)
+{
+  return onionroute_ctx_set_flush_delay(&onionroute_default_ctx, msec);
+}
+
+/** Libevent callback: the partial cell on <b>arg</b> has waited long
+ * enough; send it. */
+static void
+onionroute_flush_timer_cb(evutil_socket_t fd, short event, void *arg)
+{
+  connection_t *conn = arg;
+  (void)fd;
+  (void)event;
+
+  if (!conn->marked_for_close)
+    connection_process_inbuf(conn, 1);
+}
+
+/** The application gave us more data for <b>conn</b>. Package every full
+ * cell now; a trailing partial cell waits for more data until the flush
+ * timer fires, unless <b>flush</b> is set or coalescing is disabled.
+ * Return -1 if the connection got marked for close, else 0. */
+static int
+onionroute_stream_package(connection_t *conn, int flush)
+{
+  edge_connection_t *edge_conn;
+  unsigned int delay_msec;
+  struct timeval tv;
+
+  if (conn->marked_for_close)
+    return 0;
+  if (!CONN_IS_EDGE(conn))
+    return connection_process_inbuf(conn, 1);
+
+  edge_conn = TO_EDGE_CONN(conn);
+  delay_msec = edge_conn->onionroute_ctx->flush_delay_msec;
+
+  if (flush || !delay_msec) {
+    if (edge_conn->flush_timer)
+      event_del(edge_conn->flush_timer);
+    return connection_process_inbuf(conn, 1);
+  }
+
+  /* instruct it not to try to package partial cells. */
+  if (connection_process_inbuf(conn, 0) < 0)
+    return -1;
+  if (conn->marked_for_close ||
+      !connection_edge_bytes_to_package(edge_conn))
+    return 0;
+
+  /* The deadline runs from the first byte of the partial cell, so a steady
+   * trickle of small writes can't hold it back forever. */
+  if (!edge_conn->flush_timer)
+    edge_conn->flush_timer = tor_evtimer_new(tor_libevent_get_base(),
+                                             onionroute_flush_timer_cb,
+                                             conn);
+  if (!evtimer_pending(edge_conn->flush_timer, NULL)) {
+    tv.tv_sec = delay_msec / 1000;
+    tv.tv_usec = (delay_msec % 1000) * 1000;
+    if (evtimer_add(edge_conn->flush_timer, &tv) < 0) {
+      log_warn(LD_BUG, "Couldn't add stream flush timer; flushing now.");
+      return connection_process_inbuf(conn, 1);
+    }
+  }
+  return 0;
+}
+#endif
+
 /** Read bytes from conn-\>s and process them.
  *
  * It calls connection_read_to_buf() to bring in any new bytes,
@@ -2786,6 +3155,11 @@ onionroute_stream_write_i(void *id, char* data, int size)
 
   n_read += buf_datalen(conn->inbuf) - before;
 
+#ifdef LIBRARY
+  /* full cells go now, a partial one waits a little for company */
+  if (onionroute_stream_package(conn, 0) < 0)
+    return -1;
+#else
   if (CONN_IS_EDGE(conn))
   {
     /* instruct it not to try to package partial cells. */
@@ -2796,14 +3170,12 @@ onionroute_stream_write_i(void *id, char* data, int size)
   }
 
   /* one last try, packaging partial cells and all. */
-  /* this works but is slow if clients just makw several partial wrote requests as transfers partial cells
-     maybe we can define a flush operation */
-
   if (!conn->marked_for_close &&
       connection_process_inbuf(conn, 1) < 0)
   {
     return -1;
   }
+#endif
 
 
   if (conn->linked_conn)
@@ -2846,15 +3218,199 @@ onionroute_stream_write_i(void *id, char* data, int size)
   return 0;
 }
 
-/* XXX we do nothing now but to let API users make proper use of it beforehand 
-   in the future we could coalesce all writes here so we don't write partial cells like 
-   we do now (slow)
-*/
+#ifdef LIBRARY
+/** Main loop side of onionroute_stream_flush_v1(). */
+static void
+flush_command_processor(void *data)
+{
+	edge_connection_t *conn = onionroute_handle_get_conn(data);
+
+	if (conn)
+		onionroute_stream_package(TO_CONN(conn), 1);
+}
+
+/* send whatever partial cell is waiting on the stream right away instead of
+   waiting for the flush delay */
 ONIONROUTE_API
 int onionroute_stream_flush_v1(void *id)
 {
-	return 0;
+	if(NULL == id) return -1;
+	if(!onionroute_handle_is_live(id)) return ONIONROUTE_ERR_STALE_STREAM;
+
+	return onionroute_command_enqueue(flush_command_processor, id);
 }
+#endif
+
+#ifdef LIBRARY
+/** A write handed to us by onionroute_stream_writev_v2(), or a v1 write that
+ * had to wait behind one. The bytes stay in the caller's memory until
+ * connection_edge_package_raw_inbuf() copies them into a cell payload. */
+typedef struct onionroute_pending_write_t
+{
+  struct onionroute_pending_write_t *next;
+  void *id;
+  onionroute_write_done_t_v2 done_cb;
+  void *ctx;
+  /** If set, a copy of the data that we own and free once it is sent. */
+  char *owned;
+  /** Bytes not yet packaged. */
+  size_t remaining;
+  /** Index of the first iovec with bytes left, and our offset into it. */
+  int cur_iov;
+  size_t cur_off;
+  int n_iov;
+  onionroute_iovec_t iov[1];
+} onionroute_pending_write_t;
+
+/** Allocate a pending write for the <b>n</b> buffers in <b>iov</b>, copying
+ * the iovec array (but not the data) into the same allocation. */
+static onionroute_pending_write_t *
+onionroute_pending_write_new(void *id, const onionroute_iovec_t *iov, int n,
+                             onionroute_write_done_t_v2 done_cb, void *ctx)
+{
+  onionroute_pending_write_t *pw;
+  int i;
+
+  pw = tor_malloc_zero(STRUCT_OFFSET(onionroute_pending_write_t, iov) +
+                       n * sizeof(onionroute_iovec_t));
+  pw->id = id;
+  pw->done_cb = done_cb;
+  pw->ctx = ctx;
+  pw->n_iov = n;
+  memcpy(pw->iov, iov, n * sizeof(onionroute_iovec_t));
+  for (i = 0; i < n; ++i)
+    pw->remaining += iov[i].len;
+
+  return pw;
+}
+
+/** Tell the owner of <b>pw</b> we are done with its buffers, and free it. */
+static void
+onionroute_pending_write_done(onionroute_pending_write_t *pw, int status)
+{
+  if (pw->done_cb)
+    pw->done_cb(pw->id, pw->ctx, status);
+  tor_free(pw->owned);
+  tor_free(pw);
+}
+
+/** Queue <b>pw</b> on <b>conn</b> behind any earlier pending writes. */
+static void
+onionroute_pending_writes_append(edge_connection_t *conn,
+                                 onionroute_pending_write_t *pw)
+{
+  pw->next = NULL;
+  if (conn->pending_writes_tail)
+    conn->pending_writes_tail->next = pw;
+  else
+    conn->pending_writes = pw;
+  conn->pending_writes_tail = pw;
+  conn->pending_writes_len += pw->remaining;
+}
+
+/** Move the next <b>len</b> bytes of <b>conn</b>'s pending writes into
+ * <b>out</b>, completing every write that is fully consumed. The caller
+ * must not ask for more than conn-\>pending_writes_len bytes. */
+void
+onionroute_pending_writes_fetch(edge_connection_t *conn, char *out,
+                                size_t len)
+{
+  tor_assert(len <= conn->pending_writes_len);
+
+  while (len) {
+    onionroute_pending_write_t *pw = conn->pending_writes;
+    const onionroute_iovec_t *v;
+    size_t n;
+
+    tor_assert(pw);
+    v = &pw->iov[pw->cur_iov];
+    n = v->len - pw->cur_off;
+    if (n > len)
+      n = len;
+
+    memcpy(out, v->base + pw->cur_off, n);
+    out += n;
+    len -= n;
+    pw->cur_off += n;
+    pw->remaining -= n;
+    conn->pending_writes_len -= n;
+
+    if (pw->cur_off == v->len) {
+      ++pw->cur_iov;
+      pw->cur_off = 0;
+    }
+
+    if (!pw->remaining) {
+      conn->pending_writes = pw->next;
+      if (!conn->pending_writes)
+        conn->pending_writes_tail = NULL;
+      onionroute_pending_write_done(pw, 0);
+    }
+  }
+}
+
+/** <b>conn</b> is going away: hand every pending buffer back to its owner
+ * with an error status. */
+void
+onionroute_pending_writes_abort(edge_connection_t *conn)
+{
+  onionroute_pending_write_t *pw, *next;
+
+  for (pw = conn->pending_writes; pw; pw = next) {
+    next = pw->next;
+    onionroute_pending_write_done(pw, -1);
+  }
+  conn->pending_writes = conn->pending_writes_tail = NULL;
+  conn->pending_writes_len = 0;
+}
+
+/** Main loop side of onionroute_stream_writev_v2(). */
+static void
+writev_command_processor(void *data)
+{
+  onionroute_pending_write_t *pw = data;
+  edge_connection_t *edge_conn = onionroute_handle_get_conn(pw->id);
+  connection_t *conn;
+
+  if (!edge_conn) {
+    onionroute_pending_write_done(pw, ONIONROUTE_ERR_STALE_STREAM);
+    return;
+  }
+  conn = TO_CONN(edge_conn);
+
+  if (!pw->remaining) {
+    onionroute_pending_write_done(pw, 0);
+    return;
+  }
+
+  conn->timestamp_lastread = approx_time();
+  onionroute_pending_writes_append(edge_conn, pw);
+
+  onionroute_stream_package(conn, 0);
+}
+
+ONIONROUTE_API
+int
+onionroute_stream_writev_v2(void *id, const onionroute_iovec_t *iov, int n,
+                            onionroute_write_done_t_v2 done_cb, void *ctx)
+{
+  onionroute_pending_write_t *pw;
+  int r;
+
+  if (!id || n < 0 || (n && !iov))
+    return -1;
+  if (!onionroute_handle_is_live(id))
+    return ONIONROUTE_ERR_STALE_STREAM;
+
+  pw = onionroute_pending_write_new(id, iov, n, done_cb, ctx);
+
+  r = onionroute_command_enqueue(writev_command_processor, pw);
+  if (r < 0)
+    tor_free(pw);
+
+  return r;
+}
+#endif
 
 typedef struct onionroute_write_command_t
 {
@@ -2880,6 +3436,40 @@ write_command_processor(void *data)
 	idata = cmd->data;
 	size = cmd->size;
 
+#ifdef LIBRARY
+	{
+		edge_connection_t *edge_conn = onionroute_handle_get_conn(id);
+		connection_t *conn;
+
+		if (!edge_conn)
+		{
+			/* stream is gone */
+			tor_free(idata);
+			tor_free(data);
+			return;
+		}
+		conn = TO_CONN(edge_conn);
+
+		/* don't let this write overtake buffers still waiting from a
+		   writev, the inbuf is always packaged first */
+		if (edge_conn->pending_writes)
+		{
+			onionroute_iovec_t v;
+			onionroute_pending_write_t *pw;
+
+			v.base = idata;
+			v.len = size;
+			pw = onionroute_pending_write_new(id, &v, 1, NULL, NULL);
+			pw->owned = idata;
+			onionroute_pending_writes_append(edge_conn, pw);
+			onionroute_stream_package(conn, 0);
+			tor_free(data);
+			return;
+		}
+		id = conn;
+	}
+#endif
+
 	onionroute_stream_write_i(id, idata, size);
 
 	tor_free(idata);
@@ -2892,10 +3482,15 @@ int
 onionroute_stream_write_v1(void *id, char* data, int size)
 {
 	onionroute_write_command_t *wcmd;
-	onionroute_command_t *cmd;
+	int r;
+	char *ndata;
 
-	char *ndata = tor_malloc(size);
-	ndata = _tor_memdup(data, size);
+#ifdef LIBRARY
+	if(NULL == id) return -1;
+	if(!onionroute_handle_is_live(id)) return ONIONROUTE_ERR_STALE_STREAM;
+#endif
+
+	ndata = tor_memdup(data, size);
 
 	if(NULL == ndata) return -1;
 
@@ -2908,33 +3503,27 @@ onionroute_stream_write_v1(void *id, char* data, int size)
 		return -1;
 	}
 
-	cmd = tor_malloc(sizeof(onionroute_command_t));
-	if(NULL == cmd) 
-	{
-		/* I love catch / finally blocks to cleanup */
-		tor_free(ndata);
-		tor_free(wcmd);
-		return -1;
-	}
-
 	wcmd->data = ndata;
 	wcmd->id = id;
 	wcmd->size = size;
-	
-	cmd->data = wcmd;
-	cmd->processor = write_command_processor;
 
 	/* store command in queue */
-	smartlist_add(cqueue, cmd);
+	r = onionroute_command_enqueue(write_command_processor, wcmd);
+	if(r < 0)
+	{
+		/* I love catch / finally blocks to cleanup */
+		tor_free(ndata);
+		tor_free(wcmd);
+	}
 
-	return 0;
+	return r;
 }
 
 ONIONROUTE_API 
 int onionroute_stream_printf_v1(void *id, const char *format, ...)
 {
   char *str = NULL;
-  int size;
+  int size, r;
   va_list ap;
 
   va_start(ap,format);
@@ -2943,11 +3532,13 @@ int onionroute_stream_printf_v1(void *id, const char *format, ...)
 
   tor_assert(str != NULL);
 
-  onionroute_stream_write_v1(id, str, size);
+  /* Pass on the write's result, so that callers see backpressure
+   * (ONIONROUTE_ERR_QUEUE_FULL) and stale handles too. */
+  r = onionroute_stream_write_v1(id, str, size);
 
   tor_free(str);
 
-  return 0;
+  return r;
 }
 
 
@@ -3601,7 +4192,7 @@ connection_handle_write_impl(connection_t *conn, int force)
         log_debug(LD_NET,"wanted read.");
         if (!connection_is_reading(conn)) {
           connection_stop_writing(conn);
-          conn->write_blocked_on_bw = 1;
+          connection_set_blocked_on_bw(conn, 0);
           /* we'll start reading again when we get more tokens in our
            * read bucket; then we'll start writing again too.
            */
@@ -4645,6 +5236,9 @@ connection_free_all(void)
 #ifdef USE_BUFFEREVENTS
   if (global_rate_limit)
     bufferevent_rate_limit_group_free(global_rate_limit);
+#else
+  smartlist_free(bw_blocked_conns);
+  bw_blocked_conns = NULL;
 #endif
 }
 
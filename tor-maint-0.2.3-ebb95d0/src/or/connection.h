@@ -71,9 +71,22 @@ void connection_mark_all_noncontrol_listeners(void);
 void connection_mark_all_noncontrol_connections(void);
 
 ssize_t connection_bucket_write_limit(connection_t *conn, time_t now);
+ssize_t connection_bucket_write_room(connection_t *conn, time_t now);
+void connection_bucket_commit_write(connection_t *conn, time_t now, size_t n);
+void connection_bucket_clear_committed(void);
 int global_write_bucket_low(connection_t *conn, size_t attempt, int priority);
 void connection_bucket_init(void);
-void connection_bucket_refill(int seconds_elapsed, time_t now);
+void connection_bucket_adjust(const or_options_t *options);
+void connection_bucket_refill(time_t now);
+void connection_set_blocked_on_bw(connection_t *conn, int reading);
+void connection_get_rate_limit_totals(uint64_t *read_out,
+                                      uint64_t *written_out);
+#ifndef USE_BUFFEREVENTS
+uint64_t connection_bucket_now_msec(void);
+#ifdef CONNECTION_PRIVATE
+const token_bucket_t *connection_get_global_bucket(int relayed, int writing);
+#endif
+#endif
 
 int connection_handle_read(connection_t *conn);
 
@@ -160,6 +173,12 @@ int connection_or_nonopen_was_started_here(or_connection_t *conn);
 void connection_dump_buffer_mem_stats(int severity);
 void remove_file_if_very_old(const char *fname, time_t now);
 
+#ifdef LIBRARY
+void onionroute_pending_writes_fetch(edge_connection_t *conn, char *out,
+                                     size_t len);
+void onionroute_pending_writes_abort(edge_connection_t *conn);
+#endif
+
 #ifdef USE_BUFFEREVENTS
 int connection_type_uses_bufferevent(connection_t *conn);
 void connection_configure_bufferevent_callbacks(connection_t *conn);
@@ -167,8 +186,6 @@ void connection_handle_read_cb(struct bufferevent *bufev, void *arg);
 void connection_handle_write_cb(struct bufferevent *bufev, void *arg);
 void connection_handle_event_cb(struct bufferevent *bufev, short event,
                                  void *arg);
-void connection_get_rate_limit_totals(uint64_t *read_out,
-                                      uint64_t *written_out);
 void connection_enable_rate_limiting(connection_t *conn);
 #else
 #define connection_type_uses_bufferevent(c) (0)
@@ -306,7 +306,7 @@ int
 
 	circ = circuit_get_by_edge_conn(conn);
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
 	if(circ)
 	tor_mutex_acquire(circ->lock);
 #endif
@@ -337,7 +337,7 @@ int
 
 	}
 
-	#ifdef LIBRARY
+	#ifdef LIBRARY_CORE_LOCKS
 	if(circ)
 	{
 	  tor_mutex_release(circ->lock);
@@ -1150,24 +1150,12 @@ void
 	onionroute_clear_dns_cache_signal_i();
 }
 
+ONIONROUTE_API
 int
-	onionroute_clear_dns_cache_signal()
+	onionroute_clear_dns_cache_signal_v1()
 {
-	onionroute_command_t *cmd;
-
-	cmd = tor_malloc(sizeof(onionroute_command_t));
-	if(NULL == cmd)
-	{
-		return -1;
-	}
-
-	cmd->data = NULL;
-	cmd->processor = clear_dns_command_processor;
-
 	/* store command in queue */
-	smartlist_add(cqueue, cmd);
-
-	return 0;
+	return onionroute_command_enqueue(clear_dns_command_processor, NULL);
 }
 
 #endif
@@ -2548,7 +2536,7 @@ static int
 
 #ifdef LIBRARY
 
-int onionroute_connection_ap_process(entry_connection_t *entry_conn, char* address, int port, void* obj)
+int onionroute_connection_ap_process(entry_connection_t *entry_conn, char* address, int port, void* obj, void *id, onionroute_ctx_t *ctx)
 {
 	edge_connection_t *conn;
 	socks_request_t *socks;
@@ -2562,6 +2550,10 @@ int onionroute_connection_ap_process(entry_connection_t *entry_conn, char* addre
 
 	conn->is_onionroute_request = 1;
 	conn->obj = obj;
+	conn->onionroute_id = id;
+	onionroute_handle_bind(id, conn);
+	conn->onionroute_ctx = ctx;
+	++ctx->refcount;
 
 	//tor_addr_copy(&TO_CONN(conn)->addr, &tor_addr);
 
@@ -2830,7 +2822,11 @@ RELAY_COMMAND_BEGIN_DIR : RELAY_COMMAND_BEGIN;
 	control_event_stream_status(ap_conn, STREAM_EVENT_SENT_CONNECT, 0);
 
 	/* If there's queued-up data, send it now */
+#ifdef LIBRARY
+	if ((connection_edge_bytes_to_package(edge_conn) ||
+#else
 	if ((connection_get_inbuf_len(base_conn) ||
+#endif
 		ap_conn->sending_optimistic_data) &&
 		connection_ap_supports_optimistic_data(ap_conn)) {
 			log_info(LD_APP, "Sending up to %ld + %ld bytes of queued-up data",
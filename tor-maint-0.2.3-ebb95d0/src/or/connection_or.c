@@ -29,6 +29,7 @@
 #include "rephist.h"
 #include "router.h"
 #include "routerlist.h"
+#include "scheduler.h"
 
 #ifdef USE_BUFFEREVENTS
 #include <event2/bufferevent_ssl.h>
@@ -287,9 +288,6 @@ connection_or_report_broken_states(int severity, int domain)
 /** Pack the cell_t host-order structure <b>src</b> into network-order
  * in the buffer <b>dest</b>. See tor-spec.txt for details about the
  * wire format.
- *
- * Note that this function doesn't touch <b>dst</b>-\>next: the caller
- * should set it or clear it as appropriate.
  */
 void
 cell_pack(packed_cell_t *dst, const cell_t *src)
@@ -425,23 +423,86 @@ connection_or_process_inbuf(or_connection_t *conn)
  * drops below this size. */
 #define OR_CONN_LOWWATER (16*1024)
 
-/** Called whenever we have flushed some data on an or_conn: add more data
- * from active circuits. */
+/** Return true iff <b>conn</b>'s outbuf has drained far enough that we
+ * should start adding cells to it again. */
 int
-connection_or_flushed_some(or_connection_t *conn)
+connection_or_outbuf_is_low(or_connection_t *conn)
+{
+  return connection_get_outbuf_len(TO_CONN(conn)) < OR_CONN_LOWWATER;
+}
+
+/** Let the kernel hold this many bytes more than its congestion window
+ * can take right now, so that it has something to send when acks open the
+ * window before we next look. */
+#define OR_CONN_KERNEL_SLACK (4*CELL_NETWORK_SIZE)
+
+/** Where we can, we have the kernel report an open OR connection's socket
+ * writable only once fewer than this many bytes on it are unsent, so that
+ * a connection the scheduler is holding back for its kernel send queue can
+ * just wait for a write event.  It's a cell less than OR_CONN_KERNEL_SLACK,
+ * so by the time the event fires connection_or_kernel_room() always has
+ * room for a cell, and we never wake up only to go back to waiting. */
+#define OR_CONN_KERNEL_LOWAT (OR_CONN_KERNEL_SLACK - CELL_NETWORK_SIZE)
+
+/** Given what the kernel says about an OR connection's socket in
+ * <b>sendq</b>, and <b>outbuf_len</b> bytes still waiting on our outbuf,
+ * return how many more bytes of cells we should queue for that socket.
+ *
+ * Once a cell is on the outbuf or in the kernel, no circuit scheduler can
+ * move it.  So we only want as much waiting there as the kernel can send
+ * soon: the open part of its congestion window plus a little slack, and
+ * never more than OR_CONN_HIGHWATER in all. */
+size_t
+connection_or_kernel_room(const tor_sendq_t *sendq, size_t outbuf_len)
+{
+  size_t target = sendq->window_space + OR_CONN_KERNEL_SLACK;
+  size_t queued = sendq->unsent + outbuf_len;
+  if (target > OR_CONN_HIGHWATER)
+    target = OR_CONN_HIGHWATER;
+  return target > queued ? target - queued : 0;
+}
+
+/** Return how many more bytes of cells we are willing to put on
+ * <b>conn</b>'s outbuf, going by the outbuf alone. */
+size_t
+connection_or_outbuf_room(or_connection_t *conn)
 {
   size_t datalen = connection_get_outbuf_len(TO_CONN(conn));
-  /* If we're under the low water mark, add cells until we're just over the
-   * high water mark. */
-  if (datalen < OR_CONN_LOWWATER) {
-    ssize_t n = CEIL_DIV(OR_CONN_HIGHWATER - datalen, CELL_NETWORK_SIZE);
-    time_t now = approx_time();
-    while (conn->active_circuits && n > 0) {
-      int flushed;
-      flushed = connection_or_flush_from_first_active_circuit(conn, 1, now);
-      n -= flushed;
-    }
+  return datalen < OR_CONN_HIGHWATER ? OR_CONN_HIGHWATER - datalen : 0;
+}
+
+/** Ask the kernel about <b>conn</b>'s socket, and return how many more bytes
+ * of cells connection_or_kernel_room() says it should get; or SIZE_MAX if
+ * we can't tell.  This costs a couple of syscalls, so callers should count
+ * down the answer as they add cells rather than ask again for each one. */
+size_t
+connection_or_query_kernel_room(or_connection_t *conn)
+{
+  tor_sendq_t sendq;
+
+  if (!conn->use_kernel_sendq)
+    return SIZE_MAX;
+  if (tor_socket_get_sendq(conn->_base.s, &sendq) < 0) {
+    /* Don't keep asking about a socket the kernel can't tell us about. */
+    conn->use_kernel_sendq = 0;
+    return SIZE_MAX;
   }
+  return connection_or_kernel_room(&sendq,
+                                   connection_get_outbuf_len(TO_CONN(conn)));
+}
+
+/** Called whenever we have flushed some data on an or_conn: if we're under
+ * the low water mark, ask the scheduler for cells until we're just over the
+ * high water mark. */
+int
+connection_or_flushed_some(or_connection_t *conn)
+{
+  size_t datalen = connection_get_outbuf_len(TO_CONN(conn));
+  /* Housekeeping uses this to tell a stuck connection from a busy one. */
+  if (!datalen)
+    conn->timestamp_lastempty = approx_time();
+  if (datalen < OR_CONN_LOWWATER)
+    scheduler_conn_wants_cells(conn);
   return 0;
 }
 
@@ -470,6 +531,10 @@ connection_or_finished_flushing(or_connection_t *conn)
       tor_fragile_assert();
       return -1;
   }
+  /* If the scheduler was waiting on the kernel, this may be the write event
+   * telling it the kernel is running short; see OR_CONN_KERNEL_LOWAT. */
+  if (conn->sched_kernel_blocked)
+    scheduler_conn_kernel_writable(conn);
   return 0;
 }
 
@@ -621,16 +686,15 @@ connection_or_update_token_buckets_helper(or_connection_t *conn, int reset,
     (void) reset; /* No way to do this with libevent yet. */
   }
 #else
-  if (reset) { /* set up the token buckets to be full */
-    conn->read_bucket = conn->write_bucket = burst;
-    return;
-  }
   /* If the new token bucket is smaller, take out the extra tokens.
    * (If it's larger, don't -- the buckets can grow to reach the cap.) */
-  if (conn->read_bucket > burst)
-    conn->read_bucket = burst;
-  if (conn->write_bucket > burst)
-    conn->write_bucket = burst;
+  token_bucket_adjust(&conn->read_bucket, (uint32_t)rate, burst);
+  token_bucket_adjust(&conn->write_bucket, (uint32_t)rate, burst);
+  if (reset) { /* set up the token buckets to be full */
+    uint64_t now_msec = connection_bucket_now_msec();
+    token_bucket_reset(&conn->read_bucket, now_msec);
+    token_bucket_reset(&conn->write_bucket, now_msec);
+  }
 #endif
 }
 
@@ -856,6 +920,15 @@ connection_or_get_for_extend(const char *digest,
   }
 }
 
+/** Mark <b>or_conn</b> as unsuitable for new circuits, and make sure its
+ * housekeeping timer notices if that means it can now be closed. */
+void
+connection_or_mark_bad_for_new_circs(or_connection_t *or_conn)
+{
+  or_conn->is_bad_for_new_circs = 1;
+  connection_update_housekeeping(TO_CONN(or_conn));
+}
+
 /** How old do we let a connection to an OR get before deciding it's
  * too old for new circuits? */
 #define TIME_BEFORE_OR_CONN_IS_TOO_OLD (60*60*24*7)
@@ -898,7 +971,7 @@ connection_or_group_set_badness(or_connection_t *head, int force)
                "(fd %d, %d secs old).",
                or_conn->_base.address, or_conn->_base.port, or_conn->_base.s,
                (int)(now - or_conn->_base.timestamp_created));
-      or_conn->is_bad_for_new_circs = 1;
+      connection_or_mark_bad_for_new_circs(or_conn);
     }
 
     if (or_conn->is_bad_for_new_circs) {
@@ -930,7 +1003,7 @@ connection_or_group_set_badness(or_connection_t *head, int force)
                "another connection to that OR that is.",
                or_conn->_base.address, or_conn->_base.port, or_conn->_base.s,
                (int)(now - or_conn->_base.timestamp_created));
-      or_conn->is_bad_for_new_circs = 1;
+      connection_or_mark_bad_for_new_circs(or_conn);
       continue;
     }
 
@@ -971,7 +1044,7 @@ connection_or_group_set_badness(or_connection_t *head, int force)
                  or_conn->_base.address, or_conn->_base.port, or_conn->_base.s,
                  (int)(now - or_conn->_base.timestamp_created),
                  best->_base.s, (int)(now - best->_base.timestamp_created));
-        or_conn->is_bad_for_new_circs = 1;
+        connection_or_mark_bad_for_new_circs(or_conn);
       } else if (!tor_addr_compare(&or_conn->real_addr,
                                    &best->real_addr, CMP_EXACT)) {
         log_info(LD_OR,
@@ -981,7 +1054,7 @@ connection_or_group_set_badness(or_connection_t *head, int force)
                  or_conn->_base.address, or_conn->_base.port, or_conn->_base.s,
                  (int)(now - or_conn->_base.timestamp_created),
                  best->_base.s, (int)(now - best->_base.timestamp_created));
-        or_conn->is_bad_for_new_circs = 1;
+        connection_or_mark_bad_for_new_circs(or_conn);
       }
     }
   }
@@ -1401,6 +1474,9 @@ connection_or_set_circid_type(or_connection_t *conn,
   } else {
     conn->circ_id_type = CIRC_ID_TYPE_NEITHER;
   }
+  /* Any bitmap of the IDs in use was for the other half of the space. */
+  bitarray_free(conn->circ_id_bitmap);
+  conn->circ_id_bitmap = NULL;
 }
 
 /** <b>Conn</b> just completed its handshake. Return 0 if all is well, and
@@ -1746,6 +1822,16 @@ connection_or_set_state_open(or_connection_t *conn)
   time_t now = time(NULL);
   conn->_base.state = OR_CONN_STATE_OPEN;
   control_event_or_conn_status(conn, OR_CONN_EVENT_CONNECTED, 0);
+  /* From now on we'll be queueing cells here; size the outbuf by what the
+   * kernel can actually send, if it will tell us. */
+  conn->use_kernel_sendq = SOCKET_OK(conn->_base.s);
+#ifndef USE_BUFFEREVENTS
+  conn->kernel_sendq_lowat = conn->use_kernel_sendq &&
+    tor_socket_set_notsent_lowat(conn->_base.s, OR_CONN_KERNEL_LOWAT) == 0;
+#endif
+  /* Open connections get keepalives and idle timeouts that non-open ones
+   * don't, so the housekeeping deadline may have just moved earlier. */
+  connection_update_housekeeping(TO_CONN(conn));
 
   if (started_here) {
     circuit_build_times_network_is_live(&circ_times);
@@ -1842,6 +1928,30 @@ connection_fetch_var_cell_from_buf(or_connection_t *or_conn, var_cell_t **out)
   }
 }
 
+/** Move up to <b>max_cells</b> whole fixed-length cells from the front of
+ * <b>or_conn</b>'s input onto <b>out</b>, stopping at any variable-length
+ * cell, and return how many there were. */
+static int
+connection_fetch_cells_from_buf(or_connection_t *or_conn, char *out,
+                                int max_cells)
+{
+  connection_t *conn = TO_CONN(or_conn);
+  IF_HAS_BUFFEREVENT(conn, {
+    /* The caller already knows the first one is fixed-length. */
+    if (connection_get_inbuf_len(conn) < CELL_NETWORK_SIZE)
+      return 0;
+    connection_fetch_from_buf(out, CELL_NETWORK_SIZE, conn);
+    return 1;
+  }) ELSE_IF_NO_BUFFEREVENT {
+    return fetch_cells_from_buf(conn->inbuf, out, max_cells,
+                                or_conn->link_proto);
+  }
+}
+
+/** How many fixed-length cells connection_or_process_cells_from_inbuf()
+ * takes off the inbuf at once. */
+#define OR_CELL_BATCH_SIZE 16
+
 /** Process cells from <b>conn</b>'s inbuf.
  *
  * Loop: while inbuf contains a cell, pull it off the inbuf, unpack it,
@@ -1861,27 +1971,40 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
               tor_tls_get_pending_bytes(conn->tls));
     if (connection_fetch_var_cell_from_buf(conn, &var_cell)) {
       if (!var_cell)
-        return 0; /* not yet. */
+        break; /* not yet. */
       circuit_build_times_network_is_live(&circ_times);
       command_process_var_cell(var_cell, conn);
       var_cell_free(var_cell);
     } else {
-      char buf[CELL_NETWORK_SIZE];
+      char buf[CELL_NETWORK_SIZE*OR_CELL_BATCH_SIZE];
       cell_t cell;
-      if (connection_get_inbuf_len(TO_CONN(conn))
-          < CELL_NETWORK_SIZE) /* whole response available? */
-        return 0; /* not yet */
+      int i, n;
+
+      /* Take every whole cell that's waiting in one go, rather than going
+       * back to the buffer for each one. They're still handled strictly in
+       * order: a cell can add or remove a layer on its circuit, or close
+       * it, so later cells can't be crypted before it's done. */
+      n = connection_fetch_cells_from_buf(conn, buf, OR_CELL_BATCH_SIZE);
+      if (!n)
+        break; /* not yet */
 
       circuit_build_times_network_is_live(&circ_times);
-      connection_fetch_from_buf(buf, CELL_NETWORK_SIZE, TO_CONN(conn));
 
-      /* retrieve cell info from buf (create the host-order struct from the
-       * network-order string) */
-      cell_unpack(&cell, buf);
+      for (i = 0; i < n; ++i) {
+        /* retrieve cell info from buf (create the host-order struct from
+         * the network-order string) */
+        cell_unpack(&cell, buf + i*CELL_NETWORK_SIZE);
 
-      command_process_cell(&cell, conn);
+        command_process_cell(&cell, conn);
+      }
     }
   }
+
+#ifdef LIBRARY
+  /* hand each library stream everything it got in this pass at once */
+  relay_flush_onionroute_batches();
+#endif
+  return 0;
 }
 
 /** Write a destroy cell with circ ID <b>circ_id</b> and reason <b>reason</b>
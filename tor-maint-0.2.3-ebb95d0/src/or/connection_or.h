@@ -19,11 +19,16 @@ or_connection_t *connection_or_get_for_extend(const char *digest,
                                               const tor_addr_t *target_addr,
                                               const char **msg_out,
                                               int *launch_out);
+void connection_or_mark_bad_for_new_circs(or_connection_t *or_conn);
 void connection_or_set_bad_connections(const char *digest, int force);
 
 void connection_or_block_renegotiation(or_connection_t *conn);
 int connection_or_reached_eof(or_connection_t *conn);
 int connection_or_process_inbuf(or_connection_t *conn);
+int connection_or_outbuf_is_low(or_connection_t *conn);
+size_t connection_or_kernel_room(const tor_sendq_t *sendq, size_t outbuf_len);
+size_t connection_or_outbuf_room(or_connection_t *conn);
+size_t connection_or_query_kernel_room(or_connection_t *conn);
 int connection_or_flushed_some(or_connection_t *conn);
 int connection_or_finished_flushing(or_connection_t *conn);
 int connection_or_finished_connecting(or_connection_t *conn);
@@ -597,7 +597,7 @@ send_control_event_string(uint16_t event, event_format_t which,
 {
   smartlist_t *conns = get_connection_array();
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
 tor_mutex_acquire(conns->lock);
 #endif
 
@@ -627,7 +627,7 @@ tor_mutex_acquire(conns->lock);
     }
   } SMARTLIST_FOREACH_END(conn);
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
 tor_mutex_release(conns->lock);
 #endif
 
@@ -1573,6 +1573,8 @@ getinfo_helper_misc(control_connection_t *conn, const char *question,
       return -1;
     }
     *answer = tor_dup_ip(addr);
+  } else if (!strcmp(question, "memory/buffer-chunks")) {
+    *answer = buf_get_freelist_stats();
   } else if (!strcmp(question, "traffic/read")) {
     tor_asprintf(answer, U64_FORMAT, U64_PRINTF_ARG(get_bytes_read()));
   } else if (!strcmp(question, "traffic/written")) {
@@ -2306,6 +2308,8 @@ static const getinfo_item_t getinfo_items[] = {
       "Number of versioning authorities agreeing on the status of the "
       "current version"),
   ITEM("address", misc, "IP address of this Tor host, if we can guess it."),
+  ITEM("memory/buffer-chunks", misc,
+       "Allocation statistics for each size of buffer chunk."),
   ITEM("traffic/read", misc,"Bytes read since the process was started."),
   ITEM("traffic/written", misc,
        "Bytes written since the process was started."),
@@ -3011,7 +3015,15 @@ close_command_processor(void *data)
 
 	id = cmd->id;
 
-	onionroute_closestream_i(id);
+	{
+		edge_connection_t *conn = onionroute_handle_get_conn(id);
+
+		/* already closed, nothing to do */
+		if (conn)
+			onionroute_closestream_i(TO_CONN(conn));
+	}
+
+	tor_free(data);
 }
 
 ONIONROUTE_API
@@ -3019,30 +3031,26 @@ int
 onionroute_closestream_v1(void *id)
 {
 	onionroute_close_command_t *ccmd;
-	onionroute_command_t *cmd;
+	int r;
+
+	if(NULL == id) return -1;
+	if(!onionroute_handle_is_live(id)) return ONIONROUTE_ERR_STALE_STREAM;
 
 	/* store data */
 	ccmd = tor_malloc(sizeof(onionroute_close_command_t));
 
 	if(NULL == ccmd) { return -1; }
 
-	cmd = tor_malloc(sizeof(onionroute_command_t));
-	if(NULL == cmd)
-	{
-		/* I love catch / finally blocks to cleanup */
-		tor_free(ccmd);
-		return -1;
-	}
-
 	ccmd->id = id;
 
-	cmd->data = ccmd;
-	cmd->processor = close_command_processor;
-
 	/* store command in queue */
-	smartlist_add(cqueue, cmd);
+	r = onionroute_command_enqueue(close_command_processor, ccmd);
+	if(r < 0)
+	{
+		tor_free(ccmd);
+	}
 
-	return 0;
+	return r;
 }
 
 #endif
@@ -30,6 +30,9 @@ int connection_control_reached_eof(control_connection_t *conn);
 void connection_control_closed(control_connection_t *conn);
 
 int connection_control_process_inbuf(control_connection_t *conn);
+#ifdef LIBRARY
+int onionroute_closestream_i(void *conn);
+#endif
 
 #define EVENT_AUTHDIR_NEWDESCS 0x000D
 #define EVENT_NS 0x000F
@@ -47,15 +47,24 @@
 #include "router.h"
 #include "routerlist.h"
 #include "routerparse.h"
+#include "scheduler.h"
 #include "status.h"
 #ifdef USE_DMALLOC
 #include <dmalloc.h>
 #include <openssl/crypto.h>
 #endif
 #include "memarea.h"
+#include "timewheel.h"
 
 #ifdef LIBRARY
 #include "../libtor_internal.h"
+#include "ht.h"
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 #endif
 
 #ifdef HAVE_EVENT2_EVENT_H
@@ -78,25 +87,19 @@ static void conn_read_callback(evutil_socket_t fd, short event, void *_conn);
 static void conn_write_callback(evutil_socket_t fd, short event, void *_conn);
 static void second_elapsed_callback(periodic_timer_t *timer, void *args);
 static int conn_close_if_marked(int i);
+static void run_connection_housekeeping(connection_t *conn, time_t now);
 static void connection_start_reading_from_linked_conn(connection_t *conn);
 static int connection_should_read_from_linked_conn(connection_t *conn);
 
 /********* START VARIABLES **********/
 
 #ifndef USE_BUFFEREVENTS
-int global_read_bucket; /**< Max number of bytes I can read this second. */
-int global_write_bucket; /**< Max number of bytes I can write this second. */
-
-/** Max number of relayed (bandwidth class 1) bytes I can read this second. */
-int global_relayed_read_bucket;
-/** Max number of relayed (bandwidth class 1) bytes I can write this second. */
-int global_relayed_write_bucket;
-/** What was the read bucket before the last second_elapsed_callback() call?
- * (used to determine how many bytes we've read). */
-static int stats_prev_global_read_bucket;
-/** What was the write bucket before the last second_elapsed_callback() call?
- * (used to determine how many bytes we've written). */
-static int stats_prev_global_write_bucket;
+/** How many rate-limited bytes had we read as of the last
+ * refill_callback() call? */
+static uint64_t stats_prev_rate_limited_read = 0;
+/** How many rate-limited bytes had we written as of the last
+ * refill_callback() call? */
+static uint64_t stats_prev_rate_limited_written = 0;
 #endif
 
 /* DOCDOC stats_prev_n_read */
@@ -116,6 +119,14 @@ long stats_n_seconds_working = 0;
 /** When do we next launch DNS wildcarding checks? */
 static time_t time_to_check_for_correct_dns = 0;
 
+/** Timer wheel, in seconds, holding every deadline that
+ * run_scheduled_events() waits for: the periodic jobs in scheduled_events[]
+ * and each OR and directory connection's housekeeping timer.  Created on
+ * first use by get_main_timewheel(). */
+static timewheel_t *main_timewheel = NULL;
+/** Have the jobs in scheduled_events[] been armed on main_timewheel? */
+static int scheduled_events_initialized = 0;
+
 /** How often will we honor SIGNEWNYM requests? */
 #define MAX_SIGNEWNYM_RATE 10
 /** When did we last process a SIGNEWNYM request? */
@@ -238,7 +249,7 @@ connection_add_impl(connection_t *conn, int is_connecting)
 
   tor_assert(conn->conn_array_index == -1); /* can only connection_add once */
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(connection_array->lock);
 #endif
 
@@ -316,7 +327,9 @@ connection_add_impl(connection_t *conn, int is_connecting)
             conn_type_to_string(conn->type), (int)conn->s, conn->address,
             smartlist_len(connection_array));
 
-#ifdef LIBRARY
+  connection_update_housekeeping(conn);
+
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(connection_array->lock);
 #endif
 
@@ -360,7 +373,7 @@ connection_remove(connection_t *conn)
 
   tor_assert(conn);
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_acquire(connection_array->lock);
 #endif
 
@@ -371,6 +384,7 @@ connection_remove(connection_t *conn)
   tor_assert(conn->conn_array_index >= 0);
   current_index = conn->conn_array_index;
   connection_unregister_events(conn); /* This is redundant, but cheap. */
+  timewheel_cancel(&conn->housekeeping_timer);
   if (current_index == smartlist_len(connection_array)-1) { /* at the end */
     smartlist_del(connection_array, current_index);
     return 0;
@@ -381,7 +395,7 @@ connection_remove(connection_t *conn)
   tmp = smartlist_get(connection_array, current_index);
   tmp->conn_array_index = current_index;
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_release(connection_array->lock);
 #endif
 
@@ -390,20 +404,239 @@ connection_remove(connection_t *conn)
 
 #ifdef LIBRARY
 
-onionroute_event_stream_close_t_v1 closecallback = 0;
+/** The context behind the calls that don't take one; never freed. */
+onionroute_ctx_t onionroute_default_ctx = {
+  NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  ONIONROUTE_DEFAULT_FLUSH_DELAY_MSEC, 1
+};
+
+/** Which callback an onionroute_ctx_callback_command_t replaces. */
+typedef enum {
+	CTX_CALLBACK_OPEN_V1, CTX_CALLBACK_OPEN_V2,
+	CTX_CALLBACK_CLOSE_V1, CTX_CALLBACK_CLOSE_V2,
+	CTX_CALLBACK_DATA_V1, CTX_CALLBACK_DATA_V2, CTX_CALLBACK_DATA_V3
+} ctx_callback_t;
+
+/** A new callback for a context, handed from the application's thread to
+ * the main loop. */
+typedef struct onionroute_ctx_callback_command_t {
+	onionroute_ctx_t *ctx;
+	ctx_callback_t which;
+	union {
+		onionroute_event_stream_open_t_v1 open_v1;
+		onionroute_event_stream_open_t_v2 open_v2;
+		onionroute_event_stream_close_t_v1 close_v1;
+		onionroute_event_stream_close_t_v2 close_v2;
+		onionroute_event_stream_data_received_t_v1 data_v1;
+		onionroute_event_stream_data_received_t_v2 data_v2;
+		onionroute_event_stream_data_received_t_v3 data_v3;
+	} cb;
+} onionroute_ctx_callback_command_t;
+
+/** Store the callback <b>cmd</b> carries into its context. */
+static void
+ctx_callback_apply(const onionroute_ctx_callback_command_t *cmd)
+{
+	onionroute_ctx_t *ctx = cmd->ctx;
+
+	switch (cmd->which) {
+	case CTX_CALLBACK_OPEN_V1: ctx->open_v1 = cmd->cb.open_v1; break;
+	case CTX_CALLBACK_OPEN_V2: ctx->open_v2 = cmd->cb.open_v2; break;
+	case CTX_CALLBACK_CLOSE_V1: ctx->close_v1 = cmd->cb.close_v1; break;
+	case CTX_CALLBACK_CLOSE_V2: ctx->close_v2 = cmd->cb.close_v2; break;
+	case CTX_CALLBACK_DATA_V1: ctx->data_v1 = cmd->cb.data_v1; break;
+	case CTX_CALLBACK_DATA_V2: ctx->data_v2 = cmd->cb.data_v2; break;
+	case CTX_CALLBACK_DATA_V3: ctx->data_v3 = cmd->cb.data_v3; break;
+	}
+}
+
+/** Main loop side of onionroute_ctx_set_callback(). */
+static void
+ctx_callback_command_processor(void *data)
+{
+	ctx_callback_apply(data);
+	tor_free(data);
+}
+
+/** Install the callback described by <b>cmd</b>.  The main loop calls
+ * context callbacks whenever a stream event happens, so once it is running
+ * we hand the new one over through the command queue rather than writing
+ * it from the caller's thread, as onionroute_ctx_set_flush_delay() does.
+ * Return 0 on success or ONIONROUTE_ERR_QUEUE_FULL. */
+static int
+onionroute_ctx_set_callback(const onionroute_ctx_callback_command_t *cmd)
+{
+	onionroute_ctx_callback_command_t *copy;
+
+	if (!onionroute_command_queue_is_ready()) {
+		ctx_callback_apply(cmd);
+		return 0;
+	}
+	copy = tor_memdup(cmd, sizeof(onionroute_ctx_callback_command_t));
+	if (onionroute_command_enqueue(ctx_callback_command_processor, copy) < 0) {
+		tor_free(copy);
+		return ONIONROUTE_ERR_QUEUE_FULL;
+	}
+	return 0;
+}
+
+ONIONROUTE_API
+int onionroute_set_stream_close_callback_v1(onionroute_event_stream_close_t_v1 callback)
+{
+	return onionroute_ctx_set_stream_close_callback_v1(&onionroute_default_ctx, callback);
+}
+
+ONIONROUTE_API
+int onionroute_set_stream_close_callback_v2(onionroute_event_stream_close_t_v2 callback)
+{
+	return onionroute_ctx_set_stream_close_callback_v2(&onionroute_default_ctx, callback);
+}
+
+ONIONROUTE_API
+onionroute_ctx_t *
+onionroute_ctx_new_v1(void)
+{
+	onionroute_ctx_t *ctx = tor_malloc_zero(sizeof(onionroute_ctx_t));
+
+	ctx->flush_delay_msec = ONIONROUTE_DEFAULT_FLUSH_DELAY_MSEC;
+	ctx->refcount = 1;
+	return ctx;
+}
+
+/** Drop one reference to <b>ctx</b>, freeing it with the last one. Main
+ * loop only. */
+void
+onionroute_ctx_decref(onionroute_ctx_t *ctx)
+{
+	if (ctx == &onionroute_default_ctx)
+		return;
+	if (--ctx->refcount == 0)
+		tor_free(ctx);
+}
+
+/** Main loop side of onionroute_ctx_free_v1(): close what is still open on
+ * the context; the last stream to go frees it. */
+static void
+ctx_free_command_processor(void *data)
+{
+	onionroute_ctx_t *ctx = data;
+	smartlist_t *conns = get_connection_array();
+
+	SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
+		if (conn->type == CONN_TYPE_AP && !conn->marked_for_close &&
+			TO_EDGE_CONN(conn)->is_onionroute_request &&
+			TO_EDGE_CONN(conn)->onionroute_ctx == ctx)
+			onionroute_closestream_i(conn);
+	} SMARTLIST_FOREACH_END(conn);
+
+	onionroute_ctx_decref(ctx);
+}
+
+ONIONROUTE_API
+int
+onionroute_ctx_free_v1(onionroute_ctx_t *ctx)
+{
+	if (!ctx || ctx == &onionroute_default_ctx)
+		return -1;
+	return onionroute_command_enqueue(ctx_free_command_processor, ctx);
+}
+
+ONIONROUTE_API
+int
+onionroute_ctx_set_stream_open_callback_v1(onionroute_ctx_t *ctx,
+                                           onionroute_event_stream_open_t_v1 callback)
+{
+	onionroute_ctx_callback_command_t cmd;
+
+	cmd.ctx = ctx;
+	cmd.which = CTX_CALLBACK_OPEN_V1;
+	cmd.cb.open_v1 = callback;
+	return onionroute_ctx_set_callback(&cmd);
+}
+
+ONIONROUTE_API
+int
+onionroute_ctx_set_stream_open_callback_v2(onionroute_ctx_t *ctx,
+                                           onionroute_event_stream_open_t_v2 callback)
+{
+	onionroute_ctx_callback_command_t cmd;
+
+	cmd.ctx = ctx;
+	cmd.which = CTX_CALLBACK_OPEN_V2;
+	cmd.cb.open_v2 = callback;
+	return onionroute_ctx_set_callback(&cmd);
+}
+
+ONIONROUTE_API
+int
+onionroute_ctx_set_stream_close_callback_v1(onionroute_ctx_t *ctx,
+                                            onionroute_event_stream_close_t_v1 callback)
+{
+	onionroute_ctx_callback_command_t cmd;
+
+	cmd.ctx = ctx;
+	cmd.which = CTX_CALLBACK_CLOSE_V1;
+	cmd.cb.close_v1 = callback;
+	return onionroute_ctx_set_callback(&cmd);
+}
+
+ONIONROUTE_API
+int
+onionroute_ctx_set_stream_close_callback_v2(onionroute_ctx_t *ctx,
+                                            onionroute_event_stream_close_t_v2 callback)
+{
+	onionroute_ctx_callback_command_t cmd;
+
+	cmd.ctx = ctx;
+	cmd.which = CTX_CALLBACK_CLOSE_V2;
+	cmd.cb.close_v2 = callback;
+	return onionroute_ctx_set_callback(&cmd);
+}
+
+ONIONROUTE_API
+int
+onionroute_ctx_set_stream_data_received_callback_v1(onionroute_ctx_t *ctx,
+                               onionroute_event_stream_data_received_t_v1 callback)
+{
+	onionroute_ctx_callback_command_t cmd;
+
+	cmd.ctx = ctx;
+	cmd.which = CTX_CALLBACK_DATA_V1;
+	cmd.cb.data_v1 = callback;
+	return onionroute_ctx_set_callback(&cmd);
+}
 
 ONIONROUTE_API
-void onionroute_set_stream_close_callback_v1(onionroute_event_stream_close_t_v1 callback)
+int
+onionroute_ctx_set_stream_data_received_callback_v2(onionroute_ctx_t *ctx,
+                               onionroute_event_stream_data_received_t_v2 callback)
 {
-	closecallback = callback;
+	onionroute_ctx_callback_command_t cmd;
+
+	cmd.ctx = ctx;
+	cmd.which = CTX_CALLBACK_DATA_V2;
+	cmd.cb.data_v2 = callback;
+	return onionroute_ctx_set_callback(&cmd);
 }
 
-onionroute_event_stream_close_t_v2 closecallback2 = 0;
+ONIONROUTE_API
+int
+onionroute_ctx_set_stream_data_received_callback_v3(onionroute_ctx_t *ctx,
+                               onionroute_event_stream_data_received_t_v3 callback)
+{
+	onionroute_ctx_callback_command_t cmd;
+
+	cmd.ctx = ctx;
+	cmd.which = CTX_CALLBACK_DATA_V3;
+	cmd.cb.data_v3 = callback;
+	return onionroute_ctx_set_callback(&cmd);
+}
 
 ONIONROUTE_API
-void onionroute_set_stream_close_callback_v2(onionroute_event_stream_close_t_v2 callback)
+int
+onionroute_ctx_set_stream_flush_delay_v1(onionroute_ctx_t *ctx, unsigned int msec)
 {
-	closecallback2 = callback;
+	return onionroute_ctx_set_flush_delay(ctx, msec);
 }
 #endif
 
@@ -447,13 +680,15 @@ connection_unlink(connection_t *conn)
 	  edge_connection_t *c2 = TO_EDGE_CONN(conn);
 	  if(c2->is_onionroute_request)
 	  {
-		  if(closecallback2)
+		  onionroute_ctx_t *ctx = c2->onionroute_ctx;
+
+		  if(ctx->close_v2)
 		  {
-			  closecallback2(c2, c2->obj);
+			  ctx->close_v2(c2->onionroute_id, c2->obj);
 		  }
-		  else if(closecallback)
+		  else if(ctx->close_v1)
 		  {
-			  closecallback(c2);
+			  ctx->close_v1(c2->onionroute_id);
 		  }
 	  }
   }
@@ -930,7 +1165,7 @@ conn_close_if_marked(int i)
          * 0 until we are no longer blocked on bandwidth.
          */
         if (connection_is_writing(conn)) {
-          conn->write_blocked_on_bw = 1;
+          connection_set_blocked_on_bw(conn, 0);
           connection_stop_writing(conn);
         }
         if (connection_is_reading(conn)) {
@@ -952,7 +1187,7 @@ conn_close_if_marked(int i)
             tor_free(m);
           }
 #endif
-          conn->read_blocked_on_bw = 1;
+          connection_set_blocked_on_bw(conn, 1);
           connection_stop_reading(conn);
         }
       }
@@ -1058,14 +1293,111 @@ directory_info_has_arrived(time_t now, int from_cache)
  */
 #define IDLE_OR_CONN_TIMEOUT 180
 
+/** Return the timer wheel that run_scheduled_events() advances once per
+ * second, creating it if necessary. */
+static timewheel_t *
+get_main_timewheel(void)
+{
+  if (!main_timewheel)
+    main_timewheel = timewheel_new((uint64_t)time(NULL) - 1);
+  return main_timewheel;
+}
+
+/** Return the first second at which run_connection_housekeeping() could
+ * find anything to do for <b>conn</b>, given its current state, or 0 if
+ * connections of its type never need housekeeping.  Activity on a
+ * connection only ever moves this time later, so a timer armed for an
+ * earlier result is merely early: it runs, finds nothing to do, and re-arms
+ * itself.  A state change can move it earlier, though, so code that changes
+ * a connection's state must call connection_update_housekeeping(). */
+static time_t
+connection_housekeeping_deadline(connection_t *conn, time_t now)
+{
+  const or_options_t *options = get_options();
+  or_connection_t *or_conn;
+  time_t deadline;
+
+  if (conn->marked_for_close)
+    return 0;
+
+  if (conn->type == CONN_TYPE_DIR) {
+    time_t last_active = DIR_CONN_IS_SERVER(conn) ?
+      conn->timestamp_lastwritten : conn->timestamp_lastread;
+    return last_active + DIR_CONN_MAX_STALL + 1;
+  }
+
+  if (!connection_speaks_cells(conn))
+    return 0;
+
+  or_conn = TO_OR_CONN(conn);
+  if (!or_conn->n_circuits &&
+      (or_conn->is_bad_for_new_circs || we_are_hibernating()))
+    return now;
+
+  /* Keepalives are due, and non-open connections expire, once we haven't
+   * written for KeepalivePeriod; a stuck connection can't be detected before
+   * that either. */
+  deadline = conn->timestamp_lastwritten + options->KeepalivePeriod;
+  if (connection_state_is_open(conn) && !or_conn->n_circuits)
+    deadline = MIN(deadline, or_conn->timestamp_last_added_nonpadding +
+                             IDLE_OR_CONN_TIMEOUT);
+  return deadline;
+}
+
+/** Timewheel callback: run housekeeping for the connection in <b>arg</b>,
+ * and re-arm its timer for whatever it needs to check next. */
+static void
+connection_housekeeping_cb(timewheel_t *wheel, void *arg, uint64_t now)
+{
+  connection_t *conn = arg;
+  (void)wheel;
+  run_connection_housekeeping(conn, (time_t)now);
+  connection_update_housekeeping(conn);
+}
+
+/** Make sure that housekeeping for <b>conn</b> runs no later than the next
+ * time it could have something to do.  Call this whenever a connection's
+ * state changes in a way that could bring its deadline closer than the one
+ * its timer is already armed for. */
+void
+connection_update_housekeeping(connection_t *conn)
+{
+  timewheel_t *wheel;
+  time_t deadline;
+
+  if (conn->conn_array_index < 0)
+    return;
+  deadline = connection_housekeeping_deadline(conn, approx_time());
+  if (!deadline)
+    return;
+  if (timewheel_entry_is_scheduled(&conn->housekeeping_timer) &&
+      conn->housekeeping_timer.when <= (uint64_t)deadline)
+    return;
+
+  wheel = get_main_timewheel();
+  if (!conn->housekeeping_timer.cb)
+    timewheel_entry_init(&conn->housekeeping_timer,
+                         connection_housekeeping_cb, conn);
+  timewheel_schedule(wheel, &conn->housekeeping_timer, (uint64_t)deadline);
+}
+
+/** Call connection_update_housekeeping() on every connection: used when a
+ * global condition that housekeeping depends on changes. */
+void
+connection_update_all_housekeeping(void)
+{
+  SMARTLIST_FOREACH(connection_array, connection_t *, conn,
+                    connection_update_housekeeping(conn));
+}
+
 /** Perform regular maintenance tasks for a single connection.  This
- * function gets run once per second per connection by run_scheduled_events.
+ * function gets run by connection_housekeeping_cb() whenever the
+ * connection's housekeeping timer expires.
  */
 static void
-run_connection_housekeeping(int i, time_t now)
+run_connection_housekeeping(connection_t *conn, time_t now)
 {
   cell_t cell;
-  connection_t *conn = smartlist_get(connection_array, i);
   const or_options_t *options = get_options();
   or_connection_t *or_conn;
   int past_keepalive =
@@ -1192,20 +1524,9 @@ switch_to_new_circuits_command_processor(void* data)
 ONIONROUTE_API
 int onionroute_switch_to_new_circuits_v1()
 {
-	onionroute_command_t *cmd;
-
-	cmd = tor_malloc(sizeof(onionroute_command_t));
-	if(NULL == cmd)
-	{
-		return -1;
-	}
-
-	cmd->data = NULL;
-	cmd->processor = switch_to_new_circuits_command_processor;
-
 	/* store command in queue */
-	smartlist_add(cqueue, cmd);
-	return 0;
+	return onionroute_command_enqueue(switch_to_new_circuits_command_processor,
+	                                  NULL);
 }
 #endif
 
@@ -1239,6 +1560,377 @@ get_signewnym_epoch(void)
   return newnym_epoch;
 }
 
+/* Periodic jobs for run_scheduled_events().  Each one does its work and
+ * returns the deadline it wants to wait for: it runs again on the first
+ * second after that deadline.  A job whose preconditions don't currently
+ * hold returns <b>now</b>, so that it checks again a second later. */
+
+/** Try to fetch any router descriptors and extra-info documents we want. */
+static time_t
+fetch_descriptors_callback(time_t now, const or_options_t *options)
+{
+  if (options->DisableNetwork)
+    return now;
+  update_all_descriptor_downloads(now);
+  update_extrainfo_downloads(now);
+  if (router_have_minimum_dir_info())
+    return now + LAZY_DESCRIPTOR_RETRY_INTERVAL;
+  else
+    return now + GREEDY_DESCRIPTOR_RETRY_INTERVAL;
+}
+
+/** Forget about descriptor download failures every so often. */
+static time_t
+reset_descriptor_failures_callback(time_t now, const or_options_t *options)
+{
+  (void)options;
+  router_reset_descriptor_download_failures();
+  return now + DESCRIPTOR_FAILURE_RESET_INTERVAL;
+}
+
+/** How often do we add more entropy to OpenSSL's RNG pool? */
+#define ENTROPY_INTERVAL (60*60)
+/** Periodically add more entropy to OpenSSL's RNG pool. */
+static time_t
+add_entropy_callback(time_t now, const or_options_t *options)
+{
+  static int seeded_once = 0;
+  (void)options;
+  if (seeded_once) {
+    /* We already seeded once, so don't die on failure. */
+    crypto_seed_rng(0);
+  }
+  seeded_once = 1;
+  return now + ENTROPY_INTERVAL;
+}
+
+/** If we're an authority that tests reachability, try to determine the
+ * reachability of the other Tor relays. */
+static time_t
+launch_reachability_tests_callback(time_t now, const or_options_t *options)
+{
+  if (!authdir_mode_tests_reachability(options) || net_is_disabled())
+    return now;
+  dirserv_test_reachability(now);
+  return now + REACHABILITY_TEST_INTERVAL;
+}
+
+/** Periodically, we discount older stability information so that new
+ * stability info counts more. */
+static time_t
+downrate_stability_callback(time_t now, const or_options_t *options)
+{
+  (void)options;
+  return rep_hist_downrate_old_runs(now);
+}
+
+/** How often do we save stability information to disk? */
+#define SAVE_STABILITY_INTERVAL (30*60)
+/** If we're testing reachability, save the stability information to disk
+ * as appropriate. */
+static time_t
+save_stability_callback(time_t now, const or_options_t *options)
+{
+  static int first_run = 1;
+  if (!authdir_mode_tests_reachability(options))
+    return now;
+  if (!first_run && rep_hist_record_mtbf_data(now, 1)<0) {
+    log_warn(LD_GENERAL, "Couldn't store mtbf data.");
+  }
+  first_run = 0;
+  return now + SAVE_STABILITY_INTERVAL;
+}
+
+/** How often do we check whether our v3 authority cert is expiring? */
+#define CHECK_V3_CERTIFICATE_INTERVAL (5*60)
+/** If we're a v3 authority, check whether our cert is close to expiring and
+ * warn the admin if it is. */
+static time_t
+check_v3_certificate_callback(time_t now, const or_options_t *options)
+{
+  (void)options;
+  v3_authority_check_key_expiry();
+  return now + CHECK_V3_CERTIFICATE_INTERVAL;
+}
+
+/*XXXX RD: This value needs to be the same as REASONABLY_LIVE_TIME in
+ * networkstatus_get_reasonably_live_consensus(), but that value is way
+ * way too high.  Arma: is the bridge issue there resolved yet? -NM */
+#define NS_EXPIRY_SLOP (24*60*60)
+/** How often do we check whether our networkstatus has expired? */
+#define CHECK_EXPIRED_NS_INTERVAL (2*60)
+/** Check whether our networkstatus has expired. */
+static time_t
+check_expired_networkstatus_callback(time_t now, const or_options_t *options)
+{
+  networkstatus_t *ns = networkstatus_get_latest_consensus();
+  (void)options;
+  if (ns && ns->valid_until < now+NS_EXPIRY_SLOP &&
+      router_have_minimum_dir_info()) {
+    router_dir_info_changed();
+  }
+  return now + CHECK_EXPIRED_NS_INTERVAL;
+}
+
+/** How often do we check whether statistics need to be written? */
+#define CHECK_WRITE_STATS_INTERVAL (60*60)
+/** Check whether we should write statistics to disk. */
+static time_t
+write_stats_files_callback(time_t now, const or_options_t *options)
+{
+  static time_t time_to_write_stats_files = 0;
+  time_t next_time_to_write_stats_files = (time_to_write_stats_files > 0 ?
+         time_to_write_stats_files : now) + CHECK_WRITE_STATS_INTERVAL;
+  if (options->CellStatistics) {
+    time_t next_write =
+        rep_hist_buffer_stats_write(time_to_write_stats_files);
+    if (next_write && next_write < next_time_to_write_stats_files)
+      next_time_to_write_stats_files = next_write;
+  }
+  if (options->DirReqStatistics) {
+    time_t next_write = geoip_dirreq_stats_write(time_to_write_stats_files);
+    if (next_write && next_write < next_time_to_write_stats_files)
+      next_time_to_write_stats_files = next_write;
+  }
+  if (options->EntryStatistics) {
+    time_t next_write = geoip_entry_stats_write(time_to_write_stats_files);
+    if (next_write && next_write < next_time_to_write_stats_files)
+      next_time_to_write_stats_files = next_write;
+  }
+  if (options->ExitPortStatistics) {
+    time_t next_write = rep_hist_exit_stats_write(time_to_write_stats_files);
+    if (next_write && next_write < next_time_to_write_stats_files)
+      next_time_to_write_stats_files = next_write;
+  }
+  if (options->ConnDirectionStatistics) {
+    time_t next_write = rep_hist_conn_stats_write(time_to_write_stats_files);
+    if (next_write && next_write < next_time_to_write_stats_files)
+      next_time_to_write_stats_files = next_write;
+  }
+  if (options->BridgeAuthoritativeDir) {
+    time_t next_write = rep_hist_desc_stats_write(time_to_write_stats_files);
+    if (next_write && next_write < next_time_to_write_stats_files)
+      next_time_to_write_stats_files = next_write;
+  }
+  time_to_write_stats_files = next_time_to_write_stats_files;
+  return time_to_write_stats_files;
+}
+
+/** How often do we clean old information out of our caches? */
+#define CLEAN_CACHES_INTERVAL (30*60)
+/** Remove old information from rephist and the rend cache. */
+static time_t
+clean_caches_callback(time_t now, const or_options_t *options)
+{
+  rep_history_clean(now - options->RephistTrackTime);
+  rend_cache_clean(now);
+  rend_cache_clean_v2_descs_as_dir(now);
+  microdesc_cache_rebuild(NULL, 0);
+  return now + CLEAN_CACHES_INTERVAL;
+}
+
+/** How often do we retry a failed DNS initialization? */
+#define RETRY_DNS_INTERVAL (10*60)
+/** If we're a server and initializing dns failed, retry periodically. */
+static time_t
+retry_dns_callback(time_t now, const or_options_t *options)
+{
+  if (server_mode(options) && has_dns_init_failed())
+    dns_init();
+  return now + RETRY_DNS_INTERVAL;
+}
+
+/** How often do we check whether part of our router info has changed in a way
+ * that would require an upload? */
+#define CHECK_DESCRIPTOR_INTERVAL (60)
+/** How often do we (as a router) check whether our IP address has changed? */
+#define CHECK_IPADDRESS_INTERVAL (15*60)
+/** How often do we retest our bandwidth if our estimate looks too low? */
+#define BANDWIDTH_RECHECK_INTERVAL (12*60*60)
+/** Once per minute, regenerate and upload the descriptor if the old one is
+ * inaccurate, and consider force-uploading it (if we've passed our internal
+ * checks). */
+static time_t
+check_descriptor_callback(time_t now, const or_options_t *options)
+{
+  static time_t time_to_check_ipaddress = 0;
+  static time_t time_to_recheck_bandwidth = 0;
+  static int dirport_reachability_count = 0;
+  if (options->DisableNetwork)
+    return now;
+  check_descriptor_bandwidth_changed(now);
+  if (time_to_check_ipaddress < now) {
+    time_to_check_ipaddress = now + CHECK_IPADDRESS_INTERVAL;
+    check_descriptor_ipaddress_changed(now);
+  }
+  mark_my_descriptor_dirty_if_too_old(now);
+  consider_publishable_server(0);
+  /* also, check religiously for reachability, if it's within the first
+   * 20 minutes of our uptime. */
+  if (server_mode(options) &&
+      (can_complete_circuit || !any_predicted_circuits(now)) &&
+      !we_are_hibernating()) {
+    if (stats_n_seconds_working < TIMEOUT_UNTIL_UNREACHABILITY_COMPLAINT) {
+      consider_testing_reachability(1, dirport_reachability_count==0);
+      if (++dirport_reachability_count > 5)
+        dirport_reachability_count = 0;
+    } else if (time_to_recheck_bandwidth < now) {
+      /* If we haven't checked for 12 hours and our bandwidth estimate is
+       * low, do another bandwidth test. This is especially important for
+       * bridges, since they might go long periods without much use. */
+      const routerinfo_t *me = router_get_my_routerinfo();
+      if (time_to_recheck_bandwidth && me &&
+          me->bandwidthcapacity < me->bandwidthrate &&
+          me->bandwidthcapacity < 51200) {
+        reset_bandwidth_test();
+      }
+      time_to_recheck_bandwidth = now + BANDWIDTH_RECHECK_INTERVAL;
+    }
+  }
+
+  /* If any networkstatus documents are no longer recent, we need to
+   * update all the descriptors' running status. */
+  /* purge obsolete entries */
+  networkstatus_v2_list_clean(now);
+  /* Remove dead routers. */
+  routerlist_remove_old_routers();
+
+  /* Also, once per minute, check whether we want to download any
+   * networkstatus documents.
+   */
+  update_networkstatus_downloads(now);
+  return now + CHECK_DESCRIPTOR_INTERVAL;
+}
+
+/** Every 60 seconds, we relaunch listeners if any died. */
+static time_t
+check_listeners_callback(time_t now, const or_options_t *options)
+{
+  (void)options;
+  if (net_is_disabled())
+    return now;
+  retry_all_listeners(NULL, NULL, 0);
+  return now + 60;
+}
+
+/** How often do we check buffers and pools for empty space that can be
+ * deallocated? */
+#define MEM_SHRINK_INTERVAL (60)
+/** Release unused space from connection buffers and memory pools. */
+static time_t
+shrink_memory_callback(time_t now, const or_options_t *options)
+{
+  (void)options;
+  SMARTLIST_FOREACH(connection_array, connection_t *, conn, {
+      if (conn->outbuf)
+        buf_shrink(conn->outbuf);
+      if (conn->inbuf)
+        buf_shrink(conn->inbuf);
+    });
+  clean_cell_pool();
+  buf_shrink_freelists(0);
+  return now + MEM_SHRINK_INTERVAL;
+}
+
+/** How often do we write the bridge networkstatus file? */
+#define BRIDGE_STATUSFILE_INTERVAL (30*60)
+/** If we're a bridge authority, write the bridge networkstatus file to
+ * disk. */
+static time_t
+write_bridge_status_file_callback(time_t now, const or_options_t *options)
+{
+  if (!options->BridgeAuthoritativeDir)
+    return now;
+  networkstatus_dump_bridge_status_to_file(now);
+  return now + BRIDGE_STATUSFILE_INTERVAL;
+}
+
+/** How often do we poke the port forwarding helper? */
+#define PORT_FORWARDING_CHECK_INTERVAL 5
+/** If we're a server that uses a port forwarding app, check on it. */
+static time_t
+check_port_forwarding_callback(time_t now, const or_options_t *options)
+{
+  if (net_is_disabled() || !options->PortForwarding ||
+      !server_mode(options))
+    return now;
+  /* XXXXX this should take a list of ports, not just two! */
+  tor_check_port_forwarding(options->PortForwardingHelper,
+                            get_primary_dir_port(),
+                            get_primary_or_port(),
+                            now);
+  return now + PORT_FORWARDING_CHECK_INTERVAL;
+}
+
+/** Write the heartbeat message, if we've been asked to. */
+static time_t
+heartbeat_callback(time_t now, const or_options_t *options)
+{
+  if (!options->HeartbeatPeriod)
+    return now;
+  log_heartbeat(now);
+  /* Unlike the other deadlines, this one is due on the second itself, and
+   * scheduled_event_fire() waits for the second after it. */
+  return now + options->HeartbeatPeriod - 1;
+}
+
+/** One periodic job for run_scheduled_events(). */
+typedef struct scheduled_event_t {
+  /** Function that does the work and returns its next deadline. */
+  time_t (*fn)(time_t now, const or_options_t *options);
+  /** Our place on main_timewheel. */
+  timewheel_entry_t entry;
+} scheduled_event_t;
+
+/** Helper: declare a scheduled_event_t for <b>name</b>_callback(). */
+#define SCHEDULED_EVENT(name) { name ## _callback }
+
+/** Every periodic job, in the order they run when due on the same
+ * second. */
+static scheduled_event_t scheduled_events[] = {
+  SCHEDULED_EVENT(fetch_descriptors),
+  SCHEDULED_EVENT(reset_descriptor_failures),
+  SCHEDULED_EVENT(add_entropy),
+  SCHEDULED_EVENT(launch_reachability_tests),
+  SCHEDULED_EVENT(downrate_stability),
+  SCHEDULED_EVENT(save_stability),
+  SCHEDULED_EVENT(check_v3_certificate),
+  SCHEDULED_EVENT(check_expired_networkstatus),
+  SCHEDULED_EVENT(write_stats_files),
+  SCHEDULED_EVENT(clean_caches),
+  SCHEDULED_EVENT(retry_dns),
+  SCHEDULED_EVENT(check_descriptor),
+  SCHEDULED_EVENT(check_listeners),
+  SCHEDULED_EVENT(shrink_memory),
+  SCHEDULED_EVENT(write_bridge_status_file),
+  SCHEDULED_EVENT(check_port_forwarding),
+  SCHEDULED_EVENT(heartbeat),
+  { NULL }
+};
+
+/** Timewheel callback: run the scheduled_event_t in <b>arg</b>, and re-arm
+ * it for the second after the deadline it returns. */
+static void
+scheduled_event_fire(timewheel_t *wheel, void *arg, uint64_t now)
+{
+  scheduled_event_t *ev = arg;
+  time_t next = ev->fn((time_t)now, get_options());
+  timewheel_schedule(wheel, &ev->entry, (uint64_t)next + 1);
+}
+
+/** Arm every scheduled event to run at <b>now</b>. */
+static void
+scheduled_events_setup(time_t now)
+{
+  timewheel_t *wheel = get_main_timewheel();
+  scheduled_event_t *ev;
+  for (ev = scheduled_events; ev->fn; ++ev) {
+    timewheel_entry_init(&ev->entry, scheduled_event_fire, ev);
+    timewheel_schedule(wheel, &ev->entry, (uint64_t)now);
+  }
+  scheduled_events_initialized = 1;
+}
+
 /** Perform regular maintenance tasks.  This function gets run once per
  * second by second_elapsed_callback().
  */
@@ -1246,31 +1938,11 @@ static void
 run_scheduled_events(time_t now)
 {
   static time_t last_rotated_x509_certificate = 0;
-  static time_t time_to_check_v3_certificate = 0;
-  static time_t time_to_check_listeners = 0;
-  static time_t time_to_check_descriptor = 0;
-  static time_t time_to_check_ipaddress = 0;
-  static time_t time_to_shrink_memory = 0;
-  static time_t time_to_try_getting_descriptors = 0;
-  static time_t time_to_reset_descriptor_failures = 0;
-  static time_t time_to_add_entropy = 0;
-  static time_t time_to_write_bridge_status_file = 0;
-  static time_t time_to_downrate_stability = 0;
-  static time_t time_to_save_stability = 0;
-  static time_t time_to_clean_caches = 0;
-  static time_t time_to_recheck_bandwidth = 0;
-  static time_t time_to_check_for_expired_networkstatus = 0;
-  static time_t time_to_write_stats_files = 0;
   static time_t time_to_write_bridge_stats = 0;
-  static time_t time_to_check_port_forwarding = 0;
-  static time_t time_to_launch_reachability_tests = 0;
   static int should_init_bridge_stats = 1;
-  static time_t time_to_retry_dns_init = 0;
-  static time_t time_to_next_heartbeat = 0;
   const or_options_t *options = get_options();
 
   int is_server = server_mode(options);
-  int i;
   int have_dir_info;
 
   /** 0. See if we've been asked to shut down and our timeout has
@@ -1316,25 +1988,17 @@ run_scheduled_events(time_t now)
       router_upload_dir_desc_to_dirservers(0);
   }
 
-  if (!options->DisableNetwork && time_to_try_getting_descriptors < now) {
-    update_all_descriptor_downloads(now);
-    update_extrainfo_downloads(now);
-    if (router_have_minimum_dir_info())
-      time_to_try_getting_descriptors = now + LAZY_DESCRIPTOR_RETRY_INTERVAL;
-    else
-      time_to_try_getting_descriptors = now + GREEDY_DESCRIPTOR_RETRY_INTERVAL;
-  }
-
-  if (time_to_reset_descriptor_failures < now) {
-    router_reset_descriptor_download_failures();
-    time_to_reset_descriptor_failures =
-      now + DESCRIPTOR_FAILURE_RESET_INTERVAL;
-  }
+  /** 1b. Run every periodic job whose deadline has passed: descriptor
+   * fetches, stats writes, cache cleaning, and the rest of the table in
+   * scheduled_events[]. */
+  if (!scheduled_events_initialized)
+    scheduled_events_setup(now);
+  timewheel_advance(get_main_timewheel(), (uint64_t)now);
 
   if (options->UseBridges)
     fetch_bridge_descriptors(options, now);
 
-  /** 1b. Every MAX_SSL_KEY_LIFETIME_INTERNAL seconds, we change our
+  /** 1c. Every MAX_SSL_KEY_LIFETIME_INTERNAL seconds, we change our
    * TLS context. */
   if (!last_rotated_x509_certificate)
     last_rotated_x509_certificate = now;
@@ -1350,109 +2014,12 @@ run_scheduled_events(time_t now)
      * connection_run_housekeeping() above. */
   }
 
-  if (time_to_add_entropy < now) {
-    if (time_to_add_entropy) {
-      /* We already seeded once, so don't die on failure. */
-      crypto_seed_rng(0);
-    }
-/** How often do we add more entropy to OpenSSL's RNG pool? */
-#define ENTROPY_INTERVAL (60*60)
-    time_to_add_entropy = now + ENTROPY_INTERVAL;
-  }
-
-  /** 1c. If we have to change the accounting interval or record
+  /** 1d. If we have to change the accounting interval or record
    * bandwidth used in this accounting interval, do so. */
   if (accounting_is_enabled(options))
     accounting_run_housekeeping(now);
 
-  if (time_to_launch_reachability_tests < now &&
-      (authdir_mode_tests_reachability(options)) &&
-       !net_is_disabled()) {
-    time_to_launch_reachability_tests = now + REACHABILITY_TEST_INTERVAL;
-    /* try to determine reachability of the other Tor relays */
-    dirserv_test_reachability(now);
-  }
-
-  /** 1d. Periodically, we discount older stability information so that new
-   * stability info counts more, and save the stability information to disk as
-   * appropriate. */
-  if (time_to_downrate_stability < now)
-    time_to_downrate_stability = rep_hist_downrate_old_runs(now);
-  if (authdir_mode_tests_reachability(options)) {
-    if (time_to_save_stability < now) {
-      if (time_to_save_stability && rep_hist_record_mtbf_data(now, 1)<0) {
-        log_warn(LD_GENERAL, "Couldn't store mtbf data.");
-      }
-#define SAVE_STABILITY_INTERVAL (30*60)
-      time_to_save_stability = now + SAVE_STABILITY_INTERVAL;
-    }
-  }
-
-  /* 1e. Periodically, if we're a v3 authority, we check whether our cert is
-   * close to expiring and warn the admin if it is. */
-  if (time_to_check_v3_certificate < now) {
-    v3_authority_check_key_expiry();
-#define CHECK_V3_CERTIFICATE_INTERVAL (5*60)
-    time_to_check_v3_certificate = now + CHECK_V3_CERTIFICATE_INTERVAL;
-  }
-
-  /* 1f. Check whether our networkstatus has expired.
-   */
-  if (time_to_check_for_expired_networkstatus < now) {
-    networkstatus_t *ns = networkstatus_get_latest_consensus();
-    /*XXXX RD: This value needs to be the same as REASONABLY_LIVE_TIME in
-     * networkstatus_get_reasonably_live_consensus(), but that value is way
-     * way too high.  Arma: is the bridge issue there resolved yet? -NM */
-#define NS_EXPIRY_SLOP (24*60*60)
-    if (ns && ns->valid_until < now+NS_EXPIRY_SLOP &&
-        router_have_minimum_dir_info()) {
-      router_dir_info_changed();
-    }
-#define CHECK_EXPIRED_NS_INTERVAL (2*60)
-    time_to_check_for_expired_networkstatus = now + CHECK_EXPIRED_NS_INTERVAL;
-  }
-
-  /* 1g. Check whether we should write statistics to disk.
-   */
-  if (time_to_write_stats_files < now) {
-#define CHECK_WRITE_STATS_INTERVAL (60*60)
-    time_t next_time_to_write_stats_files = (time_to_write_stats_files > 0 ?
-           time_to_write_stats_files : now) + CHECK_WRITE_STATS_INTERVAL;
-    if (options->CellStatistics) {
-      time_t next_write =
-          rep_hist_buffer_stats_write(time_to_write_stats_files);
-      if (next_write && next_write < next_time_to_write_stats_files)
-        next_time_to_write_stats_files = next_write;
-    }
-    if (options->DirReqStatistics) {
-      time_t next_write = geoip_dirreq_stats_write(time_to_write_stats_files);
-      if (next_write && next_write < next_time_to_write_stats_files)
-        next_time_to_write_stats_files = next_write;
-    }
-    if (options->EntryStatistics) {
-      time_t next_write = geoip_entry_stats_write(time_to_write_stats_files);
-      if (next_write && next_write < next_time_to_write_stats_files)
-        next_time_to_write_stats_files = next_write;
-    }
-    if (options->ExitPortStatistics) {
-      time_t next_write = rep_hist_exit_stats_write(time_to_write_stats_files);
-      if (next_write && next_write < next_time_to_write_stats_files)
-        next_time_to_write_stats_files = next_write;
-    }
-    if (options->ConnDirectionStatistics) {
-      time_t next_write = rep_hist_conn_stats_write(time_to_write_stats_files);
-      if (next_write && next_write < next_time_to_write_stats_files)
-        next_time_to_write_stats_files = next_write;
-    }
-    if (options->BridgeAuthoritativeDir) {
-      time_t next_write = rep_hist_desc_stats_write(time_to_write_stats_files);
-      if (next_write && next_write < next_time_to_write_stats_files)
-        next_time_to_write_stats_files = next_write;
-    }
-    time_to_write_stats_files = next_time_to_write_stats_files;
-  }
-
-  /* 1h. Check whether we should write bridge statistics to disk.
+  /* 1e. Check whether we should write bridge statistics to disk.
    */
   if (should_record_bridge_info(options)) {
     if (time_to_write_bridge_stats < now) {
@@ -1474,83 +2041,7 @@ run_scheduled_events(time_t now)
     should_init_bridge_stats = 1;
   }
 
-  /* Remove old information from rephist and the rend cache. */
-  if (time_to_clean_caches < now) {
-    rep_history_clean(now - options->RephistTrackTime);
-    rend_cache_clean(now);
-    rend_cache_clean_v2_descs_as_dir(now);
-    microdesc_cache_rebuild(NULL, 0);
-#define CLEAN_CACHES_INTERVAL (30*60)
-    time_to_clean_caches = now + CLEAN_CACHES_INTERVAL;
-  }
-
-#define RETRY_DNS_INTERVAL (10*60)
-  /* If we're a server and initializing dns failed, retry periodically. */
-  if (time_to_retry_dns_init < now) {
-    time_to_retry_dns_init = now + RETRY_DNS_INTERVAL;
-    if (is_server && has_dns_init_failed())
-      dns_init();
-  }
-
-  /** 2. Periodically, we consider force-uploading our descriptor
-   * (if we've passed our internal checks). */
-
-/** How often do we check whether part of our router info has changed in a way
- * that would require an upload? */
-#define CHECK_DESCRIPTOR_INTERVAL (60)
-/** How often do we (as a router) check whether our IP address has changed? */
-#define CHECK_IPADDRESS_INTERVAL (15*60)
-
-  /* 2b. Once per minute, regenerate and upload the descriptor if the old
-   * one is inaccurate. */
-  if (time_to_check_descriptor < now && !options->DisableNetwork) {
-    static int dirport_reachability_count = 0;
-    time_to_check_descriptor = now + CHECK_DESCRIPTOR_INTERVAL;
-    check_descriptor_bandwidth_changed(now);
-    if (time_to_check_ipaddress < now) {
-      time_to_check_ipaddress = now + CHECK_IPADDRESS_INTERVAL;
-      check_descriptor_ipaddress_changed(now);
-    }
-    mark_my_descriptor_dirty_if_too_old(now);
-    consider_publishable_server(0);
-    /* also, check religiously for reachability, if it's within the first
-     * 20 minutes of our uptime. */
-    if (is_server &&
-        (can_complete_circuit || !any_predicted_circuits(now)) &&
-        !we_are_hibernating()) {
-      if (stats_n_seconds_working < TIMEOUT_UNTIL_UNREACHABILITY_COMPLAINT) {
-        consider_testing_reachability(1, dirport_reachability_count==0);
-        if (++dirport_reachability_count > 5)
-          dirport_reachability_count = 0;
-      } else if (time_to_recheck_bandwidth < now) {
-        /* If we haven't checked for 12 hours and our bandwidth estimate is
-         * low, do another bandwidth test. This is especially important for
-         * bridges, since they might go long periods without much use. */
-        const routerinfo_t *me = router_get_my_routerinfo();
-        if (time_to_recheck_bandwidth && me &&
-            me->bandwidthcapacity < me->bandwidthrate &&
-            me->bandwidthcapacity < 51200) {
-          reset_bandwidth_test();
-        }
-#define BANDWIDTH_RECHECK_INTERVAL (12*60*60)
-        time_to_recheck_bandwidth = now + BANDWIDTH_RECHECK_INTERVAL;
-      }
-    }
-
-    /* If any networkstatus documents are no longer recent, we need to
-     * update all the descriptors' running status. */
-    /* purge obsolete entries */
-    networkstatus_v2_list_clean(now);
-    /* Remove dead routers. */
-    routerlist_remove_old_routers();
-
-    /* Also, once per minute, check whether we want to download any
-     * networkstatus documents.
-     */
-    update_networkstatus_downloads(now);
-  }
-
-  /** 2c. Let directory voting happen. */
+  /** 2. Let directory voting happen. */
   if (authdir_mode_v3(options))
     dirvote_act(options, now);
 
@@ -1574,12 +2065,6 @@ run_scheduled_events(time_t now)
    */
   connection_expire_held_open();
 
-  /** 3d. And every 60 seconds, we relaunch listeners if any died. */
-  if (!net_is_disabled() && time_to_check_listeners < now) {
-    retry_all_listeners(NULL, NULL, 0);
-    time_to_check_listeners = now+60;
-  }
-
   /** 4. Every second, we try a new circuit if there are no valid
    *    circuits. Every NewCircuitPeriod seconds, we expire circuits
    *    that became dirty more than MaxCircuitDirtiness seconds ago,
@@ -1593,25 +2078,10 @@ run_scheduled_events(time_t now)
   if (now % 10 == 5)
     circuit_expire_old_circuits_serverside(now);
 
-  /** 5. We do housekeeping for each connection... */
+  /** 5. We decide which OR connections are no longer good for new
+   * circuits.  (Per-connection housekeeping runs off each connection's own
+   * timer in step 1b.) */
   connection_or_set_bad_connections(NULL, 0);
-  for (i=0;i<smartlist_len(connection_array);i++) {
-    run_connection_housekeeping(i, now);
-  }
-  if (time_to_shrink_memory < now) {
-    SMARTLIST_FOREACH(connection_array, connection_t *, conn, {
-        if (conn->outbuf)
-          buf_shrink(conn->outbuf);
-        if (conn->inbuf)
-          buf_shrink(conn->inbuf);
-      });
-    clean_cell_pool();
-    buf_shrink_freelists(0);
-/** How often do we check buffers and pools for empty space that can be
- * deallocated? */
-#define MEM_SHRINK_INTERVAL (60)
-    time_to_shrink_memory = now + MEM_SHRINK_INTERVAL;
-  }
 
   /** 6. And remove any marked circuits... */
   circuit_close_all_marked();
@@ -1645,38 +2115,9 @@ run_scheduled_events(time_t now)
     }
   }
 
-  /** 10. write bridge networkstatus file to disk */
-  if (options->BridgeAuthoritativeDir &&
-      time_to_write_bridge_status_file < now) {
-    networkstatus_dump_bridge_status_to_file(now);
-#define BRIDGE_STATUSFILE_INTERVAL (30*60)
-    time_to_write_bridge_status_file = now+BRIDGE_STATUSFILE_INTERVAL;
-  }
-
-  /** 11. check the port forwarding app */
-  if (!net_is_disabled() &&
-      time_to_check_port_forwarding < now &&
-      options->PortForwarding &&
-      is_server) {
-#define PORT_FORWARDING_CHECK_INTERVAL 5
-    /* XXXXX this should take a list of ports, not just two! */
-    tor_check_port_forwarding(options->PortForwardingHelper,
-                              get_primary_dir_port(),
-                              get_primary_or_port(),
-                              now);
-    time_to_check_port_forwarding = now+PORT_FORWARDING_CHECK_INTERVAL;
-  }
-
-  /** 11b. check pending unconfigured managed proxies */
+  /** 10. check pending unconfigured managed proxies */
   if (!net_is_disabled() && pt_proxies_configuration_pending())
     pt_configure_remaining_proxies();
-
-  /** 12. write the heartbeat message */
-  if (options->HeartbeatPeriod &&
-      time_to_next_heartbeat <= now) {
-    log_heartbeat(now);
-    time_to_next_heartbeat = now+options->HeartbeatPeriod;
-  }
 }
 
 /** Timer: used to invoke second_elapsed_callback() once per second. */
@@ -1701,6 +2142,7 @@ second_elapsed_callback(periodic_timer_t *timer, void *arg)
   (void)arg;
 
   n_libevent_errors = 0;
+  tor_gettimeofday_cache_clear();
 
   /* log_notice(LD_GENERAL, "Tick."); */
   now = time(NULL);
@@ -1787,12 +2229,12 @@ static periodic_timer_t *refill_timer = NULL;
 static void
 refill_callback(periodic_timer_t *timer, void *arg)
 {
-  static struct timeval current_millisecond;
-  struct timeval now;
+  static time_t last_refill_second = 0;
+  time_t now;
 
+  uint64_t cur_read, cur_written;
   size_t bytes_written;
   size_t bytes_read;
-  int milliseconds_elapsed = 0;
   int seconds_rolled_over = 0;
 
   const or_options_t *options = get_options();
@@ -1800,63 +2242,152 @@ refill_callback(periodic_timer_t *timer, void *arg)
   (void)timer;
   (void)arg;
 
-  tor_gettimeofday(&now);
+  /* The buckets read the cached monotonic clock; make sure it's fresh. */
+  tor_gettimeofday_cache_clear();
+  now = time(NULL);
 
   /* If this is our first time, no time has passed. */
-  if (current_millisecond.tv_sec) {
-    long mdiff = tv_mdiff(&current_millisecond, &now);
-    if (mdiff > INT_MAX)
-      mdiff = INT_MAX;
-    milliseconds_elapsed = (int)mdiff;
-    seconds_rolled_over = (int)(now.tv_sec - current_millisecond.tv_sec);
-  }
+  if (last_refill_second)
+    seconds_rolled_over = (int)(now - last_refill_second);
 
-  bytes_written = stats_prev_global_write_bucket - global_write_bucket;
-  bytes_read = stats_prev_global_read_bucket - global_read_bucket;
+  connection_get_rate_limit_totals(&cur_read, &cur_written);
+  bytes_written = (size_t)(cur_written - stats_prev_rate_limited_written);
+  bytes_read = (size_t)(cur_read - stats_prev_rate_limited_read);
 
   stats_n_bytes_read += bytes_read;
   stats_n_bytes_written += bytes_written;
-  if (accounting_is_enabled(options) && milliseconds_elapsed >= 0)
+  if (accounting_is_enabled(options) && seconds_rolled_over >= 0)
     accounting_add_bytes(bytes_read, bytes_written, seconds_rolled_over);
 
-  if (milliseconds_elapsed > 0)
-    connection_bucket_refill(milliseconds_elapsed, now.tv_sec);
+  connection_bucket_refill(now);
 
-  stats_prev_global_read_bucket = global_read_bucket;
-  stats_prev_global_write_bucket = global_write_bucket;
+  stats_prev_rate_limited_read = cur_read;
+  stats_prev_rate_limited_written = cur_written;
 
-  current_millisecond = now; /* remember what time it is, for next time */
+  last_refill_second = now; /* remember what time it is, for next time */
 }
 #endif
 
 #ifdef LIBRARY
 
-/** Timer: used to invoke command pooling(). */
-static periodic_timer_t *onionroute_timer = NULL;
-
 /* XXX remove me once library is re-entrant */
-/* command queue */
-smartlist_t *cqueue;
+/** Commands queued by API calls from other threads, waiting to be run by
+ * the main loop. */
+static mpsc_ring_t *onionroute_command_ring = NULL;
+/** Socket pair used to wake the main loop when the command ring goes from
+ * idle to non-empty: API callers write to [1], the main loop reads [0]. */
+static tor_socket_t onionroute_wakeup_fds[2] = { TOR_INVALID_SOCKET,
+                                                 TOR_INVALID_SOCKET };
+/** Libevent event that fires when onionroute_wakeup_fds[0] is readable. */
+static struct event *onionroute_wakeup_event = NULL;
+/** How many commands have we refused because the command ring was full? */
+static volatile uint32_t onionroute_n_commands_rejected = 0;
+
+/** Create the command ring and the socket pair used to wake the main loop
+ * for it.  Return 0 on success, -1 on failure. */
+static int
+onionroute_command_queue_init(void)
+{
+  int err;
 
-/* XXX remove me once library is re-entrant */
-/** Libevent callback: invoked periodically to read commands and permit multithreaded access to libtor. */
-static void
-onionroute_timer_callback(periodic_timer_t *timer, void *arg)
+  if (onionroute_command_ring)
+    return 0;
+
+  if ((err = tor_socketpair(AF_UNIX, SOCK_STREAM, 0,
+                            onionroute_wakeup_fds)) < 0) {
+    log_err(LD_NET, "Couldn't construct socketpair for the command queue: %s",
+            tor_socket_strerror(-err));
+    return -1;
+  }
+  set_socket_nonblocking(onionroute_wakeup_fds[0]);
+  set_socket_nonblocking(onionroute_wakeup_fds[1]);
+
+  onionroute_command_ring = mpsc_ring_new(ONIONROUTE_COMMAND_QUEUE_SIZE);
+  return 0;
+}
+
+/** Return true iff the command queue has been set up, so that commands can
+ * be handed to the main loop with onionroute_command_enqueue(). */
+int
+onionroute_command_queue_is_ready(void)
 {
-	onionroute_command_t *cmd;
+  return onionroute_command_ring != NULL;
+}
 
-	/* lock the smartlist before so we process it in order */
-	smartlist_lock(cqueue);
+/** Queue <b>processor</b> to be called with <b>data</b> from the main loop,
+ * and wake the main loop up if it isn't already going to look at the queue.
+ * Safe to call from any thread.  Return 0 on success, or
+ * ONIONROUTE_ERR_QUEUE_FULL if the command wasn't queued; in that case the
+ * caller still owns <b>data</b>. */
+int
+onionroute_command_enqueue(onionroute_command_processor_t processor,
+                           void *data)
+{
+  onionroute_command_t *cmd;
+  int r;
 
-	smartlist_reverse(cqueue);
+  tor_assert(onionroute_command_ring);
 
-	while(NULL != (cmd = (onionroute_command_t *)smartlist_pop_last(cqueue)))
-	{
-		cmd->processor(cmd->data);
-		tor_free(cmd);
-	}
+  cmd = tor_malloc(sizeof(onionroute_command_t));
+  cmd->processor = processor;
+  cmd->data = data;
+
+  r = mpsc_ring_push(onionroute_command_ring, cmd);
+  if (r < 0) {
+    tor_atomic_add_u32(&onionroute_n_commands_rejected, 1);
+    tor_free(cmd);
+    return ONIONROUTE_ERR_QUEUE_FULL;
+  }
+
+  if (r > 0) {
+    /* We're the first command since the main loop last looked: poke it.  If
+     * the socket is full, a wakeup is already pending anyway. */
+    char b = 0;
+    send(onionroute_wakeup_fds[1], &b, 1, 0);
+  }
 
-	smartlist_unlock(cqueue);
+  return 0;
+}
+
+ONIONROUTE_API
+void
+onionroute_get_command_queue_stats_v1(unsigned int *depth,
+                                      unsigned int *capacity,
+                                      unsigned int *n_rejected)
+{
+  if (depth)
+    *depth = onionroute_command_ring ?
+      mpsc_ring_len(onionroute_command_ring) : 0;
+  if (capacity)
+    *capacity = onionroute_command_ring ?
+      mpsc_ring_capacity(onionroute_command_ring) : 0;
+  if (n_rejected)
+    *n_rejected = onionroute_n_commands_rejected;
+}
+
+/* XXX remove me once library is re-entrant */
+/** Libevent callback: invoked when an API call has queued commands, to run
+ * them in the main thread in the order they were queued. */
+static void
+onionroute_wakeup_callback(evutil_socket_t fd, short event, void *arg)
+{
+  char buf[64];
+  onionroute_command_t *cmd;
+  (void)event;
+  (void)arg;
+
+  /* Drain the wakeup bytes, then reset the ring's wakeup flag before
+   * looking at the ring, so that a command queued after we stop popping
+   * always triggers another wakeup. */
+  while (recv(fd, buf, sizeof(buf), 0) > 0)
+    ;
+  mpsc_ring_begin_drain(onionroute_command_ring);
+
+  while (NULL != (cmd = mpsc_ring_pop(onionroute_command_ring)))
+  {
+    cmd->processor(cmd->data);
+    tor_free(cmd);
+  }
 }
 #endif
 
@@ -2016,15 +2547,11 @@ onionroute_do_main_loop_v1(void)
     }
   }
 
-  /* Set up the packed_cell_t memory pool. */
+  /* Set up the memory pool for cell queue pages. */
   init_cell_pool();
 
   /* Set up our buckets */
   connection_bucket_init();
-#ifndef USE_BUFFEREVENTS
-  stats_prev_global_read_bucket = global_read_bucket;
-  stats_prev_global_write_bucket = global_write_bucket;
-#endif
 
   /* initialize the bootstrap status events to know we're starting up */
   control_event_bootstrap(BOOTSTRAP_STATUS_STARTING, 0);
@@ -2084,21 +2611,14 @@ onionroute_do_main_loop_v1(void)
 #endif
 
 #ifdef LIBRARY
-
-  /* XXX remove me once library is re-entrant */
-  /* probably a better approach would be to send a signal */
-  if (!onionroute_timer) {
-    struct timeval refill_interval;
-    int msecs = 200;
-
-    refill_interval.tv_sec =  msecs/1000;
-    refill_interval.tv_usec = (msecs%1000)*1000;
-
-    onionroute_timer = periodic_timer_new(tor_libevent_get_base(),
-                                      &refill_interval,
-                                      onionroute_timer_callback,
-                                      NULL);
-    tor_assert(onionroute_timer);
+  if (!onionroute_wakeup_event) {
+    onionroute_wakeup_event = tor_event_new(tor_libevent_get_base(),
+                                            onionroute_wakeup_fds[0],
+                                            EV_READ|EV_PERSIST,
+                                            onionroute_wakeup_callback,
+                                            NULL);
+    tor_assert(onionroute_wakeup_event);
+    event_add(onionroute_wakeup_event, NULL);
   }
 #endif
 
@@ -2605,6 +3125,7 @@ tor_free_all(int postfork)
   entry_guards_free_all();
   pt_free_all();
   connection_free_all();
+  scheduler_free_all();
   buf_shrink_freelists(1);
   memarea_clear_freelist();
   nodelist_free_all();
@@ -2624,6 +3145,9 @@ tor_free_all(int postfork)
   smartlist_free(closeable_connection_lst);
   smartlist_free(active_linked_connection_lst);
   periodic_timer_free(second_timer);
+  timewheel_free(main_timewheel);
+  main_timewheel = NULL;
+  scheduled_events_initialized = 0;
   if (!postfork) {
     release_lockfile();
   }
@@ -2743,41 +3267,566 @@ find_flashcard_path(PWCHAR path, size_t size)
 
 #ifdef LIBRARY
 
-/* XXX : Fixme this is win32 specific */
-HANDLE ghReadEvent;
-smartlist_t *readqueue;
-smartlist_t *closequeue;
+/** Receive side of one library stream: the bytes the application has not
+ * read yet, whether the stream has closed, and, once somebody waits on it,
+ * a descriptor that is readable exactly when a read would not block.
+ *
+ * While the stream's edge connection is alive it points at this entry
+ * (edge_connection_t.recv_stream) and relay.c appends DATA cells to it
+ * directly; the ring is then bounded by ONIONROUTE_RECV_RING_MAX, and
+ * stream-level SENDMEs wait until the application has made room.
+ *
+ * The main loop fills these and application threads drain them, so every
+ * field is protected by onionroute_recv_lock. */
+typedef struct onionroute_recv_stream_t
+{
+  HT_ENTRY(onionroute_recv_stream_t) node;
+  void *id;
+  /** Circular buffer of unread bytes; cap is zero or a power of two. */
+  char *buf;
+  size_t cap;
+  size_t head;
+  size_t len;
+  /** True once the stream closed; readers get -1 after the last byte. */
+  unsigned int closed:1;
+  /** True iff notify_fds[0] currently has a wakeup waiting on it. */
+  unsigned int signaled:1;
+  /** True while an edge connection points at this entry. */
+  unsigned int attached:1;
+  /** True once a reader has been told about the close. */
+  unsigned int eof_reported:1;
+  /** True iff the main loop held back a SENDME for lack of room and wants
+   * to hear when the application reads. */
+  unsigned int want_sendme:1;
+  /** Number of threads blocked in onionroute_recv_stream_data_v1(); the
+   * entry must not be freed while this is nonzero. */
+  int n_waiters;
+  /** Readable while there is data or EOF to report. Created on demand;
+   * with eventfd both entries are the same descriptor. */
+  tor_socket_t notify_fds[2];
+} onionroute_recv_stream_t;
+
+/** Protects onionroute_recv_streams and everything in it. */
+static tor_mutex_t *onionroute_recv_lock = NULL;
+
+#define ONIONROUTE_HANDLE_SHIFT (sizeof(uintptr_t)*4)
+
+/** Map from stream handle to onionroute_recv_stream_t. */
+static HT_HEAD(onionroute_recv_map, onionroute_recv_stream_t)
+     onionroute_recv_streams = HT_INITIALIZER();
+
+/** Helper: hash a recv stream by its id. */
+static INLINE unsigned int
+onionroute_recv_stream_hash(onionroute_recv_stream_t *rs)
+{
+  uintptr_t p = (uintptr_t)rs->id;
+  return (unsigned int)p ^ (unsigned int)(p >> ONIONROUTE_HANDLE_SHIFT);
+}
 
-ONIONROUTE_API
-int onionroute_init_v1()
+/** Helper: return true iff two recv streams have the same id. */
+static INLINE int
+onionroute_recv_stream_eq(onionroute_recv_stream_t *a,
+                          onionroute_recv_stream_t *b)
 {
-	char* msg;
-	update_approx_time(time(NULL));
+  return a->id == b->id;
+}
 
-#ifdef LIBRARY
-	/* XXX remove me once library is re-entrant */
-	/* initialize library command queue */
-	readqueue = smartlist_new();
+HT_PROTOTYPE(onionroute_recv_map, onionroute_recv_stream_t, node,
+             onionroute_recv_stream_hash, onionroute_recv_stream_eq)
+HT_GENERATE(onionroute_recv_map, onionroute_recv_stream_t, node,
+            onionroute_recv_stream_hash, onionroute_recv_stream_eq, 0.6,
+            malloc, realloc, free)
 
+/** Return the receive state for <b>id</b>, creating it if <b>create</b> is
+ * set. Caller must hold onionroute_recv_lock. */
+static onionroute_recv_stream_t *
+onionroute_recv_stream_get(void *id, int create)
+{
+  onionroute_recv_stream_t search, *rs;
+
+  search.id = id;
+  rs = HT_FIND(onionroute_recv_map, &onionroute_recv_streams, &search);
+  if (!rs && create) {
+    rs = tor_malloc_zero(sizeof(onionroute_recv_stream_t));
+    rs->id = id;
+    rs->notify_fds[0] = rs->notify_fds[1] = TOR_INVALID_SOCKET;
+    HT_INSERT(onionroute_recv_map, &onionroute_recv_streams, rs);
+  }
+  return rs;
+}
 
-	ghReadEvent = CreateEvent( 
-        NULL,               // default security attributes
-        TRUE,               // manual-reset event
-        FALSE,              // initial state is nonsignaled
-        TEXT("ReadEvent")  // object name
-        ); 
+/** Release all storage held by <b>rs</b>, which must already be out of the
+ * map. */
+static void
+onionroute_recv_stream_free(onionroute_recv_stream_t *rs)
+{
+  if (SOCKET_OK(rs->notify_fds[0])) {
+#ifdef HAVE_SYS_EVENTFD_H
+    close(rs->notify_fds[0]);
+#else
+    tor_close_socket(rs->notify_fds[0]);
+    tor_close_socket(rs->notify_fds[1]);
+#endif
+  }
+  tor_free(rs->buf);
+  tor_free(rs);
+}
 
-    if (ghReadEvent == NULL) 
-    {
-		log_err(LD_BUG, "CreateEvent failed (%d). Closing", GetLastError());
-		return -1;
+/** Make <b>rs</b>'s notify descriptor agree with its contents: readable iff
+ * a reader would not block. Caller must hold onionroute_recv_lock. */
+static void
+onionroute_recv_stream_update_notify(onionroute_recv_stream_t *rs)
+{
+  int ready = rs->len > 0 || rs->closed;
+
+  if (!SOCKET_OK(rs->notify_fds[0]) || ready == (int)rs->signaled)
+    return;
+
+#ifdef HAVE_SYS_EVENTFD_H
+  {
+    uint64_t v = 1;
+    if (ready)
+      (void) write(rs->notify_fds[1], &v, sizeof(v));
+    else
+      (void) read(rs->notify_fds[0], &v, sizeof(v));
+  }
+#else
+  {
+    char b = 0;
+    if (ready)
+      send(rs->notify_fds[1], &b, 1, 0);
+    else
+      recv(rs->notify_fds[0], &b, 1, 0);
+  }
+#endif
+  rs->signaled = ready;
+}
+
+/** Create <b>rs</b>'s notify descriptor if it doesn't have one yet. Return
+ * 0 on success, -1 on failure. Caller must hold onionroute_recv_lock. */
+static int
+onionroute_recv_stream_open_notify(onionroute_recv_stream_t *rs)
+{
+  if (SOCKET_OK(rs->notify_fds[0]))
+    return 0;
+
+#ifdef HAVE_SYS_EVENTFD_H
+  rs->notify_fds[0] = eventfd(0, EFD_NONBLOCK);
+  if (rs->notify_fds[0] < 0) {
+    log_warn(LD_NET, "Couldn't create eventfd for stream: %s",
+             strerror(errno));
+    rs->notify_fds[0] = TOR_INVALID_SOCKET;
+    return -1;
+  }
+  rs->notify_fds[1] = rs->notify_fds[0];
+#else
+  {
+    int r;
+    if ((r = tor_socketpair(AF_UNIX, SOCK_STREAM, 0, rs->notify_fds)) < 0) {
+      log_warn(LD_NET, "Couldn't create socketpair for stream: %s",
+               tor_socket_strerror(-r));
+      rs->notify_fds[0] = rs->notify_fds[1] = TOR_INVALID_SOCKET;
+      return -1;
     }
+    set_socket_nonblocking(rs->notify_fds[0]);
+    set_socket_nonblocking(rs->notify_fds[1]);
+  }
+#endif
+  rs->signaled = 0;
+  onionroute_recv_stream_update_notify(rs);
+  return 0;
+}
 
-	readqueue = smartlist_new();
-	closequeue = smartlist_new();
-	cqueue = smartlist_new();
+/** Append <b>len</b> bytes from <b>data</b> to <b>rs</b>, growing its
+ * buffer as needed. Caller must hold onionroute_recv_lock. */
+static void
+onionroute_recv_stream_append(onionroute_recv_stream_t *rs,
+                              const char *data, size_t len)
+{
+  size_t tail, n;
+
+  if (rs->len + len > rs->cap) {
+    size_t newcap = rs->cap ? rs->cap : 4096;
+    char *newbuf;
+    while (newcap < rs->len + len)
+      newcap <<= 1;
+    newbuf = tor_malloc(newcap);
+    /* unwrap the old contents to the start of the new buffer */
+    n = MIN(rs->len, rs->cap - rs->head);
+    if (n)
+      memcpy(newbuf, rs->buf + rs->head, n);
+    if (rs->len > n)
+      memcpy(newbuf + n, rs->buf, rs->len - n);
+    tor_free(rs->buf);
+    rs->buf = newbuf;
+    rs->cap = newcap;
+    rs->head = 0;
+  }
 
+  tail = (rs->head + rs->len) & (rs->cap - 1);
+  n = MIN(len, rs->cap - tail);
+  memcpy(rs->buf + tail, data, n);
+  if (len > n)
+    memcpy(rs->buf, data + n, len - n);
+  rs->len += len;
+}
+
+/** Move up to <b>len</b> bytes from the front of <b>rs</b> into <b>out</b>;
+ * return how many were moved. Caller must hold onionroute_recv_lock. */
+static size_t
+onionroute_recv_stream_take(onionroute_recv_stream_t *rs, char *out,
+                            size_t len)
+{
+  size_t n;
+
+  if (len > rs->len)
+    len = rs->len;
+  n = MIN(len, rs->cap - rs->head);
+  if (n)
+    memcpy(out, rs->buf + rs->head, n);
+  if (len > n)
+    memcpy(out + n, rs->buf, len - n);
+  rs->len -= len;
+  rs->head = rs->len ? (rs->head + len) & (rs->cap - 1) : 0;
+  return len;
+}
+
+/** Main loop side of a receive ring draining: see whether the stream
+ * <b>data</b> can send the SENDME it held back. */
+static void
+recv_sendme_command_processor(void *data)
+{
+  edge_connection_t *conn = onionroute_handle_get_conn(data);
+
+  if (conn && conn->recv_stream)
+    connection_edge_consider_sending_sendme(conn);
+}
+
+/** Free <b>rs</b> if neither its connection nor any reader can still get
+ * at it. Caller must hold onionroute_recv_lock. Return true iff freed. */
+static int
+onionroute_recv_stream_maybe_free(onionroute_recv_stream_t *rs)
+{
+  if (rs->attached || !rs->eof_reported || rs->len || rs->n_waiters)
+    return 0;
+  HT_REMOVE(onionroute_recv_map, &onionroute_recv_streams, rs);
+  onionroute_recv_stream_free(rs);
+  return 1;
+}
+
+/** Body of onionroute_try_recv_stream_data_v1(); caller must hold
+ * onionroute_recv_lock, and should offer <b>rs</b> to
+ * onionroute_recv_stream_maybe_free() when this returns -1. */
+static int
+onionroute_recv_stream_read(onionroute_recv_stream_t *rs, char *buffer,
+                            size_t buffersize)
+{
+  int r;
+
+  if (rs->len) {
+    if (buffersize > INT_MAX)
+      buffersize = INT_MAX;
+    r = (int)onionroute_recv_stream_take(rs, buffer, buffersize);
+
+    /* Once half the ring is free, let the main loop retry the SENDME it
+     * held back; it checks the real window itself. */
+    if (rs->want_sendme && rs->len <= ONIONROUTE_RECV_RING_MAX / 2) {
+      rs->want_sendme = 0;
+      if (onionroute_command_enqueue(recv_sendme_command_processor,
+                                     rs->id) < 0)
+        rs->want_sendme = 1;
+    }
+  } else if (rs->closed) {
+    /* The caller frees rs with onionroute_recv_stream_maybe_free() once it
+     * is done with it. */
+    rs->eof_reported = 1;
+    return -1;
+  } else {
+    return ONIONROUTE_ERR_WOULD_BLOCK;
+  }
+
+  onionroute_recv_stream_update_notify(rs);
+  return r;
+}
+
+/** Start buffering incoming data for the library stream <b>id</b> until the
+ * application reads it, and return the ring to give to relay.c. */
+onionroute_recv_stream_t *
+onionroute_recv_stream_attach(void *id)
+{
+  onionroute_recv_stream_t *rs;
+
+  tor_mutex_acquire(onionroute_recv_lock);
+  rs = onionroute_recv_stream_get(id, 1);
+  rs->attached = 1;
+  tor_mutex_release(onionroute_recv_lock);
+
+  return rs;
+}
+
+/** The connection that was feeding <b>rs</b> is gone: report end of stream
+ * once the application has read what is left. */
+void
+onionroute_recv_stream_detach(onionroute_recv_stream_t *rs)
+{
+  tor_mutex_acquire(onionroute_recv_lock);
+  rs->attached = 0;
+  rs->closed = 1;
+  rs->want_sendme = 0;
+  if (!onionroute_recv_stream_maybe_free(rs))
+    onionroute_recv_stream_update_notify(rs);
+  tor_mutex_release(onionroute_recv_lock);
+}
+
+/** Append a DATA cell's <b>len</b> bytes to <b>rs</b>. Return -1 if that
+ * would overrun the ring, meaning the exit ignored our stream window. */
+int
+onionroute_recv_stream_deliver(onionroute_recv_stream_t *rs,
+                               const char *data, size_t len)
+{
+  int r = 0;
+
+  tor_mutex_acquire(onionroute_recv_lock);
+  if (rs->len + len > ONIONROUTE_RECV_RING_MAX) {
+    r = -1;
+  } else {
+    onionroute_recv_stream_append(rs, data, len);
+    onionroute_recv_stream_update_notify(rs);
+  }
+  tor_mutex_release(onionroute_recv_lock);
+
+  return r;
+}
+
+/** Return true iff <b>rs</b> could take <b>len</b> more bytes right now.
+ * If not, remember to poke the main loop when the application reads. */
+int
+onionroute_recv_stream_has_room(onionroute_recv_stream_t *rs, size_t len)
+{
+  int r;
+
+  tor_mutex_acquire(onionroute_recv_lock);
+  r = rs->len + len <= ONIONROUTE_RECV_RING_MAX;
+  if (!r)
+    rs->want_sendme = 1;
+  tor_mutex_release(onionroute_recv_lock);
+
+  return r;
+}
+
+/** Stream handles.
+ *
+ * Applications never see our connection pointers; every library stream is
+ * named by an opaque handle that onionroute_stream_open_v3() hands out
+ * before the stream exists. A handle packs a slot index (plus one, so a
+ * handle is never NULL) in its low half and the slot's generation in its
+ * high half. Freeing a slot bumps its generation, so a handle kept past
+ * the end of its stream can never reach whatever reuses the slot later.
+ * Rather than let a generation wrap around, we retire a slot for good once
+ * it has used them all; that only matters where pointers are 32 bits, and
+ * a slot there lasts 65535 streams.
+ *
+ * Handles are made on application threads and bound, resolved and freed
+ * on the main loop, so the table has a lock of its own. */
+typedef struct onionroute_handle_slot_t
+{
+  /** The stream's connection, or NULL until the main loop has made it. */
+  edge_connection_t *conn;
+  uintptr_t gen;
+  /** Next slot on the free list, or -1. */
+  int next_free;
+  unsigned int in_use:1;
+} onionroute_handle_slot_t;
+
+#define ONIONROUTE_HANDLE_MASK ((((uintptr_t)1)<<ONIONROUTE_HANDLE_SHIFT)-1)
+
+/** Protects every onionroute_handle_* variable below. */
+static tor_mutex_t *onionroute_handle_lock = NULL;
+static onionroute_handle_slot_t *onionroute_handle_slots = NULL;
+static int onionroute_handle_n_slots = 0;
+static int onionroute_handle_free_head = -1;
+
+/** Return the slot <b>id</b> names, or NULL if it was never handed out or
+ * its stream is gone. Caller must hold onionroute_handle_lock. */
+static onionroute_handle_slot_t *
+onionroute_handle_lookup(void *id)
+{
+  uintptr_t h = (uintptr_t)id;
+  uintptr_t idx = h & ONIONROUTE_HANDLE_MASK;
+  onionroute_handle_slot_t *slot;
+
+  if (!idx || idx > (uintptr_t)onionroute_handle_n_slots)
+    return NULL;
+  slot = &onionroute_handle_slots[idx-1];
+  if (!slot->in_use || slot->gen != (h >> ONIONROUTE_HANDLE_SHIFT))
+    return NULL;
+  return slot;
+}
+
+/** Hand out a new stream handle, or NULL if we are out of slots. */
+void *
+onionroute_handle_new(void)
+{
+  onionroute_handle_slot_t *slot;
+  void *id = NULL;
+  int i, n;
+
+  tor_mutex_acquire(onionroute_handle_lock);
+  if (onionroute_handle_free_head < 0) {
+    n = onionroute_handle_n_slots ? onionroute_handle_n_slots*2 : 64;
+    if ((uintptr_t)n > ONIONROUTE_HANDLE_MASK)
+      n = (int)ONIONROUTE_HANDLE_MASK;
+    if (n <= onionroute_handle_n_slots)
+      goto done;
+    onionroute_handle_slots = tor_realloc(onionroute_handle_slots,
+                                     n*sizeof(onionroute_handle_slot_t));
+    memset(onionroute_handle_slots + onionroute_handle_n_slots, 0,
+           (n-onionroute_handle_n_slots)*sizeof(onionroute_handle_slot_t));
+    for (i = n-1; i >= onionroute_handle_n_slots; --i) {
+      onionroute_handle_slots[i].next_free = onionroute_handle_free_head;
+      onionroute_handle_free_head = i;
+    }
+    onionroute_handle_n_slots = n;
+  }
+
+  i = onionroute_handle_free_head;
+  slot = &onionroute_handle_slots[i];
+  onionroute_handle_free_head = slot->next_free;
+  slot->in_use = 1;
+  slot->conn = NULL;
+  id = (void *)((slot->gen << ONIONROUTE_HANDLE_SHIFT) | (uintptr_t)(i+1));
+ done:
+  tor_mutex_release(onionroute_handle_lock);
+  return id;
+}
+
+/** Return true iff <b>id</b> still names a stream that has not ended. */
+int
+onionroute_handle_is_live(void *id)
+{
+  int r;
+
+  tor_mutex_acquire(onionroute_handle_lock);
+  r = onionroute_handle_lookup(id) != NULL;
+  tor_mutex_release(onionroute_handle_lock);
+
+  return r;
+}
+
+/** Point <b>id</b> at the connection the main loop made for it. */
+void
+onionroute_handle_bind(void *id, edge_connection_t *conn)
+{
+  onionroute_handle_slot_t *slot;
+
+  tor_mutex_acquire(onionroute_handle_lock);
+  slot = onionroute_handle_lookup(id);
+  if (slot)
+    slot->conn = conn;
+  tor_mutex_release(onionroute_handle_lock);
+}
+
+/** Return the connection behind <b>id</b>, or NULL if the handle is stale
+ * or the stream is already on its way out. Main loop only. */
+edge_connection_t *
+onionroute_handle_get_conn(void *id)
+{
+  onionroute_handle_slot_t *slot;
+  edge_connection_t *conn = NULL;
+
+  tor_mutex_acquire(onionroute_handle_lock);
+  slot = onionroute_handle_lookup(id);
+  if (slot)
+    conn = slot->conn;
+  tor_mutex_release(onionroute_handle_lock);
+
+  if (conn && conn->_base.marked_for_close)
+    return NULL;
+  return conn;
+}
+
+/** The stream behind <b>id</b> is gone: retire the handle, and tell anyone
+ * reading it that no more data is coming. */
+void
+onionroute_handle_free(void *id)
+{
+  onionroute_handle_slot_t *slot;
+  onionroute_recv_stream_t *rs;
+
+  tor_mutex_acquire(onionroute_handle_lock);
+  slot = onionroute_handle_lookup(id);
+  if (slot) {
+    slot->in_use = 0;
+    slot->conn = NULL;
+    if (slot->gen < ONIONROUTE_HANDLE_MASK) {
+      ++slot->gen;
+      slot->next_free = onionroute_handle_free_head;
+      onionroute_handle_free_head = (int)(slot - onionroute_handle_slots);
+    }
+  }
+  tor_mutex_release(onionroute_handle_lock);
+
+  /* A reader may have started waiting before any data arrived. */
+  tor_mutex_acquire(onionroute_recv_lock);
+  rs = onionroute_recv_stream_get(id, 0);
+  if (rs && !rs->attached) {
+    rs->closed = 1;
+    if (!onionroute_recv_stream_maybe_free(rs))
+      onionroute_recv_stream_update_notify(rs);
+  }
+  tor_mutex_release(onionroute_recv_lock);
+}
+
+/** Create the locks guarding recv streams and stream handles, if they
+ * don't exist yet. */
+void
+onionroute_locks_init(void)
+{
+  if (!onionroute_recv_lock)
+    onionroute_recv_lock = tor_mutex_new();
+  if (!onionroute_handle_lock)
+    onionroute_handle_lock = tor_mutex_new();
+}
+
+/** Return how many readers are blocked on the recv stream <b>id</b>, or -1
+ * if there is no such stream. Used by the unit tests. */
+int
+onionroute_recv_stream_get_n_waiters(void *id)
+{
+  onionroute_recv_stream_t *rs;
+  int r;
+
+  tor_mutex_acquire(onionroute_recv_lock);
+  rs = onionroute_recv_stream_get(id, 0);
+  r = rs ? rs->n_waiters : -1;
+  tor_mutex_release(onionroute_recv_lock);
+
+  return r;
+}
+
+/** Block until <b>fd</b> is readable (or the wait is interrupted). */
+static void
+onionroute_wait_readable(tor_socket_t fd)
+{
+#ifdef HAVE_POLL_H
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  poll(&pfd, 1, -1);
+#else
+  fd_set readfds;
+  FD_ZERO(&readfds);
+  FD_SET(fd, &readfds);
+  select((int)fd + 1, &readfds, NULL, NULL, NULL);
 #endif
+}
+
+ONIONROUTE_API
+int onionroute_init_v1()
+{
+	char* msg;
+	update_approx_time(time(NULL));
 
 	tor_threads_init();
 	init_logging();
@@ -2813,6 +3862,12 @@ int onionroute_init_v1()
 		log_err(LD_BUG,"Error initializing network; exiting.");
 		return -1;
 	}
+
+	/* XXX remove me once library is re-entrant */
+	/* initialize library command queue */
+	if (onionroute_command_queue_init()<0)
+		return -1;
+	onionroute_locks_init();
 	atexit(exit_function);
 
 	
@@ -2841,213 +3896,181 @@ int onionroute_init_v1()
 	return 0;
 }
 
-typedef struct onionroute_buffer_chunk_t
+ONIONROUTE_API
+int
+onionroute_queue_recvd_data_v1(void *id, size_t len, char* data)
 {
+	onionroute_recv_stream_t *rs;
+	int r = 0;
 
-  char* data;
-  size_t size;
-  void *id;
-
-} onionroute_buffer_chunk_t;
+	tor_mutex_acquire(onionroute_recv_lock);
 
-typedef struct onionroute_close_chunk_t
-{
+	rs = onionroute_recv_stream_get(id, 1);
+	if(rs->closed)
+	{
+		r = -1;
+	}
+	else
+	{
+		onionroute_recv_stream_append(rs, data, len);
+		onionroute_recv_stream_update_notify(rs);
+	}
 
-  void *id;
+	tor_mutex_release(onionroute_recv_lock);
 
-} onionroute_close_chunk_t;
+	return r;
+}
 
 ONIONROUTE_API
 int
-onionroute_queue_recvd_data_v1(void *id, size_t len, char* data)
+onionroute_queue_closed_stream_v1(void *id)
 {
-	onionroute_buffer_chunk_t *datachunk;
-	char *ndata;
-
-	datachunk = tor_malloc(sizeof(onionroute_buffer_chunk_t));
+	onionroute_recv_stream_t *rs;
 
-	ndata = tor_malloc(len);
-	memcpy(ndata, data, len);
+	tor_mutex_acquire(onionroute_recv_lock);
 
-	datachunk->id = id;
-	datachunk->size = len;
-	datachunk->data = ndata;
-
-	smartlist_add(readqueue, datachunk);
-
-	/* signal event */
-
-	if (!SetEvent(ghReadEvent))
-    {
-        log_err(LD_BUG,"SetEvent failed (%d)\n", GetLastError());
-        return -1;
-    }
+	rs = onionroute_recv_stream_get(id, 1);
+	rs->closed = 1;
+	onionroute_recv_stream_update_notify(rs);
 
+	tor_mutex_release(onionroute_recv_lock);
 
 	return 0;
 }
 
 ONIONROUTE_API
 int
-onionroute_queue_closed_stream_v1(void *id)
+onionroute_try_recv_stream_data_v1(void *id, char* buffer, size_t buffersize)
 {
-	onionroute_close_chunk_t *datachunk;
-
-	datachunk = tor_malloc(sizeof(onionroute_close_chunk_t));
+	onionroute_recv_stream_t *rs;
+	int r;
 
-	datachunk->id = id;
+	tor_mutex_acquire(onionroute_recv_lock);
 
-	smartlist_add(closequeue, datachunk);
+	rs = onionroute_recv_stream_get(id, 0);
+	if(rs)
+		r = onionroute_recv_stream_read(rs, buffer, buffersize);
+	else
+		r = onionroute_handle_is_live(id) ? ONIONROUTE_ERR_WOULD_BLOCK
+		                                  : ONIONROUTE_ERR_STALE_STREAM;
+	if(r == -1)
+		onionroute_recv_stream_maybe_free(rs);
 
-	/* signal event */
+	tor_mutex_release(onionroute_recv_lock);
 
-	if (!SetEvent(ghReadEvent))
-    {
-        log_err(LD_BUG,"SetEvent failed (%d)\n", GetLastError());
-        return -1;
-    }
-
-
-	return 0;
+	return r;
 }
 
 ONIONROUTE_API
 int
 onionroute_recv_stream_data_v1(void *id, char* buffer, size_t buffersize)
 {
-	DWORD dwWaitResult;
-	onionroute_buffer_chunk_t *datachunk;
-	onionroute_close_chunk_t *closechunk;
-	smartlist_t *nreadqueue;
-	smartlist_t *nclosequeue;
+	onionroute_recv_stream_t *rs;
+	tor_socket_t fd;
+	int r;
 
-	smartlist_t *oreadqueue;
-	smartlist_t *oclosequeue;
+	tor_mutex_acquire(onionroute_recv_lock);
 
-	char *ndata;
-	size_t nsize;
-	size_t rsize;
+	/* don't wait on a stream that is already gone; once the entry exists
+	   onionroute_handle_free() will wake us */
+	rs = onionroute_recv_stream_get(id, 0);
+	if(!rs && !onionroute_handle_is_live(id))
+	{
+		tor_mutex_release(onionroute_recv_lock);
+		return ONIONROUTE_ERR_STALE_STREAM;
+	}
+	rs = onionroute_recv_stream_get(id, 1);
 
-	rsize = -1; /* assume connection is going to return error back */
+	while((r = onionroute_recv_stream_read(rs, buffer, buffersize)) ==
+		  ONIONROUTE_ERR_WOULD_BLOCK)
+	{
+		if(onionroute_recv_stream_open_notify(rs) < 0)
+		{
+			r = -1;
+			break;
+		}
+
+		/* sleep on this stream's descriptor only, other streams getting
+		   data don't wake us */
+		fd = rs->notify_fds[0];
+		++rs->n_waiters;
+		tor_mutex_release(onionroute_recv_lock);
+
+		onionroute_wait_readable(fd);
+
+		tor_mutex_acquire(onionroute_recv_lock);
+		--rs->n_waiters;
+	}
 
-	/* XXX: Fixme, this function uses Windows API, not portable */
-	dwWaitResult = WaitForSingleObject( 
-        ghReadEvent, // event handle
-        INFINITE);    // indefinite wait
+	if(r == -1)
+		onionroute_recv_stream_maybe_free(rs);
 
-    switch (dwWaitResult) 
-    {
-        /* Event object was signaled */
-        case WAIT_OBJECT_0: 
-            
-			nreadqueue = smartlist_new();
-			nclosequeue = smartlist_new();
-
-			while(NULL != (closechunk = smartlist_pop_last(closequeue)))
-			{
-				if(id == closechunk->id)
-				{
-					/* the connection we are reading from was closed */
-					tor_free(closechunk);
-
-					/* keep popping to new queue */
-					while(NULL != (closechunk = smartlist_pop_last(closequeue)))
-			        {
-						smartlist_add(nclosequeue, closechunk);
-					}
-
-					oclosequeue = closequeue;
-			        closequeue = nclosequeue;
-			        smartlist_free(oclosequeue);
-
-
-					/* just remove them from to read queue and return error */
-
-					while(NULL != (datachunk = smartlist_pop_last(readqueue)))
-			        {
-				      if(datachunk->id != id)
-				      {
-						  smartlist_add(nreadqueue, datachunk);
-				      }
-					  else
-					  {
-						  tor_free(datachunk);
-					  }
-					}
-
-					oreadqueue = readqueue;
-					readqueue = nreadqueue;
-					smartlist_free(oreadqueue);
-
-					return -1;
-				}
-				else
-				{
-					smartlist_add(nclosequeue, closechunk);
-				}
-			}
-
-			oclosequeue = closequeue;
-			closequeue = nclosequeue;
-			smartlist_free(oclosequeue);
-
-			while(NULL != (datachunk = smartlist_pop_last(readqueue)))
-			{
-				if(datachunk->id == id)
-				{
-					/* found the one I need */
-					if(datachunk->size > buffersize)
-					{
-						nsize = datachunk->size - buffersize;
-						ndata = tor_malloc(nsize);
-
-						memcpy(buffer, datachunk->data, buffersize);
-						memcpy(ndata, &datachunk->data[buffersize], nsize);
-
-						tor_free(datachunk->data);
-
-						datachunk->data = ndata;
-						datachunk->size = nsize;
-
-						smartlist_add(nreadqueue, datachunk);
-
-						rsize = buffersize;
-					}
-					else
-					{
-						rsize = datachunk->size;
-						memcpy(buffer, datachunk->data, rsize);
-						tor_free(datachunk);
-					}
-				}
-				else
-				  smartlist_add(nreadqueue, datachunk);
-			}
+	tor_mutex_release(onionroute_recv_lock);
 
-			
-			oreadqueue = readqueue;
-			readqueue = nreadqueue;
-			smartlist_free(oreadqueue);
-			
-			return rsize;
-			
-            //break; 
+	return r;
+}
 
-        /* An error occurred */
-        default: 
-            log_err(LD_BUG,"Wait error (%d)", GetLastError()); 
-            return -1; 
-    }
+ONIONROUTE_API
+tor_socket_t
+onionroute_stream_recv_fd_v1(void *id)
+{
+	onionroute_recv_stream_t *rs;
+	tor_socket_t fd = TOR_INVALID_SOCKET;
+
+	tor_mutex_acquire(onionroute_recv_lock);
+
+	rs = onionroute_recv_stream_get(id, 0);
+	if(rs || onionroute_handle_is_live(id))
+	{
+		rs = onionroute_recv_stream_get(id, 1);
+		if(onionroute_recv_stream_open_notify(rs) == 0)
+			fd = rs->notify_fds[0];
+	}
 
+	tor_mutex_release(onionroute_recv_lock);
 
+	return fd;
 }
 
 ONIONROUTE_API
 int onionroute_shutdown_v1()
 {
-	CloseHandle(ghReadEvent);
-	smartlist_free(readqueue);
-	smartlist_free(closequeue);
+	onionroute_recv_stream_t **rsp, *rs;
+
+	if(!onionroute_recv_lock)
+		return 0;
+
+	tor_mutex_acquire(onionroute_recv_lock);
+	for(rsp = HT_START(onionroute_recv_map, &onionroute_recv_streams); rsp; )
+	{
+		rs = *rsp;
+		if(rs->n_waiters)
+		{
+			/* a reader is asleep on this entry; wake it with EOF and let it
+			   free the entry via onionroute_recv_stream_maybe_free() */
+			rs->attached = 0;
+			rs->closed = 1;
+			rs->want_sendme = 0;
+			onionroute_recv_stream_update_notify(rs);
+			rsp = HT_NEXT(onionroute_recv_map, &onionroute_recv_streams, rsp);
+			continue;
+		}
+		rsp = HT_NEXT_RMV(onionroute_recv_map, &onionroute_recv_streams, rsp);
+		onionroute_recv_stream_free(rs);
+	}
+	if(HT_EMPTY(&onionroute_recv_streams))
+		HT_CLEAR(onionroute_recv_map, &onionroute_recv_streams);
+	tor_mutex_release(onionroute_recv_lock);
+
+	if(onionroute_handle_lock)
+	{
+		tor_mutex_acquire(onionroute_handle_lock);
+		tor_free(onionroute_handle_slots);
+		onionroute_handle_n_slots = 0;
+		onionroute_handle_free_head = -1;
+		tor_mutex_release(onionroute_handle_lock);
+	}
+
 	return 0;
 }
 
@@ -20,6 +20,8 @@ int connection_add_impl(connection_t *conn, int is_connecting);
 int connection_remove(connection_t *conn);
 void connection_unregister_events(connection_t *conn);
 int connection_in_array(connection_t *conn);
+void connection_update_housekeeping(connection_t *conn);
+void connection_update_all_housekeeping(void);
 void add_connection_to_closeable_list(connection_t *conn);
 int connection_is_on_closeable_list(connection_t *conn);
 
@@ -71,6 +73,10 @@ int do_main_loop(void);
 int do_list_fingerprint(void);
 void do_hash_password(void);
 int tor_init(int argc, char **argv);
+#ifdef LIBRARY
+void onionroute_locks_init(void);
+int onionroute_recv_stream_get_n_waiters(void *id);
+#endif
 #endif
 
 #endif
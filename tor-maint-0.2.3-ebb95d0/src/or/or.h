@@ -102,6 +102,8 @@
 #include "torgzip.h"
 #include "address.h"
 #include "compat_libevent.h"
+#include "timewheel.h"
+#include "token_bucket.h"
 #include "ht.h"
 
 /* These signals are defined to help handle_control_signal work.
@@ -916,10 +918,13 @@ typedef struct var_cell_t {
 
 /** A cell as packed for writing to the network. */
 typedef struct packed_cell_t {
-  struct packed_cell_t *next; /**< Next cell queued on this circuit. */
   char body[CELL_NETWORK_SIZE]; /**< Cell as packed for network. */
 } packed_cell_t;
 
+/** A page of contiguous packed_cell_t slots, holding part of a
+ * cell_queue_t.  Defined in relay.c. */
+typedef struct cell_queue_page_t cell_queue_page_t;
+
 /** Number of cells added to a circuit queue including their insertion
  * time on 10 millisecond detail; used for buffer statistics. */
 typedef struct insertion_time_elem_t {
@@ -936,10 +941,18 @@ typedef struct insertion_time_queue_t {
 } insertion_time_queue_t;
 
 /** A queue of cells on a circuit, waiting to be added to the
- * or_connection_t's outbuf. */
+ * or_connection_t's outbuf.  Cells are packed in place into the slots of a
+ * chain of fixed-size pages: we add at the tail page and take from the head
+ * page, and give each page back as soon as its last cell has been taken. */
 typedef struct cell_queue_t {
-  packed_cell_t *head; /**< The first cell, or NULL if the queue is empty. */
-  packed_cell_t *tail; /**< The last cell, or NULL if the queue is empty. */
+  /** The page holding the first cell, or NULL if the queue is empty. */
+  cell_queue_page_t *head_page;
+  /** The page holding the last cell, or NULL if the queue is empty. */
+  cell_queue_page_t *tail_page;
+  /** Index of the first cell's slot in <b>head_page</b>. */
+  uint16_t head_idx;
+  /** Index of the first unused slot in <b>tail_page</b>. */
+  uint16_t tail_idx;
   int n; /**< The number of cells in the queue. */
   insertion_time_queue_t *insertion_times; /**< Insertion times of cells. */
 } cell_queue_t;
@@ -1056,6 +1069,9 @@ typedef struct connection_t {
 #endif
 
   time_t timestamp_created; /**< When was this connection_t created? */
+  /** Timer for run_connection_housekeeping(); armed only for OR and
+   * directory connections, for the next time they could need attention. */
+  timewheel_entry_t housekeeping_timer;
 
   /* XXXX_IP6 make this IPv6-capable */
   int socket_family; /**< Address family of this connection's socket.  Usually
@@ -1254,6 +1270,10 @@ typedef struct or_connection_t {
   circid_t next_circ_id; /**< Which circ_id do we try to use next on
                           * this connection?  This is always in the
                           * range 0..1<<15-1. */
+  /** Which circuit IDs in the half of the space we pick from are in use on
+   * this connection, or NULL if we haven't had to pick one yet.  See
+   * circuit_get_id_bitmap_on_orconn(). */
+  bitarray_t *circ_id_bitmap;
 
   or_handshake_state_t *handshake_state; /**< If we are setting this connection
                                           * up, state information to do so. */
@@ -1265,10 +1285,11 @@ typedef struct or_connection_t {
   int bandwidthrate; /**< Bytes/s added to the bucket. (OPEN ORs only.) */
   int bandwidthburst; /**< Max bucket size for this conn. (OPEN ORs only.) */
 #ifndef USE_BUFFEREVENTS
-  int read_bucket; /**< When this hits 0, stop receiving. Every second we
-                    * add 'bandwidthrate' to this, capping it at
-                    * bandwidthburst. (OPEN ORs only) */
-  int write_bucket; /**< When this hits 0, stop writing. Like read_bucket. */
+  token_bucket_t read_bucket; /**< When this hits 0, stop receiving. It
+                               * earns 'bandwidthrate' tokens a second, up
+                               * to bandwidthburst. (OPEN ORs only) */
+  token_bucket_t write_bucket; /**< When this hits 0, stop writing. Like
+                                * read_bucket. */
 #else
   /** A rate-limiting configuration object to determine how this connection
    * set its read- and write- limits. */
@@ -1284,15 +1305,37 @@ typedef struct or_connection_t {
   struct circuit_t *active_circuits;
   /** Priority queue of cell_ewma_t for circuits with queued cells waiting for
    * room to free up on this connection's outbuf.  Kept in heap order
-   * according to EWMA.
+   * according to EWMA.  Empty unless the cell EWMA scheduler is in use.
    *
    * This is redundant with active_circuits; if we ever decide only to use the
    * cell_ewma algorithm for choosing circuits, we can remove active_circuits.
    */
   smartlist_t *active_circuit_pqueue;
-  /** The tick on which the cell_ewma_ts in active_circuit_pqueue last had
-   * their ewma values rescaled. */
-  unsigned active_circuit_pqueue_last_recalibrated;
+  /** Position of this connection in the scheduler's queue of connections
+   * waiting for cells, or -1 if it isn't there.  See scheduler.c. */
+  int sched_heap_idx;
+  /** This connection's place in line for the scheduler: lower goes
+   * first. */
+  double sched_priority;
+  /** True iff this connection has cells waiting but no write tokens, and
+   * the scheduler will look at it again when the buckets refill. */
+  unsigned int sched_starved:1;
+  /** True iff this connection has cells waiting, but its kernel send queue
+   * is already as long as we want it, and the scheduler will look at it
+   * again once the socket is writable, or shortly. */
+  unsigned int sched_kernel_blocked:1;
+  /** True iff we should ask the kernel how much of what we've written to
+   * this connection's socket is still unsent, before adding more cells to
+   * its outbuf.  Cleared if the kernel can't tell us. */
+  unsigned int use_kernel_sendq:1;
+  /** True iff the kernel will report this connection's socket writable
+   * only once its unsent queue is short; see OR_CONN_KERNEL_LOWAT. */
+  unsigned int kernel_sendq_lowat:1;
+  /** Bytes of cells the kernel's send queue can still take, as last
+   * measured and then counted down by the scheduler.  Only good during
+   * scheduler run number <b>sched_kernel_room_run</b>; see scheduler.c. */
+  size_t sched_kernel_room;
+  unsigned int sched_kernel_room_run;
   struct or_connection_t *next_with_same_id; /**< Next connection with same
                                               * identity digest as this one. */
 } or_connection_t;
@@ -1339,7 +1382,29 @@ typedef struct edge_connection_t {
 #ifdef LIBRARY
   /** True iff this connection is for a libtor request only. */
   unsigned int is_onionroute_request:1;
+  /** True iff the application asked us to stop sending it data; see
+   * onionroute_stream_pause_read_v1(). */
+  unsigned int onionroute_read_paused:1;
   void *obj;
+  /** The handle the application knows this stream by; see
+   * onionroute_handle_new(). */
+  void *onionroute_id;
+  /** The context the stream was opened on; holds a reference. */
+  struct onionroute_ctx_t *onionroute_ctx;
+  /** Caller-owned buffers handed to onionroute_stream_writev_v2() that
+   * have not been packaged into relay cells yet, oldest first. */
+  struct onionroute_pending_write_t *pending_writes;
+  struct onionroute_pending_write_t *pending_writes_tail;
+  /** Total number of bytes still waiting on pending_writes. */
+  size_t pending_writes_len;
+  /** Fires when a partial cell has waited long enough for more data; see
+   * onionroute_set_stream_flush_delay_v1(). */
+  struct event *flush_timer;
+  /** Where incoming data goes when the application reads with
+   * onionroute_recv_stream_data_v1() instead of a data callback. */
+  struct onionroute_recv_stream_t *recv_stream;
+  /** Data waiting for (or left over by) the v3 data callback. */
+  struct onionroute_rx_batch_t *rx_batch;
 #endif
 
   unsigned int edge_has_sent_end:1; /**< For debugging; only used on edge
@@ -2494,14 +2559,10 @@ typedef struct {
  * connection in connection_or_flush_from_first_active_circuit().
  */
 typedef struct {
-  /** The last 'tick' at which we recalibrated cell_count.
-   *
-   * A cell sent at exactly the start of this tick has weight 1.0. Cells sent
-   * since the start of this tick have weight greater than 1.0; ones sent
-   * earlier have less weight. */
-  unsigned last_adjusted_tick;
-  /** The EWMA of the cell count. */
-  double cell_count;
+  /** The natural log of the EWMA of the cell count.  Cells are weighted
+   * by when they were sent, on a scale shared by every circuit, so this
+   * only needs rescaling when the half-life changes; see relay.c. */
+  double log_cell_count;
   /** True iff this is the cell count for a circuit's previous
    * connection. */
   unsigned int is_for_p_conn : 1;
@@ -2580,6 +2641,10 @@ typedef struct circuit_t {
    * resolution than most so that the circuit-build-time tracking code can
    * get millisecond resolution. */
   struct timeval timestamp_created;
+  /** When was this circuit created, according to tor_monotime_nsec()?  We
+   * use this rather than timestamp_created to time circuit construction
+   * and expiry, so that changes to the time of day don't disturb them. */
+  uint64_t timestamp_created_nsec;
   /** When the circuit was first used, or 0 if the circuit is clean.
    *
    * XXXX023 Note that some code will artifically adjust this value backward
@@ -2618,7 +2683,7 @@ typedef struct circuit_t {
    */
   cell_ewma_t n_cell_ewma;
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_t *lock;
 #endif
 
@@ -2776,7 +2841,7 @@ typedef struct origin_circuit_t {
   uint64_t associated_isolated_stream_global_id;
   /**@}*/
 
-#ifdef LIBRARY
+#ifdef LIBRARY_CORE_LOCKS
   tor_mutex_t *lock;
 #endif
 
@@ -2863,7 +2928,7 @@ typedef struct or_circuit_t {
    * p_conn_cells queue. */
   cell_ewma_t p_cell_ewma;
 
-  #ifdef LIBRARY
+  #ifdef LIBRARY_CORE_LOCKS
   tor_mutex_t *lock;
 #endif
 
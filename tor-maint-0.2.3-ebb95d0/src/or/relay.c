@@ -34,6 +34,16 @@
 #include "router.h"
 #include "routerlist.h"
 #include "routerparse.h"
+#include "scheduler.h"
+
+#ifdef LIBRARY
+#include "../libtor_internal.h"
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+#endif
 
 static edge_connection_t *relay_lookup_conn(circuit_t *circ, cell_t *cell,
                                             cell_direction_t cell_direction,
@@ -98,9 +108,9 @@ relay_digest_matches(crypto_digest_t *digest, cell_t *cell)
 {
   char received_integrity[4], calculated_integrity[4];
   relay_header_t rh;
-  crypto_digest_t *backup_digest=NULL;
+  crypto_digest_checkpoint_t backup_digest;
 
-  backup_digest = crypto_digest_dup(digest);
+  crypto_digest_checkpoint(&backup_digest, digest);
 
   relay_header_unpack(&rh, cell->payload);
   memcpy(received_integrity, rh.integrity, 4);
@@ -118,14 +128,12 @@ relay_digest_matches(crypto_digest_t *digest, cell_t *cell)
 //    log_fn(LOG_INFO,"Recognized=0 but bad digest. Not recognizing.");
 // (%d vs %d).", received_integrity, calculated_integrity);
     /* restore digest to its old form */
-    crypto_digest_assign(digest, backup_digest);
+    crypto_digest_restore(digest, &backup_digest);
     /* restore the relay header */
     memcpy(rh.integrity, received_integrity, 4);
     relay_header_pack(cell->payload, &rh);
-    crypto_digest_free(backup_digest);
     return 0;
   }
-  crypto_digest_free(backup_digest);
   return 1;
 }
 
@@ -151,6 +159,27 @@ relay_crypt_one_payload(crypto_cipher_t *cipher, uint8_t *in,
   return 0;
 }
 
+/** Most onion layers circuit_package_relay_cell() collects before crypting
+ * them into the cell; longer paths take more than one pass. */
+#define RELAY_MAX_FUSED_LAYERS 8
+
+/** Crypt the payload of a relay cell with all <b>n</b> layers in
+ * <b>ciphers</b> at once.  The layers are independent keystreams, so the
+ * order doesn't matter.
+ *
+ * Return -1 if the crypto fails, else return 0.
+ */
+static int
+relay_crypt_payload_layers(crypto_cipher_t **ciphers, int n, uint8_t *in)
+{
+  if (crypto_cipher_crypt_inplace_multi(ciphers, n, (char*) in,
+                                        CELL_PAYLOAD_SIZE)) {
+    log_warn(LD_BUG,"Error during relay encryption");
+    return -1;
+  }
+  return 0;
+}
+
 /** Receive a relay cell:
  *  - Crypt it (encrypt if headed toward the origin or if we <b>are</b> the
  *    origin; decrypt if we're headed toward the exit).
@@ -358,6 +387,8 @@ circuit_package_relay_cell(cell_t *cell, circuit_t *circ,
 
   if (cell_direction == CELL_DIRECTION_OUT) {
     crypt_path_t *thishop; /* counter for repeated crypts */
+    crypto_cipher_t *layers[RELAY_MAX_FUSED_LAYERS];
+    int n_layers = 0;
     conn = circ->n_conn;
     if (!CIRCUIT_IS_ORIGIN(circ) || !conn) {
       log_warn(LD_BUG,"outgoing relay cell has n_conn==NULL. Dropping.");
@@ -367,18 +398,25 @@ circuit_package_relay_cell(cell_t *cell, circuit_t *circ,
     relay_set_digest(layer_hint->f_digest, cell);
 
     thishop = layer_hint;
-    /* moving from farthest to nearest hop */
+    /* moving from farthest to nearest hop, collecting the layers so they
+     * can all be applied in one pass */
     do {
       tor_assert(thishop);
-      /* XXXX RD This is a bug, right? */
-      log_debug(LD_OR,"crypting a layer of the relay cell.");
-      if (relay_crypt_one_payload(thishop->f_crypto, cell->payload, 1) < 0) {
-        return -1;
+      layers[n_layers++] = thishop->f_crypto;
+      if (n_layers == RELAY_MAX_FUSED_LAYERS) {
+        if (relay_crypt_payload_layers(layers, n_layers, cell->payload) < 0)
+          return -1;
+        n_layers = 0;
       }
 
       thishop = thishop->prev;
     } while (thishop != TO_ORIGIN_CIRCUIT(circ)->cpath->prev);
 
+    log_debug(LD_OR,"crypting the layers of the relay cell.");
+    if (n_layers &&
+        relay_crypt_payload_layers(layers, n_layers, cell->payload) < 0)
+      return -1;
+
   } else { /* incoming cell */
     or_circuit_t *or_circ;
     if (CIRCUIT_IS_ORIGIN(circ)) {
@@ -511,21 +549,17 @@ relay_command_to_string(uint8_t command)
   }
 }
 
-/** Make a relay cell out of <b>relay_command</b> and <b>payload</b>, and send
- * it onto the open circuit <b>circ</b>. <b>stream_id</b> is the ID on
- * <b>circ</b> for the stream that's sending the relay cell, or 0 if it's a
- * control cell.  <b>cpath_layer</b> is NULL for OR->OP cells, or the
- * destination hop for OP->OR cells.
- *
- * If you can't send the cell, mark the circuit for close and return -1. Else
- * return 0.
- */
-int
-relay_send_command_from_edge(streamid_t stream_id, circuit_t *circ,
-                             uint8_t relay_command, const char *payload,
-                             size_t payload_len, crypt_path_t *cpath_layer)
+/** As relay_send_command_from_edge(), but the first <b>payload_len</b> bytes
+ * of the relay payload are already in place in <b>cell</b>, just after the
+ * relay header.  Everything else in <b>cell</b> is filled in here.  This
+ * lets callers that produce a payload write it straight into the cell that
+ * will carry it. */
+static int
+relay_send_filled_cell_from_edge(streamid_t stream_id, circuit_t *circ,
+                                 uint8_t relay_command, cell_t *cell,
+                                 size_t payload_len,
+                                 crypt_path_t *cpath_layer)
 {
-  cell_t cell;
   relay_header_t rh;
   cell_direction_t cell_direction;
   /* XXXX NM Split this function into a separate versions per circuit type? */
@@ -533,13 +567,12 @@ relay_send_command_from_edge(streamid_t stream_id, circuit_t *circ,
   tor_assert(circ);
   tor_assert(payload_len <= RELAY_PAYLOAD_SIZE);
 
-  memset(&cell, 0, sizeof(cell_t));
-  cell.command = CELL_RELAY;
+  cell->command = CELL_RELAY;
   if (cpath_layer) {
-    cell.circ_id = circ->n_circ_id;
+    cell->circ_id = circ->n_circ_id;
     cell_direction = CELL_DIRECTION_OUT;
   } else if (! CIRCUIT_IS_ORIGIN(circ)) {
-    cell.circ_id = TO_OR_CIRCUIT(circ)->p_circ_id;
+    cell->circ_id = TO_OR_CIRCUIT(circ)->p_circ_id;
     cell_direction = CELL_DIRECTION_IN;
   } else {
     return -1;
@@ -549,9 +582,10 @@ relay_send_command_from_edge(streamid_t stream_id, circuit_t *circ,
   rh.command = relay_command;
   rh.stream_id = stream_id;
   rh.length = payload_len;
-  relay_header_pack(cell.payload, &rh);
-  if (payload_len)
-    memcpy(cell.payload+RELAY_HEADER_SIZE, payload, payload_len);
+  relay_header_pack(cell->payload, &rh);
+  /* Unused payload bytes go out as zeros. */
+  memset(cell->payload + RELAY_HEADER_SIZE + payload_len, 0,
+         RELAY_PAYLOAD_SIZE - payload_len);
 
   log_debug(LD_OR,"delivering %d cell %s.", relay_command,
             cell_direction == CELL_DIRECTION_OUT ? "forward" : "backward");
@@ -576,7 +610,7 @@ relay_send_command_from_edge(streamid_t stream_id, circuit_t *circ,
        * an extend cell or we're not talking to the first hop), use
        * one of them.  Don't worry about the conn protocol version:
        * append_cell_to_circuit_queue will fix it up. */
-      cell.command = CELL_RELAY_EARLY;
+      cell->command = CELL_RELAY_EARLY;
       --origin_circ->remaining_relay_early_cells;
       log_debug(LD_OR, "Sending a RELAY_EARLY cell; %d remaining.",
                 (int)origin_circ->remaining_relay_early_cells);
@@ -603,7 +637,7 @@ relay_send_command_from_edge(streamid_t stream_id, circuit_t *circ,
     }
   }
 
-  if (circuit_package_relay_cell(&cell, circ, cell_direction, cpath_layer,
+  if (circuit_package_relay_cell(cell, circ, cell_direction, cpath_layer,
                                  stream_id) < 0) {
     log_warn(LD_BUG,"circuit_package_relay_cell failed. Closing.");
     circuit_mark_for_close(circ, END_CIRC_REASON_INTERNAL);
@@ -612,19 +646,35 @@ relay_send_command_from_edge(streamid_t stream_id, circuit_t *circ,
   return 0;
 }
 
-/** Make a relay cell out of <b>relay_command</b> and <b>payload</b>, and
- * send it onto the open circuit <b>circ</b>. <b>fromconn</b> is the stream
- * that's sending the relay cell, or NULL if it's a control cell.
- * <b>cpath_layer</b> is NULL for OR->OP cells, or the destination hop
- * for OP->OR cells.
+/** Make a relay cell out of <b>relay_command</b> and <b>payload</b>, and send
+ * it onto the open circuit <b>circ</b>. <b>stream_id</b> is the ID on
+ * <b>circ</b> for the stream that's sending the relay cell, or 0 if it's a
+ * control cell.  <b>cpath_layer</b> is NULL for OR->OP cells, or the
+ * destination hop for OP->OR cells.
  *
- * If you can't send the cell, mark the circuit for close and
- * return -1. Else return 0.
+ * If you can't send the cell, mark the circuit for close and return -1. Else
+ * return 0.
  */
 int
-connection_edge_send_command(edge_connection_t *fromconn,
+relay_send_command_from_edge(streamid_t stream_id, circuit_t *circ,
                              uint8_t relay_command, const char *payload,
-                             size_t payload_len)
+                             size_t payload_len, crypt_path_t *cpath_layer)
+{
+  cell_t cell;
+
+  tor_assert(payload_len <= RELAY_PAYLOAD_SIZE);
+  if (payload_len)
+    memcpy(cell.payload+RELAY_HEADER_SIZE, payload, payload_len);
+  return relay_send_filled_cell_from_edge(stream_id, circ, relay_command,
+                                          &cell, payload_len, cpath_layer);
+}
+
+/** As connection_edge_send_command(), but the payload is already in place
+ * in <b>cell</b>: see relay_send_filled_cell_from_edge(). */
+static int
+connection_edge_send_filled_cell(edge_connection_t *fromconn,
+                                 uint8_t relay_command, cell_t *cell,
+                                 size_t payload_len)
 {
   /* XXXX NM Split this function into a separate versions per circuit type? */
   circuit_t *circ;
@@ -654,9 +704,32 @@ connection_edge_send_command(edge_connection_t *fromconn,
     return -1;
   }
 
-  return relay_send_command_from_edge(fromconn->stream_id, circ,
-                                      relay_command, payload,
-                                      payload_len, cpath_layer);
+  return relay_send_filled_cell_from_edge(fromconn->stream_id, circ,
+                                          relay_command, cell,
+                                          payload_len, cpath_layer);
+}
+
+/** Make a relay cell out of <b>relay_command</b> and <b>payload</b>, and
+ * send it onto the open circuit <b>circ</b>. <b>fromconn</b> is the stream
+ * that's sending the relay cell, or NULL if it's a control cell.
+ * <b>cpath_layer</b> is NULL for OR->OP cells, or the destination hop
+ * for OP->OR cells.
+ *
+ * If you can't send the cell, mark the circuit for close and
+ * return -1. Else return 0.
+ */
+int
+connection_edge_send_command(edge_connection_t *fromconn,
+                             uint8_t relay_command, const char *payload,
+                             size_t payload_len)
+{
+  cell_t cell;
+
+  tor_assert(payload_len <= RELAY_PAYLOAD_SIZE);
+  if (payload_len)
+    memcpy(cell.payload+RELAY_HEADER_SIZE, payload, payload_len);
+  return connection_edge_send_filled_cell(fromconn, relay_command, &cell,
+                                          payload_len);
 }
 
 /** How many times will I retry a stream that fails due to DNS
@@ -845,18 +918,16 @@ remap_event_helper(entry_connection_t *conn, uint32_t new_addr)
 
 #ifdef LIBRARY
 
-onionroute_event_stream_open_t_v1 opencall = 0;
 ONIONROUTE_API
-void onionroute_set_stream_open_callback_v1(onionroute_event_stream_open_t_v1 callback)
+int onionroute_set_stream_open_callback_v1(onionroute_event_stream_open_t_v1 callback)
 {
-	opencall = callback;
+	return onionroute_ctx_set_stream_open_callback_v1(&onionroute_default_ctx, callback);
 }
 
-onionroute_event_stream_open_t_v2 opencall_v2 = 0;
 ONIONROUTE_API
-void onionroute_set_stream_open_callback_v2(onionroute_event_stream_open_t_v2 callback)
+int onionroute_set_stream_open_callback_v2(onionroute_event_stream_open_t_v2 callback)
 {
-	opencall_v2 = callback;
+	return onionroute_ctx_set_stream_open_callback_v2(&onionroute_default_ctx, callback);
 }
 
 #endif
@@ -969,8 +1040,9 @@ connection_edge_process_relay_cell_not_open(
 	#ifdef LIBRARY
 	if((conn)->is_onionroute_request)
     {
-	  if (opencall) opencall(conn);
-	  if (opencall_v2) opencall_v2(conn, conn->obj);
+	  onionroute_ctx_t *ctx = conn->onionroute_ctx;
+	  if (ctx->open_v1) ctx->open_v1(conn->onionroute_id);
+	  if (ctx->open_v2) ctx->open_v2(conn->onionroute_id, conn->obj);
     }
     #endif
 
@@ -1043,19 +1115,249 @@ connection_edge_process_relay_cell_not_open(
 
 #ifdef LIBRARY
 
-onionroute_event_stream_data_received_t_v1 data_received_callback = 0;
-onionroute_event_stream_data_received_t_v2 data_received_callback_v2 = 0;
+ONIONROUTE_API
+int onionroute_set_stream_data_received_callback_v1(onionroute_event_stream_data_received_t_v1 callback)
+{
+	return onionroute_ctx_set_stream_data_received_callback_v1(&onionroute_default_ctx, callback);
+}
+
+ONIONROUTE_API
+int onionroute_set_stream_data_received_callback_v2(onionroute_event_stream_data_received_t_v2 callback)
+{
+	return onionroute_ctx_set_stream_data_received_callback_v2(&onionroute_default_ctx, callback);
+}
+
+ONIONROUTE_API
+int onionroute_set_stream_data_received_callback_v3(onionroute_event_stream_data_received_t_v3 callback)
+{
+	return onionroute_ctx_set_stream_data_received_callback_v3(&onionroute_default_ctx, callback);
+}
+
+/** Bytes received on a library stream for the v3 data callback: what
+ * arrived during the current cell-processing pass, behind whatever the
+ * application left unconsumed last time. */
+typedef struct onionroute_rx_batch_t {
+  char *buf;
+  size_t len;
+  size_t alloc;
+  /** Length of each DATA cell in buf, oldest first; the first one may have
+   * been partly consumed already. */
+  uint16_t *span_len;
+  int n_spans;
+  int spans_alloc;
+  /** True iff the stream is on onionroute_batched_streams. */
+  unsigned int queued:1;
+  /** Offers leftover bytes again if no new data shows up to carry them. */
+  struct event *retry_timer;
+} onionroute_rx_batch_t;
+
+/** Library streams that got data for the v3 callback during the current
+ * connection_or_process_cells_from_inbuf() pass. */
+static smartlist_t *onionroute_batched_streams = NULL;
+
+/** Scratch span array handed to the v3 callback. */
+static onionroute_iovec_t *onionroute_batch_iov = NULL;
+static int onionroute_batch_iov_alloc = 0;
+
+static void onionroute_batch_deliver(edge_connection_t *conn);
+
+/** Libevent callback: leftover bytes on <b>arg</b> have waited long
+ * enough; offer them again. */
+static void
+onionroute_batch_retry_cb(evutil_socket_t fd, short event, void *arg)
+{
+  edge_connection_t *conn = arg;
+  (void)fd;
+  (void)event;
+
+  if (!conn->_base.marked_for_close)
+    onionroute_batch_deliver(conn);
+}
+
+/** Stage a DATA cell's <b>len</b> bytes for <b>conn</b>'s next v3
+ * callback. */
+static void
+onionroute_batch_add(edge_connection_t *conn, const char *data, size_t len)
+{
+  onionroute_rx_batch_t *b = conn->rx_batch;
+
+  if (!b)
+    b = conn->rx_batch = tor_malloc_zero(sizeof(onionroute_rx_batch_t));
+
+  if (b->len + len > b->alloc) {
+    b->alloc = MAX(b->alloc * 2, b->len + len);
+    b->alloc = MAX(b->alloc, 16*RELAY_PAYLOAD_SIZE);
+    b->buf = tor_realloc(b->buf, b->alloc);
+  }
+  if (b->n_spans == b->spans_alloc) {
+    b->spans_alloc = b->spans_alloc ? b->spans_alloc * 2 : 16;
+    b->span_len = tor_realloc(b->span_len,
+                              b->spans_alloc * sizeof(uint16_t));
+  }
+  memcpy(b->buf + b->len, data, len);
+  b->len += len;
+  b->span_len[b->n_spans++] = (uint16_t)len;
+
+  if (!b->queued) {
+    if (!onionroute_batched_streams)
+      onionroute_batched_streams = smartlist_new();
+    smartlist_add(onionroute_batched_streams, conn);
+    b->queued = 1;
+  }
+}
+
+/** Offer everything staged on <b>conn</b> to the v3 callback, keep what it
+ * didn't consume, and reopen the stream window as far as that allows. */
+static void
+onionroute_batch_deliver(edge_connection_t *conn)
+{
+  onionroute_rx_batch_t *b = conn->rx_batch;
+  size_t consumed, off = 0;
+  int i, n;
+
+  if (!b || !b->len || !conn->onionroute_ctx->data_v3 ||
+      conn->onionroute_read_paused)
+    return;
+
+  if (b->n_spans > onionroute_batch_iov_alloc) {
+    onionroute_batch_iov_alloc = MAX(b->n_spans, 64);
+    onionroute_batch_iov = tor_realloc(onionroute_batch_iov,
+                 onionroute_batch_iov_alloc * sizeof(onionroute_iovec_t));
+  }
+  for (i = 0; i < b->n_spans; ++i) {
+    onionroute_batch_iov[i].base = b->buf + off;
+    onionroute_batch_iov[i].len = b->span_len[i];
+    off += b->span_len[i];
+  }
+
+  consumed = conn->onionroute_ctx->data_v3(conn->onionroute_id, conn->obj,
+                                           onionroute_batch_iov,
+                                           b->n_spans, b->len);
+  if (consumed > b->len)
+    consumed = b->len;
+
+  if (consumed == b->len) {
+    b->len = 0;
+    b->n_spans = 0;
+  } else if (consumed) {
+    /* Drop the consumed bytes and whole spans; trim the one we stopped
+     * inside of. */
+    memmove(b->buf, b->buf + consumed, b->len - consumed);
+    b->len -= consumed;
+    for (n = 0; consumed >= b->span_len[n]; ++n)
+      consumed -= b->span_len[n];
+    b->span_len[n] -= (uint16_t)consumed;
+    memmove(b->span_len, b->span_len + n, (b->n_spans - n) * sizeof(uint16_t));
+    b->n_spans -= n;
+  }
+
+  if (b->len) {
+    struct timeval tv;
+    if (!b->retry_timer)
+      b->retry_timer = tor_evtimer_new(tor_libevent_get_base(),
+                                       onionroute_batch_retry_cb, conn);
+    tv.tv_sec = ONIONROUTE_REDELIVER_DELAY_MSEC / 1000;
+    tv.tv_usec = (ONIONROUTE_REDELIVER_DELAY_MSEC % 1000) * 1000;
+    evtimer_add(b->retry_timer, &tv);
+  } else if (b->retry_timer) {
+    event_del(b->retry_timer);
+  }
+
+  connection_edge_consider_sending_sendme(conn);
+}
+
+/** Called at the end of each cell-processing pass: run the v3 callback
+ * once for every stream that got data during it. */
+void
+relay_flush_onionroute_batches(void)
+{
+  smartlist_t *streams = onionroute_batched_streams;
+
+  if (!streams || !smartlist_len(streams))
+    return;
+
+  /* the callback may not add streams, but be safe about it */
+  onionroute_batched_streams = NULL;
+  SMARTLIST_FOREACH_BEGIN(streams, edge_connection_t *, conn) {
+    conn->rx_batch->queued = 0;
+    if (!conn->_base.marked_for_close)
+      onionroute_batch_deliver(conn);
+  } SMARTLIST_FOREACH_END(conn);
+  smartlist_clear(streams);
+
+  if (onionroute_batched_streams) {
+    smartlist_add_all(onionroute_batched_streams, streams);
+    smartlist_free(streams);
+  } else {
+    onionroute_batched_streams = streams;
+  }
+}
+
+/** Main loop side of onionroute_stream_pause_read_v1(). */
+static void
+pause_read_command_processor(void *data)
+{
+  edge_connection_t *conn = onionroute_handle_get_conn(data);
+
+  if (conn)
+    conn->onionroute_read_paused = 1;
+}
+
+/** Main loop side of onionroute_stream_resume_read_v1(): hand over what
+ * was held back and reopen the stream window. */
+static void
+resume_read_command_processor(void *data)
+{
+  edge_connection_t *edge_conn = onionroute_handle_get_conn(data);
+
+  if (!edge_conn || !edge_conn->onionroute_read_paused)
+    return;
+
+  edge_conn->onionroute_read_paused = 0;
+  if (edge_conn->rx_batch && edge_conn->rx_batch->len)
+    onionroute_batch_deliver(edge_conn); /* considers sendmes too */
+  else
+    connection_edge_consider_sending_sendme(edge_conn);
+}
 
 ONIONROUTE_API
-void onionroute_set_stream_data_received_callback_v1(onionroute_event_stream_data_received_t_v1 callback)
+int
+onionroute_stream_pause_read_v1(void *id)
 {
-	data_received_callback = callback;
+  if (!id)
+    return -1;
+  if (!onionroute_handle_is_live(id))
+    return ONIONROUTE_ERR_STALE_STREAM;
+  return onionroute_command_enqueue(pause_read_command_processor, id);
 }
 
 ONIONROUTE_API
-void onionroute_set_stream_data_received_callback_v2(onionroute_event_stream_data_received_t_v2 callback)
+int
+onionroute_stream_resume_read_v1(void *id)
+{
+  if (!id)
+    return -1;
+  if (!onionroute_handle_is_live(id))
+    return ONIONROUTE_ERR_STALE_STREAM;
+  return onionroute_command_enqueue(resume_read_command_processor, id);
+}
+
+/** Release <b>conn</b>'s v3 staging area; unconsumed bytes are lost. */
+void
+relay_free_onionroute_batch(edge_connection_t *conn)
 {
-	data_received_callback_v2 = callback;
+  onionroute_rx_batch_t *b = conn->rx_batch;
+
+  if (!b)
+    return;
+  if (b->queued && onionroute_batched_streams)
+    smartlist_remove(onionroute_batched_streams, conn);
+  if (b->retry_timer)
+    tor_event_free(b->retry_timer);
+  tor_free(b->buf);
+  tor_free(b->span_len);
+  tor_free(b);
+  conn->rx_batch = NULL;
 }
 
 #endif
@@ -1204,8 +1506,37 @@ connection_edge_process_relay_cell(cell_t *cell, circuit_t *circ,
 
 	  if(conn->is_onionroute_request)
 	  {
-		  if(data_received_callback)    data_received_callback(conn, rh.length, (char*)(cell->payload + RELAY_HEADER_SIZE));
-		  if(data_received_callback_v2) data_received_callback_v2(conn, conn->obj, rh.length, (char*)(cell->payload + RELAY_HEADER_SIZE));
+		  onionroute_ctx_t *ctx = conn->onionroute_ctx;
+
+		  if(ctx->data_v3)
+		  {
+		    /* delivered, and sendmes considered, at the end of this pass */
+		    onionroute_batch_add(conn,
+		        (char*)(cell->payload + RELAY_HEADER_SIZE), rh.length);
+		    return 0;
+		  }
+		  else if(ctx->data_v1 || ctx->data_v2)
+		  {
+		    if(ctx->data_v1) ctx->data_v1(conn->onionroute_id, rh.length, (char*)(cell->payload + RELAY_HEADER_SIZE));
+		    if(ctx->data_v2) ctx->data_v2(conn->onionroute_id, conn->obj, rh.length, (char*)(cell->payload + RELAY_HEADER_SIZE));
+		  }
+		  else
+		  {
+		    /* nobody listening for callbacks: keep it until the
+		       application reads it */
+		    if(!conn->recv_stream)
+		      conn->recv_stream = onionroute_recv_stream_attach(conn->onionroute_id);
+		    if(onionroute_recv_stream_deliver(conn->recv_stream,
+		        (char*)(cell->payload + RELAY_HEADER_SIZE), rh.length) < 0)
+		    {
+		      log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+		             "(relay data) stream overflowed its receive ring. "
+		             "Killing.");
+		      connection_edge_end(conn, END_STREAM_REASON_TORPROTOCOL);
+		      connection_mark_for_close(TO_CONN(conn));
+		      return 0;
+		    }
+		  }
 	  }
 	  else
 	  {
@@ -1383,12 +1714,6 @@ connection_edge_process_relay_cell(cell_t *cell, circuit_t *circ,
         return 0;
       }
 
-	  if(conn->is_onionroute_request)
-	  {
-		  /* ignore send me cells for onionroute requests */
-		  return 0;
-	  }
-
       conn->package_window += STREAMWINDOW_INCREMENT;
       log_debug(domain,"stream-level sendme, packagewindow now %d.",
                 conn->package_window);
@@ -1396,6 +1721,11 @@ connection_edge_process_relay_cell(cell_t *cell, circuit_t *circ,
         /* Still waiting for queue to flush; don't touch conn */
         return 0;
       }
+#ifdef LIBRARY
+      /* library streams have no socket to start reading from, but they may
+       * have data waiting for this window to open */
+      if (!conn->is_onionroute_request)
+#endif
       connection_start_reading(TO_CONN(conn));
       /* handle whatever might still be on the inbuf */
       if (connection_edge_package_raw_inbuf(conn, 1, NULL) < 0) {
@@ -1464,6 +1794,19 @@ uint64_t stats_n_data_cells_received = 0;
  * ever received were completely full of data. */
 uint64_t stats_n_data_bytes_received = 0;
 
+/** Return the number of bytes <b>conn</b> has waiting to go into relay
+ * cells: its inbuf, plus for library streams any caller-owned buffers from
+ * onionroute_stream_writev_v2(). */
+size_t
+connection_edge_bytes_to_package(edge_connection_t *conn)
+{
+  size_t n = connection_get_inbuf_len(TO_CONN(conn));
+#ifdef LIBRARY
+  n += conn->pending_writes_len;
+#endif
+  return n;
+}
+
 /** If <b>conn</b> has an entire relay payload of bytes on its inbuf (or
  * <b>package_partial</b> is true), and the appropriate package windows aren't
  * empty, grab a cell and send it down the circuit.
@@ -1479,7 +1822,10 @@ connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
                                   int *max_cells)
 {
   size_t bytes_to_process, length;
-  char payload[CELL_PAYLOAD_SIZE];
+  /* The stream data is read straight into the relay cell that will carry
+   * it, rather than into a scratch buffer that then gets copied. */
+  cell_t cell;
+  char *payload = (char*)cell.payload + RELAY_HEADER_SIZE;
   circuit_t *circ;
   const unsigned domain = conn->_base.type == CONN_TYPE_AP ? LD_APP : LD_EXIT;
   int sending_from_optimistic = 0;
@@ -1528,11 +1874,11 @@ connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
     bytes_to_process = generic_buffer_len(entry_conn->sending_optimistic_data);
     if (PREDICT_UNLIKELY(!bytes_to_process)) {
       log_warn(LD_BUG, "sending_optimistic_data was non-NULL but empty");
-      bytes_to_process = connection_get_inbuf_len(TO_CONN(conn));
+      bytes_to_process = connection_edge_bytes_to_package(conn);
       sending_from_optimistic = 0;
     }
   } else {
-    bytes_to_process = connection_get_inbuf_len(TO_CONN(conn));
+    bytes_to_process = connection_edge_bytes_to_package(conn);
   }
 
   if (!bytes_to_process)
@@ -1559,7 +1905,20 @@ connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
         entry_conn->sending_optimistic_data = NULL;
     }
   } else {
+#ifdef LIBRARY
+    /* The inbuf always goes first; whatever is left comes straight out of
+     * the caller's writev buffers. */
+    size_t from_inbuf = connection_get_inbuf_len(TO_CONN(conn));
+    if (from_inbuf > length)
+      from_inbuf = length;
+    if (from_inbuf)
+      connection_fetch_from_buf(payload, from_inbuf, TO_CONN(conn));
+    if (length > from_inbuf)
+      onionroute_pending_writes_fetch(conn, payload + from_inbuf,
+                                      length - from_inbuf);
+#else
     connection_fetch_from_buf(payload, length, TO_CONN(conn));
+#endif
   }
 
   log_debug(domain,"(%d) Packaging %d bytes (%d waiting).", conn->_base.s,
@@ -1573,8 +1932,8 @@ connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
     generic_buffer_add(entry_conn->pending_optimistic_data, payload, length);
   }
 
-  if (connection_edge_send_command(conn, RELAY_COMMAND_DATA,
-                                   payload, length) < 0 )
+  if (connection_edge_send_filled_cell(conn, RELAY_COMMAND_DATA,
+                                       &cell, length) < 0 )
     /* circuit got marked for close, don't continue, don't need to mark conn */
     return 0;
 
@@ -1631,6 +1990,25 @@ connection_edge_consider_sending_sendme(edge_connection_t *conn)
   }
 
   while (conn->deliver_window <= STREAMWINDOW_START - STREAMWINDOW_INCREMENT) {
+#ifdef LIBRARY
+    /* A paused stream lets its window run dry. */
+    if (conn->onionroute_read_paused)
+      return;
+    /* Library streams have no outbuf; whatever holds data the application
+     * hasn't taken yet must have room for everything the exit may send
+     * once this sendme arrives. If not, the application's next read (or
+     * the next v3 delivery) brings us back here. */
+    if (conn->rx_batch &&
+        conn->rx_batch->len + (conn->deliver_window +
+          STREAMWINDOW_INCREMENT) * RELAY_PAYLOAD_SIZE >
+        ONIONROUTE_RECV_RING_MAX)
+      return;
+    if (conn->recv_stream &&
+        !onionroute_recv_stream_has_room(conn->recv_stream,
+          (conn->deliver_window + STREAMWINDOW_INCREMENT) *
+          RELAY_PAYLOAD_SIZE))
+      return;
+#endif
     log_debug(conn->_base.type == CONN_TYPE_AP ?LD_APP:LD_EXIT,
               "Outbuf %d, Queuing stream sendme.",
               (int)conn->_base.outbuf_flushlen);
@@ -1732,7 +2110,7 @@ circuit_resume_edge_reading_helper(edge_connection_t *first_conn,
         connection_start_reading(TO_CONN(conn));
 	  
 
-      if (connection_get_inbuf_len(TO_CONN(conn)) > 0)
+      if (connection_edge_bytes_to_package(conn) > 0)
         ++n_packaging_streams;
 
     }
@@ -1748,7 +2126,7 @@ circuit_resume_edge_reading_helper(edge_connection_t *first_conn,
       #endif
       connection_start_reading(TO_CONN(conn));
 
-      if (connection_get_inbuf_len(TO_CONN(conn)) > 0)
+      if (connection_edge_bytes_to_package(conn) > 0)
         ++n_packaging_streams;
     }
   }
@@ -1787,7 +2165,7 @@ circuit_resume_edge_reading_helper(edge_connection_t *first_conn,
       }
 
       /* If there's still data to read, we'll be coming back to this stream. */
-      if (connection_get_inbuf_len(TO_CONN(conn)))
+      if (connection_edge_bytes_to_package(conn))
           ++n_streams_left;
 
       /* If the circuit won't accept any more data, return without looking
@@ -1886,10 +2264,32 @@ circuit_consider_sending_sendme(circuit_t *circ, crypt_path_t *layer_hint)
 #define assert_active_circuits_ok_paranoid(conn)
 #endif
 
-/** The total number of cells we have allocated from the memory pool. */
-static int total_cells_allocated = 0;
-
-/** A memory pool to allocate packed_cell_t objects. */
+/** How many cells fit on each page of a cell_queue_t?  Every circuit with
+ * any cells queued holds at least one page, so we keep them small. */
+#define CELL_QUEUE_PAGE_CELLS 8
+
+/** A page of slots for the cells in a cell_queue_t.  Cells are packed
+ * straight into their slots when they are queued, and written straight
+ * from them onto the OR connection's outbuf when they are flushed. */
+struct cell_queue_page_t {
+  /** The slots themselves.  They come first, so that each starts on a
+   * cache line boundary whenever the page does. */
+  packed_cell_t slots[CELL_QUEUE_PAGE_CELLS];
+  /** The next page in the queue, or NULL if this is the tail page. */
+  struct cell_queue_page_t *next;
+};
+
+/** The number of cell queue pages we have allocated from the memory pool. */
+static int total_pages_allocated = 0;
+
+/** How many cells have we queued since startup? */
+static uint64_t total_cells_queued = 0;
+/** How many times since startup have we started writing into, or reading
+ * from, a page we had not touched before?  Each time is likely to mean a
+ * cache miss; with one allocation per cell, it was at least one per cell. */
+static uint64_t total_page_touches = 0;
+
+/** A memory pool to allocate cell_queue_page_t objects. */
 static mp_pool_t *cell_pool = NULL;
 
 /** Memory pool to allocate insertion_time_elem_t objects used for cell
@@ -1901,7 +2301,7 @@ void
 init_cell_pool(void)
 {
   tor_assert(!cell_pool);
-  cell_pool = mp_pool_new(sizeof(packed_cell_t), 128*1024);
+  cell_pool = mp_pool_new(sizeof(cell_queue_page_t), 256*1024);
 }
 
 /** Free all storage used to hold cells (and insertion times if we measure
@@ -1928,20 +2328,24 @@ clean_cell_pool(void)
   mp_pool_clean(cell_pool, 0, 1);
 }
 
-/** Release storage held by <b>cell</b>. */
+/** Release storage held by <b>page</b>. */
 static INLINE void
-packed_cell_free_unchecked(packed_cell_t *cell)
+cell_queue_page_free(cell_queue_page_t *page)
 {
-  --total_cells_allocated;
-  mp_pool_release(cell);
+  --total_pages_allocated;
+  mp_pool_release(page);
 }
 
-/** Allocate and return a new packed_cell_t. */
-static INLINE packed_cell_t *
-packed_cell_alloc(void)
+/** Allocate and return a new, unlinked cell_queue_page_t. */
+static INLINE cell_queue_page_t *
+cell_queue_page_alloc(void)
 {
-  ++total_cells_allocated;
-  return mp_pool_get(cell_pool);
+  cell_queue_page_t *page;
+  ++total_pages_allocated;
+  ++total_page_touches;
+  page = mp_pool_get(cell_pool);
+  page->next = NULL;
+  return page;
 }
 
 /** Log current statistics for cell pool allocation at log level
@@ -1952,47 +2356,64 @@ dump_cell_pool_usage(int severity)
   circuit_t *c;
   int n_circs = 0;
   int n_cells = 0;
+  int n_pages = 0;
   for (c = _circuit_get_global_list(); c; c = c->next) {
     n_cells += c->n_conn_cells.n;
-    if (!CIRCUIT_IS_ORIGIN(c))
+    n_pages += cell_queue_n_pages(&c->n_conn_cells);
+    if (!CIRCUIT_IS_ORIGIN(c)) {
       n_cells += TO_OR_CIRCUIT(c)->p_conn_cells.n;
+      n_pages += cell_queue_n_pages(&TO_OR_CIRCUIT(c)->p_conn_cells);
+    }
     ++n_circs;
   }
-  log(severity, LD_MM, "%d cells allocated on %d circuits. %d cells leaked.",
-      n_cells, n_circs, total_cells_allocated - n_cells);
+  log(severity, LD_MM, "%d cells queued on %d circuits, in %d pages of %d "
+      "cells. %d pages leaked.",
+      n_cells, n_circs, n_pages, CELL_QUEUE_PAGE_CELLS,
+      total_pages_allocated - n_pages);
+  if (n_cells)
+    log(severity, LD_MM, "%.1f bytes of queue pages per queued cell.",
+        ((double)n_pages) * sizeof(cell_queue_page_t) / n_cells);
+  if (total_cells_queued)
+    log(severity, LD_MM, "Since startup, %.3f new pages touched (likely "
+        "cache misses) per cell queued.",
+        ((double)total_page_touches) / total_cells_queued);
   mp_pool_log_status(cell_pool, severity);
 }
 
-/** Allocate a new copy of packed <b>cell</b>. */
-static INLINE packed_cell_t *
-packed_cell_copy(const cell_t *cell)
+/** Return the number of pages holding the cells of <b>queue</b>. */
+int
+cell_queue_n_pages(const cell_queue_t *queue)
 {
-  packed_cell_t *c = packed_cell_alloc();
-  cell_pack(c, cell);
-  c->next = NULL;
-  return c;
+  const cell_queue_page_t *page;
+  int n = 0;
+  for (page = queue->head_page; page; page = page->next)
+    ++n;
+  return n;
 }
 
-/** Append <b>cell</b> to the end of <b>queue</b>. */
-void
-cell_queue_append(cell_queue_t *queue, packed_cell_t *cell)
+/** Add a slot to the end of <b>queue</b>, and return it for the caller to
+ * pack a cell into. */
+static INLINE packed_cell_t *
+cell_queue_append_slot(cell_queue_t *queue)
 {
-  if (queue->tail) {
-    tor_assert(!queue->tail->next);
-    queue->tail->next = cell;
-  } else {
-    queue->head = cell;
+  if (!queue->tail_page) {
+    queue->head_page = queue->tail_page = cell_queue_page_alloc();
+    queue->head_idx = queue->tail_idx = 0;
+  } else if (queue->tail_idx == CELL_QUEUE_PAGE_CELLS) {
+    cell_queue_page_t *page = cell_queue_page_alloc();
+    queue->tail_page->next = page;
+    queue->tail_page = page;
+    queue->tail_idx = 0;
   }
-  queue->tail = cell;
-  cell->next = NULL;
   ++queue->n;
+  ++total_cells_queued;
+  return &queue->tail_page->slots[queue->tail_idx++];
 }
 
-/** Append a newly allocated copy of <b>cell</b> to the end of <b>queue</b> */
+/** Pack <b>cell</b> onto the end of <b>queue</b>. */
 void
 cell_queue_append_packed_copy(cell_queue_t *queue, const cell_t *cell)
 {
-  packed_cell_t *copy = packed_cell_copy(cell);
   /* Remember the time when this cell was put in the queue. */
   if (get_options()->CellStatistics) {
     struct timeval now;
@@ -2023,21 +2444,22 @@ cell_queue_append_packed_copy(cell_queue_t *queue, const cell_t *cell)
       }
     }
   }
-  cell_queue_append(queue, copy);
+  cell_pack(cell_queue_append_slot(queue), cell);
 }
 
 /** Remove and free every cell in <b>queue</b>. */
 void
 cell_queue_clear(cell_queue_t *queue)
 {
-  packed_cell_t *cell, *next;
-  cell = queue->head;
-  while (cell) {
-    next = cell->next;
-    packed_cell_free_unchecked(cell);
-    cell = next;
-  }
-  queue->head = queue->tail = NULL;
+  cell_queue_page_t *page, *next;
+  page = queue->head_page;
+  while (page) {
+    next = page->next;
+    cell_queue_page_free(page);
+    page = next;
+  }
+  queue->head_page = queue->tail_page = NULL;
+  queue->head_idx = queue->tail_idx = 0;
   queue->n = 0;
   if (queue->insertion_times) {
     while (queue->insertion_times->first) {
@@ -2049,23 +2471,45 @@ cell_queue_clear(cell_queue_t *queue)
   }
 }
 
-/** Extract and return the cell at the head of <b>queue</b>; return NULL if
- * <b>queue</b> is empty. */
-static INLINE packed_cell_t *
-cell_queue_pop(cell_queue_t *queue)
+/** Remove the cell at the head of <b>queue</b>, and return a pointer to
+ * it; return NULL if <b>queue</b> is empty.  The cell stays where it is.
+ * If taking it emptied its page, unlink the page from <b>queue</b> and set
+ * *<b>page_out</b> to it: the caller must give it to
+ * cell_queue_page_release() once it's done with the cell.  Otherwise set
+ * *<b>page_out</b> to NULL. */
+const packed_cell_t *
+cell_queue_pop(cell_queue_t *queue, cell_queue_page_t **page_out)
 {
-  packed_cell_t *cell = queue->head;
-  if (!cell)
+  cell_queue_page_t *page = queue->head_page;
+  const packed_cell_t *cell;
+  *page_out = NULL;
+  if (!queue->n)
     return NULL;
-  queue->head = cell->next;
-  if (cell == queue->tail) {
-    tor_assert(!queue->head);
-    queue->tail = NULL;
-  }
+  cell = &page->slots[queue->head_idx++];
   --queue->n;
+  if (queue->head_idx == CELL_QUEUE_PAGE_CELLS || !queue->n) {
+    queue->head_page = page->next;
+    queue->head_idx = 0;
+    if (queue->head_page) {
+      ++total_page_touches;
+    } else {
+      tor_assert(!queue->n);
+      queue->tail_page = NULL;
+      queue->tail_idx = 0;
+    }
+    *page_out = page;
+  }
   return cell;
 }
 
+/** Give back <b>page</b>, which cell_queue_pop() unlinked from its queue. */
+void
+cell_queue_page_release(cell_queue_page_t *page)
+{
+  if (page)
+    cell_queue_page_free(page);
+}
+
 /** Return a pointer to the "next_active_on_{n,p}_conn" pointer of <b>circ</b>,
  * depending on whether <b>conn</b> matches n_conn or p_conn. */
 static INLINE circuit_t **
@@ -2103,9 +2547,9 @@ static int
 compare_cell_ewma_counts(const void *p1, const void *p2)
 {
   const cell_ewma_t *e1=p1, *e2=p2;
-  if (e1->cell_count < e2->cell_count)
+  if (e1->log_cell_count < e2->log_cell_count)
     return -1;
-  else if (e1->cell_count > e2->cell_count)
+  else if (e1->log_cell_count > e2->log_cell_count)
     return 1;
   else
     return 0;
@@ -2125,7 +2569,21 @@ cell_ewma_to_circuit(cell_ewma_t *ewma)
   }
 }
 
-/* ==== Functions for scaling cell_ewma_t ====
+/** Return the cell_ewma_t that <b>circ</b> uses to count cells sent on
+ * <b>conn</b>. */
+static INLINE cell_ewma_t *
+circuit_get_cell_ewma_on_conn(circuit_t *circ, or_connection_t *conn)
+{
+  if (circ->n_conn == conn) {
+    return &circ->n_cell_ewma;
+  } else {
+    or_circuit_t *orcirc = TO_OR_CIRCUIT(circ);
+    tor_assert(conn == orcirc->p_conn);
+    return &orcirc->p_cell_ewma;
+  }
+}
+
+/* ==== Functions for computing cell_ewma_t ====
 
    When choosing which cells to relay first, we favor circuits that have been
    quiet recently.  This gives better latency on connections that aren't
@@ -2138,171 +2596,135 @@ cell_ewma_to_circuit(cell_ewma_t *ewma)
    F^N times as much as a cell sent now, for 0<F<1.0, and we favor the
    circuit that has sent the fewest cells]
 
-   If 'double' had infinite precision, we could do this simply by counting a
-   cell sent at startup as having weight 1.0, and a cell sent N seconds later
-   as having weight F^-N.  This way, we would never need to re-scale
-   any already-sent cells.
-
-   To prevent double from overflowing, we could count a cell sent now as
-   having weight 1.0 and a cell sent N seconds ago as having weight F^N.
-   This, however, would mean we'd need to re-scale *ALL* old circuits every
-   time we wanted to send a cell.
-
-   So as a compromise, we divide time into 'ticks' (currently, 10-second
-   increments) and say that a cell sent at the start of a current tick is
-   worth 1.0, a cell sent N seconds before the start of the current tick is
-   worth F^N, and a cell sent N seconds after the start of the current tick is
-   worth F^-N.  This way we don't overflow, and we don't need to constantly
-   rescale.
+   Scaling every count down by F each time the clock moves doesn't change
+   which circuit has the smallest count, so instead we never scale anything:
+   a cell sent at monotonic time T counts F^-T, and later cells simply count
+   for more.  Those weights grow without bound, so we keep each count as its
+   natural logarithm.  A cell sent at T then adds T*(-ln F) in the log
+   domain, and the count only needs a log and an exp to update.  Comparing
+   two circuits' counts is still just comparing two doubles.  (Only a
+   change to F itself means touching every count; see
+   cell_ewma_rescale_all().)
+
+   We used to keep counts in the linear domain and rescale them every
+   10-second tick, which cost a pass over all the active circuits on a
+   connection each time the tick changed, just when the connection was
+   busiest.
  */
 
-/** How long does a tick last (seconds)? */
-#define EWMA_TICK_LEN 10
-
-/** The default per-tick scale factor, if it hasn't been overridden by a
- * consensus or a configuration setting.  zero means "disabled". */
+/** The default half-life, if it hasn't been overridden by a consensus or a
+ * configuration setting.  zero means "disabled". */
 #define EWMA_DEFAULT_HALFLIFE 0.0
 
-/** Given a timeval <b>now</b>, compute the cell_ewma tick in which it occurs
- * and the fraction of the tick that has elapsed between the start of the tick
- * and <b>now</b>.  Return the former and store the latter in
- * *<b>remainder_out</b>.
- *
- * These tick values are not meant to be shared between Tor instances, or used
- * for other purposes. */
-static unsigned
-cell_ewma_tick_from_timeval(const struct timeval *now,
-                            double *remainder_out)
+/** How much the log of a cell's weight grows per second of monotonic time:
+ * ln(2) divided by the half-life in seconds.  (A cell sent N seconds before
+ * another counts exp(-ewma_log_rate * N) times as much.) */
+static double ewma_log_rate = 0.0;
+
+/** The log of a count of zero cells. */
+#define CELL_EWMA_LOG_COUNT_EMPTY (-HUGE_VAL)
+
+/** Return the natural log of the weight of a cell sent at monotonic time
+ * <b>now_nsec</b>. */
+static INLINE double
+cell_ewma_log_weight(uint64_t now_nsec)
 {
-  unsigned res = (unsigned) (now->tv_sec / EWMA_TICK_LEN);
-  /* rem */
-  double rem = (now->tv_sec % EWMA_TICK_LEN) +
-    ((double)(now->tv_usec)) / 1.0e6;
-  *remainder_out = rem / EWMA_TICK_LEN;
-  return res;
+  return ewma_log_rate * (now_nsec / 1.0e9);
 }
 
-/** Compute and return the current cell_ewma tick. */
-unsigned
-cell_ewma_get_tick(void)
+/** Add one cell sent at monotonic time <b>now_nsec</b> to <b>ewma</b>. */
+void
+cell_ewma_add_cell(cell_ewma_t *ewma, uint64_t now_nsec)
 {
-  return ((unsigned)approx_time() / EWMA_TICK_LEN);
+  /* log(e^a + e^b) = max + log(1 + e^(min-max)), which never overflows. */
+  double w = cell_ewma_log_weight(now_nsec);
+  double hi = ewma->log_cell_count, lo = w;
+  if (lo > hi) {
+    hi = w;
+    lo = ewma->log_cell_count;
+  }
+  ewma->log_cell_count = hi + tor_mathlog(1.0 + exp(lo - hi));
 }
 
-/** The per-tick scale factor to be used when computing cell-count EWMA
- * values.  (A cell sent N ticks before the start of the current tick
- * has value ewma_scale_factor ** N.)
- */
-static double ewma_scale_factor = 0.1;
-/* DOCDOC ewma_enabled */
-static int ewma_enabled = 0;
-
-/*DOCDOC*/
-#define EPSILON 0.00001
-/*DOCDOC*/
-#define LOG_ONEHALF -0.69314718055994529
+/** Multiply the log of <b>ewma</b>'s count by <b>factor</b>, or empty it if
+ * <b>factor</b> is zero. */
+static void
+cell_ewma_rescale(cell_ewma_t *ewma, double factor)
+{
+  if (factor > 0.0)
+    ewma->log_cell_count *= factor;
+  else
+    ewma->log_cell_count = CELL_EWMA_LOG_COUNT_EMPTY;
+}
 
-/** Adjust the global cell scale factor based on <b>options</b> */
-void
-cell_ewma_set_scale_factor(const or_options_t *options,
-                           const networkstatus_t *consensus)
+/** The log weight of every cell is proportional to ewma_log_rate, so when
+ * the rate changes from <b>old_rate</b> to <b>new_rate</b>, bring every
+ * circuit's counts over to the new rate.  Scaling by new_rate/old_rate is
+ * exact for a count whose weight comes from cells sent at one moment (in
+ * practice, the most recent ones dominate), and it keeps counts in the same
+ * order, so the connections' priority queues stay valid.  Counts made while
+ * the rate was zero carry no timing at all, so we just forget them. */
+static void
+cell_ewma_rescale_all(double old_rate, double new_rate)
 {
-  int32_t halflife_ms;
-  double halflife;
-  const char *source;
-  if (options && options->CircuitPriorityHalflife >= -EPSILON) {
-    halflife = options->CircuitPriorityHalflife;
-    source = "CircuitPriorityHalflife in configuration";
-  } else if (consensus && (halflife_ms = networkstatus_get_param(
-                 consensus, "CircuitPriorityHalflifeMsec",
-                 -1, -1, INT32_MAX)) >= 0) {
-    halflife = ((double)halflife_ms)/1000.0;
-    source = "CircuitPriorityHalflifeMsec in consensus";
-  } else {
-    halflife = EWMA_DEFAULT_HALFLIFE;
-    source = "Default value";
-  }
+  circuit_t *circ;
+  double factor = old_rate > 0.0 ? new_rate / old_rate : 0.0;
 
-  if (halflife <= EPSILON) {
-    /* The cell EWMA algorithm is disabled. */
-    ewma_scale_factor = 0.1;
-    ewma_enabled = 0;
-    log_info(LD_OR,
-             "Disabled cell_ewma algorithm because of value in %s",
-             source);
-  } else {
-    /* convert halflife into halflife-per-tick. */
-    halflife /= EWMA_TICK_LEN;
-    /* compute per-tick scale factor. */
-    ewma_scale_factor = exp( LOG_ONEHALF / halflife );
-    ewma_enabled = 1;
-    log_info(LD_OR,
-             "Enabled cell_ewma algorithm because of value in %s; "
-             "scale factor is %f per %d seconds",
-             source, ewma_scale_factor, EWMA_TICK_LEN);
+  for (circ = _circuit_get_global_list(); circ; circ = circ->next) {
+    cell_ewma_rescale(&circ->n_cell_ewma, factor);
+    if (! CIRCUIT_IS_ORIGIN(circ))
+      cell_ewma_rescale(&TO_OR_CIRCUIT(circ)->p_cell_ewma, factor);
   }
 }
 
-/** Return the multiplier necessary to convert the value of a cell sent in
- * 'from_tick' to one sent in 'to_tick'. */
-static INLINE double
-get_scale_factor(unsigned from_tick, unsigned to_tick)
+/** Set <b>ewma</b> up to count cells for a circuit on its previous
+ * connection (if <b>is_for_p_conn</b>) or its next connection. */
+void
+cell_ewma_init(cell_ewma_t *ewma, int is_for_p_conn)
 {
-  /* This math can wrap around, but that's okay: unsigned overflow is
-     well-defined */
-  int diff = (int)(to_tick - from_tick);
-  return pow(ewma_scale_factor, diff);
+  ewma->log_cell_count = CELL_EWMA_LOG_COUNT_EMPTY;
+  ewma->is_for_p_conn = is_for_p_conn ? 1 : 0;
+  ewma->heap_index = -1;
 }
 
-/** Adjust the cell count of <b>ewma</b> so that it is scaled with respect to
- * <b>cur_tick</b> */
+/* ==== Circuit schedulers ==== */
+
+/** circuit_scheduler_t.circuit_flushed for round-robin: move on to the next
+ * circuit in the ring. */
 static void
-scale_single_cell_ewma(cell_ewma_t *ewma, unsigned cur_tick)
+rr_circuit_flushed(or_connection_t *conn, circuit_t *circ)
 {
-  double factor = get_scale_factor(ewma->last_adjusted_tick, cur_tick);
-  ewma->cell_count *= factor;
-  ewma->last_adjusted_tick = cur_tick;
+  conn->active_circuits = *next_circ_on_conn_p(circ, conn);
 }
 
-/** Adjust the cell count of every active circuit on <b>conn</b> so
- * that they are scaled with respect to <b>cur_tick</b> */
-static void
-scale_active_circuits(or_connection_t *conn, unsigned cur_tick)
+/** circuit_scheduler_t.pick for round-robin: take circuits in ring order.
+ * The ring itself is maintained for every scheduler, so round-robin keeps
+ * no state of its own. */
+static circuit_t *
+rr_pick(or_connection_t *conn)
 {
-
-  double factor = get_scale_factor(
-              conn->active_circuit_pqueue_last_recalibrated,
-              cur_tick);
-  /** Ordinarily it isn't okay to change the value of an element in a heap,
-   * but it's okay here, since we are preserving the order. */
-  SMARTLIST_FOREACH(conn->active_circuit_pqueue, cell_ewma_t *, e, {
-      tor_assert(e->last_adjusted_tick ==
-                 conn->active_circuit_pqueue_last_recalibrated);
-      e->cell_count *= factor;
-      e->last_adjusted_tick = cur_tick;
-  });
-  conn->active_circuit_pqueue_last_recalibrated = cur_tick;
+  return conn->active_circuits;
 }
 
-/** Rescale <b>ewma</b> to the same scale as <b>conn</b>, and add it to
- * <b>conn</b>'s priority queue of active circuits */
+/** circuit_scheduler_t.activate for EWMA: add <b>circ</b> to <b>conn</b>'s
+ * priority queue of active circuits. */
 static void
-add_cell_ewma_to_conn(or_connection_t *conn, cell_ewma_t *ewma)
+ewma_activate(or_connection_t *conn, circuit_t *circ)
 {
+  cell_ewma_t *ewma = circuit_get_cell_ewma_on_conn(circ, conn);
   tor_assert(ewma->heap_index == -1);
-  scale_single_cell_ewma(ewma,
-                         conn->active_circuit_pqueue_last_recalibrated);
-
   smartlist_pqueue_add(conn->active_circuit_pqueue,
                        compare_cell_ewma_counts,
                        STRUCT_OFFSET(cell_ewma_t, heap_index),
                        ewma);
 }
 
-/** Remove <b>ewma</b> from <b>conn</b>'s priority queue of active circuits */
+/** circuit_scheduler_t.deactivate for EWMA: remove <b>circ</b> from
+ * <b>conn</b>'s priority queue of active circuits. */
 static void
-remove_cell_ewma_from_conn(or_connection_t *conn, cell_ewma_t *ewma)
+ewma_deactivate(or_connection_t *conn, circuit_t *circ)
 {
+  cell_ewma_t *ewma = circuit_get_cell_ewma_on_conn(circ, conn);
   tor_assert(ewma->heap_index != -1);
   smartlist_pqueue_remove(conn->active_circuit_pqueue,
                           compare_cell_ewma_counts,
@@ -2310,14 +2732,153 @@ remove_cell_ewma_from_conn(or_connection_t *conn, cell_ewma_t *ewma)
                           ewma);
 }
 
-/** Remove and return the first cell_ewma_t from conn's priority queue of
- * active circuits.  Requires that the priority queue is nonempty. */
-static cell_ewma_t *
-pop_first_cell_ewma_from_conn(or_connection_t *conn)
+/** circuit_scheduler_t.pick for EWMA: take the active circuit that has sent
+ * the fewest cells recently. */
+static circuit_t *
+ewma_pick(or_connection_t *conn)
+{
+  return cell_ewma_to_circuit(smartlist_get(conn->active_circuit_pqueue, 0));
+}
+
+/** circuit_scheduler_t.priority for EWMA: a connection is as urgent as the
+ * quietest circuit it has waiting. */
+static double
+ewma_priority(or_connection_t *conn)
+{
+  const cell_ewma_t *ewma = smartlist_get(conn->active_circuit_pqueue, 0);
+  return ewma->log_cell_count;
+}
+
+/** circuit_scheduler_t.cell_flushed for EWMA: count the cell, and move
+ * <b>circ</b> to its new place in the priority queue. */
+static void
+ewma_cell_flushed(or_connection_t *conn, circuit_t *circ, uint64_t now_nsec)
+{
+  cell_ewma_t *ewma = circuit_get_cell_ewma_on_conn(circ, conn);
+  /* Counts can't change while they're in the heap, so take this one out
+   * and put it back. */
+  smartlist_pqueue_remove(conn->active_circuit_pqueue,
+                          compare_cell_ewma_counts,
+                          STRUCT_OFFSET(cell_ewma_t, heap_index),
+                          ewma);
+  cell_ewma_add_cell(ewma, now_nsec);
+  smartlist_pqueue_add(conn->active_circuit_pqueue,
+                       compare_cell_ewma_counts,
+                       STRUCT_OFFSET(cell_ewma_t, heap_index),
+                       ewma);
+}
+
+/** Round-robin: every active circuit on a connection takes its turn. */
+const circuit_scheduler_t circuit_scheduler_rr = {
+  "round-robin",
+  NULL,
+  NULL,
+  rr_pick,
+  NULL,
+  rr_circuit_flushed,
+  NULL,
+};
+
+/** Cell EWMA: the circuit that has been quietest recently goes first. */
+const circuit_scheduler_t circuit_scheduler_ewma = {
+  "cell EWMA",
+  ewma_activate,
+  ewma_deactivate,
+  ewma_pick,
+  ewma_cell_flushed,
+  NULL,
+  ewma_priority,
+};
+
+/** The scheduler that picks which circuit flushes next on every OR
+ * connection. */
+static const circuit_scheduler_t *active_scheduler = &circuit_scheduler_rr;
+
+/** Return the scheduler currently in use. */
+const circuit_scheduler_t *
+relay_get_circuit_scheduler(void)
+{
+  return active_scheduler;
+}
+
+/** Start using <b>sched</b> to pick circuits on every OR connection, moving
+ * the active circuits on each existing connection over to it. */
+void
+relay_set_circuit_scheduler(const circuit_scheduler_t *sched)
 {
-  return smartlist_pqueue_pop(conn->active_circuit_pqueue,
-                              compare_cell_ewma_counts,
-                              STRUCT_OFFSET(cell_ewma_t, heap_index));
+  const circuit_scheduler_t *old = active_scheduler;
+  tor_assert(sched);
+  if (sched == old)
+    return;
+
+  active_scheduler = sched;
+  SMARTLIST_FOREACH_BEGIN(get_connection_array(), connection_t *, c) {
+    or_connection_t *orconn;
+    circuit_t *head, *cur;
+    if (c->type != CONN_TYPE_OR)
+      continue;
+    orconn = TO_OR_CONN(c);
+    head = cur = orconn->active_circuits;
+    if (!head)
+      continue;
+    do {
+      if (old->deactivate)
+        old->deactivate(orconn, cur);
+      if (sched->activate)
+        sched->activate(orconn, cur);
+      cur = *next_circ_on_conn_p(cur, orconn);
+    } while (cur != head);
+  } SMARTLIST_FOREACH_END(c);
+  log_info(LD_OR, "Now using the %s circuit scheduler.", sched->name);
+}
+
+/*DOCDOC*/
+#define EPSILON 0.00001
+/*DOCDOC*/
+#define LOG_ONEHALF -0.69314718055994529
+
+/** Adjust the cell EWMA half-life, and pick the circuit scheduler to match,
+ * based on <b>options</b> and <b>consensus</b>. */
+void
+cell_ewma_set_scale_factor(const or_options_t *options,
+                           const networkstatus_t *consensus)
+{
+  int32_t halflife_ms;
+  double halflife;
+  const char *source;
+  if (options && options->CircuitPriorityHalflife >= -EPSILON) {
+    halflife = options->CircuitPriorityHalflife;
+    source = "CircuitPriorityHalflife in configuration";
+  } else if (consensus && (halflife_ms = networkstatus_get_param(
+                 consensus, "CircuitPriorityHalflifeMsec",
+                 -1, -1, INT32_MAX)) >= 0) {
+    halflife = ((double)halflife_ms)/1000.0;
+    source = "CircuitPriorityHalflifeMsec in consensus";
+  } else {
+    halflife = EWMA_DEFAULT_HALFLIFE;
+    source = "Default value";
+  }
+
+  if (halflife <= EPSILON) {
+    /* The cell EWMA algorithm is disabled. */
+    relay_set_circuit_scheduler(&circuit_scheduler_rr);
+    log_info(LD_OR,
+             "Disabled cell_ewma algorithm because of value in %s",
+             source);
+  } else {
+    double new_rate = -LOG_ONEHALF / halflife;
+    /* Counts kept at the old rate would be off from the weights of new
+     * cells by a factor that grows with time, so carry them over. */
+    if (new_rate != ewma_log_rate) {
+      cell_ewma_rescale_all(ewma_log_rate, new_rate);
+      ewma_log_rate = new_rate;
+    }
+    relay_set_circuit_scheduler(&circuit_scheduler_ewma);
+    log_info(LD_OR,
+             "Enabled cell_ewma algorithm because of value in %s; "
+             "half-life is %f seconds",
+             source, halflife);
+  }
 }
 
 /** Add <b>circ</b> to the list of circuits with pending cells on
@@ -2347,13 +2908,8 @@ make_circuit_active_on_conn(circuit_t *circ, or_connection_t *conn)
     *prevp = old_tail;
   }
 
-  if (circ->n_conn == conn) {
-    add_cell_ewma_to_conn(conn, &circ->n_cell_ewma);
-  } else {
-    or_circuit_t *orcirc = TO_OR_CIRCUIT(circ);
-    tor_assert(conn == orcirc->p_conn);
-    add_cell_ewma_to_conn(conn, &orcirc->p_cell_ewma);
-  }
+  if (active_scheduler->activate)
+    active_scheduler->activate(conn, circ);
 
   assert_active_circuits_ok_paranoid(conn);
 }
@@ -2388,13 +2944,8 @@ make_circuit_inactive_on_conn(circuit_t *circ, or_connection_t *conn)
   }
   *prevp = *nextp = NULL;
 
-  if (circ->n_conn == conn) {
-    remove_cell_ewma_from_conn(conn, &circ->n_cell_ewma);
-  } else {
-    or_circuit_t *orcirc = TO_OR_CIRCUIT(circ);
-    tor_assert(conn == orcirc->p_conn);
-    remove_cell_ewma_from_conn(conn, &orcirc->p_cell_ewma);
-  }
+  if (active_scheduler->deactivate)
+    active_scheduler->deactivate(conn, circ);
 
   assert_active_circuits_ok_paranoid(conn);
 }
@@ -2487,34 +3038,13 @@ connection_or_flush_from_first_active_circuit(or_connection_t *conn, int max,
   cell_queue_t *queue;
   circuit_t *circ;
   int streams_blocked;
+  const circuit_scheduler_t *sched = active_scheduler;
+  uint64_t now_nsec = tor_monotime_cached_nsec();
 
-  /* The current (hi-res) time */
-  struct timeval now_hires;
-
-  /* The EWMA cell counter for the circuit we're flushing. */
-  cell_ewma_t *cell_ewma = NULL;
-  double ewma_increment = -1;
-
-  circ = conn->active_circuits;
-  if (!circ) return 0;
+  if (!conn->active_circuits) return 0;
   assert_active_circuits_ok_paranoid(conn);
 
-  /* See if we're doing the ewma circuit selection algorithm. */
-  if (ewma_enabled) {
-    unsigned tick;
-    double fractional_tick;
-    tor_gettimeofday_cached(&now_hires);
-    tick = cell_ewma_tick_from_timeval(&now_hires, &fractional_tick);
-
-    if (tick != conn->active_circuit_pqueue_last_recalibrated) {
-      scale_active_circuits(conn, tick);
-    }
-
-    ewma_increment = pow(ewma_scale_factor, -fractional_tick);
-
-    cell_ewma = smartlist_get(conn->active_circuit_pqueue, 0);
-    circ = cell_ewma_to_circuit(cell_ewma);
-  }
+  circ = sched->pick(conn);
 
   if (circ->n_conn == conn) {
     queue = &circ->n_conn_cells;
@@ -2525,8 +3055,9 @@ connection_or_flush_from_first_active_circuit(or_connection_t *conn, int max,
   }
   tor_assert(*next_circ_on_conn_p(circ,conn));
 
-  for (n_flushed = 0; n_flushed < max && queue->head; ) {
-    packed_cell_t *cell = cell_queue_pop(queue);
+  for (n_flushed = 0; n_flushed < max && queue->n; ) {
+    cell_queue_page_t *emptied_page;
+    const packed_cell_t *cell = cell_queue_pop(queue, &emptied_page);
     tor_assert(*next_circ_on_conn_p(circ,conn));
 
     /* Calculate the exact time that this cell has spent in the queue. */
@@ -2571,31 +3102,24 @@ connection_or_flush_from_first_active_circuit(or_connection_t *conn, int max,
 
     connection_write_to_buf(cell->body, CELL_NETWORK_SIZE, TO_CONN(conn));
 
-    packed_cell_free_unchecked(cell);
+    cell_queue_page_release(emptied_page);
     ++n_flushed;
-    if (cell_ewma) {
-      cell_ewma_t *tmp;
-      cell_ewma->cell_count += ewma_increment;
-      /* We pop and re-add the cell_ewma_t here, not above, since we need to
-       * re-add it immediately to keep the priority queue consistent with
-       * the linked-list implementation */
-      tmp = pop_first_cell_ewma_from_conn(conn);
-      tor_assert(tmp == cell_ewma);
-      add_cell_ewma_to_conn(conn, cell_ewma);
-    }
-    if (!ewma_enabled && circ != conn->active_circuits) {
+    if (!*next_circ_on_conn_p(circ, conn)) {
       /* If this happens, the current circuit just got made inactive by
        * a call in connection_write_to_buf().  That's nothing to worry about:
-       * circuit_make_inactive_on_conn() already advanced conn->active_circuits
-       * for us.
+       * circuit_make_inactive_on_conn() already took it out of the
+       * scheduler for us.
        */
       assert_active_circuits_ok_paranoid(conn);
       goto done;
     }
+    if (sched->cell_flushed)
+      sched->cell_flushed(conn, circ, now_nsec);
   }
   tor_assert(*next_circ_on_conn_p(circ,conn));
   assert_active_circuits_ok_paranoid(conn);
-  conn->active_circuits = *next_circ_on_conn_p(circ, conn);
+  if (sched->circuit_flushed)
+    sched->circuit_flushed(conn, circ);
 
   /* Is the cell queue low enough to unblock all the streams that are waiting
    * to write to this circuit? */
@@ -2678,13 +3202,11 @@ append_cell_to_circuit_queue(circuit_t *circ, or_connection_t *orconn,
     make_circuit_active_on_conn(circ, orconn);
   }
 
-  if (! connection_get_outbuf_len(TO_CONN(orconn))) {
-    /* There is no data at all waiting to be sent on the outbuf.  Add a
-     * cell, so that we can notice when it gets flushed, flushed_some can
-     * get called, and we can start putting more data onto the buffer then.
+  if (connection_or_outbuf_is_low(orconn)) {
+    /* The outbuf has room for this cell.  Let the scheduler decide, along
+     * with every other connection that wants cells, when it gets there.
      */
-    log_debug(LD_GENERAL, "Primed a buffer.");
-    connection_or_flush_from_first_active_circuit(orconn, 1, approx_time());
+    scheduler_conn_wants_cells(orconn);
   }
 }
 
@@ -2785,21 +3307,23 @@ assert_active_circuits_ok(or_connection_t *orconn)
     tor_assert(prev);
     tor_assert(*next_circ_on_conn_p(prev, orconn) == cur);
     tor_assert(*prev_circ_on_conn_p(next, orconn) == cur);
-    if (orconn == cur->n_conn) {
-      ewma = &cur->n_cell_ewma;
-      tor_assert(!ewma->is_for_p_conn);
+    ewma = circuit_get_cell_ewma_on_conn(cur, orconn);
+    tor_assert(ewma->is_for_p_conn == (orconn != cur->n_conn));
+    if (active_scheduler == &circuit_scheduler_ewma) {
+      tor_assert(ewma->heap_index != -1);
+      tor_assert(ewma == smartlist_get(orconn->active_circuit_pqueue,
+                                       ewma->heap_index));
     } else {
-      ewma = &TO_OR_CIRCUIT(cur)->p_cell_ewma;
-      tor_assert(ewma->is_for_p_conn);
+      tor_assert(ewma->heap_index == -1);
     }
-    tor_assert(ewma->heap_index != -1);
-    tor_assert(ewma == smartlist_get(orconn->active_circuit_pqueue,
-                                     ewma->heap_index));
     n++;
     cur = next;
   } while (cur != head);
 
-  tor_assert(n == smartlist_len(orconn->active_circuit_pqueue));
+  if (active_scheduler == &circuit_scheduler_ewma)
+    tor_assert(n == smartlist_len(orconn->active_circuit_pqueue));
+  else
+    tor_assert(smartlist_len(orconn->active_circuit_pqueue) == 0);
 }
 
 /** Return 1 if we shouldn't restart reading on this circuit, even if
@@ -26,10 +26,15 @@ int relay_send_command_from_edge(streamid_t stream_id, circuit_t *circ,
 int connection_edge_send_command(edge_connection_t *fromconn,
                                  uint8_t relay_command, const char *payload,
                                  size_t payload_len);
+size_t connection_edge_bytes_to_package(edge_connection_t *conn);
 int connection_edge_package_raw_inbuf(edge_connection_t *conn,
                                       int package_partial,
                                       int *max_cells);
 void connection_edge_consider_sending_sendme(edge_connection_t *conn);
+#ifdef LIBRARY
+void relay_flush_onionroute_batches(void);
+void relay_free_onionroute_batch(edge_connection_t *conn);
+#endif
 
 extern uint64_t stats_n_data_cells_packaged;
 extern uint64_t stats_n_data_bytes_packaged;
@@ -42,8 +47,8 @@ void clean_cell_pool(void);
 void dump_cell_pool_usage(int severity);
 
 void cell_queue_clear(cell_queue_t *queue);
-void cell_queue_append(cell_queue_t *queue, packed_cell_t *cell);
 void cell_queue_append_packed_copy(cell_queue_t *queue, const cell_t *cell);
+int cell_queue_n_pages(const cell_queue_t *queue);
 
 void append_cell_to_circuit_queue(circuit_t *circ, or_connection_t *orconn,
                                   cell_t *cell, cell_direction_t direction,
@@ -59,12 +64,49 @@ int append_address_to_payload(uint8_t *payload_out, const tor_addr_t *addr);
 const uint8_t *decode_address_from_payload(tor_addr_t *addr_out,
                                         const uint8_t *payload,
                                         int payload_len);
-unsigned cell_ewma_get_tick(void);
+void cell_ewma_init(cell_ewma_t *ewma, int is_for_p_conn);
 void cell_ewma_set_scale_factor(const or_options_t *options,
                                 const networkstatus_t *consensus);
+
+/** A policy for choosing which of the circuits with cells queued for an OR
+ * connection gets to flush next.  Every active circuit is also kept on the
+ * connection's active_circuits ring, whichever scheduler is in use.  Any
+ * hook but <b>pick</b> may be NULL. */
+typedef struct circuit_scheduler_t {
+  /** Name of this scheduler, for log messages. */
+  const char *name;
+  /** Called when <b>circ</b> has just become active on <b>conn</b>. */
+  void (*activate)(or_connection_t *conn, circuit_t *circ);
+  /** Called when <b>circ</b> is about to become inactive on <b>conn</b>. */
+  void (*deactivate)(or_connection_t *conn, circuit_t *circ);
+  /** Return the active circuit on <b>conn</b> that should flush next.
+   * Only called when there is at least one. */
+  circuit_t *(*pick)(or_connection_t *conn);
+  /** Called when <b>circ</b> has just flushed a cell onto <b>conn</b> at
+   * monotonic time <b>now_nsec</b>, and is still active. */
+  void (*cell_flushed)(or_connection_t *conn, circuit_t *circ,
+                       uint64_t now_nsec);
+  /** Called when <b>circ</b> has flushed as many cells as it is going to
+   * for now onto <b>conn</b>, and is still active. */
+  void (*circuit_flushed)(or_connection_t *conn, circuit_t *circ);
+  /** Return a number saying how urgently <b>conn</b>, which has active
+   * circuits, wants to send a cell: lower is more urgent.  Used by the
+   * scheduler in scheduler.c to choose between connections.  If NULL,
+   * connections go first-come, first-served. */
+  double (*priority)(or_connection_t *conn);
+} circuit_scheduler_t;
+
+extern const circuit_scheduler_t circuit_scheduler_rr;
+extern const circuit_scheduler_t circuit_scheduler_ewma;
+const circuit_scheduler_t *relay_get_circuit_scheduler(void);
+void relay_set_circuit_scheduler(const circuit_scheduler_t *sched);
 void circuit_clear_cell_queue(circuit_t *circ, or_connection_t *orconn);
 
 #ifdef RELAY_PRIVATE
+const packed_cell_t *cell_queue_pop(cell_queue_t *queue,
+                                    cell_queue_page_t **page_out);
+void cell_queue_page_release(cell_queue_page_t *page);
+void cell_ewma_add_cell(cell_ewma_t *ewma, uint64_t now_nsec);
 int relay_crypt(circuit_t *circ, cell_t *cell, cell_direction_t cell_direction,
                 crypt_path_t **layer_hint, char *recognized);
 #endif
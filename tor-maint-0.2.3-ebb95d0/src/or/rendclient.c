@@ -994,7 +994,7 @@ rend_client_note_connection_attempt_ended(const char *onion_address)
   /* Clear the timed_out flag on all remaining intro points for this HS. */
   if (cache_entry != NULL) {
 
-	#ifdef LIBRARY
+	#ifdef LIBRARY_CORE_LOCKS
     tor_mutex_acquire(cache_entry->parsed->intro_nodes->lock);
     #endif
 
@@ -1002,7 +1002,7 @@ rend_client_note_connection_attempt_ended(const char *onion_address)
                       rend_intro_point_t *, ip,
                       ip->timed_out = 0; );
 
-	#ifdef LIBRARY
+	#ifdef LIBRARY_CORE_LOCKS
     tor_mutex_release(cache_entry->parsed->intro_nodes->lock);
     #endif
   }
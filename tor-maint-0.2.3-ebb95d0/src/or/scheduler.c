@@ -0,0 +1,405 @@
+/* Copyright (c) 2012, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file scheduler.c
+ * \brief Decide which OR connection gets the next cell, across all of them.
+ *
+ * Each OR connection picks among its own active circuits with the circuit
+ * scheduler in relay.c.  This module picks among connections.  An OR
+ * connection is "pending" when it has circuits with queued cells and room
+ * to take more of them: room on its outbuf, and room in the write buckets
+ * that decide how fast that outbuf can drain.  Pending connections wait in
+ * a priority queue ordered by their best circuit.  When the scheduler runs,
+ * it moves one cell at a time from the best circuit anywhere onto that
+ * circuit's connection, until every connection is out of cells or out of
+ * room.
+ *
+ * That way a quiet circuit on one connection doesn't wait behind a bulk
+ * circuit on another just because the other connection's outbuf drained
+ * first.  Cells that can't be written yet stay in their circuit queues,
+ * where they can still be reordered, instead of piling up on outbufs.
+ * The global write buckets are shared: cells a run hands to one connection
+ * come out of the room every other connection sees for the rest of that
+ * run (see connection_bucket_commit_write()), so when tokens are short the
+ * best circuit gets them.
+ *
+ * Where the kernel will tell us how much it still has to send on a socket,
+ * "room" also leaves out whatever is already waiting there; see
+ * connection_or_kernel_room().  Asking costs syscalls, so we ask at most
+ * once per connection per run, and count the answer down ourselves as we
+ * add cells.  A connection held back that way waits for a write event,
+ * which the kernel only reports once the queue is short (see
+ * OR_CONN_KERNEL_LOWAT in connection_or.c).  Where the kernel can't do
+ * that, nothing tells us when the queue gets shorter, so we check those
+ * connections again every KERNEL_RETRY_MSEC.
+ **/
+
+#define SCHEDULER_PRIVATE
+#include "or.h"
+#include "connection.h"
+#include "connection_or.h"
+#include "main.h"
+#include "relay.h"
+#include "scheduler.h"
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
+/** Priority queue of OR connections that have cells to send and room to
+ * send them, ordered by or_connection_t.sched_priority. */
+static smartlist_t *pending_conns = NULL;
+/** OR connections that have cells to send but are out of write tokens.
+ * They become pending again when the buckets are refilled. */
+static smartlist_t *starved_conns = NULL;
+/** OR connections that have cells to send but whose kernel send queues
+ * are full enough for now, and that can't wait for a write event instead.
+ * We check them again after KERNEL_RETRY_MSEC. */
+static smartlist_t *kernel_blocked_conns = NULL;
+/** Timer used to check back on kernel_blocked_conns. */
+static struct event *kernel_retry_event = NULL;
+/** Event used to run the scheduler once the current batch of events has
+ * been handled, so that cells queued by several callbacks compete in a
+ * single run. */
+static struct event *run_scheduler_event = NULL;
+/** Incremented every time a connection joins the pending queue.  Used to
+ * keep the queue first-come, first-served when the circuit scheduler has no
+ * way to compare connections. */
+static double pending_seq = 0.0;
+/** Number of the scheduler run under way, or of the next one if none is.
+ * An or_connection_t's sched_kernel_room is only good while this matches
+ * its sched_kernel_room_run.  Never 0, so a new connection's room is never
+ * taken as good. */
+static unsigned int sched_run_number = 1;
+
+/** How long do we wait before asking the kernel again whether a connection
+ * has room for more cells? */
+#define KERNEL_RETRY_MSEC 10
+
+/** Helper for sorting or_connection_t values in the pending queue. */
+static int
+compare_conns_by_priority(const void *a, const void *b)
+{
+  const or_connection_t *c1 = a, *c2 = b;
+  if (c1->sched_priority < c2->sched_priority)
+    return -1;
+  else if (c1->sched_priority > c2->sched_priority)
+    return 1;
+  else
+    return 0;
+}
+
+/** Return how many bytes of cells the scheduler may add to <b>conn</b>'s
+ * outbuf right now.  If <b>kernel_limited_out</b> is provided, set it to
+ * true iff there is less than a cell's worth of room only because the
+ * kernel is still holding data for this connection that it hasn't sent. */
+static size_t
+scheduler_conn_room(or_connection_t *conn, time_t now,
+                    int *kernel_limited_out)
+{
+  size_t room = connection_or_outbuf_room(conn);
+  ssize_t bucket_room = connection_bucket_write_room(TO_CONN(conn), now);
+  if (kernel_limited_out)
+    *kernel_limited_out = 0;
+  if (bucket_room < 0)
+    bucket_room = 0;
+  if ((size_t)bucket_room < room)
+    room = bucket_room;
+  if (room < CELL_NETWORK_SIZE || !conn->use_kernel_sendq)
+    return room;
+
+  if (conn->sched_kernel_room_run != sched_run_number) {
+    conn->sched_kernel_room = connection_or_query_kernel_room(conn);
+    conn->sched_kernel_room_run = sched_run_number;
+  }
+  if (conn->sched_kernel_room < room) {
+    room = conn->sched_kernel_room;
+    if (kernel_limited_out && room < CELL_NETWORK_SIZE)
+      *kernel_limited_out = 1;
+  }
+  return room;
+}
+
+/** Callback: run the scheduler. */
+static void
+run_scheduler_cb(evutil_socket_t fd, short event, void *arg)
+{
+  (void)fd;
+  (void)event;
+  (void)arg;
+  scheduler_run();
+}
+
+/** Arrange for the scheduler to run once we're done with the events that
+ * are ready now. */
+static void
+scheduler_schedule_run(void)
+{
+  if (PREDICT_UNLIKELY(!run_scheduler_event)) {
+    run_scheduler_event = tor_event_new(tor_libevent_get_base(), -1, 0,
+                                        run_scheduler_cb, NULL);
+    tor_assert(run_scheduler_event);
+  }
+  event_active(run_scheduler_event, EV_TIMEOUT, 1);
+}
+
+/** Callback: give every connection that was waiting on its kernel send
+ * queue another chance. */
+static void
+kernel_retry_cb(evutil_socket_t fd, short event, void *arg)
+{
+  smartlist_t *blocked;
+  (void)fd;
+  (void)event;
+  (void)arg;
+  blocked = kernel_blocked_conns;
+  kernel_blocked_conns = smartlist_new();
+  SMARTLIST_FOREACH(blocked, or_connection_t *, conn, {
+      conn->sched_kernel_blocked = 0;
+      conn->sched_kernel_room_run = 0; /* Ask the kernel again. */
+      scheduler_conn_wants_cells(conn);
+  });
+  smartlist_free(blocked);
+}
+
+/** Arrange to check kernel_blocked_conns again in a little while, unless
+ * we already have. */
+static void
+scheduler_schedule_kernel_retry(void)
+{
+  if (PREDICT_UNLIKELY(!kernel_retry_event)) {
+    kernel_retry_event = tor_evtimer_new(tor_libevent_get_base(),
+                                         kernel_retry_cb, NULL);
+    tor_assert(kernel_retry_event);
+  }
+  if (!evtimer_pending(kernel_retry_event, NULL)) {
+    struct timeval tv;
+    tv.tv_sec = 0;
+    tv.tv_usec = KERNEL_RETRY_MSEC*1000;
+    event_add(kernel_retry_event, &tv);
+  }
+}
+
+/** Put <b>conn</b>, which is in no queue, into the pending queue with its
+ * current priority. */
+static void
+scheduler_add_pending(or_connection_t *conn)
+{
+  const circuit_scheduler_t *sched = relay_get_circuit_scheduler();
+  tor_assert(conn->sched_heap_idx == -1);
+  if (sched->priority)
+    conn->sched_priority = sched->priority(conn);
+  else
+    conn->sched_priority = ++pending_seq;
+  smartlist_pqueue_add(pending_conns, compare_conns_by_priority,
+                       STRUCT_OFFSET(or_connection_t, sched_heap_idx), conn);
+}
+
+/** Called when <b>conn</b> may want cells from its active circuits: because
+ * one of them just got cells queued, or because its outbuf has drained.  If
+ * it has both cells and room, queue it for the next scheduler run; if it
+ * has cells but no write tokens, wait for the next refill; if the kernel
+ * is still sitting on what we gave it, wait until it's running short. */
+void
+scheduler_conn_wants_cells(or_connection_t *conn)
+{
+  size_t room;
+  int kernel_limited = 0;
+  if (!conn->active_circuits || TO_CONN(conn)->marked_for_close)
+    return;
+  if (conn->sched_heap_idx != -1 || conn->sched_starved ||
+      conn->sched_kernel_blocked)
+    return; /* Already waiting for its turn. */
+  if (PREDICT_UNLIKELY(!pending_conns)) {
+    pending_conns = smartlist_new();
+    starved_conns = smartlist_new();
+    kernel_blocked_conns = smartlist_new();
+  }
+
+  room = scheduler_conn_room(conn, approx_time(), &kernel_limited);
+  if (room >= CELL_NETWORK_SIZE) {
+    scheduler_add_pending(conn);
+    scheduler_schedule_run();
+  } else if (connection_bucket_write_room(TO_CONN(conn),
+                                          approx_time()) < CELL_NETWORK_SIZE) {
+    conn->sched_starved = 1;
+    smartlist_add(starved_conns, conn);
+  } else if (kernel_limited) {
+    conn->sched_kernel_blocked = 1;
+    if (conn->kernel_sendq_lowat) {
+      /* See scheduler_conn_kernel_writable(). */
+      connection_start_writing(TO_CONN(conn));
+    } else {
+      smartlist_add(kernel_blocked_conns, conn);
+      scheduler_schedule_kernel_retry();
+    }
+  }
+  /* Otherwise its outbuf is full, and it will ask again when some of it
+   * has been flushed. */
+}
+
+/** Forget about <b>conn</b>, which is about to be freed. */
+void
+scheduler_release_conn(or_connection_t *conn)
+{
+  if (conn->sched_heap_idx != -1) {
+    smartlist_pqueue_remove(pending_conns, compare_conns_by_priority,
+                            STRUCT_OFFSET(or_connection_t, sched_heap_idx),
+                            conn);
+  }
+  if (conn->sched_starved) {
+    smartlist_remove(starved_conns, conn);
+    conn->sched_starved = 0;
+  }
+  if (conn->sched_kernel_blocked) {
+    if (!conn->kernel_sendq_lowat)
+      smartlist_remove(kernel_blocked_conns, conn);
+    conn->sched_kernel_blocked = 0;
+  }
+}
+
+/** Called when <b>conn</b>, which was waiting on its kernel send queue, has
+ * been reported writable: see whether it can take cells now. */
+void
+scheduler_conn_kernel_writable(or_connection_t *conn)
+{
+  if (!conn->sched_kernel_blocked)
+    return;
+  if (!conn->kernel_sendq_lowat)
+    smartlist_remove(kernel_blocked_conns, conn);
+  conn->sched_kernel_blocked = 0;
+  conn->sched_kernel_room_run = 0; /* Ask the kernel again. */
+  scheduler_conn_wants_cells(conn);
+}
+
+/** Called when the write buckets have been refilled: give every connection
+ * that was waiting for tokens another chance. */
+void
+scheduler_bandwidth_refilled(void)
+{
+  smartlist_t *starved;
+  if (!starved_conns || !smartlist_len(starved_conns))
+    return;
+  starved = starved_conns;
+  starved_conns = smartlist_new();
+  SMARTLIST_FOREACH(starved, or_connection_t *, conn, {
+      conn->sched_starved = 0;
+      scheduler_conn_wants_cells(conn);
+  });
+  smartlist_free(starved);
+}
+
+/** Remove and return the pending connection whose turn is next, or NULL
+ * if there is none. */
+or_connection_t *
+scheduler_pop_pending(void)
+{
+  if (!pending_conns || !smartlist_len(pending_conns))
+    return NULL;
+  return smartlist_pqueue_pop(pending_conns, compare_conns_by_priority,
+                              STRUCT_OFFSET(or_connection_t, sched_heap_idx));
+}
+
+/** Return the priority queue of pending connections, or NULL if no
+ * connection has asked for cells yet.  For testing. */
+smartlist_t *
+scheduler_get_pending_conns(void)
+{
+  return pending_conns;
+}
+
+/** Return the list of connections waiting for write tokens, or NULL if no
+ * connection has asked for cells yet.  For testing. */
+smartlist_t *
+scheduler_get_starved_conns(void)
+{
+  return starved_conns;
+}
+
+/** Return the list of connections waiting for a timer to check their
+ * kernel send queues again, or NULL if no connection has asked for cells
+ * yet.  For testing. */
+smartlist_t *
+scheduler_get_kernel_blocked_conns(void)
+{
+  return kernel_blocked_conns;
+}
+
+/** Move cells from active circuits onto OR connection outbufs, one at a
+ * time, always taking the next cell from the pending connection whose best
+ * circuit the circuit scheduler likes most. */
+void
+scheduler_run(void)
+{
+  time_t now = approx_time();
+  size_t added;
+  int n;
+
+  if (!pending_conns)
+    return;
+
+  while (smartlist_len(pending_conns)) {
+    or_connection_t *conn = scheduler_pop_pending();
+    if (TO_CONN(conn)->marked_for_close || !conn->active_circuits)
+      continue;
+    if (scheduler_conn_room(conn, now, NULL) < CELL_NETWORK_SIZE) {
+      /* Its room went away since it was queued; see whether it's waiting
+       * on tokens, its outbuf, or the kernel. */
+      scheduler_conn_wants_cells(conn);
+      continue;
+    }
+
+    n = connection_or_flush_from_first_active_circuit(conn, 1, now);
+    added = (size_t)n * CELL_NETWORK_SIZE;
+    connection_bucket_commit_write(TO_CONN(conn), now, added);
+    if (conn->sched_kernel_room_run == sched_run_number)
+      conn->sched_kernel_room -= MIN(conn->sched_kernel_room, added);
+
+    /* Writing the cell may have flushed the outbuf, and put this connection
+     * back in line already. */
+    if (conn->sched_heap_idx == -1)
+      scheduler_conn_wants_cells(conn);
+  }
+
+  /* What we learned from the kernel this time was good for this run, and
+   * now it isn't.  So is the count of cells we promised the global buckets:
+   * from here on, each connection's outbuf only counts against itself. */
+  connection_bucket_clear_committed();
+  if (++sched_run_number == 0)
+    sched_run_number = 1;
+}
+
+/** Release all storage held by the scheduler. */
+void
+scheduler_free_all(void)
+{
+  if (pending_conns) {
+    SMARTLIST_FOREACH(pending_conns, or_connection_t *, conn,
+                      conn->sched_heap_idx = -1);
+    smartlist_free(pending_conns);
+    pending_conns = NULL;
+  }
+  if (starved_conns) {
+    SMARTLIST_FOREACH(starved_conns, or_connection_t *, conn,
+                      conn->sched_starved = 0);
+    smartlist_free(starved_conns);
+    starved_conns = NULL;
+  }
+  if (kernel_blocked_conns) {
+    SMARTLIST_FOREACH(kernel_blocked_conns, or_connection_t *, conn,
+                      conn->sched_kernel_blocked = 0);
+    smartlist_free(kernel_blocked_conns);
+    kernel_blocked_conns = NULL;
+  }
+  if (kernel_retry_event) {
+    tor_event_free(kernel_retry_event);
+    kernel_retry_event = NULL;
+  }
+  if (run_scheduler_event) {
+    tor_event_free(run_scheduler_event);
+    run_scheduler_event = NULL;
+  }
+}
+
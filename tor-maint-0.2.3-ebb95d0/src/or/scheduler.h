@@ -0,0 +1,27 @@
+/* Copyright (c) 2012, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file scheduler.h
+ * \brief Header file for scheduler.c.
+ **/
+
+#ifndef _TOR_SCHEDULER_H
+#define _TOR_SCHEDULER_H
+
+void scheduler_conn_wants_cells(or_connection_t *conn);
+void scheduler_release_conn(or_connection_t *conn);
+void scheduler_conn_kernel_writable(or_connection_t *conn);
+void scheduler_bandwidth_refilled(void);
+void scheduler_run(void);
+void scheduler_free_all(void);
+
+#ifdef SCHEDULER_PRIVATE
+or_connection_t *scheduler_pop_pending(void);
+smartlist_t *scheduler_get_pending_conns(void);
+smartlist_t *scheduler_get_starved_conns(void);
+smartlist_t *scheduler_get_kernel_blocked_conns(void);
+#endif
+
+#endif
+
@@ -14,10 +14,14 @@ const char tor_git_revision[] = "";
 
 #include "orconfig.h"
 
+#define BUFFERS_PRIVATE
 #define RELAY_PRIVATE
 
 #include "or.h"
+#include "buffers.h"
+#include "connection_or.h"
 #include "relay.h"
+#include "timewheel.h"
 
 #if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_PROCESS_CPUTIME_ID)
 static uint64_t nanostart;
@@ -67,6 +71,9 @@ perftime(void)
 #define NANOCOUNT(start,end,iters) \
   ( ((double)((end)-(start))) / (iters) )
 
+/** Largest write to make in bench_buf_chunks(). */
+#define MAX_BUF_CHUNK_BENCH_LEN 50000
+
 /** Run AES performance benchmarks. */
 static void
 bench_aes(void)
@@ -124,6 +131,44 @@ bench_cell_aes(void)
   tor_free(b);
 }
 
+/** Compare crypting a cell with three onion layers one at a time, as
+ * cell_aes does, against doing all of them in one call. */
+static void
+bench_cell_aes_layers(void)
+{
+  uint64_t start, end;
+  const int len = 509;
+  const int iters = (1<<16);
+  const int n_layers = 3;
+  char *b = tor_malloc_zero(len);
+  crypto_cipher_t *c[3];
+  int i, j;
+
+  for (j = 0; j < n_layers; ++j)
+    c[j] = crypto_cipher_new(NULL);
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    for (j = 0; j < n_layers; ++j)
+      crypto_cipher_crypt_inplace(c[j], b, len);
+  }
+  end = perftime();
+  printf("%d bytes, %d layers one at a time: %.2f nsec per byte\n",
+         len, n_layers, NANOCOUNT(start, end, iters*len));
+
+  start = perftime();
+  for (i = 0; i < iters; ++i)
+    crypto_cipher_crypt_inplace_multi(c, n_layers, b, len);
+  end = perftime();
+  printf("%d bytes, %d layers at once: %.2f nsec per byte\n",
+         len, n_layers, NANOCOUNT(start, end, iters*len));
+
+  for (j = 0; j < n_layers; ++j)
+    crypto_cipher_free(c[j]);
+  tor_free(b);
+}
+
 /** Run digestmap_t performance benchmarks. */
 static void
 bench_dmap(void)
@@ -240,6 +285,32 @@ bench_cell_ops(void)
            NANOCOUNT(start,end,iters*CELL_PAYLOAD_SIZE));
   }
 
+  /* What a recognized=0 cell with a bad digest costs on top of that:
+   * the running digest is saved, updated, and put back. */
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    crypto_digest_t *backup = crypto_digest_dup(or_circ->n_digest);
+    crypto_digest_add_bytes(or_circ->n_digest, (char*)cell->payload,
+                            CELL_PAYLOAD_SIZE);
+    crypto_digest_assign(or_circ->n_digest, backup);
+    crypto_digest_free(backup);
+  }
+  end = perftime();
+  printf("Digest check with dup+assign: %.2f ns per cell.\n",
+         NANOCOUNT(start,end,iters));
+
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    crypto_digest_checkpoint_t backup;
+    crypto_digest_checkpoint(&backup, or_circ->n_digest);
+    crypto_digest_add_bytes(or_circ->n_digest, (char*)cell->payload,
+                            CELL_PAYLOAD_SIZE);
+    crypto_digest_restore(or_circ->n_digest, &backup);
+  }
+  end = perftime();
+  printf("Digest check with checkpoint: %.2f ns per cell.\n",
+         NANOCOUNT(start,end,iters));
+
   crypto_digest_free(or_circ->p_digest);
   crypto_digest_free(or_circ->n_digest);
   crypto_cipher_free(or_circ->p_crypto);
@@ -248,6 +319,641 @@ bench_cell_ops(void)
   tor_free(cell);
 }
 
+/** Time the smartlist and buf_t operations that every cell goes through,
+ * so builds with and without LIBRARY_CORE_LOCKS can be compared. */
+static void
+bench_core_locks(void)
+{
+  const int iters = 1<<20;
+  const int elts = 64;
+  int i, j, n = 0;
+  smartlist_t *sl = smartlist_new();
+  buf_t *buf = buf_new();
+  char cell[CELL_NETWORK_SIZE];
+  uint64_t start, end;
+
+#ifdef LIBRARY_CORE_LOCKS
+  puts("Core locks: compiled in");
+#else
+  puts("Core locks: compiled out");
+#endif
+
+  memset(cell, 0, sizeof(cell));
+  reset_perftime();
+
+  start = perftime();
+  for (i = 0; i < iters / elts; ++i) {
+    for (j = 0; j < elts; ++j)
+      smartlist_add(sl, cell);
+    for (j = 0; j < elts; ++j)
+      n += smartlist_get(sl, j) == cell;
+    smartlist_clear(sl);
+  }
+  end = perftime();
+  printf("smartlist add+get: %.2f ns per element.\n",
+         NANOCOUNT(start, end, iters));
+
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    write_to_buf(cell, sizeof(cell), buf);
+    fetch_from_buf(cell, sizeof(cell), buf);
+  }
+  end = perftime();
+  printf("buf write+fetch: %.2f ns per cell.\n",
+         NANOCOUNT(start, end, iters));
+  /* We need to use this, or else the whole loop gets optimized out. */
+  printf("Hits == %d\n", n);
+
+  smartlist_free(sl);
+  buf_free(buf);
+}
+
+/** Time taking a burst of cells off an OR connection's inbuf one by one
+ * against taking them all with fetch_cells_from_buf(). */
+static void
+bench_cell_fetch(void)
+{
+  const int iters = 1<<16;
+  const int burst = 16;
+  int i, j, n = 0;
+  buf_t *buf = buf_new();
+  char cells[CELL_NETWORK_SIZE*16];
+  uint64_t start, end;
+
+  memset(cells, 0, sizeof(cells));
+  for (j = 0; j < burst; ++j)
+    cells[j*CELL_NETWORK_SIZE+2] = CELL_RELAY;
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    write_to_buf(cells, sizeof(cells), buf);
+    for (j = 0; j < burst; ++j)
+      n += fetch_from_buf(cells + j*CELL_NETWORK_SIZE, CELL_NETWORK_SIZE, buf);
+  }
+  end = perftime();
+  printf("one cell at a time: %.2f ns per cell.\n",
+         NANOCOUNT(start, end, iters*burst));
+
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    write_to_buf(cells, sizeof(cells), buf);
+    n += fetch_cells_from_buf(buf, cells, burst, 3);
+  }
+  end = perftime();
+  printf("%d cells at a time: %.2f ns per cell.\n", burst,
+         NANOCOUNT(start, end, iters*burst));
+  /* We need to use this, or else the whole loop gets optimized out. */
+  printf("Hits == %d\n", n);
+
+  buf_free(buf);
+}
+
+/** Churn chunks of every size through a set of buffers, the way a busy
+ * relay's connections do, and report how often we had to go to malloc once
+ * the buffers were warmed up. */
+static void
+bench_buf_chunks(void)
+{
+  const int iters = 1<<12;
+  const int n_bufs = 64;
+  buf_t *bufs[64];
+  char *data = tor_malloc_zero(MAX_BUF_CHUNK_BENCH_LEN);
+  size_t len;
+  int i, j, round;
+  uint64_t start = 0, end, mallocs_before = 0;
+
+  for (j = 0; j < n_bufs; ++j)
+    bufs[j] = buf_new();
+
+  for (round = 0; round < 2; ++round) {
+    if (round == 1) {
+      mallocs_before = buf_get_chunk_malloc_count();
+      reset_perftime();
+      start = perftime();
+    }
+    for (i = 0; i < iters; ++i) {
+      for (j = 0; j < n_bufs; ++j) {
+        /* Sizes from 200 bytes to 50K, so we touch every size class. */
+        len = 200 + ((i * 131 + j * 977) % (MAX_BUF_CHUNK_BENCH_LEN - 200));
+        write_to_buf(data, len, bufs[j]);
+      }
+      for (j = 0; j < n_bufs; ++j)
+        buf_clear(bufs[j]);
+    }
+  }
+  end = perftime();
+  printf("write+clear: %.2f ns per buffer; "U64_FORMAT" mallocs for "
+         "%d writes after warm-up.\n",
+         NANOCOUNT(start, end, iters*n_bufs),
+         U64_PRINTF_ARG(buf_get_chunk_malloc_count() - mallocs_before),
+         iters*n_bufs);
+
+  for (j = 0; j < n_bufs; ++j)
+    buf_free(bufs[j]);
+  buf_shrink_freelists(1);
+  tor_free(data);
+}
+
+/** Push data through a socketpair with flush_buf() and read_to_buf(), once
+ * with a system call per chunk and once with readv()/writev() over the
+ * whole chain, and report how many calls each needed per megabyte. */
+static void
+bench_buf_io(void)
+{
+  const size_t total = 32<<20;
+  const size_t window = 256<<10;
+  char *data = tor_malloc_zero(CELL_NETWORK_SIZE);
+  char *out = tor_malloc(window);
+  int mode;
+
+  for (mode = 0; mode < 2; ++mode) {
+    tor_socket_t fds[2];
+    buf_t *src, *dst;
+    size_t moved = 0, flushlen = 0;
+    uint64_t reads0, writes0, reads1, writes1, start, end;
+    int r, eof = 0, err = 0;
+
+    if (buf_set_scatter_gather_io(mode) < 0) {
+      puts("readv()/writev() not available.");
+      continue;
+    }
+    if (tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+      puts("Couldn't make a socketpair.");
+      break;
+    }
+    set_socket_nonblocking(fds[0]);
+    set_socket_nonblocking(fds[1]);
+    src = buf_new();
+    dst = buf_new();
+
+    buf_get_io_call_counts(&reads0, &writes0);
+    reset_perftime();
+    start = perftime();
+    while (moved < total) {
+      /* Queue cells until there's a window's worth waiting, as a busy OR
+       * connection would. */
+      while (buf_datalen(src) < window) {
+        write_to_buf(data, CELL_NETWORK_SIZE, src);
+        flushlen += CELL_NETWORK_SIZE;
+      }
+      r = flush_buf(fds[0], src, flushlen, &flushlen);
+      tor_assert(r >= 0);
+      r = read_to_buf(fds[1], window, dst, &eof, &err);
+      tor_assert(r >= 0);
+      moved += r;
+      while (buf_datalen(dst))
+        fetch_from_buf(out, MIN(buf_datalen(dst), window), dst);
+    }
+    end = perftime();
+    buf_get_io_call_counts(&reads1, &writes1);
+
+    printf("%s: %.2f reads and %.2f writes per MB; %.2f usec per MB.\n",
+           mode ? "readv/writev" : "recv/send per chunk",
+           (double)(reads1 - reads0) / (moved >> 20),
+           (double)(writes1 - writes0) / (moved >> 20),
+           NANOCOUNT(start, end, moved >> 20) / 1000.0);
+
+    buf_free(src);
+    buf_free(dst);
+    tor_close_socket(fds[0]);
+    tor_close_socket(fds[1]);
+  }
+  buf_set_scatter_gather_io(1);
+  tor_free(data);
+  tor_free(out);
+}
+
+/** How many bytes per millisecond does the reading end of the connection
+ * in bench_or_conn_latency() accept?  This is the bottleneck. */
+#define LATENCY_BENCH_RATE 2500
+/** How many milliseconds does each run of bench_or_conn_latency() last? */
+#define LATENCY_BENCH_MSEC 4000
+/** How many milliseconds at the start of each run do we leave out, while
+ * the queues fill up? */
+#define LATENCY_BENCH_WARMUP_MSEC 1000
+/** How often does an interactive cell arrive, in milliseconds? */
+#define LATENCY_BENCH_INTERACTIVE_MSEC 20
+/** High and low water marks used in bench_or_conn_latency() when sizing
+ * the outbuf without asking the kernel; they match connection_or.c. */
+#define LATENCY_BENCH_HIGHWATER (32*1024)
+#define LATENCY_BENCH_LOWWATER (16*1024)
+
+/** Return the current wall-clock time in microseconds. */
+static uint64_t
+bench_usec_now(void)
+{
+  struct timeval tv;
+  tor_gettimeofday(&tv);
+  return ((uint64_t)tv.tv_sec)*1000000 + tv.tv_usec;
+}
+
+/** Open a TCP connection to ourselves over loopback.  Set <b>fds</b>[0]
+ * to the sending end and <b>fds</b>[1] to the receiving end, which gets a
+ * small receive buffer so that the sender's queue is where data piles up.
+ * Return 0 on success, -1 on failure. */
+static int
+open_loopback_tcp_pair(tor_socket_t fds[2])
+{
+  struct sockaddr_in sin;
+  socklen_t len = sizeof(sin);
+  tor_socket_t listener;
+  int rcvbuf = 8192;
+
+  fds[0] = fds[1] = TOR_INVALID_SOCKET;
+  listener = tor_open_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (!SOCKET_OK(listener))
+    return -1;
+  setsockopt(listener, SOL_SOCKET, SO_RCVBUF, (void*)&rcvbuf,
+             sizeof(rcvbuf));
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(listener, (struct sockaddr*)&sin, sizeof(sin)) < 0 ||
+      listen(listener, 1) < 0 ||
+      getsockname(listener, (struct sockaddr*)&sin, &len) < 0)
+    goto err;
+  fds[0] = tor_open_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (!SOCKET_OK(fds[0]) ||
+      connect(fds[0], (struct sockaddr*)&sin, sizeof(sin)) < 0)
+    goto err;
+  len = sizeof(sin);
+  fds[1] = tor_accept_socket(listener, (struct sockaddr*)&sin, &len);
+  if (!SOCKET_OK(fds[1]))
+    goto err;
+  tor_close_socket(listener);
+  set_socket_nonblocking(fds[0]);
+  set_socket_nonblocking(fds[1]);
+  return 0;
+ err:
+  tor_close_socket(listener);
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket(fds[0]);
+  fds[0] = TOR_INVALID_SOCKET;
+  return -1;
+}
+
+/** Push an endless bulk stream, plus an occasional interactive cell, down
+ * a loopback TCP connection whose reader is slower than its writer, and
+ * report how long the interactive cells take to arrive.  Interactive cells
+ * always go onto the outbuf ahead of bulk ones, as the EWMA scheduler would
+ * put them; what's left is the time they spend behind cells that were
+ * already on the outbuf or in the kernel.  Compare refilling the outbuf
+ * from the fixed water marks alone with refilling it only as far as
+ * connection_or_kernel_room() allows. */
+static void
+bench_or_conn_latency(void)
+{
+  char cell[CELL_NETWORK_SIZE];
+  int kernel_aware;
+
+  for (kernel_aware = 0; kernel_aware < 2; ++kernel_aware) {
+    tor_socket_t fds[2];
+    buf_t *outbuf, *inbuf;
+    size_t flushlen = 0;
+    uint64_t start, now, next_interactive, n_interactive = 0;
+    uint64_t latency_total = 0, latency_max = 0, received = 0;
+    uint64_t interactive_waiting = 0;
+    int eof = 0, err = 0;
+
+    if (open_loopback_tcp_pair(fds) < 0) {
+      puts("Couldn't open a loopback TCP connection.");
+      return;
+    }
+    if (kernel_aware) {
+      tor_sendq_t sendq;
+      if (tor_socket_get_sendq(fds[0], &sendq) < 0) {
+        puts("The kernel won't report its send queue here.");
+        tor_close_socket(fds[0]);
+        tor_close_socket(fds[1]);
+        break;
+      }
+    }
+    outbuf = buf_new();
+    inbuf = buf_new();
+
+    start = now = bench_usec_now();
+    next_interactive = start;
+    while (now - start < LATENCY_BENCH_MSEC*1000) {
+      size_t outlen = buf_datalen(outbuf), room = 0;
+
+      if (now >= next_interactive) {
+        /* Only one waiting at a time; its arrival time is its deadline. */
+        if (!interactive_waiting)
+          interactive_waiting = now;
+        next_interactive += LATENCY_BENCH_INTERACTIVE_MSEC*1000;
+      }
+
+      if (kernel_aware) {
+        tor_sendq_t sendq;
+        if (tor_socket_get_sendq(fds[0], &sendq) == 0)
+          room = connection_or_kernel_room(&sendq, outlen);
+      } else if (outlen < LATENCY_BENCH_LOWWATER) {
+        room = LATENCY_BENCH_HIGHWATER - outlen;
+      }
+      while (room >= CELL_NETWORK_SIZE) {
+        memset(cell, 0, sizeof(cell));
+        if (interactive_waiting) {
+          cell[0] = 1;
+          memcpy(cell+1, &interactive_waiting, sizeof(uint64_t));
+          interactive_waiting = 0;
+        }
+        write_to_buf(cell, CELL_NETWORK_SIZE, outbuf);
+        flushlen += CELL_NETWORK_SIZE;
+        room -= CELL_NETWORK_SIZE;
+      }
+      if (flushlen)
+        tor_assert(flush_buf(fds[0], outbuf, flushlen, &flushlen) >= 0);
+
+      tor_assert(read_to_buf(fds[1], LATENCY_BENCH_RATE, inbuf,
+                             &eof, &err) >= 0);
+      now = bench_usec_now();
+      while (buf_datalen(inbuf) >= CELL_NETWORK_SIZE) {
+        fetch_from_buf(cell, CELL_NETWORK_SIZE, inbuf);
+        received += CELL_NETWORK_SIZE;
+        if (cell[0] == 1) {
+          uint64_t queued_at, latency;
+          memcpy(&queued_at, cell+1, sizeof(uint64_t));
+          if (queued_at - start < LATENCY_BENCH_WARMUP_MSEC*1000)
+            continue;
+          latency = now - queued_at;
+          latency_total += latency;
+          if (latency > latency_max)
+            latency_max = latency;
+          ++n_interactive;
+        }
+      }
+
+#ifdef _WIN32
+      Sleep(1);
+#else
+      usleep(1000);
+#endif
+      now = bench_usec_now();
+    }
+
+    printf("%s: %.1f KB/s; interactive cells waited %.1f msec on average, "
+           "%.1f at most (%d cells).\n",
+           kernel_aware ? "kernel-aware refill" : "fixed water marks",
+           (received / 1024.0) / ((now - start) / 1000000.0),
+           n_interactive ? latency_total / 1000.0 / n_interactive : 0.0,
+           latency_max / 1000.0, (int)n_interactive);
+
+    buf_free(outbuf);
+    buf_free(inbuf);
+    tor_close_socket(fds[0]);
+    tor_close_socket(fds[1]);
+  }
+}
+
+/** How many always-busy circuits share the connection in
+ * bench_circuit_schedulers(), per unit of scale? */
+#define SIM_N_BULK 10
+/** How many mostly-idle circuits share it, per unit of scale? */
+#define SIM_N_INTERACTIVE 100
+/** How many cell-sending slots does each simulation run last? */
+#define SIM_N_SLOTS 200000
+/** How long does it take to send one cell, in simulated nanoseconds? */
+#define SIM_SLOT_NSEC 50000
+
+/** State for one run of sim_circuit_scheduler(). */
+typedef struct sim_t {
+  or_connection_t *conn;
+  int scale;
+  uint32_t rng;
+  uint64_t n_interactive_arrived;
+  uint64_t n_interactive_sent;
+} sim_t;
+
+/** One simulated circuit. */
+typedef struct sim_circ_t {
+  origin_circuit_t circ;
+  sim_t *sim;
+  int queued; /**< Cells waiting to be sent. */
+  uint64_t sent; /**< Cells sent so far. */
+  timewheel_entry_t next_burst; /**< When the next burst of cells arrives. */
+} sim_circ_t;
+
+/** Deterministic pseudorandom numbers, so every scheduler sees the same
+ * trace. */
+static uint32_t
+sim_rand(sim_t *sim)
+{
+  sim->rng = sim->rng * 1103515245 + 12345;
+  return sim->rng >> 8;
+}
+
+/** Timewheel callback: a burst of 1-4 cells arrives on an interactive
+ * circuit, which will get another burst after about 2000*scale slots. */
+static void
+sim_burst_cb(timewheel_t *wheel, void *arg, uint64_t now)
+{
+  sim_circ_t *sc = arg;
+  sim_t *sim = sc->sim;
+  int burst = 1 + sim_rand(sim) % 4;
+  if (!sc->queued)
+    make_circuit_active_on_conn(TO_CIRCUIT(&sc->circ), sim->conn);
+  sc->queued += burst;
+  sim->n_interactive_arrived += burst;
+  timewheel_schedule(wheel, &sc->next_burst,
+                     now + 1 + sim_rand(sim) % (4000 * sim->scale));
+}
+
+/** Simulate one OR connection through <b>sched</b>.  Bulk circuits always
+ * have cells queued; interactive circuits get a short burst now and then,
+ * offering about an eighth of a cell per slot between them.  The link sends
+ * one cell per slot.  Report the time spent per slot, Jain's fairness index
+ * over the bulk circuits, and the mean queueing delay of interactive
+ * cells. */
+static void
+sim_circuit_scheduler(const circuit_scheduler_t *sched, int scale)
+{
+  const int n_bulk = SIM_N_BULK * scale;
+  const int n_circs = (SIM_N_BULK + SIM_N_INTERACTIVE) * scale;
+  or_options_t *options = tor_malloc_zero(sizeof(or_options_t));
+  sim_circ_t *circs = tor_malloc_zero(sizeof(sim_circ_t) * n_circs);
+  timewheel_t *wheel = timewheel_new(0);
+  sim_t sim;
+  uint64_t start, end, slot, interactive_backlog = 0;
+  double sum = 0.0, sum_sq = 0.0;
+  int i;
+
+  options->CircuitPriorityHalflife =
+    (sched == &circuit_scheduler_ewma) ? 30.0 : 0.0;
+  cell_ewma_set_scale_factor(options, NULL);
+  tor_assert(relay_get_circuit_scheduler() == sched);
+
+  memset(&sim, 0, sizeof(sim));
+  sim.conn = tor_malloc_zero(sizeof(or_connection_t));
+  sim.conn->active_circuit_pqueue = smartlist_new();
+  sim.scale = scale;
+  sim.rng = 1;
+  for (i = 0; i < n_circs; ++i) {
+    circuit_t *circ = TO_CIRCUIT(&circs[i].circ);
+    circ->magic = ORIGIN_CIRCUIT_MAGIC;
+    circ->n_conn = sim.conn;
+    cell_ewma_init(&circ->n_cell_ewma, 0);
+    circs[i].sim = &sim;
+    timewheel_entry_init(&circs[i].next_burst, sim_burst_cb, &circs[i]);
+    if (i < n_bulk) {
+      circs[i].queued = 1;
+      make_circuit_active_on_conn(circ, sim.conn);
+    } else {
+      timewheel_schedule(wheel, &circs[i].next_burst,
+                         sim_rand(&sim) % (2000 * scale));
+    }
+  }
+
+  reset_perftime();
+  start = perftime();
+  for (slot = 0; slot < SIM_N_SLOTS; ++slot) {
+    circuit_t *circ;
+    sim_circ_t *sc;
+
+    timewheel_advance(wheel, slot);
+    if (!sim.conn->active_circuits)
+      continue;
+
+    circ = sched->pick(sim.conn);
+    sc = SUBTYPE_P(TO_ORIGIN_CIRCUIT(circ), sim_circ_t, circ);
+    ++sc->sent;
+    if (sc - circs >= n_bulk) {
+      --sc->queued;
+      ++sim.n_interactive_sent;
+    }
+    if (!sc->queued) {
+      make_circuit_inactive_on_conn(circ, sim.conn);
+    } else {
+      if (sched->cell_flushed)
+        sched->cell_flushed(sim.conn, circ, slot * SIM_SLOT_NSEC);
+      if (sched->circuit_flushed)
+        sched->circuit_flushed(sim.conn, circ);
+    }
+    interactive_backlog += sim.n_interactive_arrived - sim.n_interactive_sent;
+  }
+  end = perftime();
+
+  for (i = 0; i < n_bulk; ++i) {
+    sum += (double)circs[i].sent;
+    sum_sq += ((double)circs[i].sent) * circs[i].sent;
+  }
+  printf("%s, %d circuits: %.1f nsec per slot; bulk fairness %.4f; "
+         "interactive cells wait %.1f slots\n",
+         sched->name, n_circs,
+         NANOCOUNT(start, end, SIM_N_SLOTS),
+         (sum * sum) / (n_bulk * sum_sq),
+         sim.n_interactive_sent ?
+           ((double)interactive_backlog) / sim.n_interactive_sent : 0.0);
+
+  connection_or_unlink_all_active_circs(sim.conn);
+  timewheel_free(wheel);
+  smartlist_free(sim.conn->active_circuit_pqueue);
+  tor_free(sim.conn);
+  tor_free(options);
+  tor_free(circs);
+}
+
+/** Replay the same synthetic cell arrival traces through each circuit
+ * scheduler, at a few different numbers of circuits per connection. */
+static void
+bench_circuit_schedulers(void)
+{
+  int scale;
+  for (scale = 1; scale <= 100; scale *= 10) {
+    sim_circuit_scheduler(&circuit_scheduler_rr, scale);
+    sim_circuit_scheduler(&circuit_scheduler_ewma, scale);
+  }
+  relay_set_circuit_scheduler(&circuit_scheduler_rr);
+}
+
+#ifdef TOR_IS_MULTITHREADED
+/** How many commands to send through the queue in bench_cmd_queue(). */
+#define CMD_QUEUE_BENCH_ITERS 20000
+
+/** One command sent through the queue in bench_cmd_queue(). */
+typedef struct bench_cmd_t {
+  struct timeval queued_at;
+} bench_cmd_t;
+
+/** State shared between the two threads of bench_cmd_queue(). */
+typedef struct bench_cmd_queue_state_t {
+  mpsc_ring_t *ring;
+  bench_cmd_t *cmds;
+  /** Producer writes here to wake the consumer. */
+  tor_socket_t wakeup[2];
+  /** Consumer writes here once it has run each command. */
+  tor_socket_t ack[2];
+} bench_cmd_queue_state_t;
+
+/** Producer half of bench_cmd_queue(): acts like an application making
+ * one API call and then waiting for the answer, over and over. */
+static void
+bench_cmd_queue_producer(void *arg)
+{
+  bench_cmd_queue_state_t *st = arg;
+  int i;
+  char b = 0;
+  for (i = 0; i < CMD_QUEUE_BENCH_ITERS; ++i) {
+    tor_gettimeofday(&st->cmds[i].queued_at);
+    if (mpsc_ring_push(st->ring, &st->cmds[i]) > 0)
+      send(st->wakeup[1], &b, 1, 0);
+    recv(st->ack[0], &b, 1, 0);
+  }
+  spawn_exit();
+}
+
+/** Run benchmarks for the command queue that carries library API calls to
+ * the main loop: report how long commands wait between being queued and
+ * being run. */
+static void
+bench_cmd_queue(void)
+{
+  bench_cmd_queue_state_t st;
+  uint32_t *latency;
+  struct timeval now;
+  bench_cmd_t *cmd;
+  char buf[64];
+  int n = 0;
+
+  memset(&st, 0, sizeof(st));
+  if (tor_socketpair(AF_UNIX, SOCK_STREAM, 0, st.wakeup) < 0 ||
+      tor_socketpair(AF_UNIX, SOCK_STREAM, 0, st.ack) < 0) {
+    puts("Couldn't make socketpairs.");
+    return;
+  }
+  st.ring = mpsc_ring_new(4096);
+  st.cmds = tor_malloc_zero(sizeof(bench_cmd_t)*CMD_QUEUE_BENCH_ITERS);
+  latency = tor_malloc_zero(sizeof(uint32_t)*CMD_QUEUE_BENCH_ITERS);
+
+  spawn_func(bench_cmd_queue_producer, &st);
+
+  while (n < CMD_QUEUE_BENCH_ITERS) {
+    /* This is what the main loop's wakeup callback does. */
+    if (recv(st.wakeup[0], buf, sizeof(buf), 0) <= 0)
+      break;
+    mpsc_ring_begin_drain(st.ring);
+    while ((cmd = mpsc_ring_pop(st.ring))) {
+      tor_gettimeofday(&now);
+      latency[n++] = (uint32_t) tv_udiff(&cmd->queued_at, &now);
+      send(st.ack[1], buf, 1, 0);
+    }
+  }
+
+  printf("%d commands: p50 %u usec, p99 %u usec, max %u usec\n", n,
+         find_nth_uint32(latency, n, n/2),
+         find_nth_uint32(latency, n, (n*99)/100),
+         find_nth_uint32(latency, n, n-1));
+
+  tor_close_socket(st.wakeup[0]);
+  tor_close_socket(st.wakeup[1]);
+  tor_close_socket(st.ack[0]);
+  tor_close_socket(st.ack[1]);
+  mpsc_ring_free(st.ring);
+  tor_free(st.cmds);
+  tor_free(latency);
+}
+#endif
+
 typedef void (*bench_fn)(void);
 
 typedef struct benchmark_t {
@@ -262,7 +968,17 @@ static struct benchmark_t benchmarks[] = {
   ENT(dmap),
   ENT(aes),
   ENT(cell_aes),
+  ENT(cell_aes_layers),
   ENT(cell_ops),
+  ENT(cell_fetch),
+  ENT(core_locks),
+  ENT(buf_chunks),
+  ENT(buf_io),
+  ENT(or_conn_latency),
+  ENT(circuit_schedulers),
+#ifdef TOR_IS_MULTITHREADED
+  ENT(cmd_queue),
+#endif
   {NULL,NULL,0}
 };
 
@@ -30,9 +30,13 @@ const char tor_git_revision[] = "";
  * are typically file-private. */
 #define BUFFERS_PRIVATE
 #define CONFIG_PRIVATE
+#define CONNECTION_PRIVATE
 #define GEOIP_PRIVATE
 #define ROUTER_PRIVATE
 #define CIRCUIT_PRIVATE
+#define RELAY_PRIVATE
+#define SCHEDULER_PRIVATE
+#define MAIN_PRIVATE
 
 /*
  * Linux doesn't provide lround in math.h by default, but mac os does...
@@ -45,8 +49,11 @@ double fabs(double x);
 #include "or.h"
 #include "buffers.h"
 #include "circuitbuild.h"
+#include "circuitlist.h"
 #include "config.h"
+#include "connection.h"
 #include "connection_edge.h"
+#include "connection_or.h"
 #include "geoip.h"
 #include "rendcommon.h"
 #include "test.h"
@@ -55,8 +62,15 @@ double fabs(double x);
 #include "memarea.h"
 #include "onion.h"
 #include "policies.h"
+#include "relay.h"
 #include "rephist.h"
 #include "routerparse.h"
+#include "scheduler.h"
+
+#ifdef LIBRARY
+#include "main.h"
+#include "../libtor_internal.h"
+#endif
 
 #ifdef USE_DMALLOC
 #include <dmalloc.h>
@@ -636,6 +650,585 @@ test_buffer_copy(void *arg)
     generic_buffer_free(buf2);
 }
 
+/** Make sure that chunks freed from one buffer get reused by the next,
+ * including when buf_pullup() has to grow a chunk. */
+static void
+test_buffer_chunk_reuse(void *arg)
+{
+  buf_t *buf = NULL;
+  char *stats = NULL;
+  char data[20000], out[20000];
+  uint64_t n_mallocs;
+  int i, j;
+  (void)arg;
+
+  for (i = 0; i < (int)sizeof(data); ++i)
+    data[i] = (char)(i*7);
+
+  /* Warm up: get one of every size we'll need. */
+  buf = buf_new_with_capacity(512);
+  for (j = 0; j < (int)sizeof(data); j += 500)
+    write_to_buf(data+j, 500, buf);
+  buf_pullup(buf, sizeof(data), 0);
+  buf_free(buf);
+
+  n_mallocs = buf_get_chunk_malloc_count();
+  for (i = 0; i < 10; ++i) {
+    buf = buf_new_with_capacity(512);
+    for (j = 0; j < (int)sizeof(data); j += 500)
+      write_to_buf(data+j, 500, buf);
+    tt_int_op(buf_datalen(buf), ==, sizeof(data));
+    buf_pullup(buf, sizeof(data), 0);
+    tt_int_op(buf_datalen(buf), ==, sizeof(data));
+    fetch_from_buf(out, sizeof(out), buf);
+    test_memeq(out, data, sizeof(data));
+    buf_free(buf);
+    buf = NULL;
+  }
+#ifdef ENABLE_BUF_FREELISTS
+  tt_assert(buf_get_chunk_malloc_count() == n_mallocs);
+#else
+  tt_assert(buf_get_chunk_malloc_count() > n_mallocs);
+#endif
+
+  stats = buf_get_freelist_stats();
+  tt_assert(stats);
+#ifdef ENABLE_BUF_FREELISTS
+  tt_assert(strstr(stats, "1024-byte chunks: 0 in use"));
+#endif
+
+ done:
+  if (buf)
+    buf_free(buf);
+  tor_free(stats);
+  buf_shrink_freelists(0);
+}
+
+/** Move a lot of data through a socketpair with flush_buf() and
+ * read_to_buf(), so that both span many chunks at once, and make sure it
+ * arrives intact whichever way the buffers do their I/O. */
+static void
+test_buffer_socket_io(void *arg)
+{
+  buf_t *src = NULL, *dst = NULL;
+  char *data = NULL, *out = NULL;
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  const size_t len = 200000;
+  size_t flushlen, sent = 0;
+  int mode, i, r, eof = 0, err = 0;
+  (void)arg;
+
+  data = tor_malloc(len);
+  out = tor_malloc(len);
+  for (i = 0; i < (int)len; ++i)
+    data[i] = (char)(i*13 + i/256);
+
+  for (mode = 0; mode < 2; ++mode) {
+    if (buf_set_scatter_gather_io(mode) < 0)
+      continue;
+    tt_int_op(tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds), ==, 0);
+    set_socket_nonblocking(fds[0]);
+    set_socket_nonblocking(fds[1]);
+    src = buf_new_with_capacity(512);
+    dst = buf_new_with_capacity(512);
+    for (i = 0; i < (int)len; i += 1000)
+      write_to_buf(data+i, MIN(1000, len-i), src);
+    flushlen = buf_datalen(src);
+
+    sent = 0;
+    while (buf_datalen(dst) < len) {
+      if (flushlen) {
+        r = flush_buf(fds[0], src, flushlen, &flushlen);
+        tt_int_op(r, >=, 0);
+        sent += r;
+      }
+      r = read_to_buf(fds[1], len, dst, &eof, &err);
+      tt_int_op(r, >=, 0);
+      tt_assert(!eof);
+    }
+    tt_int_op(sent, ==, len);
+    tt_int_op(buf_datalen(src), ==, 0);
+    tt_int_op(buf_datalen(dst), ==, len);
+    fetch_from_buf(out, len, dst);
+    test_memeq(out, data, len);
+
+    buf_free(src);
+    buf_free(dst);
+    src = dst = NULL;
+    tor_close_socket(fds[0]);
+    tor_close_socket(fds[1]);
+    fds[0] = fds[1] = TOR_INVALID_SOCKET;
+  }
+
+ done:
+  buf_set_scatter_gather_io(1);
+  if (src)
+    buf_free(src);
+  if (dst)
+    buf_free(dst);
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket(fds[1]);
+  tor_free(data);
+  tor_free(out);
+}
+
+/** Make sure we size OR connection outbufs by what the kernel reports. */
+static void
+test_or_conn_kernel_room(void *arg)
+{
+  tor_sendq_t sendq;
+  (void)arg;
+
+  /* A full congestion window and nothing queued: there's still room for a
+   * few cells, so the connection doesn't stall waiting on acks. */
+  memset(&sendq, 0, sizeof(sendq));
+  tt_int_op(connection_or_kernel_room(&sendq, 0), >=, CELL_NETWORK_SIZE);
+  tt_int_op(connection_or_kernel_room(&sendq, 0), <, 32*1024);
+
+  /* A wide-open window is still capped at the high water mark, less what
+   * the kernel and the outbuf already hold. */
+  sendq.window_space = 1<<20;
+  tt_int_op(connection_or_kernel_room(&sendq, 0), ==, 32*1024);
+  sendq.unsent = 10000;
+  tt_int_op(connection_or_kernel_room(&sendq, 5000), ==, 32*1024 - 15000);
+
+  /* Once enough is waiting to be sent, we add nothing more. */
+  sendq.unsent = 40000;
+  tt_int_op(connection_or_kernel_room(&sendq, 0), ==, 0);
+  sendq.window_space = 0;
+  sendq.unsent = 0;
+  tt_int_op(connection_or_kernel_room(&sendq, 32*1024), ==, 0);
+
+ done:
+  ;
+}
+
+#ifndef USE_BUFFEREVENTS
+/** Change the bandwidth options once the global token buckets are set up,
+ * and make sure the buckets follow. */
+static void
+test_bucket_adjust(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  const token_bucket_t *rd = connection_get_global_bucket(0, 0);
+  const token_bucket_t *wr = connection_get_global_bucket(0, 1);
+  const token_bucket_t *relay_rd = connection_get_global_bucket(1, 0);
+  const token_bucket_t *relay_wr = connection_get_global_bucket(1, 1);
+  uint64_t old_rate = options->BandwidthRate;
+  uint64_t old_burst = options->BandwidthBurst;
+  uint64_t old_relay_rate = options->RelayBandwidthRate;
+  uint64_t old_relay_burst = options->RelayBandwidthBurst;
+  (void)arg;
+
+  options->BandwidthRate = 100000;
+  options->BandwidthBurst = 200000;
+  options->RelayBandwidthRate = 0;
+  options->RelayBandwidthBurst = 0;
+  connection_bucket_init();
+  tt_int_op(rd->rate, ==, 100000);
+  tt_int_op(token_bucket_get(wr), ==, 200000);
+  tt_int_op(relay_rd->rate, ==, 100000);
+  tt_int_op(token_bucket_get(relay_wr), ==, 200000);
+
+  /* Lower the limits: full buckets drop to their new bursts. */
+  options->BandwidthRate = 50000;
+  options->BandwidthBurst = 60000;
+  options->RelayBandwidthRate = 10000;
+  options->RelayBandwidthBurst = 20000;
+  connection_bucket_adjust(options);
+  tt_int_op(rd->rate, ==, 50000);
+  tt_int_op(wr->rate, ==, 50000);
+  tt_int_op(token_bucket_get(rd), ==, 60000);
+  tt_int_op(token_bucket_get(wr), ==, 60000);
+  tt_int_op(relay_rd->rate, ==, 10000);
+  tt_int_op(relay_wr->rate, ==, 10000);
+  tt_int_op(token_bucket_get(relay_rd), ==, 20000);
+  tt_int_op(token_bucket_get(relay_wr), ==, 20000);
+
+  /* Raise them: the buckets keep what they hold and grow towards the new
+   * caps; with no RelayBandwidthRate, relayed traffic gets the main
+   * limits. */
+  options->BandwidthBurst = 500000;
+  options->RelayBandwidthRate = 0;
+  options->RelayBandwidthBurst = 0;
+  connection_bucket_adjust(options);
+  tt_int_op(rd->burst, ==, 500000);
+  tt_int_op(token_bucket_get(rd), ==, 60000);
+  tt_int_op(relay_wr->rate, ==, 50000);
+  tt_int_op(relay_wr->burst, ==, 500000);
+  tt_int_op(token_bucket_get(relay_wr), ==, 20000);
+
+ done:
+  options->BandwidthRate = old_rate;
+  options->BandwidthBurst = old_burst;
+  options->RelayBandwidthRate = old_relay_rate;
+  options->RelayBandwidthBurst = old_relay_burst;
+}
+
+/** Have several fake OR connections ask the scheduler for cells, and make
+ * sure it takes them in priority order, holds back the ones without write
+ * tokens until the buckets refill, and forgets each one as it is freed.
+ * Then have two connections compete for the last cell's worth of global
+ * write tokens, and make sure the better circuit gets them. */
+static void
+test_scheduler(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  uint64_t old_rate = options->BandwidthRate;
+  uint64_t old_burst = options->BandwidthBurst;
+  const double counts[3] = { 3.0, 1.0, 2.0 };
+  or_connection_t *conns[3];
+  cell_ewma_t ewma[3];
+  circuit_t circ;
+  or_circuit_t *or_circs[2];
+  cell_t cell;
+  tor_libevent_cfg cfg;
+  smartlist_t *pending, *starved, *blocked;
+  int i;
+  (void)arg;
+
+  memset(conns, 0, sizeof(conns));
+  memset(or_circs, 0, sizeof(or_circs));
+  memset(&cell, 0, sizeof(cell));
+  memset(&circ, 0, sizeof(circ));
+  memset(&cfg, 0, sizeof(cfg));
+  tor_libevent_initialize(&cfg);
+  relay_set_circuit_scheduler(&circuit_scheduler_ewma);
+
+  /* Plenty of write tokens to start with. */
+  options->BandwidthRate = options->BandwidthBurst = 1<<20;
+  connection_bucket_init();
+
+  /* Each connection has one active circuit, with a public address so
+   * that it's rate-limited. */
+  for (i = 0; i < 3; ++i) {
+    conns[i] = or_connection_new(AF_INET);
+    tor_addr_from_ipv4h(&TO_CONN(conns[i])->addr, 0x12000001 + i);
+    cell_ewma_init(&ewma[i], 0);
+    ewma[i].log_cell_count = counts[i];
+    smartlist_add(conns[i]->active_circuit_pqueue, &ewma[i]);
+    conns[i]->active_circuits = &circ;
+  }
+
+  /* Connections take their turns quietest circuit first. */
+  for (i = 0; i < 3; ++i)
+    scheduler_conn_wants_cells(conns[i]);
+  pending = scheduler_get_pending_conns();
+  tt_int_op(smartlist_len(pending), ==, 3);
+  for (i = 0; i < 3; ++i)
+    tt_assert(conns[i]->sched_priority == counts[i]);
+  tt_ptr_op(scheduler_pop_pending(), ==, conns[1]);
+  tt_ptr_op(scheduler_pop_pending(), ==, conns[2]);
+  tt_ptr_op(scheduler_pop_pending(), ==, conns[0]);
+  tt_ptr_op(scheduler_pop_pending(), ==, NULL);
+  tt_int_op(conns[0]->sched_heap_idx, ==, -1);
+
+  /* Without a cell's worth of write tokens, they wait for a refill
+   * instead, and asking again doesn't put them on the list twice. */
+  options->BandwidthRate = options->BandwidthBurst = 100;
+  connection_bucket_init();
+  for (i = 0; i < 3; ++i)
+    scheduler_conn_wants_cells(conns[i]);
+  scheduler_conn_wants_cells(conns[0]);
+  starved = scheduler_get_starved_conns();
+  tt_int_op(smartlist_len(pending), ==, 0);
+  tt_int_op(smartlist_len(starved), ==, 3);
+  for (i = 0; i < 3; ++i)
+    tt_assert(conns[i]->sched_starved);
+
+  /* Once the buckets refill, they're back in line. */
+  options->BandwidthRate = options->BandwidthBurst = 1<<20;
+  connection_bucket_init();
+  scheduler_bandwidth_refilled();
+  starved = scheduler_get_starved_conns();
+  tt_int_op(smartlist_len(starved), ==, 0);
+  tt_int_op(smartlist_len(pending), ==, 3);
+  for (i = 0; i < 3; ++i)
+    tt_assert(! conns[i]->sched_starved);
+
+  /* Leave one connection pending, one starved and one waiting on its
+   * kernel send queue, then free them all. */
+  tt_ptr_op(scheduler_pop_pending(), ==, conns[1]);
+  tt_ptr_op(scheduler_pop_pending(), ==, conns[2]);
+  options->BandwidthRate = options->BandwidthBurst = 100;
+  connection_bucket_init();
+  scheduler_conn_wants_cells(conns[1]);
+  tt_int_op(smartlist_len(starved), ==, 1);
+  blocked = scheduler_get_kernel_blocked_conns();
+  conns[2]->sched_kernel_blocked = 1;
+  smartlist_add(blocked, conns[2]);
+
+  for (i = 0; i < 3; ++i) {
+    connection_free(TO_CONN(conns[i]));
+    tt_assert(! smartlist_isin(pending, conns[i]));
+    tt_assert(! smartlist_isin(starved, conns[i]));
+    tt_assert(! smartlist_isin(blocked, conns[i]));
+    conns[i] = NULL;
+  }
+  tt_int_op(smartlist_len(pending), ==, 0);
+  tt_int_op(smartlist_len(starved), ==, 0);
+  tt_int_op(smartlist_len(blocked), ==, 0);
+
+  /* Two connections each get a circuit with a cell queued, but the global
+   * bucket only has room for one cell.  Both look like they have room
+   * until one of them uses it up. */
+  init_cell_pool();
+  options->BandwidthRate = options->BandwidthBurst = CELL_NETWORK_SIZE;
+  connection_bucket_init();
+  cell.command = CELL_RELAY;
+  for (i = 0; i < 2; ++i) {
+    conns[i] = or_connection_new(AF_INET);
+    tor_addr_from_ipv4h(&TO_CONN(conns[i])->addr, 0x12000001 + i);
+    or_circs[i] = or_circuit_new(i + 1, conns[i]);
+    or_circs[i]->p_cell_ewma.log_cell_count = i ? 1.0 : 2.0;
+    cell.circ_id = i + 1;
+    append_cell_to_circuit_queue(TO_CIRCUIT(or_circs[i]), conns[i], &cell,
+                                 CELL_DIRECTION_IN, 0);
+  }
+  tt_int_op(smartlist_len(pending), ==, 2);
+
+  /* The quieter circuit's connection gets the tokens; the other waits for
+   * a refill with its cell still queued. */
+  scheduler_run();
+  starved = scheduler_get_starved_conns();
+  tt_int_op(TO_CONN(conns[1])->outbuf_flushlen, ==, CELL_NETWORK_SIZE);
+  tt_int_op(TO_CONN(conns[0])->outbuf_flushlen, ==, 0);
+  tt_int_op(or_circs[0]->p_conn_cells.n, ==, 1);
+  tt_int_op(smartlist_len(pending), ==, 0);
+  tt_int_op(smartlist_len(starved), ==, 1);
+  tt_assert(conns[0]->sched_starved);
+
+ done:
+  scheduler_free_all();
+  for (i = 0; i < 2; ++i) {
+    if (or_circs[i] && conns[i])
+      circuit_clear_cell_queue(TO_CIRCUIT(or_circs[i]), conns[i]);
+  }
+  for (i = 0; i < 3; ++i) {
+    if (conns[i])
+      connection_free(TO_CONN(conns[i]));
+  }
+  free_cell_pool();
+  options->BandwidthRate = old_rate;
+  options->BandwidthBurst = old_burst;
+}
+#endif
+
+#ifdef LIBRARY
+/** State shared with recv_shutdown_reader(). */
+typedef struct recv_shutdown_reader_t {
+  void *id;
+  tor_mutex_t *lock;
+  int done;
+  int result;
+} recv_shutdown_reader_t;
+
+/** Thread body for test_recv_shutdown: block reading one stream. */
+static void
+recv_shutdown_reader(void *arg)
+{
+  recv_shutdown_reader_t *reader = arg;
+  char buf[64];
+  int r = onionroute_recv_stream_data_v1(reader->id, buf, sizeof(buf));
+
+  tor_mutex_acquire(reader->lock);
+  reader->result = r;
+  reader->done = 1;
+  tor_mutex_release(reader->lock);
+  spawn_exit();
+}
+
+/** Sleep for about a millisecond. */
+static void
+recv_shutdown_nap(void)
+{
+#ifdef _WIN32
+  Sleep(1);
+#else
+  usleep(1000);
+#endif
+}
+
+/** Shut the library down while a reader is blocked on a stream, and make
+ * sure the reader wakes with end of stream and frees the entry on its
+ * way out. */
+static void
+test_recv_shutdown(void *arg)
+{
+  recv_shutdown_reader_t reader;
+  int i, finished = 0;
+  (void)arg;
+
+  onionroute_locks_init();
+  memset(&reader, 0, sizeof(reader));
+  reader.lock = tor_mutex_new();
+  reader.id = onionroute_handle_new();
+  tt_assert(reader.id);
+
+  tt_int_op(spawn_func(recv_shutdown_reader, &reader), ==, 0);
+  for (i = 0; i < 5000; ++i) {
+    if (onionroute_recv_stream_get_n_waiters(reader.id) == 1)
+      break;
+    recv_shutdown_nap();
+  }
+  tt_int_op(onionroute_recv_stream_get_n_waiters(reader.id), ==, 1);
+
+  /* The entry outlives shutdown for as long as someone sleeps on it. */
+  tt_int_op(onionroute_shutdown_v1(), ==, 0);
+
+  for (i = 0; i < 5000 && !finished; ++i) {
+    tor_mutex_acquire(reader.lock);
+    finished = reader.done;
+    tor_mutex_release(reader.lock);
+    if (!finished)
+      recv_shutdown_nap();
+  }
+  tt_assert(finished);
+  tt_int_op(reader.result, ==, -1);
+  tt_int_op(onionroute_recv_stream_get_n_waiters(reader.id), ==, -1);
+
+ done:
+  /* A reader that never woke still uses the lock; leave it be. */
+  if (finished)
+    tor_mutex_free(reader.lock);
+}
+#endif
+
+/** Return true iff two cell EWMA log counts are equal, give or take
+ * rounding. */
+static int
+ewma_log_counts_eq(double a, double b)
+{
+  if (a == b)
+    return 1;
+  return a - b < 1e-9 && b - a < 1e-9;
+}
+
+/** Change the cell EWMA half-life while circuits have cells counted, and
+ * make sure their counts carry over to the new half-life. */
+static void
+test_cell_ewma_halflife_change(void *arg)
+{
+  or_options_t *options = options_new();
+  or_circuit_t *circ = or_circuit_new(0, NULL);
+  or_circuit_t *quiet = or_circuit_new(0, NULL);
+  cell_ewma_t fresh;
+  const uint64_t sec = 1000000000;
+  (void)arg;
+
+  options->CircuitPriorityHalflife = 10.0;
+  cell_ewma_set_scale_factor(options, NULL);
+  tt_ptr_op(relay_get_circuit_scheduler(), ==, &circuit_scheduler_ewma);
+
+  /* One circuit sends a cell a long while ago on one side and a recent cell
+   * on the other; the other circuit sends nothing. */
+  cell_ewma_add_cell(&TO_CIRCUIT(circ)->n_cell_ewma, 100*sec);
+  cell_ewma_add_cell(&circ->p_cell_ewma, 1000*sec);
+
+  /* Shorten the half-life mid-run. */
+  options->CircuitPriorityHalflife = 1.0;
+  cell_ewma_set_scale_factor(options, NULL);
+
+  /* Each count now matches what the same cell would have counted for had
+   * the new half-life been in force all along. */
+  cell_ewma_init(&fresh, 0);
+  cell_ewma_add_cell(&fresh, 100*sec);
+  tt_assert(ewma_log_counts_eq(TO_CIRCUIT(circ)->n_cell_ewma.log_cell_count,
+                               fresh.log_cell_count));
+  cell_ewma_init(&fresh, 1);
+  cell_ewma_add_cell(&fresh, 1000*sec);
+  tt_assert(ewma_log_counts_eq(circ->p_cell_ewma.log_cell_count,
+                               fresh.log_cell_count));
+
+  /* So new cells weigh against the old ones at the new half-life: a cell
+   * sent one second after the old one counts twice as much. */
+  cell_ewma_add_cell(&circ->p_cell_ewma, 1001*sec);
+  cell_ewma_add_cell(&fresh, 1001*sec);
+  tt_assert(ewma_log_counts_eq(circ->p_cell_ewma.log_cell_count,
+                               fresh.log_cell_count));
+
+  /* Empty counts stay empty, and still sort before everything. */
+  cell_ewma_init(&fresh, 0);
+  tt_assert(TO_CIRCUIT(quiet)->n_cell_ewma.log_cell_count ==
+            fresh.log_cell_count);
+  tt_assert(quiet->p_cell_ewma.log_cell_count <
+            TO_CIRCUIT(circ)->n_cell_ewma.log_cell_count);
+
+ done:
+  circuit_free_all();
+  tor_free(options);
+}
+
+/** Queue cells on a cell_queue_t across several pages, and make sure they
+ * come back out in order and that pages are given back as they empty. */
+static void
+test_cell_queue(void *arg)
+{
+  cell_queue_t queue;
+  cell_t cell;
+  const packed_cell_t *packed;
+  cell_queue_page_t *page;
+  int i;
+  (void)arg;
+
+  init_cell_pool();
+  memset(&queue, 0, sizeof(queue));
+  memset(&cell, 0, sizeof(cell));
+  tt_ptr_op(cell_queue_pop(&queue, &page), ==, NULL);
+  tt_ptr_op(page, ==, NULL);
+
+  for (i = 0; i < 40; ++i) {
+    cell.circ_id = i;
+    cell.command = CELL_RELAY;
+    cell.payload[0] = (uint8_t)i;
+    cell_queue_append_packed_copy(&queue, &cell);
+  }
+  tt_int_op(queue.n, ==, 40);
+  tt_int_op(cell_queue_n_pages(&queue), ==, 5);
+
+  for (i = 0; i < 20; ++i) {
+    packed = cell_queue_pop(&queue, &page);
+    tt_assert(packed);
+    tt_int_op(ntohs(get_uint16(packed->body)), ==, i);
+    tt_int_op((uint8_t)packed->body[2], ==, CELL_RELAY);
+    tt_int_op((uint8_t)packed->body[3], ==, i);
+    /* Only the last cell on a page hands the page back. */
+    tt_assert(bool_eq(page, i == 7 || i == 15));
+    cell_queue_page_release(page);
+  }
+  tt_int_op(queue.n, ==, 20);
+  tt_int_op(cell_queue_n_pages(&queue), ==, 3);
+
+  /* Emptying the queue gives back its last page too. */
+  for (i = 20; i < 40; ++i) {
+    packed = cell_queue_pop(&queue, &page);
+    tt_int_op(ntohs(get_uint16(packed->body)), ==, i);
+    tt_assert(bool_eq(page, i == 23 || i == 31 || i == 39));
+    cell_queue_page_release(page);
+  }
+  tt_int_op(queue.n, ==, 0);
+  tt_ptr_op(queue.head_page, ==, NULL);
+  tt_ptr_op(queue.tail_page, ==, NULL);
+
+  /* And the queue can be reused, and cleared with cells still on it. */
+  cell.circ_id = 99;
+  cell_queue_append_packed_copy(&queue, &cell);
+  packed = cell_queue_pop(&queue, &page);
+  tt_int_op(ntohs(get_uint16(packed->body)), ==, 99);
+  cell_queue_page_release(page);
+  for (i = 0; i < 20; ++i)
+    cell_queue_append_packed_copy(&queue, &cell);
+  cell_queue_clear(&queue);
+  tt_int_op(queue.n, ==, 0);
+  tt_int_op(cell_queue_n_pages(&queue), ==, 0);
+
+ done:
+  cell_queue_clear(&queue);
+  free_cell_pool();
+}
+
 /** Run unit tests for buffers.c */
 static void
 test_buffers(void)
@@ -814,6 +1407,39 @@ test_buffers(void)
     buf = NULL;
   }
 
+  /* Fetching a run of fixed-length cells stops at a variable-length one. */
+  {
+    char cells[CELL_NETWORK_SIZE*4];
+    var_cell_t *var_cell = NULL;
+
+    buf = buf_new();
+    memset(cells, 0, sizeof(cells));
+    for (j = 0; j < 3; ++j) {
+      cells[j*CELL_NETWORK_SIZE+1] = j;
+      cells[j*CELL_NETWORK_SIZE+2] = CELL_RELAY;
+    }
+    write_to_buf(cells, CELL_NETWORK_SIZE*3, buf);
+    /* a VERSIONS cell with a 2-byte body, then half a cell */
+    write_to_buf("\x00\x00\x07\x00\x02\x00\x03", 7, buf);
+    write_to_buf(cells, CELL_NETWORK_SIZE/2, buf);
+
+    memset(cells, 0xff, sizeof(cells));
+    tt_int_op(fetch_cells_from_buf(buf, cells, 2, 3), ==, 2);
+    tt_int_op(cells[1], ==, 0);
+    tt_int_op(cells[CELL_NETWORK_SIZE+1], ==, 1);
+    tt_int_op(fetch_cells_from_buf(buf, cells, 16, 3), ==, 1);
+    tt_int_op(cells[1], ==, 2);
+    tt_int_op(fetch_cells_from_buf(buf, cells, 16, 3), ==, 0);
+    tt_int_op(fetch_var_cell_from_buf(buf, &var_cell, 3), ==, 1);
+    tt_assert(var_cell);
+    tt_int_op(var_cell->command, ==, CELL_VERSIONS);
+    tor_free(var_cell);
+    tt_int_op(fetch_cells_from_buf(buf, cells, 16, 3), ==, 0);
+    tt_int_op(buf_datalen(buf), ==, CELL_NETWORK_SIZE/2);
+    buf_free(buf);
+    buf = NULL;
+  }
+
  done:
   if (buf)
     buf_free(buf);
@@ -1906,6 +2532,19 @@ const struct testcase_setup_t legacy_setup = {
 static struct testcase_t test_array[] = {
   ENT(buffers),
   { "buffer_copy", test_buffer_copy, 0, NULL, NULL },
+  { "buffer_chunk_reuse", test_buffer_chunk_reuse, 0, NULL, NULL },
+  { "buffer_socket_io", test_buffer_socket_io, 0, NULL, NULL },
+  { "or_conn_kernel_room", test_or_conn_kernel_room, 0, NULL, NULL },
+  { "cell_queue", test_cell_queue, 0, NULL, NULL },
+  { "cell_ewma_halflife_change", test_cell_ewma_halflife_change, TT_FORK,
+    NULL, NULL },
+#ifndef USE_BUFFEREVENTS
+  { "bucket_adjust", test_bucket_adjust, TT_FORK, NULL, NULL },
+  { "scheduler", test_scheduler, TT_FORK, NULL, NULL },
+#endif
+#ifdef LIBRARY
+  { "recv_shutdown", test_recv_shutdown, TT_FORK, NULL, NULL },
+#endif
   ENT(onion_handshake),
   ENT(circuit_timeout),
   ENT(policies),
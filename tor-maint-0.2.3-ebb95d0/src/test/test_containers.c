@@ -504,12 +504,71 @@ test_container_bitarray(void)
     else
       i += 7;
   }
+  bitarray_free(ba);
+
+  /* Finding zero bits, one word at a time. */
+  ba = bitarray_init_zero(1000);
+  test_eq(bitarray_find_first_zero(ba, 1000, 0), 0);
+  test_eq(bitarray_find_first_zero(ba, 1000, 77), 77);
+  test_eq(bitarray_find_first_zero(ba, 1000, 1000), -1);
+  for (j = 0; j < 1000; ++j)
+    bitarray_set(ba, j);
+  test_eq(bitarray_find_first_zero(ba, 1000, 0), -1);
+  bitarray_clear(ba, 5);
+  bitarray_clear(ba, 700);
+  bitarray_clear(ba, 999);
+  test_eq(bitarray_find_first_zero(ba, 1000, 0), 5);
+  test_eq(bitarray_find_first_zero(ba, 1000, 5), 5);
+  test_eq(bitarray_find_first_zero(ba, 1000, 6), 700);
+  test_eq(bitarray_find_first_zero(ba, 1000, 701), 999);
+  /* Bits past the end don't count, even if they're clear. */
+  test_eq(bitarray_find_first_zero(ba, 999, 701), -1);
 
  done:
   if (ba)
     bitarray_free(ba);
 }
 
+/** Run unit tests for the single-consumer command ring. */
+static void
+test_container_mpsc_ring(void)
+{
+  mpsc_ring_t *ring = mpsc_ring_new(3);
+  int items[5];
+  int i;
+
+  /* Capacity is rounded up to a power of two. */
+  test_eq(4, mpsc_ring_capacity(ring));
+  test_eq(0, mpsc_ring_len(ring));
+  test_eq_ptr(NULL, mpsc_ring_pop(ring));
+
+  /* Only the first push after a drain asks for a wakeup; a full ring
+   * refuses new items. */
+  test_eq(1, mpsc_ring_push(ring, &items[0]));
+  test_eq(0, mpsc_ring_push(ring, &items[1]));
+  test_eq(0, mpsc_ring_push(ring, &items[2]));
+  test_eq(0, mpsc_ring_push(ring, &items[3]));
+  test_eq(-1, mpsc_ring_push(ring, &items[4]));
+  test_eq(4, mpsc_ring_len(ring));
+
+  mpsc_ring_begin_drain(ring);
+  test_eq_ptr(&items[0], mpsc_ring_pop(ring));
+  test_eq(1, mpsc_ring_push(ring, &items[4]));
+  for (i = 1; i < 5; ++i)
+    test_eq_ptr(&items[i], mpsc_ring_pop(ring));
+  test_eq_ptr(NULL, mpsc_ring_pop(ring));
+  test_eq(0, mpsc_ring_len(ring));
+
+  /* Wrap around several times. */
+  for (i = 0; i < 20; ++i) {
+    test_assert(mpsc_ring_push(ring, &items[i%5]) >= 0);
+    test_eq_ptr(&items[i%5], mpsc_ring_pop(ring));
+  }
+
+ done:
+  mpsc_ring_free(ring);
+}
+
 /** Run unit tests for digest set code (implemented as a hashtable or as a
  * bloom filter) */
 static void
@@ -792,6 +851,7 @@ struct testcase_t container_tests[] = {
   CONTAINER_LEGACY(smartlist_digests),
   CONTAINER_LEGACY(smartlist_join),
   CONTAINER_LEGACY(bitarray),
+  CONTAINER_LEGACY(mpsc_ring),
   CONTAINER_LEGACY(digestset),
   CONTAINER_LEGACY(strmap),
   CONTAINER_LEGACY(pqueue),
@@ -241,6 +241,50 @@ test_crypto_aes(void *arg)
   tor_free(data3);
 }
 
+/** Check that crypting with several ciphers at once gives the same result
+ * as crypting with each in turn, from any position in the keystream. */
+static void
+test_crypto_aes_multi(void *arg)
+{
+  crypto_cipher_t *one[3] = { NULL, NULL, NULL };
+  crypto_cipher_t *all[3] = { NULL, NULL, NULL };
+  char *data1 = NULL, *data2 = NULL;
+  int i, j, len;
+
+  int use_evp = !strcmp(arg,"evp");
+  evaluate_evp_for_aes(use_evp);
+  evaluate_ctr_for_aes();
+
+  data1 = tor_malloc(1024);
+  data2 = tor_malloc(1024);
+
+  for (j = 0; j < 3; ++j) {
+    one[j] = crypto_cipher_new(NULL);
+    all[j] = crypto_cipher_new(crypto_cipher_get_key(one[j]));
+  }
+
+  /* Odd lengths leave each keystream in the middle of a block. */
+  for (i = 0; i < 40; ++i) {
+    len = (i * 131 + 7) % 1024;
+    crypto_rand(data1, len);
+    memcpy(data2, data1, len);
+    for (j = 0; j < 3; ++j)
+      crypto_cipher_crypt_inplace(one[j], data1, len);
+    crypto_cipher_crypt_inplace_multi(all, 3, data2, len);
+    test_memeq(data1, data2, len);
+  }
+
+ done:
+  for (j = 0; j < 3; ++j) {
+    if (one[j])
+      crypto_cipher_free(one[j]);
+    if (all[j])
+      crypto_cipher_free(all[j]);
+  }
+  tor_free(data1);
+  tor_free(data2);
+}
+
 /** Run unit tests for our SHA-1 functionality */
 static void
 test_crypto_sha(void)
@@ -379,6 +423,16 @@ test_crypto_sha(void)
   crypto_digest_get_digest(d1, d_out1, sizeof(d_out1));
   crypto_digest(d_out2, "abcdef", 6);
   test_memeq(d_out1, d_out2, DIGEST_LEN);
+  {
+    crypto_digest_checkpoint_t cp;
+    crypto_digest_checkpoint(&cp, d1);
+    crypto_digest_add_bytes(d1, "ghijkl", 6);
+    crypto_digest_restore(d1, &cp);
+    crypto_digest_add_bytes(d1, "mno", 3);
+    crypto_digest_get_digest(d1, d_out1, sizeof(d_out1));
+    crypto_digest(d_out2, "abcdefmno", 9);
+    test_memeq(d_out1, d_out2, DIGEST_LEN);
+  }
   crypto_digest_free(d1);
   crypto_digest_free(d2);
 
@@ -400,6 +454,16 @@ test_crypto_sha(void)
   crypto_digest_get_digest(d1, d_out1, sizeof(d_out1));
   crypto_digest256(d_out2, "abcdef", 6, DIGEST_SHA256);
   test_memeq(d_out1, d_out2, DIGEST_LEN);
+  {
+    crypto_digest_checkpoint_t cp;
+    crypto_digest_checkpoint(&cp, d1);
+    crypto_digest_add_bytes(d1, "ghijkl", 6);
+    crypto_digest_restore(d1, &cp);
+    crypto_digest_add_bytes(d1, "mno", 3);
+    crypto_digest_get_digest(d1, d_out1, sizeof(d_out1));
+    crypto_digest256(d_out2, "abcdefmno", 9, DIGEST_SHA256);
+    test_memeq(d_out1, d_out2, DIGEST_LEN);
+  }
 
  done:
   if (d1)
@@ -851,6 +915,10 @@ struct testcase_t crypto_tests[] = {
   CRYPTO_LEGACY(rng),
   { "aes_AES", test_crypto_aes, TT_FORK, &pass_data, (void*)"aes" },
   { "aes_EVP", test_crypto_aes, TT_FORK, &pass_data, (void*)"evp" },
+  { "aes_multi_AES", test_crypto_aes_multi, TT_FORK, &pass_data,
+    (void*)"aes" },
+  { "aes_multi_EVP", test_crypto_aes_multi, TT_FORK, &pass_data,
+    (void*)"evp" },
   CRYPTO_LEGACY(sha),
   CRYPTO_LEGACY(pk),
   CRYPTO_LEGACY(dh),
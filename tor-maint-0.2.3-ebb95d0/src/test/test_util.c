@@ -13,6 +13,7 @@
 #include "test.h"
 #include "mempool.h"
 #include "memarea.h"
+#include "timewheel.h"
 
 #ifdef _WIN32
 #include <tchar.h>
@@ -1800,6 +1801,189 @@ test_util_memarea(void)
   tor_free(malloced_ptr);
 }
 
+/** Record of which timewheel test entries ran, in order. */
+static smartlist_t *timewheel_fired = NULL;
+/** If nonzero, the timewheel test callback reschedules itself this many
+ * ticks after the time it is given. */
+static int timewheel_resched_interval = 0;
+
+/** Timewheel callback for test_util_timewheel: note that <b>arg</b> ran. */
+static void
+timewheel_test_cb(timewheel_t *wheel, void *arg, uint64_t now)
+{
+  timewheel_entry_t *ent = arg;
+  smartlist_add(timewheel_fired, ent);
+  if (timewheel_resched_interval)
+    timewheel_schedule(wheel, ent, now + timewheel_resched_interval);
+}
+
+/** Run unit tests for the hierarchical timer wheel. */
+static void
+test_util_timewheel(void *arg)
+{
+  timewheel_t *wheel = timewheel_new(1000);
+  timewheel_entry_t e[4];
+  int i;
+  (void)arg;
+
+  timewheel_fired = smartlist_new();
+  for (i = 0; i < 4; ++i)
+    timewheel_entry_init(&e[i], timewheel_test_cb, &e[i]);
+
+  /* Entries due on the same tick run in the order they were armed;
+   * nothing runs early. */
+  timewheel_schedule(wheel, &e[2], 1010);
+  timewheel_schedule(wheel, &e[0], 1010);
+  timewheel_schedule(wheel, &e[1], 1005);
+  tt_int_op(timewheel_n_scheduled(wheel), ==, 3);
+  timewheel_advance(wheel, 1004);
+  tt_int_op(smartlist_len(timewheel_fired), ==, 0);
+  timewheel_advance(wheel, 1010);
+  tt_int_op(smartlist_len(timewheel_fired), ==, 3);
+  tt_ptr_op(smartlist_get(timewheel_fired, 0), ==, &e[1]);
+  tt_ptr_op(smartlist_get(timewheel_fired, 1), ==, &e[2]);
+  tt_ptr_op(smartlist_get(timewheel_fired, 2), ==, &e[0]);
+  tt_int_op(timewheel_n_scheduled(wheel), ==, 0);
+  tt_assert(!timewheel_entry_is_scheduled(&e[0]));
+  smartlist_clear(timewheel_fired);
+
+  /* Cancelling and moving entries; deadlines in the past run next tick. */
+  timewheel_schedule(wheel, &e[0], 1100);
+  timewheel_schedule(wheel, &e[1], 5000);
+  timewheel_schedule(wheel, &e[3], 10);
+  timewheel_cancel(&e[0]);
+  timewheel_schedule(wheel, &e[1], 1200);
+  tt_int_op(timewheel_n_scheduled(wheel), ==, 2);
+  timewheel_advance(wheel, 1011);
+  tt_int_op(smartlist_len(timewheel_fired), ==, 1);
+  tt_ptr_op(smartlist_get(timewheel_fired, 0), ==, &e[3]);
+  timewheel_advance(wheel, 1199);
+  tt_int_op(smartlist_len(timewheel_fired), ==, 1);
+  timewheel_advance(wheel, 1200);
+  tt_int_op(smartlist_len(timewheel_fired), ==, 2);
+  tt_ptr_op(smartlist_get(timewheel_fired, 1), ==, &e[1]);
+  smartlist_clear(timewheel_fired);
+
+  /* Deadlines that need several cascades, or that lie beyond the span of
+   * the wheel, still run exactly on time. */
+  timewheel_schedule(wheel, &e[0], 1200 + 300000);
+  timewheel_schedule(wheel, &e[1], 1200 + U64_LITERAL(40000000));
+  timewheel_advance(wheel, 1200 + 299999);
+  tt_int_op(smartlist_len(timewheel_fired), ==, 0);
+  timewheel_advance(wheel, 1200 + 300000);
+  tt_int_op(smartlist_len(timewheel_fired), ==, 1);
+  timewheel_advance(wheel, 1200 + U64_LITERAL(39999999));
+  tt_int_op(smartlist_len(timewheel_fired), ==, 1);
+  timewheel_advance(wheel, 1200 + U64_LITERAL(40000000));
+  tt_int_op(smartlist_len(timewheel_fired), ==, 2);
+  tt_ptr_op(smartlist_get(timewheel_fired, 1), ==, &e[1]);
+  smartlist_clear(timewheel_fired);
+
+  /* After a big jump forward, a periodic entry runs once, not once per
+   * missed period. */
+  timewheel_resched_interval = 60;
+  timewheel_schedule(wheel, &e[2], timewheel_get_now(wheel) + 60);
+  timewheel_advance(wheel, timewheel_get_now(wheel) + 100000);
+  tt_int_op(smartlist_len(timewheel_fired), ==, 1);
+  tt_int_op(e[2].when, ==, timewheel_get_now(wheel) + 60);
+
+ done:
+  timewheel_resched_interval = 0;
+  timewheel_free(wheel);
+  smartlist_free(timewheel_fired);
+  timewheel_fired = NULL;
+}
+
+static void
+test_util_monotime(void *arg)
+{
+  uint64_t a, b, c;
+  int i;
+  (void)arg;
+
+  /* The live clock never goes backwards. */
+  a = tor_monotime_nsec();
+  b = tor_monotime_nsec();
+  tt_assert(a > 0);
+  tt_assert(b >= a);
+
+  /* The cached clock holds still until the cache is cleared. */
+  tor_monotime_cache_clear();
+  a = tor_monotime_cached_nsec();
+  tt_assert(a >= b);
+  /* Wait for the (possibly coarse) clock to tick. */
+  for (i = 0; i < 100000000 && tor_monotime_nsec() == a; ++i)
+    ;
+  tt_assert(tor_monotime_nsec() > a);
+  b = tor_monotime_cached_nsec();
+  tt_assert(a == b);
+  tt_assert(tor_monotime_cached_msec() == a / 1000000);
+  tor_monotime_cache_clear();
+  c = tor_monotime_cached_nsec();
+  tt_assert(c > b);
+
+ done:
+  ;
+}
+
+static void
+test_util_token_bucket(void *arg)
+{
+  token_bucket_t tb;
+  (void)arg;
+
+  /* Starts full. */
+  token_bucket_init(&tb, 1000, 5000, 100000);
+  tt_int_op(token_bucket_get(&tb), ==, 5000);
+
+  /* Refilling a full bucket does nothing. */
+  tt_int_op(token_bucket_refill(&tb, 110000), ==, 0);
+  tt_int_op(token_bucket_get(&tb), ==, 5000);
+
+  /* Overdraw it: it goes negative and reports that it ran dry. */
+  tt_int_op(token_bucket_dec(&tb, 3000), ==, 0);
+  tt_int_op(token_bucket_dec(&tb, 2500), ==, 1);
+  tt_int_op(token_bucket_get(&tb), ==, -500);
+
+  /* Half a second earns 500 tokens: back to zero, still empty. */
+  tt_int_op(token_bucket_refill(&tb, 110500), ==, 0);
+  tt_int_op(token_bucket_get(&tb), ==, 0);
+  /* One more millisecond makes it nonempty. */
+  tt_int_op(token_bucket_refill(&tb, 110501), ==, 1);
+  tt_int_op(token_bucket_get(&tb), ==, 1);
+
+  /* Fractions of a token carry over between refills. */
+  token_bucket_init(&tb, 3, 100, 0);
+  token_bucket_dec(&tb, 100);
+  tt_int_op(token_bucket_refill(&tb, 200), ==, 0);
+  tt_int_op(token_bucket_get(&tb), ==, 0);
+  tt_int_op(token_bucket_refill(&tb, 400), ==, 1);
+  tt_int_op(token_bucket_get(&tb), ==, 1);
+  tt_int_op(token_bucket_refill(&tb, 1000), ==, 0);
+  tt_int_op(token_bucket_get(&tb), ==, 3);
+
+  /* Never beyond the burst, however long we wait; the clock going
+   * backwards adds nothing. */
+  tt_int_op(token_bucket_refill(&tb, U64_LITERAL(1)<<40), ==, 0);
+  tt_int_op(token_bucket_get(&tb), ==, 100);
+  token_bucket_dec(&tb, 50);
+  tt_int_op(token_bucket_refill(&tb, 5000), ==, 0);
+  tt_int_op(token_bucket_get(&tb), ==, 50);
+  tt_int_op(token_bucket_refill(&tb, 6000), ==, 0);
+  tt_int_op(token_bucket_get(&tb), ==, 53);
+
+  /* Shrinking the burst clips the bucket; reset fills it. */
+  token_bucket_adjust(&tb, 3, 20);
+  tt_int_op(token_bucket_get(&tb), ==, 20);
+  token_bucket_adjust(&tb, 3, 40);
+  tt_int_op(token_bucket_get(&tb), ==, 20);
+  token_bucket_reset(&tb, 7000);
+  tt_int_op(token_bucket_get(&tb), ==, 40);
+
+ done:
+  ;
+}
+
 /** Run unit tests for utility functions to get file names relative to
  * the data directory. */
 static void
@@ -3098,6 +3282,9 @@ struct testcase_t util_tests[] = {
   UTIL_LEGACY(datadir),
   UTIL_LEGACY(mempool),
   UTIL_LEGACY(memarea),
+  UTIL_TEST(timewheel, 0),
+  UTIL_TEST(monotime, 0),
+  UTIL_TEST(token_bucket, 0),
   UTIL_LEGACY(control_formats),
   UTIL_LEGACY(mmap),
   UTIL_LEGACY(threads),